@@ -0,0 +1,59 @@
+#ifndef ACPI_H
+#define ACPI_H
+
+#include "types.h"
+
+struct RootSystemDescriptionPointer
+{
+    char signature[8]; // "RSD PTR "
+    uint8_t checksum;
+    char oem_id[6];
+    uint8_t revision;
+    uint32_t rsdt_address;
+
+    // Only valid from revision 2 (ACPI 2.0) onwards.
+    uint32_t length;
+    uint64_t xsdt_address;
+    uint8_t extended_checksum;
+    uint8_t reserved[3];
+} __attribute__((packed));
+
+struct SystemDescriptionTableHeader
+{
+    char signature[4];
+    uint32_t length;
+    uint8_t revision;
+    uint8_t checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+} __attribute__((packed));
+
+// One entry of the MCFG table, describing the ECAM window of a PCI segment group.
+struct MemoryMappedConfigurationAllocation
+{
+    uint64_t base_address;
+    uint16_t segment_group;
+    uint8_t start_bus;
+    uint8_t end_bus;
+    uint32_t reserved;
+} __attribute__((packed));
+
+class AdvancedConfigurationPowerInterface
+{
+    RootSystemDescriptionPointer* root_pointer;
+
+    RootSystemDescriptionPointer* find_root_pointer(uint32_t start, uint32_t length);
+    static bool is_checksum_valid(void* table, uint32_t length);
+
+    public:
+        AdvancedConfigurationPowerInterface();
+        ~AdvancedConfigurationPowerInterface();
+
+        bool is_available();
+        SystemDescriptionTableHeader* find_table(string signature);
+};
+
+#endif
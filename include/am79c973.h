@@ -3,28 +3,26 @@
 
 #include "driver.h"
 #include "interrupts.h"
+#include "nic.h"
 #include "pci.h"
 #include "port.h"
 #include "terminal.h"
 #include "types.h"
 
-class Am79C973;
+// Descriptor ring sizes must be a power of two, the chip supports up to 512 entries (RLEN/TLEN = 9).
+#define AM79C973_MAX_RING_SIZE 512
+#define AM79C973_DEFAULT_RECEIVE_RING_SIZE 128
+#define AM79C973_DEFAULT_SEND_RING_SIZE 64
 
-class RawDataHandler
-{
-    protected:
-        Am79C973* backend;
-    
-    public:
-        RawDataHandler(Am79C973* backend);
-        ~RawDataHandler();
-
-        virtual bool on_raw_data_received(uint8_t* buffer, uint32_t size);
+// Enough for a full 1518 byte frame, rounded to keep every buffer 16 byte aligned.
+#define AM79C973_BUFFER_SIZE 1536
 
-        void send(uint8_t* buffer, uint32_t size);
-};
+// Frames waiting in software for a free send descriptor (power of two), and how many
+// fragments such a frame may have.
+#define AM79C973_SEND_QUEUE_SIZE 64
+#define AM79C973_MAX_SEND_FRAGMENTS 4
 
-class Am79C973 : public Driver
+class Am79C973 : public NetworkInterfaceController, public TransmitCompletionHandler, public PollHandler
 {
     static const uint32_t STATUS_ERR    = 0x8000;  // Bit 15: Error
     static const uint32_t STATUS_CERR   = 0x2000;  // Bit 13: Collision Error
@@ -33,6 +31,14 @@ class Am79C973 : public Driver
     static const uint32_t STATUS_RINT   = 0x0400;  // Bit 10: Receive Interrupt
     static const uint32_t STATUS_TINT   = 0x0200;  // Bit 9:  Transmit Done
     static const uint32_t STATUS_IDON   = 0x0100;  // Bit 8:  Initialization Done
+    static const uint32_t STATUS_IENA   = 0x0040;  // Bit 6:  Interrupt Enable (read/write, keep it set)
+
+    static const uint32_t MASK_RINTM    = 0x0400;  // CSR3 bit 10: Receive Interrupt Mask
+
+    static const uint32_t DESCRIPTOR_OWN = 0x80000000; // Bit 31: Owned by the NIC
+    static const uint32_t DESCRIPTOR_ERR = 0x40000000; // Bit 30: Error
+    static const uint32_t DESCRIPTOR_STP = 0x02000000; // Bit 25: Start of packet
+    static const uint32_t DESCRIPTOR_ENP = 0x01000000; // Bit 24: End of packet
 
     struct InitializationBlock
     {
@@ -64,20 +70,82 @@ class Am79C973 : public Driver
 
     InitializationBlock initialization_block;
 
+    // Rings and their buffers live in one heap allocation per direction, not in the driver object.
+    uint16_t send_ring_size;
+    void* send_ring_memory;
     BufferDescriptor* send_buffer_descriptor;
-    uint8_t send_buffer_descriptor_memory[2048 + 15]; // add 15 since we're masking the smallest 4 bits
-    uint8_t send_buffers[2 * 1024 + 15][8];
-    uint8_t current_send_buffer;
+    uint8_t* send_buffers;
+    uint16_t current_send_buffer;
 
-    BufferDescriptor* receive_buffer_descriptor;
-    uint8_t receive_buffer_descriptor_memory[2048 + 15];
-    uint8_t receive_buffers[2 * 1024 + 15][8];
-    uint8_t current_receive_buffer;
+    // Who to tell when each send descriptor completes (only set on a frame's last descriptor).
+    struct SendRecord
+    {
+        TransmitCompletionHandler* handler;
+        void* context;
+    };
+
+    SendRecord* send_records;
+    uint16_t oldest_send_buffer;
+    uint16_t send_buffers_in_use;
 
-    RawDataHandler* raw_data_handler;
+    // Frames that didn't fit into the ring. Copied frames keep their data in the entry's own
+    // buffer, zero-copy ones only keep the fragment list (the caller holds on to the memory).
+    struct SendQueueEntry
+    {
+        TransmitFragment fragments[AM79C973_MAX_SEND_FRAGMENTS];
+        uint16_t fragment_count;
+        bool is_copy;
+        TransmitCompletionHandler* handler;
+        void* context;
+    };
+
+    SendQueueEntry* send_queue;
+    uint8_t* send_queue_buffers;
+    uint16_t send_queue_head;
+    uint16_t send_queue_count;
+
+    uint16_t receive_ring_size;
+    void* receive_ring_memory;
+    BufferDescriptor* receive_buffer_descriptor;
+    uint8_t* receive_buffers;
+    uint16_t current_receive_buffer;
+
+    // CSR112 is a 16 bit counter, so we keep a running total of its increments.
+    uint16_t last_missed_frame_count;
+    uint32_t missed_frames;
+    uint32_t miss_interrupts;
+    uint32_t received_frames;
+    uint32_t sent_frames;
+    uint32_t send_errors;
+    uint32_t queued_frames;
+    uint32_t send_queue_full;
+    uint32_t send_drops;
+    uint16_t max_send_queue_depth;
+
+    // Hybrid receive: the first RINT masks receive interrupts and the ring gets polled until empty.
+    bool is_receive_polling_enabled;
+    bool is_receive_interrupt_masked;
+    uint32_t interrupts;
+    uint32_t receive_interrupts;
+    uint32_t polls;
+    uint32_t exhausted_polls;
+
+    static uint16_t round_ring_size(uint16_t size, uint8_t* length);
+    void* allocate_ring(uint16_t ring_size, uint16_t buffer_count, BufferDescriptor** descriptors, uint8_t** buffers);
+    void free_rings();
+    void update_missed_frame_count();
+    void reclaim_send_buffers();
+    void set_receive_interrupt_mask(bool masked);
+    void post_send_fragments(TransmitFragment* fragments, uint16_t fragment_count, TransmitCompletionHandler* handler, void* context);
+    void copy_to_send_buffer(uint8_t* buffer, uint32_t size);
+    SendQueueEntry* enqueue_send();
+    void drain_send_queue();
+    void wait_for_send_space();
 
     public:
-        Am79C973(PeripheralComponentInterconnectDeviceDescriptor* device, InterruptManager* interrupt_manager);
+        Am79C973(PeripheralComponentInterconnectDeviceDescriptor* device, InterruptManager* interrupt_manager,
+                 uint16_t receive_ring_size = AM79C973_DEFAULT_RECEIVE_RING_SIZE,
+                 uint16_t send_ring_size = AM79C973_DEFAULT_SEND_RING_SIZE);
         ~Am79C973();
 
         void initialize();
@@ -86,12 +154,24 @@ class Am79C973 : public Driver
         void reset();
         string get_driver_name();
         uint32_t handle_interrupt(uint32_t esp);
-        void send(uint8_t* buffer, int size);
-        void receive();
-        void set_handler(RawDataHandler* raw_data_handler);
+        bool is_available();
+        TransmitStatus send(uint8_t* buffer, int size, bool wait = false);
+        TransmitStatus send_fragments(TransmitFragment* fragments, uint16_t fragment_count, TransmitCompletionHandler* handler, void* context,
+                                      bool wait = false, const TransmitChecksumOffload* offload = nullptr);
+        void on_transmit_complete(void* context);
+        uint16_t receive(uint16_t budget);
+        uint16_t poll(uint16_t budget);
+        void set_receive_polling(bool enabled);
         uint64_t get_mac_address();
         void set_ip_address(uint32_t ip);
         uint32_t get_ip_address();
+
+        uint16_t get_receive_ring_size();
+        uint16_t get_send_ring_size();
+        uint16_t get_send_queue_size();
+        uint32_t get_send_drop_count();
+        uint32_t get_missed_frame_count();
+        void print_statistics();
 };
 
 #endif
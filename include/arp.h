@@ -1,10 +1,25 @@
 #ifndef ARP_H
 #define ARP_H
 
-#include "am79c973.h"
 #include "ethernet_frame.h"
+#include "packet_buffer.h"
+#include "timer.h"
 #include "types.h"
 
+// Neighbor cache size (entries and hash buckets, both powers of two) and how many packets may
+// wait for one address to resolve.
+#define ARP_CACHE_SIZE 128
+#define ARP_HASH_BUCKETS 64
+#define ARP_MAX_PENDING_PACKETS 4
+
+// All in milliseconds. A confirmed entry is trusted for ARP_REACHABLE_TIME, then goes stale
+// (still used, but refreshed on use) and is dropped if nobody used it for ARP_STALE_TIME more.
+#define ARP_TIMER_PERIOD 100
+#define ARP_RETRY_INTERVAL 1000
+#define ARP_MAX_RETRIES 3
+#define ARP_REACHABLE_TIME 30000
+#define ARP_STALE_TIME 60000
+
 struct AddressResolutionProtocolMessage
 {
     uint16_t hardware_type;
@@ -12,30 +27,93 @@ struct AddressResolutionProtocolMessage
     uint8_t hardware_address_size; // 6
     uint8_t protocol_address_size; // 4
     uint16_t command;
-    
+
 
     uint64_t source_mac : 48;
     uint32_t source_ip;
     uint64_t destination_mac : 48;
     uint32_t destination_ip;
-    
+
 } __attribute__((packed));
 
-class AddressResolutionProtocol : EthernetFrameHandler
+enum NeighborState
 {
-    uint32_t ip_cache[128];
-    uint64_t mac_cache[128];
-    int num_cache_entries;
+    NeighborFree = 0,
+    NeighborIncomplete = 1,  // Request sent, no answer yet. Packets for it wait in the entry.
+    NeighborReachable = 2,   // Answered recently.
+    NeighborStale = 3        // Not confirmed for a while, still used but refreshed on use.
+};
+
+class AddressResolutionProtocol : EthernetFrameHandler, public TimerHandler
+{
+    struct PendingPacket
+    {
+        PacketBuffer* packet;
+        uint16_t ether_type;
+    };
+
+    struct NeighborEntry
+    {
+        uint32_t ip;
+        uint64_t mac;
+        NeighborState state;
+        uint32_t updated;       // Ticks at the last confirmation (or the first request)
+        uint32_t last_request;  // Ticks at the last request we sent for it
+        uint8_t retries;
+        int16_t next;           // Next entry in the same bucket, -1 ends the chain
+
+        PendingPacket pending[ARP_MAX_PENDING_PACKETS];
+        uint8_t pending_count;
+    };
+
+    NeighborEntry entries[ARP_CACHE_SIZE];
+    int16_t buckets[ARP_HASH_BUCKETS];
+    int16_t free_entries;  // Chained through next like the buckets
+    uint16_t entry_count;
+
+    uint32_t requests_sent;
+    uint32_t replies_sent;
+    uint32_t resolved;
+    uint32_t failed;
+    uint32_t queued_packets;
+    uint32_t dropped_packets;
+    uint32_t evictions;
+
+    uint32_t subnet_mask;  // To spot directed broadcasts, 0xFFFFFFFF until IPv4 tells us
+
+    static uint16_t hash(uint32_t ip);
+    static uint32_t get_now();
+
+    NeighborEntry* find(uint32_t ip);
+    NeighborEntry* create(uint32_t ip);
+    void remove(NeighborEntry* entry);
+    void update(NeighborEntry* entry, uint64_t mac, bool is_confirmed);
+    void flush_pending(NeighborEntry* entry);
+    void drop_pending(NeighborEntry* entry);
+    bool is_broadcast(uint32_t ip);
 
     public:
         AddressResolutionProtocol(EthernetFrameProvider* backend);
         ~AddressResolutionProtocol();
 
-        bool on_ether_frame_received(uint8_t* payload, uint32_t size);
+        bool on_packet_received(PacketBuffer* packet);
+        void on_timer(uint32_t ticks);
 
         void request_mac_address(uint32_t ip);
-        uint64_t get_mac_from_cache(uint32_t ip);
-        uint64_t resolve(uint32_t ip);
+        bool get_mac_from_cache(uint32_t ip, uint64_t* mac);
+        void set_subnet_mask(uint32_t subnet_mask);
+
+        // Returns true and fills in mac right away if the address is known (broadcasts always
+        // are), otherwise returns false and starts asking. Never waits for the answer.
+        bool resolve(uint32_t ip, uint64_t* mac = nullptr);
+
+        // Sends packet to ip over Ethernet (ether_type as on the wire), resolving the address
+        // first if needed. Until the answer comes the packet waits in the cache (TransmitQueued),
+        // if it never comes it's dropped. Takes over the caller's reference either way.
+        // is_unresolved (if given) tells that wait apart from a card's own TransmitQueued.
+        TransmitStatus send(uint32_t ip, uint16_t ether_type, PacketBuffer* packet, bool* is_unresolved = nullptr);
+
+        void print_cache();
 };
 
 #endif
@@ -0,0 +1,43 @@
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include "types.h"
+
+struct TransmitFragment;
+
+// The Internet checksum (RFC 1071): ones' complement sum of 16 bit words. The sum doesn't care
+// about byte order as long as it's read and stored the same way, so everything here works on
+// the bytes as they are in memory and the result can be stored as is.
+
+// Picks the fastest checksum_add the CPU can run (SSE2 when CPUID has it, plain 32 bit adds
+// otherwise). Call it once at boot, before that the scalar one is used.
+void checksum_initialize();
+const char* checksum_get_implementation_name();
+
+// Adds length bytes to a running sum. Pieces of one packet can be summed one after the other,
+// as long as every piece but the last has an even length.
+uint32_t checksum_add(const void* data, uint32_t length, uint32_t sum = 0);
+
+// The same over a scatter-gather list (the pieces a NIC sends from, or a header and a payload
+// in different buffers). Fragments can have any length, odd ones included.
+uint32_t checksum_add_fragments(const TransmitFragment* fragments, uint16_t count, uint32_t sum = 0);
+
+// Folds a running sum down to 16 bits and complements it, ready to go into a header.
+uint16_t checksum_finish(uint32_t sum);
+
+static inline uint16_t internet_checksum(const void* data, uint32_t length)
+{
+    return checksum_finish(checksum_add(data, length));
+}
+
+// RFC 1624: fixes up a checksum after one 16 bit field changed from old_value to new_value,
+// without touching the rest of the data (TTL decrement, address rewrite, ...).
+uint16_t checksum_update_16(uint16_t checksum, uint16_t old_value, uint16_t new_value);
+uint16_t checksum_update_32(uint16_t checksum, uint32_t old_value, uint32_t new_value);
+
+// Times every implementation the CPU has over 64 to 1500 byte payloads and prints cycles per
+// call and MB/s, and checks them (and a sum over odd sized fragments) against the scalar one.
+// Needs the timer (and a TSC to have anything to show).
+void checksum_benchmark();
+
+#endif
@@ -0,0 +1,93 @@
+#ifndef CPU_H
+#define CPU_H
+
+#include "types.h"
+
+// Small wrappers around the instructions we need for probing and configuring the CPU itself.
+
+static inline void cpuid(uint32_t leaf, uint32_t* eax, uint32_t* ebx, uint32_t* ecx, uint32_t* edx)
+{
+    __asm__ volatile("cpuid" : "=a" (*eax), "=b" (*ebx), "=c" (*ecx), "=d" (*edx) : "a" (leaf), "c" (0));
+}
+
+static inline uint64_t read_msr(uint32_t msr)
+{
+    uint32_t low, high;
+    __asm__ volatile("rdmsr" : "=a" (low), "=d" (high) : "c" (msr));
+    return ((uint64_t) high << 32) | low;
+}
+
+static inline void write_msr(uint32_t msr, uint64_t value)
+{
+    __asm__ volatile("wrmsr" : : "c" (msr), "a" ((uint32_t) value), "d" ((uint32_t) (value >> 32)));
+}
+
+static inline uint64_t read_timestamp_counter()
+{
+    uint32_t low, high;
+    __asm__ volatile("rdtsc" : "=a" (low), "=d" (high));
+    return ((uint64_t) high << 32) | low;
+}
+
+// There's no libgcc, so a 64 bit division has to be spelled out. Dividing the high half first
+// leaves a remainder below the divisor, so the second divl can't overflow.
+static inline uint64_t divide_64(uint64_t dividend, uint32_t divisor)
+{
+    uint32_t high { (uint32_t) (dividend >> 32) };
+    uint32_t quotient_high { high / divisor };
+    uint32_t remainder { high % divisor };
+    uint32_t quotient_low;
+
+    __asm__("divl %4" : "=a" (quotient_low), "=d" (remainder) : "a" ((uint32_t) dividend), "d" (remainder), "rm" (divisor));
+    return ((uint64_t) quotient_high << 32) | quotient_low;
+}
+
+// Disables interrupts and returns the previous EFLAGS so restore_interrupts() can put IF back.
+static inline uint32_t disable_interrupts()
+{
+    uint32_t flags;
+    __asm__ volatile("pushf\n popl %0\n cli" : "=r" (flags) : : "memory");
+    return flags;
+}
+
+static inline void restore_interrupts(uint32_t flags)
+{
+    __asm__ volatile("pushl %0\n popf" : : "r" (flags) : "memory", "cc");
+}
+
+namespace CPU {
+    // CPUID leaf 1, EDX
+    const uint32_t FEATURE_TSC = 1 << 4;
+    const uint32_t FEATURE_APIC = 1 << 9;
+    const uint32_t FEATURE_MTRR = 1 << 12;
+    const uint32_t FEATURE_FXSR = 1 << 24;
+    const uint32_t FEATURE_SSE = 1 << 25;
+    const uint32_t FEATURE_SSE2 = 1 << 26;
+
+    const uint32_t CR0_MONITOR_COPROCESSOR = 1 << 1;
+    const uint32_t CR0_EMULATION = 1 << 2;
+    const uint32_t CR4_OSFXSR = 1 << 9;
+    const uint32_t CR4_OSXMMEXCPT = 1 << 10;
+}
+
+// Turns on SSE/SSE2 if the CPU has it and returns whether it did. Nothing saves the XMM
+// registers on a task switch, so code using them has to keep interrupts off while it does.
+static inline bool enable_sse2()
+{
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+
+    if ((edx & (CPU::FEATURE_FXSR | CPU::FEATURE_SSE | CPU::FEATURE_SSE2)) != (CPU::FEATURE_FXSR | CPU::FEATURE_SSE | CPU::FEATURE_SSE2)) {
+        return false;
+    }
+
+    uint32_t cr0, cr4;
+    __asm__ volatile("movl %%cr0, %0" : "=r" (cr0));
+    __asm__ volatile("movl %0, %%cr0" : : "r" ((cr0 & ~CPU::CR0_EMULATION) | CPU::CR0_MONITOR_COPROCESSOR) : "memory");
+    __asm__ volatile("movl %%cr4, %0" : "=r" (cr4));
+    __asm__ volatile("movl %0, %%cr4" : : "r" (cr4 | CPU::CR4_OSFXSR | CPU::CR4_OSXMMEXCPT) : "memory");
+
+    return true;
+}
+
+#endif
@@ -4,12 +4,25 @@
 #include "types.h"
 #include "interrupts.h"
 
+// Maximum number of interrupt vectors (queues) a single driver can ask for
+#define MAX_DRIVER_INTERRUPT_QUEUES 8
+
+class PeripheralComponentInterconnectDeviceDescriptor;
+
 // Abstract base class for all hardware drivers
 class Driver : public InterruptHandler
 {
 protected:
     Driver(InterruptManager* manager, uint8_t interrupt_number);
 
+    InterruptHandler* queue_handlers[MAX_DRIVER_INTERRUPT_QUEUES];
+    uint16_t interrupt_queue_count;
+
+    // Asks the PCI layer for dedicated MSI/MSI-X vectors instead of the shared legacy line.
+    // Queue 0 keeps arriving in handle_interrupt(), the others in handle_queue_interrupt().
+    // Returns how many queues got a vector, 0 means we're still on the legacy line.
+    uint16_t request_interrupt_vectors(PeripheralComponentInterconnectDeviceDescriptor* device, uint16_t queue_count);
+
 public:
     virtual ~Driver();
     
@@ -21,11 +34,28 @@ public:
     
     // Virtual method from InterruptHandler that drivers can override
     virtual uint32_t handle_interrupt(uint32_t esp) override = 0;
+    virtual uint32_t handle_queue_interrupt(uint16_t queue, uint32_t esp) { return handle_interrupt(esp); }
     
     // Optional virtual methods for common driver operations
     virtual bool is_available() { return true; }
     virtual const char* get_driver_name() = 0;
     virtual uint32_t get_driver_version() { return 0x0100; } // Default version 1.0
+
+    uint16_t get_interrupt_queue_count() { return interrupt_queue_count; }
+};
+
+// Forwards an extra MSI-X vector to the driver that owns it, tagged with its queue number.
+class DriverQueueInterruptHandler : public InterruptHandler
+{
+protected:
+    Driver* driver;
+    uint16_t queue;
+
+public:
+    DriverQueueInterruptHandler(InterruptManager* manager, uint8_t interrupt_number, Driver* driver, uint16_t queue);
+    ~DriverQueueInterruptHandler();
+
+    uint32_t handle_interrupt(uint32_t esp) override;
 };
 
 #endif
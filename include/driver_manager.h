@@ -34,7 +34,9 @@ public:
     // Driver information and status
     uint8_t get_driver_count() const;
     Driver* get_driver(uint8_t index);
-    Driver* find_driver(const char* name);
+    // The first driver called name, or with after the next one registered past it (a second
+    // card of the same kind).
+    Driver* find_driver(const char* name, Driver* after = nullptr);
     bool is_driver_registered(const char* name);
     
     // System status
@@ -1,7 +1,8 @@
 #ifndef ETHERNET_FRAME_H
 #define ETHERNET_FRAME_H
 
-#include "am79c973.h"
+#include "nic.h"
+#include "packet_buffer.h"
 #include "types.h"
 
 // NOTE: All of these values are in big endian
@@ -14,6 +15,11 @@ struct EthernetFrameHeader
 
 typedef uint32_t EthernetFrameFooter;
 
+// Only a handful of EtherTypes ever get a handler (ARP, IPv4, ...), so instead of a table with
+// one entry per EtherType we keep them in a small array and scan it. The EtherTypes go first
+// so the scan stays in one cache line.
+#define MAX_ETHERNET_FRAME_HANDLERS 8
+
 class EthernetFrameProvider;
 
 class EthernetFrameHandler
@@ -27,24 +33,64 @@ public:
     ~EthernetFrameHandler();
     
     virtual bool on_ethernet_frame_received(uint8_t* payload, uint32_t size);
-    void send(uint64_t destination_mac, uint8_t* payload, uint32_t size);
+
+    // The same with the payload in a packet buffer (Ethernet header already pulled), which is
+    // lent for the duration of the call: retain() it to keep it. Passes the bytes on to
+    // on_ethernet_frame_received unless overridden. Returning true sends the frame back.
+    virtual bool on_packet_received(PacketBuffer* packet);
+
+    // The payload is sent straight from the caller's memory, so it must stay valid until the
+    // completion handler runs (or, without one, for as long as the frame might be queued).
+    TransmitStatus send(uint64_t destination_mac, uint8_t* payload, uint32_t size, TransmitCompletionHandler* completion = nullptr, void* context = nullptr);
+
+    // Takes over the caller's reference to packet, whether or not it could be sent.
+    TransmitStatus send(uint64_t destination_mac, PacketBuffer* packet);
     
 };
         
         
-class EthernetFrameProvider : public RawDataHandler
+class EthernetFrameProvider : public RawDataHandler, public TransmitCompletionHandler
 {
 friend class EthernetFrameHandler;
 protected:
-    EthernetFrameHandler* handlers[65535];
+    struct DispatchTable
+    {
+        uint16_t ether_types[MAX_ETHERNET_FRAME_HANDLERS];  // Big endian, as on the wire
+        EthernetFrameHandler* handlers[MAX_ETHERNET_FRAME_HANDLERS];
+        uint8_t count;
+    } __attribute__((aligned(64)));
+
+    DispatchTable dispatch_table;
+
+    bool register_handler(uint16_t ether_type, EthernetFrameHandler* handler);
+    void unregister_handler(uint16_t ether_type, EthernetFrameHandler* handler);
+    EthernetFrameHandler* find_handler(uint16_t ether_type);
+
+    // One header for every frame that can be in flight (ring plus software queue). Frames complete
+    // in order and a slot is only used up by an accepted frame, so it's never reused too early.
+    // Without them (no memory, or a NIC that reports no ring) frames get copied instead.
+    EthernetFrameHeader* header_slots;
+    uint16_t header_slot_count;
+    uint16_t next_header_slot;
+
+    TransmitStatus send_copy(uint64_t destination_mac, uint16_t ether_type, uint8_t* buffer, uint32_t size, TransmitCompletionHandler* completion, void* context);
 public:
-    EthernetFrameProvider(Am79C973* backend);
+    EthernetFrameProvider(NetworkInterfaceController* backend);
     ~EthernetFrameProvider();
     
     bool on_raw_data_received(uint8_t* buffer, uint32_t size);
-    void send(uint64_t destination_mac, uint16_t ether_type, uint8_t* buffer, uint32_t size);
+    TransmitStatus send(uint64_t destination_mac, uint16_t ether_type, uint8_t* buffer, uint32_t size, TransmitCompletionHandler* completion = nullptr, void* context = nullptr);
+
+    // The header goes into the packet's headroom, so the whole frame is one fragment. The
+    // packet is released once the NIC is done with it (or right away if it wasn't accepted).
+    TransmitStatus send(uint64_t destination_mac, uint16_t ether_type, PacketBuffer* packet);
+    void on_transmit_complete(void* context);
     uint64_t get_mac_address();
     uint32_t get_ip_address();
+
+    // Passed through from the NIC, so upper layers can skip work it already did.
+    uint32_t get_features();
+    uint8_t get_receive_checksum_status();
 };
 
 #endif
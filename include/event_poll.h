@@ -0,0 +1,115 @@
+#ifndef EVENT_POLL_H
+#define EVENT_POLL_H
+
+#include "task_scheduler.h"
+#include "types.h"
+
+// What a source can be ready for. Hangup and error are always reported, asked for or not.
+#define EVENT_READABLE 0x01
+#define EVENT_WRITABLE 0x02
+#define EVENT_HANGUP 0x04
+#define EVENT_ERROR 0x08
+
+// Part of the interest, not an event: report a source once per notification instead of for as
+// long as it stays ready.
+#define EVENT_EDGE_TRIGGERED 0x80
+
+#define EVENT_POLL_MAX_REGISTRATIONS 32
+
+class EventPoll;
+class EventSource;
+
+// What wait() hands back, data is whatever was given to add().
+struct PolledEvent
+{
+    uint8_t events;
+    void* data;
+};
+
+// One source in one poll. It sits on the source's list for as long as it's registered, and on
+// the poll's ready list while it may have something to report.
+struct EventRegistration
+{
+    EventPoll* poll;
+    EventSource* source;
+    uint8_t interest;
+    void* data;
+    bool is_in_use;
+    bool is_ready;
+
+    EventRegistration* next_for_source;
+    EventRegistration* next_ready;
+    EventRegistration* previous_ready;
+};
+
+// Anything a task can wait on: sockets, but a driver can be one just as well. The source calls
+// notify_events() whenever it becomes ready for something, that's the only point where polls
+// hear about it, so a source that's never registered pays nothing.
+class EventSource
+{
+    friend class EventPoll;
+
+    EventRegistration* registrations;
+
+    protected:
+        // With interrupts off (the receive path or a public call that disabled them).
+        void notify_events(uint8_t events);
+
+        // Drops every registration, for when the source goes away or is handed back.
+        void detach_events();
+
+    public:
+        EventSource();
+        virtual ~EventSource();
+
+        // What the source is ready for right now. Level triggered registrations ask again each
+        // time they're reported.
+        virtual uint8_t get_events();
+};
+
+// epoll for tasks. Register sources with add(), then wait() blocks the task in the scheduler
+// until at least one of them is ready. Only ready sources are ever looked at, so a wakeup costs
+// the same with 2 registrations as with 32.
+//
+// One task waits on a poll at a time.
+class EventPoll
+{
+    friend class EventSource;
+
+    EventRegistration registrations[EVENT_POLL_MAX_REGISTRATIONS];
+    EventRegistration* ready_head;
+    EventRegistration* ready_tail;
+    uint32_t ready_count;
+    Task* waiter;
+
+    uint32_t notifications;
+    uint32_t blocks;
+    uint32_t reported_events;
+
+    EventRegistration* find(EventSource* source);
+    void make_ready(EventRegistration* registration);
+    void signal(EventRegistration* registration);
+    void remove_ready(EventRegistration* registration);
+    void unlink(EventRegistration* registration);
+    uint32_t collect(PolledEvent* events, uint32_t count);
+
+    public:
+        EventPoll();
+        ~EventPoll();
+
+        // events is a mask of EVENT_* to wait for (EVENT_EDGE_TRIGGERED included). False if
+        // the source is already registered or there's no room left.
+        bool add(EventSource* source, uint8_t events, void* data);
+        bool modify(EventSource* source, uint8_t events, void* data);
+        void remove(EventSource* source);
+
+        // Fills in up to count events and returns how many, blocking until there's at least one.
+        uint32_t wait(PolledEvent* events, uint32_t count);
+
+        // The same without blocking, 0 if nothing is ready.
+        uint32_t poll(PolledEvent* events, uint32_t count);
+
+        void print_statistics();
+};
+
+#endif
@@ -0,0 +1,216 @@
+#ifndef I82540EM_H
+#define I82540EM_H
+
+#include "driver.h"
+#include "interrupts.h"
+#include "mmio.h"
+#include "nic.h"
+#include "pci.h"
+#include "terminal.h"
+#include "types.h"
+
+// Ring sizes in descriptors. RDLEN/TDLEN must be a multiple of 128 bytes, so a multiple of 8.
+#define I82540EM_RECEIVE_RING_SIZE 256
+#define I82540EM_SEND_RING_SIZE 256
+
+// RCTL.BSIZE = 00 gives 2048 byte receive buffers, send buffers only need a full frame.
+#define I82540EM_RECEIVE_BUFFER_SIZE 2048
+#define I82540EM_SEND_BUFFER_SIZE 1536
+
+#define I82540EM_MAX_SEND_FRAGMENTS 8
+
+// ITR counts in 256ns units, 488 caps us at about 8000 interrupts per second (what Linux uses).
+#define I82540EM_INTERRUPT_THROTTLE 488
+
+// Intel 8254x gigabit ethernet (e1000), QEMU's default NIC. Driven entirely through BAR0.
+// Receive works like the other cards: the interrupt masks the receive causes and the ring
+// gets drained from the poll list.
+class Intel82540EM : public NetworkInterfaceController, public PollHandler
+{
+    static const uint32_t REGISTER_CTRL   = 0x0000;
+    static const uint32_t REGISTER_STATUS = 0x0008;
+    static const uint32_t REGISTER_EERD   = 0x0014;
+    static const uint32_t REGISTER_ICR    = 0x00C0;
+    static const uint32_t REGISTER_ITR    = 0x00C4;
+    static const uint32_t REGISTER_IMS    = 0x00D0;
+    static const uint32_t REGISTER_IMC    = 0x00D8;
+    static const uint32_t REGISTER_RCTL   = 0x0100;
+    static const uint32_t REGISTER_TCTL   = 0x0400;
+    static const uint32_t REGISTER_TIPG   = 0x0410;
+    static const uint32_t REGISTER_RDBAL  = 0x2800;
+    static const uint32_t REGISTER_RDBAH  = 0x2804;
+    static const uint32_t REGISTER_RDLEN  = 0x2808;
+    static const uint32_t REGISTER_RDH    = 0x2810;
+    static const uint32_t REGISTER_RDT    = 0x2818;
+    static const uint32_t REGISTER_TDBAL  = 0x3800;
+    static const uint32_t REGISTER_TDBAH  = 0x3804;
+    static const uint32_t REGISTER_TDLEN  = 0x3808;
+    static const uint32_t REGISTER_TDH    = 0x3810;
+    static const uint32_t REGISTER_TDT    = 0x3818;
+    static const uint32_t REGISTER_MPC    = 0x4010;  // Missed packets count (clears on read)
+    static const uint32_t REGISTER_RXCSUM = 0x5000;
+    static const uint32_t REGISTER_MTA    = 0x5200;  // 128 entries
+    static const uint32_t REGISTER_RAL    = 0x5400;
+    static const uint32_t REGISTER_RAH    = 0x5404;
+
+    static const uint32_t CTRL_ASDE = 0x00000020;  // Auto speed detection
+    static const uint32_t CTRL_SLU  = 0x00000040;  // Set link up
+    static const uint32_t CTRL_RST  = 0x04000000;
+
+    static const uint32_t STATUS_LU = 0x00000002;  // Link up
+
+    static const uint32_t INTERRUPT_TXDW   = 0x0001;  // Transmit descriptor written back
+    static const uint32_t INTERRUPT_LSC    = 0x0004;  // Link status change
+    static const uint32_t INTERRUPT_RXDMT0 = 0x0010;  // Receive ring below its threshold
+    static const uint32_t INTERRUPT_RXO    = 0x0040;  // Receiver overrun
+    static const uint32_t INTERRUPT_RXT0   = 0x0080;  // Receiver timer (a frame arrived)
+    static const uint32_t INTERRUPT_RECEIVE = INTERRUPT_RXT0 | INTERRUPT_RXO | INTERRUPT_RXDMT0;
+
+    static const uint32_t RCTL_EN    = 0x00000002;
+    static const uint32_t RCTL_BAM   = 0x00008000;  // Accept broadcast
+    static const uint32_t RCTL_SECRC = 0x04000000;  // Strip the FCS
+
+    static const uint32_t TCTL_EN  = 0x00000002;
+    static const uint32_t TCTL_PSP = 0x00000008;  // Pad short packets
+
+    static const uint32_t RXCSUM_IPOFLD = 0x0100;
+    static const uint32_t RXCSUM_TUOFLD = 0x0200;
+
+    static const uint8_t RECEIVE_STATUS_DD    = 0x01;
+    static const uint8_t RECEIVE_STATUS_EOP   = 0x02;
+    static const uint8_t RECEIVE_STATUS_IXSM  = 0x04;  // Ignore the checksum bits
+    static const uint8_t RECEIVE_STATUS_TCPCS = 0x20;
+    static const uint8_t RECEIVE_STATUS_IPCS  = 0x40;
+
+    static const uint8_t RECEIVE_ERROR_TCPE = 0x20;
+    static const uint8_t RECEIVE_ERROR_IPE  = 0x40;
+
+    static const uint8_t SEND_COMMAND_EOP  = 0x01;
+    static const uint8_t SEND_COMMAND_IFCS = 0x02;  // Append the FCS
+    static const uint8_t SEND_COMMAND_RS   = 0x08;  // Report status (sets DD when done)
+    static const uint8_t SEND_COMMAND_DEXT = 0x20;  // Extended (context/data) descriptor
+
+    static const uint8_t SEND_STATUS_DD = 0x01;
+
+    struct ReceiveDescriptor
+    {
+        uint64_t address;
+        uint16_t length;
+        uint16_t checksum;
+        uint8_t status;
+        uint8_t errors;
+        uint16_t special;
+    } __attribute__((packed));
+
+    // The legacy layout, used for every frame that doesn't want checksum offload.
+    struct SendDescriptor
+    {
+        uint64_t address;
+        uint16_t length;
+        uint8_t checksum_offset;
+        uint8_t command;
+        uint8_t status;
+        uint8_t checksum_start;
+        uint16_t special;
+    } __attribute__((packed));
+
+    // Tells the NIC where the checksums of the following data descriptors go.
+    struct SendContextDescriptor
+    {
+        uint8_t ip_checksum_start;
+        uint8_t ip_checksum_offset;
+        uint16_t ip_checksum_end;
+        uint8_t transport_checksum_start;
+        uint8_t transport_checksum_offset;
+        uint16_t transport_checksum_end;
+        uint32_t length_type_command;  // PAYLEN (19:0), DTYP (23:20), TUCMD (31:24)
+        uint8_t status;
+        uint8_t header_length;
+        uint16_t maximum_segment_size;
+    } __attribute__((packed));
+
+    // Data descriptor that goes with a context descriptor.
+    struct SendDataDescriptor
+    {
+        uint64_t address;
+        uint32_t length_type_command;  // DTALEN (19:0), DTYP (23:20), DCMD (31:24)
+        uint8_t status;
+        uint8_t options;               // POPTS: IXSM (bit 0), TXSM (bit 1)
+        uint16_t special;
+    } __attribute__((packed));
+
+    MemoryMappedRegion registers;
+    uint64_t mac_address;
+    uint32_t ip_address;
+
+    void* receive_ring_memory;
+    ReceiveDescriptor* receive_descriptors;
+    uint8_t* receive_buffers;
+    uint16_t current_receive_buffer;
+    uint8_t lent_checksum_status;
+
+    void* send_ring_memory;
+    SendDescriptor* send_descriptors;
+    uint8_t* send_buffers;
+    uint16_t current_send_buffer;
+    uint16_t oldest_send_buffer;
+    uint16_t send_buffers_in_use;
+
+    // Kept for the first descriptor of every frame, so reclaiming knows where the frame ends.
+    struct SendRecord
+    {
+        TransmitCompletionHandler* handler;
+        void* context;
+        uint16_t last_descriptor;
+    };
+
+    SendRecord* send_records;
+
+    uint32_t interrupts;
+    uint32_t received_frames;
+    uint32_t sent_frames;
+    uint32_t send_drops;
+    uint32_t receive_overruns;
+    uint32_t missed_frames;
+    uint32_t checksum_errors;
+    uint32_t offloaded_frames;
+    uint32_t polls;
+
+    static void* allocate_ring(uint32_t descriptor_bytes, uint32_t buffer_bytes, void** descriptors, uint8_t** buffers);
+    void free_rings();
+    uint16_t read_eeprom(uint8_t address);
+    uint64_t read_mac_address();
+    uint16_t get_free_send_descriptors();
+    void post_send_fragments(TransmitFragment* fragments, uint16_t fragment_count, TransmitCompletionHandler* handler, void* context, const TransmitChecksumOffload* offload);
+    void reclaim_send_buffers();
+    void wait_for_send_descriptors(uint16_t count);
+
+    public:
+        Intel82540EM(PeripheralComponentInterconnectDeviceDescriptor* device, InterruptManager* interrupt_manager);
+        ~Intel82540EM();
+
+        void initialize();
+        void activate();
+        void deactivate();
+        void reset();
+        string get_driver_name();
+        uint32_t handle_interrupt(uint32_t esp);
+        uint16_t poll(uint16_t budget);
+
+        bool is_available();
+        TransmitStatus send(uint8_t* buffer, int size, bool wait = false);
+        TransmitStatus send_fragments(TransmitFragment* fragments, uint16_t fragment_count, TransmitCompletionHandler* handler, void* context,
+                                      bool wait = false, const TransmitChecksumOffload* offload = nullptr);
+        uint16_t receive(uint16_t budget);
+
+        uint64_t get_mac_address();
+        void set_ip_address(uint32_t ip);
+        uint32_t get_ip_address();
+        uint16_t get_send_ring_size();
+        uint32_t get_features();
+        uint8_t get_receive_checksum_status();
+        bool is_link_up();
+        void print_statistics();
+};
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef ICMP_H
+#define ICMP_H
+
+#include "ipv4.h"
+#include "packet_buffer.h"
+#include "types.h"
+
+#define ICMP_ECHO_REPLY 0
+#define ICMP_ECHO_REQUEST 8
+
+// Payload size of our own echo requests, the same as ping's default.
+#define ICMP_ECHO_PAYLOAD_SIZE 56
+
+struct InternetControlMessageProtocolMessage
+{
+    uint8_t type;
+    uint8_t code;
+    uint16_t checksum;
+
+    // Echo request and reply only, big endian.
+    uint16_t identifier;
+    uint16_t sequence;
+} __attribute__((packed));
+
+// Answers pings by turning the request around in the receive buffer, so a ping from the host
+// measures the interrupt and receive path and nothing else. Keeps TSC counters of how long
+// each echo took us to turn around, and can ping by itself (RTT from the timestamp it puts in
+// the payload).
+class InternetControlMessageProtocol : public InternetProtocolHandler
+{
+    uint16_t identifier;
+    uint16_t next_sequence;
+
+    uint32_t echo_requests;
+    uint32_t echo_replies_sent;
+    uint64_t min_turnaround;   // In cycles
+    uint64_t max_turnaround;
+    uint64_t total_turnaround;
+
+    uint32_t echo_requests_sent;
+    uint32_t echo_replies;
+    uint64_t min_round_trip;   // In cycles
+    uint64_t max_round_trip;
+    uint64_t total_round_trip;
+
+    uint32_t checksum_errors;
+    uint32_t other_messages;
+
+    void on_echo_reply(InternetControlMessageProtocolMessage* message, uint32_t size);
+
+    public:
+        InternetControlMessageProtocol(InternetProtocolProvider* backend);
+        ~InternetControlMessageProtocol();
+
+        bool on_internet_protocol_received(uint32_t source_ip, uint32_t destination_ip, PacketBuffer* packet);
+
+        TransmitStatus send_echo_request(uint32_t destination_ip, uint16_t payload_size = ICMP_ECHO_PAYLOAD_SIZE);
+
+        void print_statistics();
+};
+
+#endif
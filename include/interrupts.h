@@ -2,12 +2,35 @@
 #define INTERRUPT_MANAGER_H
 
 #include "gdt.h"
+#include "mmio.h"
 #include "task_scheduler.h"
 #include "types.h"
 #include "port.h"
 
+// Vectors handed out to MSI/MSI-X devices, relative to the hardware interrupt offset (0x40-0x4F).
+#define MESSAGE_SIGNALED_INTERRUPT_BASE 0x20
+#define MAX_MESSAGE_SIGNALED_INTERRUPTS 16
+
+// Deferred polling (NAPI style): how many handlers can be scheduled at once, how much work each
+// may do per pass, and how many passes we make at the end of an interrupt before leaving the
+// rest for the next one (at the latest the next timer tick). The passes run with interrupts on.
+#define MAX_POLL_HANDLERS 8
+#define POLL_BUDGET 64
+#define MAX_POLL_ROUNDS 4
+
 class InterruptManager;
 
+// A driver that masks its interrupt under load and gets polled from the interrupt exit path.
+// Polls run with interrupts on, but never alongside another poll: interrupts that come in
+// meanwhile only run their handlers (the top half).
+class PollHandler
+{
+public:
+    // Does up to budget units of work and returns how many it did. Using up the whole budget
+    // keeps the handler scheduled, returning less means it's done and has unmasked its interrupt.
+    virtual uint16_t poll(uint16_t budget) = 0;
+};
+
 class InterruptHandler
 {
 protected:
@@ -17,6 +40,9 @@ protected:
     InterruptHandler(InterruptManager* interrupt_manager, uint8_t interrupt_number);
     ~InterruptHandler();
 
+    // Moves this handler to another vector (e.g. from a legacy IRQ line to an MSI vector).
+    void set_interrupt_number(uint8_t interrupt_number);
+
 public:
     virtual uint32_t handle_interrupt(uint32_t esp);
 };
@@ -48,6 +74,23 @@ protected:
     } __attribute__((packed));
 
     uint16_t hardware_interrupt_offset_value;
+
+    // The local APIC is what receives MSI writes, so it has to be on even though the PIC
+    // still delivers all the legacy lines (through LINT0 in virtual wire mode).
+    MemoryMappedRegion local_apic;
+    uint8_t local_apic_id;
+    uint16_t allocated_message_signaled_interrupts;  // One bit per vector above MESSAGE_SIGNALED_INTERRUPT_BASE
+
+    PollHandler* poll_handlers[MAX_POLL_HANDLERS];
+    uint8_t poll_handler_count;
+
+    // How deep in do_handle_interrupt we are. Only the outermost one polls and switches tasks,
+    // a nested one leaves its switch to it.
+    uint8_t interrupt_depth;
+    bool is_switch_deferred;
+
+    void enable_local_apic();
+    void run_poll_handlers();
     
     static void set_interrupt_descriptor_table_entry(
         uint8_t interrupt,
@@ -69,11 +112,18 @@ public:
     ~InterruptManager();
     
     uint16_t get_hardware_interrupt_offset();
+    uint8_t allocate_interrupt_vector();
+    void free_interrupt_vector(uint8_t vector);
+    bool get_message_signaled_interrupt(uint8_t vector, uint32_t* address, uint32_t* data);
+    bool schedule_poll(PollHandler* handler);
     void activate();
     void deactivate();
     
     // Main interrupt handling function (made it public so the wrapper can access it).
     static uint32_t handle_interrupt(uint8_t interrupt, uint32_t esp);
+
+    // True in interrupt handlers and polls, where blocking isn't an option.
+    static bool is_handling_interrupt();
 };
 
 // Assembly interface functions declared with C linkage to avoid name mangling :)
@@ -119,6 +169,26 @@ extern "C" {
     void handle_interrupt_request_0x0d();
     void handle_interrupt_request_0x0e();
     void handle_interrupt_request_0x0f();
+
+    void handle_interrupt_request_0x20();
+    void handle_interrupt_request_0x21();
+    void handle_interrupt_request_0x22();
+    void handle_interrupt_request_0x23();
+    void handle_interrupt_request_0x24();
+    void handle_interrupt_request_0x25();
+    void handle_interrupt_request_0x26();
+    void handle_interrupt_request_0x27();
+    void handle_interrupt_request_0x28();
+    void handle_interrupt_request_0x29();
+    void handle_interrupt_request_0x2a();
+    void handle_interrupt_request_0x2b();
+    void handle_interrupt_request_0x2c();
+    void handle_interrupt_request_0x2d();
+    void handle_interrupt_request_0x2e();
+    void handle_interrupt_request_0x2f();
+
+    void handle_interrupt_request_0x30();
+
     void handle_interrupt_request_0x31();
 }
 
@@ -0,0 +1,175 @@
+#ifndef IPV4_H
+#define IPV4_H
+
+#include "arp.h"
+#include "ethernet_frame.h"
+#include "packet_buffer.h"
+#include "routing.h"
+#include "types.h"
+
+#define INTERNET_PROTOCOL_ETHER_TYPE 0x0800
+
+// Protocol numbers we care about.
+#define INTERNET_PROTOCOL_ICMP 1
+#define INTERNET_PROTOCOL_TCP 6
+#define INTERNET_PROTOCOL_UDP 17
+
+// Same idea as the EtherType dispatch: few protocols, so a small array that fits a cache line.
+#define MAX_INTERNET_PROTOCOL_HANDLERS 8
+
+#define INTERNET_PROTOCOL_DEFAULT_TIME_TO_LIVE 64
+#define INTERNET_PROTOCOL_MTU 1500
+
+// Flags and offset share a field.
+#define INTERNET_PROTOCOL_FLAG_DONT_FRAGMENT  0x4000
+#define INTERNET_PROTOCOL_FLAG_MORE_FRAGMENTS 0x2000
+#define INTERNET_PROTOCOL_FRAGMENT_OFFSET     0x1FFF
+
+// NOTE: Multi byte fields are big endian, addresses are kept that way everywhere.
+struct InternetProtocolV4Header
+{
+    uint8_t header_length : 4;  // In 32 bit words
+    uint8_t version : 4;
+    uint8_t type_of_service;
+    uint16_t total_length;
+    uint16_t identification;
+    uint16_t flags_and_offset;
+    uint8_t time_to_live;
+    uint8_t protocol;
+    uint16_t checksum;
+    uint32_t source_ip;
+    uint32_t destination_ip;
+} __attribute__((packed));
+
+static inline uint16_t swap_endian_16(uint16_t value)
+{
+    return (value << 8) | (value >> 8);
+}
+
+static inline uint32_t swap_endian_32(uint32_t value)
+{
+    return ((uint32_t) swap_endian_16(value) << 16) | swap_endian_16(value >> 16);
+}
+
+class InternetProtocolProvider;
+
+class InternetProtocolHandler
+{
+protected:
+    InternetProtocolProvider* backend;
+    uint8_t protocol;
+
+public:
+    InternetProtocolHandler(InternetProtocolProvider* backend, uint8_t protocol);
+    ~InternetProtocolHandler();
+
+    // The packet starts past the IP header and is trimmed to the IP payload. It's lent like in
+    // EthernetFrameHandler::on_packet_received. Returning true sends it back to source_ip,
+    // changed in place (same size).
+    virtual bool on_internet_protocol_received(uint32_t source_ip, uint32_t destination_ip, PacketBuffer* packet);
+
+    // Takes over the caller's reference. source_ip 0 means the routed interface's address.
+    TransmitStatus send(uint32_t destination_ip, PacketBuffer* packet, uint32_t source_ip = 0);
+};
+
+class InternetProtocolProvider : public EthernetFrameHandler
+{
+friend class InternetProtocolHandler;
+protected:
+    struct DispatchTable
+    {
+        uint8_t protocols[MAX_INTERNET_PROTOCOL_HANDLERS];
+        InternetProtocolHandler* handlers[MAX_INTERNET_PROTOCOL_HANDLERS];
+        uint8_t count;
+    } __attribute__((aligned(64)));
+
+    DispatchTable dispatch_table;
+    AddressResolutionProtocol* arp;
+    RoutingTable* routing_table;
+    uint32_t subnet_mask;
+    uint16_t next_identification;
+
+    uint32_t received_packets;
+    uint32_t delivered_packets;
+    uint32_t header_errors;
+    uint32_t checksum_errors;
+    uint32_t foreign_packets;
+    uint32_t fragments_dropped;
+    uint32_t unknown_protocols;
+    uint32_t sent_packets;
+    uint32_t send_drops;
+    uint32_t no_route;
+
+    bool is_forwarding;
+    uint32_t forwarded_packets;
+    uint32_t forwarded_unresolved;  // Of those, the ones left waiting for ARP
+    uint32_t time_to_live_exceeded;
+    uint32_t forward_drops;
+    uint32_t last_forwarded_packets;
+    uint32_t last_forwarding_report;
+
+    bool register_handler(uint8_t protocol, InternetProtocolHandler* handler);
+    void unregister_handler(uint8_t protocol, InternetProtocolHandler* handler);
+    InternetProtocolHandler* find_handler(uint8_t protocol);
+
+    bool is_local_destination(uint32_t ip);
+    InternetProtocolProvider* find_local_interface(uint32_t ip);
+    InternetProtocolProvider* get_output_interface(uint32_t destination_ip, Route** route);
+    void forward(InternetProtocolV4Header* header, PacketBuffer* packet);
+
+public:
+    // Adds the route to its own subnet to routing_table, the rest (a default route) is up to
+    // the caller. Several interfaces can share one table.
+    InternetProtocolProvider(EthernetFrameProvider* backend, AddressResolutionProtocol* arp, RoutingTable* routing_table, uint32_t subnet_mask);
+    ~InternetProtocolProvider();
+
+    bool on_packet_received(PacketBuffer* packet);
+
+    // Puts an IP header in front of packet and sends it towards destination_ip, out of
+    // whichever interface the routing table says. The source is that interface's address
+    // unless source_ip says otherwise. Takes over the caller's reference.
+    TransmitStatus send(uint32_t destination_ip, uint8_t protocol, PacketBuffer* packet, uint32_t source_ip = 0);
+
+    // Sends a finished IP packet to next_hop on this interface's link. is_unresolved as in
+    // AddressResolutionProtocol::send.
+    TransmitStatus transmit(uint32_t next_hop, PacketBuffer* packet, bool* is_unresolved = nullptr);
+
+    // Packets for someone else get routed on instead of dropped. Only the receiving interface
+    // has to have it on.
+    void set_forwarding(bool is_forwarding);
+    uint32_t get_forwarded_packets();
+
+    uint32_t get_ip_address();
+    uint32_t get_subnet_mask();
+
+    // All ones, or the directed broadcast of our subnet.
+    bool is_broadcast(uint32_t ip);
+    RoutingTable* get_routing_table();
+
+    // 0 when there's no route.
+    uint32_t get_next_hop(uint32_t destination_ip);
+
+    // The address send() puts in the header for destination_ip (that of the interface it goes
+    // out of). TCP and UDP need it up front for their pseudo header.
+    uint32_t get_source_for(uint32_t destination_ip);
+
+    // For the packet being handed up right now, see NetworkInterfaceController.
+    uint8_t get_receive_checksum_status();
+
+    // Header checksum for a header that is header_length bytes long.
+    static uint16_t compute_header_checksum(InternetProtocolV4Header* header, uint32_t header_length);
+
+    // Running checksum sum of the pseudo header TCP and UDP put in front of their checksum.
+    // The addresses are as stored, length is in host order.
+    static uint32_t pseudo_header_sum(uint32_t source_ip, uint32_t destination_ip, uint8_t protocol, uint16_t length);
+
+    // One hop further: decrements the TTL and patches the checksum for just that change.
+    static void decrease_time_to_live(InternetProtocolV4Header* header);
+
+    void print_statistics();
+
+    // Forwarded packets per second since the last call.
+    void print_forwarding_statistics();
+};
+
+#endif
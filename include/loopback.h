@@ -0,0 +1,84 @@
+#ifndef LOOPBACK_H
+#define LOOPBACK_H
+
+#include "driver.h"
+#include "interrupts.h"
+#include "nic.h"
+#include "terminal.h"
+#include "types.h"
+
+// Frames that can wait for delivery at once (power of two). There are twice as many buffers,
+// the rest covers buffers the stack holds on to.
+#define LOOPBACK_QUEUE_SIZE 64
+#define LOOPBACK_BUFFER_SIZE 1536
+
+// The loopback has no interrupt, but every Driver needs a vector. This one sits between the
+// legacy lines and the MSI vectors (relative to the hardware offset) and has no IDT gate.
+#define LOOPBACK_INTERRUPT_NUMBER 0x10
+
+// A NIC without hardware: everything sent comes straight back in through the raw data handler,
+// so the stack can be tested and benchmarked without a card or a peer.
+//
+// Frames are copied into a queue on send and delivered right away, from the same poll path the
+// real drivers use. Sends made while a frame is being delivered (replies) just queue up and go
+// out in the same pass, and whatever is left after the poll budget runs from the poll list.
+class Loopback : public NetworkInterfaceController, public PollHandler
+{
+    uint64_t mac_address;
+    uint32_t ip_address;
+
+    struct QueueEntry
+    {
+        uint8_t* buffer;
+        uint32_t size;
+        TransmitCompletionHandler* handler;
+        void* context;
+    };
+
+    void* memory;
+    uint8_t* buffers;
+    QueueEntry* queue;
+    uint16_t queue_head;
+    uint16_t queue_count;
+
+    bool is_delivering;
+
+    uint32_t sent_frames;
+    uint32_t sent_bytes;
+    uint32_t received_frames;
+    uint32_t send_drops;
+    uint32_t deferred_polls;
+    uint16_t max_queue_depth;
+
+    TransmitStatus enqueue(TransmitFragment* fragments, uint16_t fragment_count, TransmitCompletionHandler* handler, void* context);
+    void deliver();
+
+    public:
+        Loopback(InterruptManager* interrupt_manager, uint64_t mac_address = 0);
+        ~Loopback();
+
+        void initialize();
+        void activate();
+        void deactivate();
+        void reset();
+        string get_driver_name();
+        uint32_t handle_interrupt(uint32_t esp);
+        uint16_t poll(uint16_t budget);
+
+        TransmitStatus send(uint8_t* buffer, int size, bool wait = false);
+        TransmitStatus send_fragments(TransmitFragment* fragments, uint16_t fragment_count, TransmitCompletionHandler* handler, void* context,
+                                      bool wait = false, const TransmitChecksumOffload* offload = nullptr);
+        uint16_t receive(uint16_t budget);
+
+        uint64_t get_mac_address();
+        void set_ip_address(uint32_t ip);
+        uint32_t get_ip_address();
+        uint16_t get_send_ring_size();
+
+        // Nothing leaves the machine, so there are no checksums worth computing or checking.
+        uint32_t get_features();
+        uint8_t get_receive_checksum_status();
+        void print_statistics();
+};
+
+#endif
@@ -0,0 +1,75 @@
+#ifndef MMIO_H
+#define MMIO_H
+
+#include "types.h"
+
+// Typed access to a single memory-mapped device register. The pointer is volatile so the
+// compiler never caches, merges or reorders the accesses (same idea as the Port classes).
+template <typename T>
+class MemoryMappedRegister
+{
+protected:
+    volatile T* address;
+
+public:
+    MemoryMappedRegister(uint32_t address)
+    {
+        this->address = (volatile T*) address;
+    }
+
+    inline T read()
+    {
+        return *address;
+    }
+
+    inline void write(T data)
+    {
+        *address = data;
+    }
+};
+
+typedef MemoryMappedRegister<uint8_t>  MemoryMappedRegister8Bit;
+typedef MemoryMappedRegister<uint16_t> MemoryMappedRegister16Bit;
+typedef MemoryMappedRegister<uint32_t> MemoryMappedRegister32Bit;
+
+// A block of device registers (usually a PCI memory BAR).
+class MemoryMappedRegion
+{
+protected:
+    uint32_t base;
+    uint32_t size;
+
+public:
+    MemoryMappedRegion();
+    MemoryMappedRegion(uint32_t base, uint32_t size);
+    ~MemoryMappedRegion();
+
+    bool map_uncached();
+    uint32_t get_base();
+    uint32_t get_size();
+
+    template <typename T>
+    inline T read(uint32_t offset)
+    {
+        return *((volatile T*) (base + offset));
+    }
+
+    template <typename T>
+    inline void write(uint32_t offset, T data)
+    {
+        *((volatile T*) (base + offset)) = data;
+    }
+
+    template <typename T>
+    inline MemoryMappedRegister<T> get_register(uint32_t offset)
+    {
+        return MemoryMappedRegister<T>(base + offset);
+    }
+};
+
+// We don't have paging yet, so physical addresses are accessed directly and the only way to
+// control caching is through the variable range MTRRs. Regions must be a power of two in size
+// and naturally aligned (which PCI BARs always are).
+bool map_memory_uncached(uint32_t physical_address, uint32_t size);
+
+#endif
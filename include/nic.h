@@ -0,0 +1,155 @@
+#ifndef NIC_H
+#define NIC_H
+
+#include "driver.h"
+#include "interrupts.h"
+#include "task_scheduler.h"
+#include "types.h"
+
+// Largest frame we send or accept, without the FCS.
+#define MAX_ETHERNET_FRAME_SIZE 1518
+
+// Optional features a NIC can advertise through get_features().
+#define NIC_FEATURE_TRANSMIT_CHECKSUM 0x01  // Fills in checksums described by a TransmitChecksumOffload.
+#define NIC_FEATURE_RECEIVE_CHECKSUM  0x02  // Verifies IP/TCP/UDP checksums, see get_receive_checksum_status().
+
+class NetworkInterfaceController;
+
+// One piece of a frame for scatter-gather transmit. The NIC reads it straight from this
+// memory, so it has to stay untouched until the transmit completes.
+struct TransmitFragment
+{
+    uint8_t* data;
+    uint32_t size;
+};
+
+enum TransmitStatus
+{
+    TransmitSent = 0,       // Handed to the NIC.
+    TransmitQueued = 1,     // The ring was full, the frame waits in the software queue.
+    TransmitQueueFull = 2,  // Ring and queue both full, the frame was dropped.
+    TransmitInvalid = 3     // Too big, too many fragments or empty, the frame was dropped.
+};
+
+// Which checksums the NIC should fill in. All offsets count from the start of the frame.
+// The transport checksum covers everything from transport_start to the end of the frame,
+// so the caller seeds the checksum field with the pseudo header sum first (like Linux does).
+struct TransmitChecksumOffload
+{
+    bool insert_ip_checksum;
+    uint8_t ip_header_start;
+    uint8_t ip_checksum_offset;
+    uint16_t ip_header_end;         // Last byte of the IP header.
+
+    bool insert_transport_checksum;
+    bool is_tcp;
+    uint8_t transport_start;
+    uint8_t transport_checksum_offset;
+};
+
+// Bits of get_receive_checksum_status() for the frame currently being handed up.
+#define RECEIVE_CHECKSUM_IP_VERIFIED        0x01
+#define RECEIVE_CHECKSUM_TRANSPORT_VERIFIED 0x02
+
+class TransmitCompletionHandler
+{
+    public:
+        // Called from the interrupt handler once the NIC is done with a frame's memory.
+        virtual void on_transmit_complete(void* context);
+};
+
+class RawDataHandler
+{
+    protected:
+        NetworkInterfaceController* backend;
+
+    public:
+        RawDataHandler(NetworkInterfaceController* backend);
+        ~RawDataHandler();
+
+        virtual bool on_raw_data_received(uint8_t* buffer, uint32_t size);
+
+        TransmitStatus send(uint8_t* buffer, uint32_t size, bool wait = false);
+
+        // Receive buffers are only lent to on_raw_data_received. A handler that wants to keep
+        // one past the callback (without copying) holds it, and releases it when done.
+        // Any pointer into the buffer works. Returns false if no spare buffer was left to
+        // refill the ring with, in which case the data has to be copied after all.
+        bool hold_buffer(uint8_t* buffer);
+        void release_buffer(uint8_t* buffer);
+};
+
+// What the network stack needs from a network card, so it doesn't care which one it's on.
+class NetworkInterfaceController : public Driver
+{
+    protected:
+        RawDataHandler* raw_data_handler;
+
+        // The task sleeping in wait_for_send_completion(), if any.
+        Task* send_waiter;
+
+        // Receive buffer lending, the same for every driver. The driver registers its buffers
+        // (one block, all the same size) and a pool of spares, and wraps each frame it hands up
+        // in lend_receive_buffer()/end_receive_loan(). A held buffer gets replaced from the pool.
+        uint8_t* receive_buffer_region;
+        uint32_t receive_buffer_size;
+        uint32_t receive_buffer_region_size;
+        uint8_t** receive_buffer_pool;       // Used as a stack
+        uint16_t receive_buffer_pool_count;
+        uint16_t receive_buffer_pool_size;
+        uint16_t receive_buffer_pool_reserve; // Spares hold_receive_buffer() never hands out
+        uint8_t* lent_receive_buffer;
+        bool is_lent_buffer_held;
+        uint32_t held_buffers;
+        uint32_t pool_exhausted;
+
+        NetworkInterfaceController(InterruptManager* interrupt_manager, uint8_t interrupt_number);
+
+        // The pool starts out empty, the driver pushes its spares itself.
+        void set_receive_buffers(uint8_t* buffers, uint32_t buffer_size, uint32_t buffer_count, uint8_t** pool, uint16_t pool_size, uint16_t pool_reserve = 0);
+        uint8_t* get_receive_buffer_start(uint8_t* pointer);
+
+        // Lends buffer to the stack for the on_raw_data_received() callback. Ending the loan
+        // returns true if the stack kept the buffer, the driver then needs a spare from take_pool_buffer().
+        void lend_receive_buffer(uint8_t* buffer);
+        bool end_receive_loan();
+        uint8_t* take_pool_buffer();
+
+        // For sends with wait set, with interrupts off and the ring full: gives the CPU away until
+        // the driver reclaims something, then returns (interrupts off again) so the caller can
+        // look at the ring once more. Interrupt handlers and polls can't sleep, for them it returns
+        // right away and the caller keeps polling the ring.
+        void wait_for_send_completion();
+
+        // Drivers call this whenever they've freed send space.
+        void wake_send_waiter();
+
+    public:
+        virtual ~NetworkInterfaceController();
+
+        // Both return TransmitQueueFull right away when there's no room left, unless wait is
+        // set: then they block until the NIC has sent enough to make room.
+        virtual TransmitStatus send(uint8_t* buffer, int size, bool wait = false) = 0;
+        virtual TransmitStatus send_fragments(TransmitFragment* fragments, uint16_t fragment_count, TransmitCompletionHandler* handler, void* context,
+                                              bool wait = false, const TransmitChecksumOffload* offload = nullptr) = 0;
+
+        // Only the buffer currently lent out can be held, and only while the pool can replace it.
+        virtual bool hold_receive_buffer(uint8_t* buffer);
+        virtual void release_receive_buffer(uint8_t* buffer);
+
+        virtual uint64_t get_mac_address() = 0;
+        virtual void set_ip_address(uint32_t ip) = 0;
+        virtual uint32_t get_ip_address() = 0;
+
+        // How many frames can be accepted before send starts failing (ring plus software queue).
+        virtual uint16_t get_send_ring_size() = 0;
+        virtual uint16_t get_send_queue_size() { return 0; }
+
+        virtual uint32_t get_features() { return 0; }
+        virtual uint8_t get_receive_checksum_status() { return 0; }
+        virtual void print_statistics() {}
+
+        void set_handler(RawDataHandler* raw_data_handler);
+};
+
+#endif
@@ -0,0 +1,100 @@
+#ifndef PACKET_BUFFER_H
+#define PACKET_BUFFER_H
+
+#include "nic.h"
+#include "types.h"
+
+// Every pool buffer is this big, and starts out with this much of it reserved in front of the
+// packet: enough for Ethernet, IP and TCP headers with options, so no layer has to copy to
+// prepend its header.
+#define PACKET_BUFFER_SIZE 2048
+#define PACKET_BUFFER_HEADROOM 128
+#define PACKET_BUFFER_POOL_SIZE 256
+
+class PacketBufferPool;
+
+// A packet plus the room around it (like an sk_buff or mbuf). Layers push their header in
+// front on the way down and pull it off on the way up, the payload never moves.
+//
+// A buffer either has its own memory from the pool, or wraps a receive buffer a NIC lent to
+// the stack, in which case keeping it around (retain) has to ask the NIC first.
+class PacketBuffer
+{
+    friend class PacketBufferPool;
+
+    uint8_t* start;
+    uint8_t* end;
+    uint8_t* data;
+    uint32_t length;
+    uint16_t reference_count;
+
+    NetworkInterfaceController* lender;
+    bool is_held;
+
+    PacketBufferPool* pool;
+    PacketBuffer* next;  // Free list
+
+    public:
+        uint8_t* get_data() { return data; }
+        uint32_t get_length() { return length; }
+        uint32_t get_headroom() { return data - start; }
+        uint32_t get_tailroom() { return end - (data + length); }
+
+        // Grow the packet at the front (returns the new start) or the back (returns the new
+        // part), nullptr when there's no room.
+        uint8_t* push(uint32_t size);
+        uint8_t* put(uint32_t size);
+
+        // Strip size bytes from the front (returns the new start, nullptr if it's shorter), or
+        // cut the packet down to length.
+        uint8_t* pull(uint32_t size);
+        void trim(uint32_t length);
+
+        // Takes another reference. For a lent receive buffer the NIC has to agree to part
+        // with it, if it can't we hand back a copy instead (or nullptr if the pool is empty).
+        // Either way, the returned buffer is the one to release later.
+        PacketBuffer* retain();
+
+        // Drops a reference, the last one gives the memory back.
+        void release();
+};
+
+// Preallocated packet buffers. There's a single CPU, so this is the per-CPU pool and only has
+// to keep interrupt handlers out while it changes the free list.
+class PacketBufferPool
+{
+    void* memory;
+    PacketBuffer* buffers;
+    uint8_t* buffer_memory;
+    uint16_t buffer_count;
+
+    PacketBuffer* free_list;
+    uint16_t free_count;
+    uint16_t min_free_count;
+
+    uint32_t allocations;
+    uint32_t allocation_failures;
+    uint32_t retain_copies;
+
+    PacketBuffer* take();
+
+    public:
+        static PacketBufferPool* active_pool;
+
+        PacketBufferPool(uint16_t buffer_count = PACKET_BUFFER_POOL_SIZE);
+        ~PacketBufferPool();
+
+        // An empty packet with headroom bytes reserved in front of it.
+        PacketBuffer* allocate(uint32_t headroom = PACKET_BUFFER_HEADROOM);
+
+        // A packet that points at memory the NIC lent us for the duration of a receive callback.
+        PacketBuffer* wrap(uint8_t* data, uint32_t length, NetworkInterfaceController* lender);
+
+        void free(PacketBuffer* buffer);
+        void count_retain_copy() { ++retain_copies; }
+
+        uint16_t get_free_count() { return free_count; }
+        void print_statistics();
+};
+
+#endif
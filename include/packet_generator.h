@@ -0,0 +1,106 @@
+#ifndef PACKET_GENERATOR_H
+#define PACKET_GENERATOR_H
+
+#include "ethernet_frame.h"
+#include "nic.h"
+#include "task_scheduler.h"
+#include "timer.h"
+#include "types.h"
+
+// IEEE 802 local experimental EtherType, so nothing else on the wire mistakes our frames.
+#define PACKET_GENERATOR_ETHER_TYPE 0x88B5
+#define PACKET_GENERATOR_MAGIC 0x47544B50  // "PKTG"
+
+// Smallest frame we generate is the Ethernet minimum (without FCS).
+#define PACKET_GENERATOR_MIN_FRAME_SIZE 60
+
+// At the start of every generated payload, the rest is filler.
+struct PacketGeneratorHeader
+{
+    uint32_t magic;
+    uint32_t sequence;
+    uint64_t timestamp;  // TSC at send time
+} __attribute__((packed));
+
+struct PacketGeneratorConfiguration
+{
+    uint64_t destination_mac;
+    uint16_t frame_size;    // Whole frame without the FCS, 60 to 1518
+    uint32_t frame_count;
+    uint32_t rate;          // Frames per second, 0 sends flat out
+    bool use_driver;        // Build whole frames and hand them to the NIC, skipping EthernetFrameProvider
+};
+
+// pktgen: blasts numbered, timestamped frames through the stack (or straight into the driver)
+// and measures how fast they went out. Frames go out zero-copy from a slot per frame that can
+// be in flight, so only the header is rewritten per frame.
+class PacketGenerator : public TransmitCompletionHandler
+{
+    EthernetFrameProvider* backend;
+    NetworkInterfaceController* nic;
+    PacketGeneratorConfiguration configuration;
+
+    uint8_t* slots;
+    uint16_t slot_count;
+    uint16_t next_slot;
+
+    uint32_t sent_frames;
+    volatile uint32_t completed_frames;
+    uint64_t sent_bytes;
+    uint32_t queue_full_retries;
+    uint32_t invalid_frames;
+    uint64_t start_cycles;
+    uint64_t end_cycles;
+
+    // run() sleeps here while it waits for the NIC, on_transmit_complete() wakes it.
+    Task* waiter;
+
+    TransmitStatus send_frame(uint8_t* slot, uint16_t payload_size);
+    void wait_for_completion();
+
+    public:
+        PacketGenerator(EthernetFrameProvider* backend, NetworkInterfaceController* nic);
+        ~PacketGenerator();
+
+        void configure(const PacketGeneratorConfiguration* configuration);
+
+        // Sends the configured frames and returns when all of them are accepted. Needs the
+        // timer and runs with interrupts on (the NIC has to complete frames meanwhile). From a
+        // task it blocks while the NIC is busy, otherwise it halts.
+        void run();
+        void print_results();
+
+        void on_transmit_complete(void* context);
+};
+
+// The receiving end: counts the generator's frames and keeps track of loss, reordering,
+// throughput and inter-arrival jitter (RFC 3550 style, so it works across machines too).
+// Latency needs both ends on the same TSC, which only the loopback gives us.
+class PacketSink : public EthernetFrameHandler
+{
+    uint32_t received_frames;
+    uint64_t received_bytes;
+    uint32_t lost_frames;
+    uint32_t reordered_frames;
+    uint32_t foreign_frames;
+    uint32_t expected_sequence;
+
+    uint64_t first_arrival;
+    uint64_t last_arrival;
+
+    int64_t previous_transit;
+    int64_t jitter;  // In cycles, scaled by 16 (see on_ethernet_frame_received)
+    uint64_t total_latency;
+    uint64_t min_latency;
+    uint64_t max_latency;
+
+    public:
+        PacketSink(EthernetFrameProvider* backend);
+        ~PacketSink();
+
+        void reset();
+        bool on_ethernet_frame_received(uint8_t* payload, uint32_t size);
+        void print_results();
+};
+
+#endif
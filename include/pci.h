@@ -1,12 +1,17 @@
 #ifndef PCI_H
 #define PCI_H
 
+#include "acpi.h"
 #include "driver_manager.h"
 #include "interrupts.h"
 #include "memory_manager.h"
+#include "mmio.h"
 #include "port.h"
 #include "terminal.h"
 
+// Maximum number of PCI functions kept in the device table
+#define MAX_PCI_DEVICES 64
+
 enum BaseAddressRegisterType
 {
     MemoryMapping = 0,
@@ -17,14 +22,21 @@ class BaseAddressRegister
 {
     public:
         bool prefetchable_bit;
+        bool is_64_bit; // This BAR also uses the next slot for the upper 32 bits of the address.
         uint8_t* address;
         uint32_t size;
         BaseAddressRegisterType type;
+
+        BaseAddressRegister();
 };
 
+class PeripheralComponentInterconnectController;
+
 class PeripheralComponentInterconnectDeviceDescriptor
 {
     public:
+        PeripheralComponentInterconnectController* controller;
+
         uint32_t port;
         uint32_t interrupt_number;
 
@@ -40,15 +52,77 @@ class PeripheralComponentInterconnectDeviceDescriptor
         uint8_t programming_interface;
 
         uint8_t revision_id;
+        uint8_t header_type;
+
+        BaseAddressRegister base_address_registers[6];
 
         PeripheralComponentInterconnectDeviceDescriptor();
         ~PeripheralComponentInterconnectDeviceDescriptor();
 };
 
+// Wildcard for any field of a PeripheralComponentInterconnectDeviceMatch
+#define PCI_MATCH_ANY 0xFFFF
+
+// One ID/class tuple a driver can bind to. Class fields are 16 bit so PCI_MATCH_ANY can't
+// collide with a real class code.
+struct PeripheralComponentInterconnectDeviceMatch
+{
+    uint16_t vendor_id;
+    uint16_t device_id;
+    uint16_t class_code;
+    uint16_t subclass;
+
+    constexpr bool matches(const PeripheralComponentInterconnectDeviceDescriptor* device) const
+    {
+        return (vendor_id == PCI_MATCH_ANY || vendor_id == device->vendor_id)
+            && (device_id == PCI_MATCH_ANY || device_id == device->device_id)
+            && (class_code == PCI_MATCH_ANY || class_code == device->class_code)
+            && (subclass == PCI_MATCH_ANY || subclass == device->subclass);
+    }
+};
+
+typedef Driver* (*PeripheralComponentInterconnectProbe)(PeripheralComponentInterconnectDeviceDescriptor* device, InterruptManager* interrupt_manager);
+
+struct PeripheralComponentInterconnectDriverEntry
+{
+    string name;
+    const PeripheralComponentInterconnectDeviceMatch* matches;
+    uint32_t match_count;
+    PeripheralComponentInterconnectProbe probe;
+};
+
+// Drivers register themselves by dropping an entry into the .pci_drivers section, which the
+// linker script gathers between start_pci_drivers and end_pci_drivers (just like the ctors).
+// Nothing in pci.cpp has to change when a driver is added.
+#define REGISTER_PCI_DRIVER(name, match_table, probe_function) \
+    static const PeripheralComponentInterconnectDriverEntry pci_driver_entry_##name \
+        __attribute__((used, section(".pci_drivers"), aligned(4))) { \
+            #name, match_table, sizeof(match_table) / sizeof(match_table[0]), probe_function \
+        }
+
 class PeripheralComponentInterconnectController
 {
     Port32Bit command_port;
     Port32Bit data_port;
+
+    // PCIe ECAM window from the ACPI MCFG table (empty when only the legacy ports are usable).
+    MemoryMappedRegion configuration_space;
+    uint16_t configuration_space_start_bus;
+    uint16_t configuration_space_end_bus;
+
+    // Filled once by enumerate(), every lookup after boot is served from here.
+    PeripheralComponentInterconnectDeviceDescriptor devices[MAX_PCI_DEVICES];
+    uint16_t device_count;
+    uint32_t visited_buses[256 / 32];
+    uint16_t bus_count;
+    bool is_enumerated;
+    uint32_t config_access_count;
+
+    void enumerate_bus(uint16_t bus_number);
+    void enumerate_function(uint16_t bus_number, uint16_t device_number, uint16_t function_number, uint32_t id);
+    bool is_memory_mapped(uint16_t bus_number);
+    uint32_t get_configuration_offset(uint16_t bus_number, uint16_t device_number, uint16_t function_number, uint32_t register_offset);
+    BaseAddressRegister probe_base_address_register(uint16_t bus_number, uint16_t device_number, uint16_t function_number, uint16_t bar_number, int max_bars);
     
     public:
         PeripheralComponentInterconnectController();
@@ -57,11 +131,36 @@ class PeripheralComponentInterconnectController
         uint32_t read(uint16_t bus_number, uint16_t device_number, uint16_t function_number, uint32_t register_offset);
         void write(uint16_t bus_number, uint16_t device_number, uint16_t function_number, uint32_t register_offset, uint32_t value);
         bool device_has_functions(uint16_t bus_number, uint16_t device_number);
+
+        bool enable_memory_mapped_configuration();
+        bool has_extended_configuration_space();
+        uint16_t find_extended_capability(uint16_t bus_number, uint16_t device_number, uint16_t function_number, uint16_t capability_id);
+        uint8_t find_capability(uint16_t bus_number, uint16_t device_number, uint16_t function_number, uint8_t capability_id);
+
+        uint16_t get_message_signaled_interrupt_count(PeripheralComponentInterconnectDeviceDescriptor* device);
+
+        // Turns on I/O and memory decoding plus bus mastering, which any device doing DMA needs.
+        void enable_bus_mastering(PeripheralComponentInterconnectDeviceDescriptor* device);
+
+        // Programs MSI-X (or plain MSI when there's only one vector) and turns off the legacy
+        // INTx line. Returns how many of the vectors were programmed, 0 means stay on INTx.
+        uint16_t enable_message_signaled_interrupts(PeripheralComponentInterconnectDeviceDescriptor* device, InterruptManager* interrupt_manager, uint8_t* vectors, uint16_t vector_count);
         
+        void enumerate();
         void select_drivers(DriverManager* driver_manager, InterruptManager* interrupt_manager);
-        Driver* get_driver(PeripheralComponentInterconnectDeviceDescriptor device, InterruptManager* interrupt_manager);
+        Driver* get_driver(PeripheralComponentInterconnectDeviceDescriptor* device, InterruptManager* interrupt_manager);
         PeripheralComponentInterconnectDeviceDescriptor get_device_descriptor(uint16_t bus_number, uint16_t device_number, uint16_t function_number);
         BaseAddressRegister get_base_address_register(uint16_t bus_number, uint16_t device_number, uint16_t function_number, uint16_t base_address_register);
+
+        // Device table lookups. Pass the previous result as "after" to continue a search.
+        uint16_t get_device_count();
+        PeripheralComponentInterconnectDeviceDescriptor* get_device(uint16_t index);
+        PeripheralComponentInterconnectDeviceDescriptor* find_device(uint16_t vendor_id, uint16_t device_id, PeripheralComponentInterconnectDeviceDescriptor* after = nullptr);
+        PeripheralComponentInterconnectDeviceDescriptor* find_device_by_class(uint8_t class_code, uint8_t subclass, PeripheralComponentInterconnectDeviceDescriptor* after = nullptr);
+        PeripheralComponentInterconnectDeviceDescriptor* find_device_by_location(uint16_t bus_number, uint16_t device_number, uint16_t function_number);
+
+        uint32_t get_config_access_count();
+        void print_devices();
 };
 
 #endif
@@ -0,0 +1,108 @@
+#ifndef ROUTING_H
+#define ROUTING_H
+
+#include "types.h"
+
+// Routes the table can hold. Every route takes at most two trie nodes (itself and the fork
+// above it), both come out of one allocation made up front.
+#define ROUTING_TABLE_MAX_ROUTES 4096
+
+// Interfaces that can share one table.
+#define ROUTING_TABLE_MAX_INTERFACES 8
+
+// Direct mapped cache of recent lookups (power of two).
+#define ROUTE_CACHE_BITS 8
+#define ROUTE_CACHE_SIZE (1 << ROUTE_CACHE_BITS)
+
+class InternetProtocolProvider;
+
+// Addresses are stored like everywhere else (network order), gateway 0 means the destination
+// is on the interface's link and is its own next hop.
+struct Route
+{
+    uint32_t destination;
+    uint8_t prefix_length;
+    uint32_t gateway;
+    InternetProtocolProvider* interface;
+    uint32_t hits;
+};
+
+// Longest prefix match over a path compressed binary trie: every node knows how many leading
+// bits it stands for, so chains of single children are skipped and a lookup visits at most 33
+// nodes however many routes there are. Most lookups don't get that far, they hit the cache,
+// which is thrown away whenever a route changes.
+//
+// One table is shared by all interfaces, the route says which one a packet leaves through.
+class RoutingTable
+{
+    struct Node
+    {
+        uint32_t key;  // Host order, bits past length are zero
+        uint8_t length;
+        bool has_route;
+        Route route;
+        Node* children[2];
+    };
+
+    struct CacheEntry
+    {
+        uint32_t destination;
+        uint32_t generation;  // Valid only while it matches the table's
+        Route* route;         // nullptr caches "no route" as well
+    };
+
+    Node* nodes;
+    Node* free_nodes;
+    Node* root;
+    uint32_t generation;
+    uint32_t route_count;
+    uint32_t node_count;
+
+    CacheEntry cache[ROUTE_CACHE_SIZE];
+
+    InternetProtocolProvider* interfaces[ROUTING_TABLE_MAX_INTERFACES];
+    uint8_t interface_count;
+
+    uint32_t lookups;
+    uint32_t cache_hits;
+    uint32_t no_route;
+
+    Node* allocate_node(uint32_t key, uint8_t length);
+    void free_node(Node* node);
+    Route* find_longest_match(uint32_t key);
+    void print_node(Node* node);
+
+    public:
+        RoutingTable();
+        ~RoutingTable();
+
+        // Adds a route, or replaces the one with the same prefix. False if the table is full.
+        bool add(uint32_t destination, uint8_t prefix_length, uint32_t gateway, InternetProtocolProvider* interface);
+        bool remove(uint32_t destination, uint8_t prefix_length);
+
+        // Interfaces sign up so the others can tell their addresses apart from ones to route.
+        // False if there's no room.
+        bool add_interface(InternetProtocolProvider* interface);
+
+        // Every route through interface and the interface itself, for when it goes away.
+        void remove_interface(InternetProtocolProvider* interface);
+
+        uint8_t get_interface_count() { return interface_count; }
+        InternetProtocolProvider* get_interface(uint8_t index) { return interfaces[index]; }
+
+        // The most specific route to destination, nullptr if there's none (not even a default).
+        Route* lookup(uint32_t destination);
+
+        // Where a packet to destination goes next on the route's link.
+        static uint32_t get_next_hop(Route* route, uint32_t destination) { return route->gateway != 0 ? route->gateway : destination; }
+
+        // 255.255.255.0 -> 24. The mask is stored like an address.
+        static uint8_t get_prefix_length(uint32_t subnet_mask);
+
+        uint32_t get_route_count() { return route_count; }
+
+        void print_routes();
+        void print_statistics();
+};
+
+#endif
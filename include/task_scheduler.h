@@ -4,6 +4,10 @@
 #include "gdt.h"
 #include "types.h"
 
+// Software interrupt a task raises to give up the CPU when it blocks. It's the hardware
+// interrupt offset (0x20) plus 0x30, see interruptstubs.s.
+#define TASK_SWITCH_VECTOR 0x50
+
 struct CPUState
 {
     uint32_t eax;
@@ -24,12 +28,21 @@ struct CPUState
     uint32_t ss;        
 } __attribute__((packed));
 
+enum TaskState
+{
+    TaskRunnable = 0,
+    TaskBlocked = 1
+};
+
 class Task
 {
     friend class TaskScheduler;
     private:
         uint8_t stack[4096];
         CPUState* cpu_state;
+        volatile TaskState state;
+        volatile bool is_sleeping;
+        uint32_t wake_tick;  // Timer tick a sleeping task is due at
     public:
         Task(GlobalDescriptorTable *gdt, void entry_point());
         ~Task();
@@ -43,11 +56,37 @@ class TaskScheduler
         int num_tasks;
         int current_task;
 
+        void wake_sleepers();
+
+        // Whatever ran before the first task (kernel_main's hlt loop). It only gets the CPU
+        // back when every task is blocked, so that's our idle loop.
+        CPUState* idle_state;
+        volatile bool is_switch_pending;
+
     public:
+        static TaskScheduler* active_task_scheduler;
+
         TaskScheduler();
         ~TaskScheduler();
         bool add_task(Task* task);
         CPUState* schedule(CPUState* cpu_state);
+
+        // nullptr outside of a task (during boot or in the idle loop).
+        Task* get_current_task();
+
+        // Called by the current task with interrupts off, after it checked there's nothing to
+        // do. Returns once someone called wake() on it, interrupts still off.
+        void block_current();
+
+        // Makes a blocked task runnable again, fine from interrupt handlers. If nothing was
+        // running it gets the CPU when the interrupt returns, otherwise at the next tick.
+        void wake(Task* task);
+
+        // Blocks the current task for at least milliseconds, the CPU goes to the others in the
+        // meantime. Interrupts on, from a task. Anywhere else it falls back to Timer::sleep.
+        void sleep(uint32_t milliseconds);
+
+        bool should_switch() { return is_switch_pending; }
 };
 
 #endif
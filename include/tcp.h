@@ -0,0 +1,297 @@
+#ifndef TCP_H
+#define TCP_H
+
+#include "event_poll.h"
+#include "ipv4.h"
+#include "packet_buffer.h"
+#include "timer.h"
+#include "types.h"
+
+// Connections (listeners included) that can exist at once.
+#define TCP_MAX_SOCKETS 32
+#define TCP_MAX_BACKLOG 8
+#define TCP_EPHEMERAL_PORT_START 49152
+
+// Sent data stays in the send buffer until it's acknowledged. Received segments are kept as
+// they came in (no copy), at most TCP_RECEIVE_QUEUE_SIZE of them and TCP_RECEIVE_BUFFER_SIZE
+// bytes. Segments that arrive early wait in a few out of order slots.
+#define TCP_SEND_BUFFER_SIZE 16384
+#define TCP_RECEIVE_BUFFER_SIZE 65536
+#define TCP_RECEIVE_QUEUE_SIZE 64
+#define TCP_MAX_OUT_OF_ORDER 8
+
+// Our MSS for a 1500 byte MTU, and what we assume when the peer doesn't say (RFC 1122).
+#define TCP_MAXIMUM_SEGMENT_SIZE 1460
+#define TCP_DEFAULT_SEGMENT_SIZE 536
+
+// We scale our window by 4 (RFC 7323), so the whole receive buffer can be offered.
+#define TCP_WINDOW_SCALE 2
+
+// All in milliseconds. The RTO follows RFC 6298 but with Linux's lower bound, 1 s is a long
+// time on a LAN.
+#define TCP_TIMER_PERIOD 10
+#define TCP_INITIAL_RTO 1000
+#define TCP_MIN_RTO 200
+#define TCP_MAX_RTO 60000
+#define TCP_DELAYED_ACK_TIME 40
+#define TCP_TIME_WAIT_TIME 2000
+
+#define TCP_MAX_SYN_RETRIES 5
+#define TCP_MAX_RETRIES 12
+#define TCP_DUPLICATE_ACK_THRESHOLD 3
+#define TCP_INITIAL_WINDOW_SEGMENTS 10  // RFC 6928
+
+#define TCP_FLAG_FIN 0x01
+#define TCP_FLAG_SYN 0x02
+#define TCP_FLAG_RST 0x04
+#define TCP_FLAG_PSH 0x08
+#define TCP_FLAG_ACK 0x10
+#define TCP_FLAG_URG 0x20
+
+#define TCP_OPTION_END 0
+#define TCP_OPTION_NOP 1
+#define TCP_OPTION_MAXIMUM_SEGMENT_SIZE 2
+#define TCP_OPTION_WINDOW_SCALE 3
+
+// NOTE: All of these values are in big endian
+struct TransmissionControlProtocolHeader
+{
+    uint16_t source_port;
+    uint16_t destination_port;
+    uint32_t sequence_number;
+    uint32_t acknowledgement_number;
+    uint8_t reserved : 4;
+    uint8_t data_offset : 4;  // In 32 bit words
+    uint8_t flags;
+    uint16_t window_size;
+    uint16_t checksum;
+    uint16_t urgent_pointer;
+} __attribute__((packed));
+
+enum TransmissionControlProtocolState
+{
+    TcpClosed = 0,
+    TcpListen = 1,
+    TcpSynSent = 2,
+    TcpSynReceived = 3,
+    TcpEstablished = 4,
+    TcpFinWait1 = 5,
+    TcpFinWait2 = 6,
+    TcpCloseWait = 7,
+    TcpClosing = 8,
+    TcpLastAck = 9,
+    TcpTimeWait = 10
+};
+
+class TransmissionControlProtocolProvider;
+
+// One connection or listener. They live in the provider (listen(), connect(), accept() hand
+// them out) and go back to it after close() once the connection is done with them.
+//
+// The timer handler (Timer::poll runs it with interrupts off) and the public calls (they
+// turn them off) can't be interrupted by the receive path, so nothing else needs locking.
+//
+// As an event source: readable when receive() has bytes or the peer closed (listeners: when
+// accept() has a connection), writable when send() has room, hangup once the connection is
+// over and error if it was reset.
+class TransmissionControlProtocolSocket : public EventSource
+{
+    friend class TransmissionControlProtocolProvider;
+
+    struct OutOfOrderSegment
+    {
+        uint32_t sequence;
+        PacketBuffer* packet;
+    };
+
+    TransmissionControlProtocolProvider* backend;
+    TransmissionControlProtocolState state;
+    bool is_in_use;
+    bool is_closed_by_user;  // The slot goes back once the connection is over
+    bool is_reset;
+
+    uint32_t local_ip;    // Fixed at connect() or when the SYN comes in, 0 for listeners
+    uint16_t local_port;
+    uint32_t remote_ip;
+    uint16_t remote_port;
+
+    // Listeners: connections that finished the handshake and wait for accept(), and the ones
+    // still in it (counted against the backlog too).
+    TransmissionControlProtocolSocket* parent;
+    TransmissionControlProtocolSocket* accept_queue[TCP_MAX_BACKLOG];
+    uint8_t accept_count;
+    uint8_t pending_count;
+    uint8_t backlog;
+
+    // Send side (RFC 793 names in the comments). The send buffer holds every byte from
+    // send_unacknowledged on, sent or not.
+    uint32_t initial_send_sequence;     // ISS
+    uint32_t send_unacknowledged;       // SND.UNA
+    uint32_t send_next;                 // SND.NXT
+    uint32_t send_maximum;              // Highest SND.NXT so far, it goes back on a timeout
+    uint32_t send_window;               // SND.WND, already scaled
+    uint32_t send_window_sequence;      // SND.WL1
+    uint32_t send_window_acknowledged;  // SND.WL2
+    uint16_t send_maximum_segment_size;
+    uint8_t send_window_scale;          // The peer's shift
+    uint8_t receive_window_scale;       // Ours, 0 if the peer doesn't do scaling
+    uint8_t* send_buffer;
+    uint32_t send_buffer_start;
+    uint32_t send_buffer_count;
+    bool is_fin_sent;
+    bool is_sending;
+
+    // Receive side.
+    uint32_t receive_next;              // RCV.NXT
+    uint32_t receive_advertised;        // Right edge of the last window we offered
+    PacketBuffer* receive_queue[TCP_RECEIVE_QUEUE_SIZE];
+    uint32_t receive_queue_head;
+    uint32_t receive_queue_tail;
+    uint32_t receive_queued_bytes;
+    OutOfOrderSegment out_of_order[TCP_MAX_OUT_OF_ORDER];
+    uint8_t out_of_order_count;
+    bool is_fin_received;
+
+    // Congestion control (Reno with NewReno recovery, RFC 5681 / 6582).
+    uint32_t congestion_window;
+    uint32_t slow_start_threshold;
+    uint8_t duplicate_acks;
+    bool is_in_fast_recovery;
+    uint32_t recovery_point;
+
+    // RTT estimation (RFC 6298), in milliseconds. One segment is timed at a time, and never a
+    // retransmitted one (Karn).
+    uint32_t smoothed_rtt;
+    uint32_t rtt_variance;
+    uint32_t retransmission_timeout;
+    bool is_timing_rtt;
+    uint32_t rtt_sequence;
+    uint32_t rtt_start;
+
+    // Deadlines in ticks, 0 when not running.
+    uint32_t retransmit_deadline;
+    uint32_t delayed_ack_deadline;
+    uint32_t time_wait_deadline;
+    uint8_t retries;
+    uint8_t unacknowledged_segments;
+
+    uint32_t segments_sent;
+    uint32_t segments_received;
+    uint32_t retransmissions;
+    uint32_t fast_retransmissions;
+    uint32_t timeouts;
+
+    void initialize(TransmissionControlProtocolProvider* backend, uint32_t local_ip, uint16_t local_port, uint32_t remote_ip, uint16_t remote_port);
+    void release_buffers();
+
+    uint32_t get_receive_window();
+    uint32_t get_flight_size();
+    void start_retransmit_timer();
+
+    public:
+        TransmissionControlProtocolSocket();
+
+        TransmissionControlProtocolState get_state() { return state; }
+        bool is_connected() { return state == TcpEstablished || state == TcpCloseWait; }
+        bool was_reset() { return is_reset; }
+
+        uint32_t get_local_ip() { return local_ip; }
+        uint16_t get_local_port() { return local_port; }
+        uint32_t get_remote_ip() { return remote_ip; }
+        uint16_t get_remote_port() { return remote_port; }
+
+        // Bytes that receive() would return right now, room left for send().
+        uint32_t get_receive_available() { return receive_queued_bytes; }
+        uint32_t get_send_space() { return TCP_SEND_BUFFER_SIZE - send_buffer_count; }
+
+        // True once the peer sent its FIN and everything before it was read.
+        bool is_end_of_stream() { return is_fin_received && receive_queued_bytes == 0; }
+
+        uint8_t get_events();
+
+        // Listeners only: the next established connection, nullptr if there's none yet.
+        TransmissionControlProtocolSocket* accept();
+
+        // Copies as much of data into the send buffer as fits and returns how much that was.
+        uint32_t send(const uint8_t* data, uint32_t size);
+
+        // Copies received bytes out, the one copy between the NIC buffer and the caller.
+        uint32_t receive(uint8_t* buffer, uint32_t size);
+
+        // Without the copy: the next received segment (just the payload), or nullptr. The
+        // caller owns the reference.
+        PacketBuffer* receive_packet();
+
+        // Sends FIN after whatever is still in the send buffer. The socket mustn't be used
+        // afterwards, the provider takes it back when the connection is over. It's taken out
+        // of every event poll right away.
+        void close();
+
+        void print_statistics();
+};
+
+class TransmissionControlProtocolProvider : public InternetProtocolHandler, public TimerHandler
+{
+    friend class TransmissionControlProtocolSocket;
+
+    TransmissionControlProtocolSocket sockets[TCP_MAX_SOCKETS];
+    uint16_t next_ephemeral_port;
+    uint32_t sequence_seed;
+
+    uint32_t received_segments;
+    uint32_t header_errors;
+    uint32_t checksum_errors;
+    uint32_t resets_sent;
+    uint32_t dropped_segments;
+
+    static uint32_t get_now();
+
+    TransmissionControlProtocolSocket* allocate(uint32_t local_ip, uint16_t local_port, uint32_t remote_ip, uint16_t remote_port);
+    void free(TransmissionControlProtocolSocket* socket);
+    TransmissionControlProtocolSocket* find(uint32_t remote_ip, uint16_t remote_port, uint32_t local_ip, uint16_t local_port);
+    TransmissionControlProtocolSocket* find_listener(uint16_t local_port);
+    bool is_port_in_use(uint16_t port);
+    uint32_t generate_initial_sequence();
+
+    void parse_options(TransmissionControlProtocolSocket* socket, TransmissionControlProtocolHeader* header);
+
+    // Segments out. send_segment takes the payload from the send buffer at sequence.
+    void send_segment(TransmissionControlProtocolSocket* socket, uint32_t sequence, uint32_t length, uint8_t flags);
+    void send_acknowledgement(TransmissionControlProtocolSocket* socket);
+    void send_reset(uint32_t source_ip, uint32_t destination_ip, TransmissionControlProtocolHeader* header, uint32_t segment_length);
+    void output(TransmissionControlProtocolSocket* socket);
+    void retransmit_first(TransmissionControlProtocolSocket* socket);
+    void update_receive_window(TransmissionControlProtocolSocket* socket);
+
+    // Segments in.
+    void process_syn_sent(TransmissionControlProtocolSocket* socket, TransmissionControlProtocolHeader* header);
+    void process_listen(TransmissionControlProtocolSocket* listener, uint32_t source_ip, uint32_t destination_ip, TransmissionControlProtocolHeader* header, uint32_t segment_length);
+    bool process_acknowledgement(TransmissionControlProtocolSocket* socket, TransmissionControlProtocolHeader* header, uint32_t payload_length);
+    bool process_data(TransmissionControlProtocolSocket* socket, uint32_t sequence, PacketBuffer* packet);
+    bool enqueue_data(TransmissionControlProtocolSocket* socket, PacketBuffer* packet);
+    void process_fin(TransmissionControlProtocolSocket* socket);
+    void update_rtt(TransmissionControlProtocolSocket* socket, uint32_t sample);
+    void on_connection_closed(TransmissionControlProtocolSocket* socket);
+    void abort(TransmissionControlProtocolSocket* socket, bool send_reset);
+    void enter_time_wait(TransmissionControlProtocolSocket* socket);
+
+    void on_socket_timer(TransmissionControlProtocolSocket* socket, uint32_t ticks);
+
+    public:
+        TransmissionControlProtocolProvider(InternetProtocolProvider* backend);
+        ~TransmissionControlProtocolProvider();
+
+        bool on_internet_protocol_received(uint32_t source_ip, uint32_t destination_ip, PacketBuffer* packet);
+        void on_timer(uint32_t ticks);
+
+        // nullptr when the port is taken or there's no free socket.
+        TransmissionControlProtocolSocket* listen(uint16_t port, uint8_t backlog = TCP_MAX_BACKLOG);
+
+        // Starts the handshake and returns right away, the socket is connected once its state
+        // says TcpEstablished (or closed, if it didn't work out).
+        TransmissionControlProtocolSocket* connect(uint32_t ip, uint16_t port);
+
+        void print_statistics();
+};
+
+#endif
@@ -0,0 +1,85 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include "driver.h"
+#include "interrupts.h"
+#include "port.h"
+#include "types.h"
+
+// The PIT counts at this rate, we divide it down to TIMER_FREQUENCY interrupts per second.
+#define PIT_BASE_FREQUENCY 1193182
+#define TIMER_FREQUENCY 1000
+
+// Periodic callbacks for protocol timers (ARP aging, retransmits, ...).
+#define MAX_TIMER_HANDLERS 8
+
+class TimerHandler
+{
+    public:
+        // Runs from the timer's poll after the interrupt, in line with the NIC polls, so it
+        // doesn't race the receive path. Interrupts are on but no task runs meanwhile.
+        virtual void on_timer(uint32_t ticks);
+};
+
+// PIT channel 0 on IRQ 0 for a millisecond tick, and the TSC (calibrated against PIT channel 2
+// at boot) for anything finer. The scheduler keeps switching tasks on the same interrupt.
+class Timer : public Driver, public PollHandler
+{
+    Port8Bit channel_0_data_port;
+    Port8Bit channel_2_data_port;
+    Port8Bit command_port;
+    Port8Bit channel_2_gate_port;  // 0x61, also the PC speaker
+
+    volatile uint32_t ticks;
+    bool has_timestamp_counter;
+    uint64_t boot_timestamp;
+    uint32_t cycles_per_microsecond;
+
+    struct TimerRegistration
+    {
+        TimerHandler* handler;
+        uint32_t period;
+        uint32_t next_tick;
+    };
+
+    TimerRegistration registrations[MAX_TIMER_HANDLERS];
+    uint8_t registration_count;
+    uint32_t handled_ticks;  // Up to where poll() has run the handlers
+
+    void calibrate_timestamp_counter();
+
+    public:
+        static Timer* active_timer;
+
+        Timer(InterruptManager* manager);
+        ~Timer();
+
+        void initialize() override;
+        void activate() override;
+        void deactivate() override;
+        void reset() override;
+        const char* get_driver_name() override;
+        uint32_t handle_interrupt(uint32_t esp) override;
+        uint16_t poll(uint16_t budget) override;
+
+        // Milliseconds since activate(), wraps after 49 days.
+        uint32_t get_ticks();
+
+        // Microseconds since boot, from the TSC when there is one.
+        uint64_t get_microseconds();
+
+        // Raw TSC reads for timing short things, and how to turn them into time.
+        uint64_t get_cycles();
+        uint32_t get_cycles_per_microsecond();
+        uint64_t cycles_to_microseconds(uint64_t cycles);
+        uint64_t cycles_to_nanoseconds(uint64_t cycles);
+
+        // Calls handler every period milliseconds until it's removed again.
+        bool add_handler(TimerHandler* handler, uint32_t period);
+        void remove_handler(TimerHandler* handler);
+
+        // Busy waits (halting between ticks), so only from task context with interrupts on.
+        void sleep(uint32_t milliseconds);
+};
+
+#endif
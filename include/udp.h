@@ -0,0 +1,112 @@
+#ifndef UDP_H
+#define UDP_H
+
+#include "event_poll.h"
+#include "ipv4.h"
+#include "packet_buffer.h"
+#include "types.h"
+
+// Datagrams a socket keeps until they're read (power of two), and hash buckets for finding
+// the socket of a port (power of two as well).
+#define UDP_RECEIVE_RING_SIZE 64
+#define UDP_SOCKET_BUCKETS 64
+
+// Where bind() with port 0 starts looking for a free port (RFC 6335 dynamic range).
+#define UDP_EPHEMERAL_PORT_START 49152
+
+// NOTE: All of these values are in big endian
+struct UserDatagramProtocolHeader
+{
+    uint16_t source_port;
+    uint16_t destination_port;
+    uint16_t length;
+    uint16_t checksum;
+} __attribute__((packed));
+
+// One datagram for the batch calls. On receive packet holds just the payload and the caller
+// owns a reference to it. On send it's the payload to go out, and the socket takes the
+// reference over. Ports are in host order.
+struct UserDatagram
+{
+    PacketBuffer* packet;
+    uint32_t ip;
+    uint16_t port;
+};
+
+class UserDatagramProtocolProvider;
+
+// A bound port. Received datagrams are never copied: the socket keeps a reference to the
+// buffer they came in (usually the NIC's own) in its ring and hands that reference out.
+// Readable while the ring has something in it.
+class UserDatagramProtocolSocket : public EventSource
+{
+    friend class UserDatagramProtocolProvider;
+
+    UserDatagramProtocolProvider* backend;
+    uint16_t port;
+    UserDatagramProtocolSocket* next;  // Bucket chain
+
+    UserDatagram ring[UDP_RECEIVE_RING_SIZE];
+    volatile uint32_t head;  // Written by the receive path
+    volatile uint32_t tail;  // Written by the reader
+
+    uint32_t received_datagrams;
+    uint32_t dropped_datagrams;
+    uint32_t sent_datagrams;
+    uint32_t send_failures;
+
+    bool enqueue(uint32_t source_ip, uint16_t source_port, PacketBuffer* packet);
+
+    public:
+        // Port 0 picks a free ephemeral port, see get_port() for which (0 if none was free).
+        UserDatagramProtocolSocket(UserDatagramProtocolProvider* backend, uint16_t port = 0);
+        ~UserDatagramProtocolSocket();
+
+        uint16_t get_port() { return port; }
+        uint32_t get_pending_count() { return head - tail; }
+        uint8_t get_events();
+
+        // Takes up to count datagrams out of the ring, returns how many. Release each packet
+        // when done with it.
+        uint32_t receive_batch(UserDatagram* datagrams, uint32_t count);
+
+        // Sends count datagrams, returns how many were accepted. Every packet is consumed,
+        // accepted or not.
+        uint32_t send_batch(UserDatagram* datagrams, uint32_t count);
+
+        // Copies size bytes into a fresh packet and sends it, for when zero-copy isn't worth it.
+        TransmitStatus send_to(uint32_t ip, uint16_t port, const uint8_t* data, uint32_t size);
+
+        void print_statistics();
+};
+
+class UserDatagramProtocolProvider : public InternetProtocolHandler
+{
+    friend class UserDatagramProtocolSocket;
+
+    UserDatagramProtocolSocket* buckets[UDP_SOCKET_BUCKETS];
+    uint16_t next_ephemeral_port;
+
+    uint32_t received_datagrams;
+    uint32_t header_errors;
+    uint32_t checksum_errors;
+    uint32_t no_port;
+
+    static uint16_t hash(uint16_t port);
+
+    bool bind(UserDatagramProtocolSocket* socket, uint16_t port);
+    void unbind(UserDatagramProtocolSocket* socket);
+    UserDatagramProtocolSocket* find(uint16_t port);
+
+    TransmitStatus send(uint16_t source_port, uint32_t destination_ip, uint16_t destination_port, PacketBuffer* packet);
+
+    public:
+        UserDatagramProtocolProvider(InternetProtocolProvider* backend);
+        ~UserDatagramProtocolProvider();
+
+        bool on_internet_protocol_received(uint32_t source_ip, uint32_t destination_ip, PacketBuffer* packet);
+
+        void print_statistics();
+};
+
+#endif
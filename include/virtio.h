@@ -0,0 +1,129 @@
+#ifndef VIRTIO_H
+#define VIRTIO_H
+
+#include "types.h"
+
+// Registers of the legacy (0.9.5) virtio PCI interface, relative to the I/O BAR.
+#define VIRTIO_REGISTER_DEVICE_FEATURES 0x00
+#define VIRTIO_REGISTER_GUEST_FEATURES  0x04
+#define VIRTIO_REGISTER_QUEUE_ADDRESS   0x08  // Page frame number of the ring
+#define VIRTIO_REGISTER_QUEUE_SIZE      0x0C
+#define VIRTIO_REGISTER_QUEUE_SELECT    0x0E
+#define VIRTIO_REGISTER_QUEUE_NOTIFY    0x10
+#define VIRTIO_REGISTER_DEVICE_STATUS   0x12
+#define VIRTIO_REGISTER_ISR_STATUS      0x13
+#define VIRTIO_REGISTER_CONFIG_VECTOR   0x14  // Only there while MSI-X is on
+#define VIRTIO_REGISTER_QUEUE_VECTOR    0x16  // Only there while MSI-X is on
+
+#define VIRTIO_STATUS_ACKNOWLEDGE 0x01
+#define VIRTIO_STATUS_DRIVER      0x02
+#define VIRTIO_STATUS_DRIVER_OK   0x04
+#define VIRTIO_STATUS_FAILED      0x80
+
+#define VIRTIO_RING_F_EVENT_IDX (1 << 29)
+
+#define VIRTIO_MSI_NO_VECTOR 0xFFFF
+
+// Legacy rings are laid out in one physically contiguous block on this alignment.
+#define VIRTIO_QUEUE_ALIGNMENT 4096
+
+struct VirtioQueueDescriptor
+{
+    uint64_t address;
+    uint32_t length;
+    uint16_t flags;
+    uint16_t next;
+} __attribute__((packed));
+
+#define VIRTIO_DESCRIPTOR_F_NEXT  0x1
+#define VIRTIO_DESCRIPTOR_F_WRITE 0x2  // The device writes into this buffer
+
+// Followed by the used_event field when event indexes are on.
+struct VirtioQueueAvailable
+{
+    uint16_t flags;
+    uint16_t index;
+    uint16_t ring[];
+} __attribute__((packed));
+
+struct VirtioQueueUsedElement
+{
+    uint32_t id;      // Head of the descriptor chain
+    uint32_t length;  // Bytes the device wrote
+} __attribute__((packed));
+
+// Followed by the avail_event field when event indexes are on.
+struct VirtioQueueUsed
+{
+    uint16_t flags;
+    uint16_t index;
+    VirtioQueueUsedElement ring[];
+} __attribute__((packed));
+
+#define VIRTIO_AVAILABLE_F_NO_INTERRUPT 0x1
+#define VIRTIO_USED_F_NO_NOTIFY         0x1
+
+// One buffer of a descriptor chain.
+struct VirtioBuffer
+{
+    void* data;
+    uint32_t size;
+};
+
+// One split virtqueue. Buffers go in as descriptor chains through add(), the device hands them
+// back through the used ring and get_used() frees the chain again.
+class VirtioQueue
+{
+    uint16_t io_base;
+    uint16_t queue_index;
+    uint16_t size;
+    bool has_event_index;
+
+    void* memory;
+    VirtioQueueDescriptor* descriptors;
+    VirtioQueueAvailable* available;
+    VirtioQueueUsed* used;
+
+    uint16_t free_head;
+    uint16_t free_count;
+    uint16_t last_used_index;
+    uint16_t last_kicked_index;  // available->index at the last notify
+
+    uint32_t notifications;
+    uint32_t suppressed_notifications;
+
+    volatile uint16_t* get_used_event();
+    volatile uint16_t* get_available_event();
+
+    public:
+        VirtioQueue();
+        ~VirtioQueue();
+
+        // Allocates the rings for queue queue_index and hands them to the device.
+        bool initialize(uint16_t io_base, uint16_t queue_index, bool has_event_index);
+
+        uint16_t get_size();
+        uint16_t get_free_count();
+
+        // Puts a chain of buffers on the available ring, returns its head or -1 if it doesn't fit.
+        // The device only sees it after the next kick().
+        int32_t add(VirtioBuffer* buffers, uint16_t buffer_count, bool is_device_writable);
+
+        // Tells the device about everything added since the last kick, unless it said it doesn't
+        // need to hear about it (event index, or the NO_NOTIFY flag without one).
+        void kick();
+
+        // Takes the next chain the device is done with and frees its descriptors.
+        bool get_used(uint16_t* head, uint32_t* length);
+        bool has_used();
+
+        // Asks for an interrupt on the next used buffer. Returns false if one already came in
+        // meanwhile, so the caller has to poll again before waiting.
+        bool enable_used_interrupts();
+        void disable_used_interrupts();
+
+        uint32_t get_notification_count();
+        uint32_t get_suppressed_notification_count();
+};
+
+#endif
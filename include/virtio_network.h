@@ -0,0 +1,111 @@
+#ifndef VIRTIO_NETWORK_H
+#define VIRTIO_NETWORK_H
+
+#include "driver.h"
+#include "interrupts.h"
+#include "nic.h"
+#include "pci.h"
+#include "terminal.h"
+#include "types.h"
+#include "virtio.h"
+
+#define VIRTIO_NETWORK_F_MAC       (1 << 5)
+#define VIRTIO_NETWORK_F_MRG_RXBUF (1 << 15)  // Mergeable receive buffers
+#define VIRTIO_NETWORK_F_STATUS    (1 << 16)
+
+#define VIRTIO_NETWORK_RECEIVE_QUEUE 0
+#define VIRTIO_NETWORK_SEND_QUEUE    1
+
+// Each receive buffer holds the virtio header plus a full frame, so mergeable buffers never
+// actually need merging (we don't ask for any offloads that would make frames bigger).
+#define VIRTIO_NETWORK_BUFFER_SIZE 2048
+#define VIRTIO_NETWORK_MAX_SEND_FRAGMENTS 8
+
+// Goes in front of every frame. buffer_count only exists with mergeable receive buffers.
+struct VirtioNetworkHeader
+{
+    uint8_t flags;
+    uint8_t gso_type;
+    uint16_t header_length;
+    uint16_t gso_size;
+    uint16_t checksum_start;
+    uint16_t checksum_offset;
+    uint16_t buffer_count;
+} __attribute__((packed));
+
+// virtio-net over the legacy PCI interface (what QEMU's transitional virtio-net-pci offers by default).
+class VirtioNetwork : public NetworkInterfaceController, public PollHandler
+{
+    uint16_t io_base;
+    bool is_message_signaled;  // MSI-X on, which also moves the device config from 0x14 to 0x18
+    uint32_t features;
+    uint16_t header_size;
+    uint16_t config_offset;
+    uint64_t mac_address;
+    uint32_t ip_address;
+
+    VirtioQueue receive_queue;
+    VirtioQueue send_queue;
+
+    // Receive buffer for every descriptor head the device may hand back.
+    uint8_t** receive_slots;
+    void* receive_memory;
+    uint8_t* receive_buffers;
+    uint32_t receive_buffer_count;
+
+    // All we send is plain frames, so every send chain starts with the same all-zero header.
+    VirtioNetworkHeader send_header;
+
+    struct SendRecord
+    {
+        TransmitCompletionHandler* handler;
+        void* context;
+        uint8_t* copy_buffer;
+    };
+
+    SendRecord* send_records;
+    void* send_memory;
+    uint8_t** send_copy_buffers;  // Free copy buffers, used as a stack
+    uint16_t send_copy_buffer_count;
+
+    uint32_t interrupts;
+    uint32_t polls;
+    uint32_t received_frames;
+    uint32_t sent_frames;
+    uint32_t send_drops;
+    uint32_t merged_frame_drops;
+
+    void free_buffers();
+    void post_receive_buffer(uint8_t* buffer);
+    void reclaim_send_buffers();
+    bool reserve_send_space(uint16_t descriptor_count, bool needs_copy_buffer, bool wait);
+    void post_send(VirtioBuffer* chain, uint16_t chain_length, TransmitCompletionHandler* handler, void* context, uint8_t* copy_buffer);
+
+    public:
+        VirtioNetwork(PeripheralComponentInterconnectDeviceDescriptor* device, InterruptManager* interrupt_manager);
+        ~VirtioNetwork();
+
+        void initialize();
+        void activate();
+        void deactivate();
+        void reset();
+        string get_driver_name();
+        uint32_t handle_interrupt(uint32_t esp);
+        uint16_t poll(uint16_t budget);
+
+        bool is_available();
+        TransmitStatus send(uint8_t* buffer, int size, bool wait = false);
+        TransmitStatus send_fragments(TransmitFragment* fragments, uint16_t fragment_count, TransmitCompletionHandler* handler, void* context,
+                                      bool wait = false, const TransmitChecksumOffload* offload = nullptr);
+        uint16_t receive(uint16_t budget);
+
+
+        uint64_t get_mac_address();
+        void set_ip_address(uint32_t ip);
+        uint32_t get_ip_address();
+        uint16_t get_send_ring_size();
+        bool is_link_up();
+        void print_statistics();
+};
+
+#endif
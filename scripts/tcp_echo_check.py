@@ -0,0 +1,108 @@
+#!/usr/bin/env python3
+# Talks to the kernel's TCP echo task through QEMU's user networking (the host's own TCP stack
+# on the other end) and checks every byte comes back. Used by make check-qemu-tcp-echo.
+#
+#   tcp_echo_check.py [host] [port] [boot timeout in seconds]
+
+import os
+import socket
+import sys
+import time
+
+host = sys.argv[1] if len(sys.argv) > 1 else "localhost"
+port = int(sys.argv[2]) if len(sys.argv) > 2 else 7777
+boot_timeout = float(sys.argv[3]) if len(sys.argv) > 3 else 60
+
+
+def connect(deadline):
+    # QEMU accepts on the forwarded port right away, but until the guest is up the connection
+    # gets closed again without an answer. So a connection only counts once something echoes.
+    while True:
+        try:
+            connection = socket.create_connection((host, port), timeout=5)
+            connection.sendall(b"ping")
+
+            if receive_exactly(connection, 4) == b"ping":
+                return connection
+
+            connection.close()
+        except OSError:
+            pass
+
+        if time.monotonic() > deadline:
+            sys.exit("tcp echo: no answer within %d s" % boot_timeout)
+
+        time.sleep(1)
+
+
+def receive_exactly(connection, size):
+    data = bytearray()
+
+    while len(data) < size:
+        chunk = connection.recv(size - len(data))
+
+        if not chunk:
+            break
+
+        data += chunk
+
+    return bytes(data)
+
+
+def echo(connection, payload, chunk_size):
+    # Sends and reads back in steps, so neither side has to buffer the whole payload.
+    received = bytearray()
+
+    for offset in range(0, len(payload), chunk_size):
+        chunk = payload[offset:offset + chunk_size]
+        connection.sendall(chunk)
+        received += receive_exactly(connection, len(chunk))
+
+    return bytes(received)
+
+
+def main():
+    connection = connect(time.monotonic() + boot_timeout)
+    checks = [
+        ("one byte", b"x", 1),
+        ("odd sized segment", os.urandom(1459), 1459),
+        ("full segments", os.urandom(4 * 1460), 1460),
+        ("bulk, past the send buffer", os.urandom(256 * 1024), 8192),
+    ]
+
+    for name, payload, chunk_size in checks:
+        received = echo(connection, payload, chunk_size)
+
+        if received != payload:
+            sys.exit("tcp echo: %s: sent %d bytes, %d came back%s" % (
+                name, len(payload), len(received), "" if len(received) != len(payload) else " but different"))
+
+        print("tcp echo: %s, %d bytes ok" % (name, len(payload)))
+
+    # An orderly close from our side must end in the guest's FIN, not a reset.
+    connection.shutdown(socket.SHUT_WR)
+
+    try:
+        rest = connection.recv(1)
+    except ConnectionResetError:
+        sys.exit("tcp echo: connection reset on close")
+
+    if rest:
+        sys.exit("tcp echo: data after our FIN")
+
+    connection.close()
+
+    # A few connections one after the other, so the sockets get handed back and reused.
+    for i in range(8):
+        connection = socket.create_connection((host, port), timeout=5)
+        payload = os.urandom(100 + i)
+
+        if echo(connection, payload, len(payload)) != payload:
+            sys.exit("tcp echo: connection %d got the wrong bytes back" % i)
+
+        connection.close()
+
+    print("tcp echo: 8 more connections ok")
+
+
+main()
@@ -0,0 +1,106 @@
+#include "acpi.h"
+
+AdvancedConfigurationPowerInterface::AdvancedConfigurationPowerInterface()
+{
+    // The RSDP is either in the first KiB of the EBDA (whose segment is stored at 0x40E)
+    // or somewhere in the BIOS area between 0xE0000 and 0xFFFFF.
+    uint32_t ebda { (uint32_t) (*((uint16_t*) 0x40E)) << 4 };
+
+    root_pointer = nullptr;
+
+    if (ebda != 0) {
+        root_pointer = find_root_pointer(ebda, 1024);
+    }
+
+    if (root_pointer == nullptr) {
+        root_pointer = find_root_pointer(0xE0000, 0x20000);
+    }
+}
+
+AdvancedConfigurationPowerInterface::~AdvancedConfigurationPowerInterface()
+{
+
+}
+
+bool AdvancedConfigurationPowerInterface::is_checksum_valid(void* table, uint32_t length)
+{
+    uint8_t sum { 0 };
+
+    for (uint32_t i = 0; i < length; ++i) {
+        sum += ((uint8_t*) table)[i];
+    }
+
+    return sum == 0;
+}
+
+RootSystemDescriptionPointer* AdvancedConfigurationPowerInterface::find_root_pointer(uint32_t start, uint32_t length)
+{
+    const char* signature { "RSD PTR " };
+
+    // The structure is always on a 16 byte boundary.
+    for (uint32_t address = start; address + 20 <= start + length; address += 16) {
+        char* candidate { (char*) address };
+        bool matches { true };
+
+        for (int i = 0; i < 8 && matches; ++i) {
+            matches = candidate[i] == signature[i];
+        }
+
+        if (matches && is_checksum_valid(candidate, 20)) {
+            return (RootSystemDescriptionPointer*) address;
+        }
+    }
+
+    return nullptr;
+}
+
+bool AdvancedConfigurationPowerInterface::is_available()
+{
+    return root_pointer != nullptr;
+}
+
+SystemDescriptionTableHeader* AdvancedConfigurationPowerInterface::find_table(string signature)
+{
+    if (root_pointer == nullptr) {
+        return nullptr;
+    }
+
+    // Prefer the XSDT when there is one we can reach, otherwise fall back to the RSDT.
+    bool use_xsdt {
+        root_pointer->revision >= 2
+        && root_pointer->xsdt_address != 0
+        && (root_pointer->xsdt_address >> 32) == 0
+    };
+
+    SystemDescriptionTableHeader* root_table {
+        (SystemDescriptionTableHeader*) (use_xsdt ? (uint32_t) root_pointer->xsdt_address : root_pointer->rsdt_address)
+    };
+
+    if (root_table == nullptr || !is_checksum_valid(root_table, root_table->length)) {
+        return nullptr;
+    }
+
+    uint32_t entry_size { use_xsdt ? 8u : 4u };
+    uint32_t entry_count { (root_table->length - sizeof(SystemDescriptionTableHeader)) / entry_size };
+    uint8_t* entries { (uint8_t*) root_table + sizeof(SystemDescriptionTableHeader) };
+
+    for (uint32_t i = 0; i < entry_count; ++i) {
+        uint64_t entry_address { use_xsdt ? *((uint64_t*) (entries + i * 8)) : *((uint32_t*) (entries + i * 4)) };
+
+        if ((entry_address >> 32) != 0) {
+            continue;
+        }
+
+        SystemDescriptionTableHeader* table { (SystemDescriptionTableHeader*) (uint32_t) entry_address };
+
+        if (table->signature[0] == signature[0]
+            && table->signature[1] == signature[1]
+            && table->signature[2] == signature[2]
+            && table->signature[3] == signature[3]
+            && is_checksum_valid(table, table->length)) {
+            return table;
+        }
+    }
+
+    return nullptr;
+}
@@ -1,7 +1,32 @@
 #include "am79c973.h"
+#include "cpu.h"
 
-Am79C973::Am79C973(PeripheralComponentInterconnectDeviceDescriptor *device, InterruptManager* interrupt_manager)
-:   Driver(interrupt_manager, device->interrupt_number + interrupt_manager->get_hardware_interrupt_offset()),
+static constexpr PeripheralComponentInterconnectDeviceMatch am79c973_matches[] {
+    { 0x1022, 0x2000, PCI_MATCH_ANY, PCI_MATCH_ANY }, // AMD PCnet-PCI II
+};
+
+static Driver* probe_am79c973(PeripheralComponentInterconnectDeviceDescriptor* device, InterruptManager* interrupt_manager)
+{
+    Am79C973* driver { (Am79C973*) MemoryManager::memory_manager->malloc(sizeof(Am79C973)) };
+
+    if (driver != nullptr) {
+        new (driver) Am79C973(device, interrupt_manager);
+
+        // Out of memory for the rings, leave the device alone.
+        if (!driver->is_available()) {
+            driver->~Am79C973();
+            MemoryManager::memory_manager->free(driver);
+            return nullptr;
+        }
+    }
+
+    return driver;
+}
+
+REGISTER_PCI_DRIVER(am79c973, am79c973_matches, probe_am79c973);
+
+Am79C973::Am79C973(PeripheralComponentInterconnectDeviceDescriptor *device, InterruptManager* interrupt_manager, uint16_t receive_ring_size, uint16_t send_ring_size)
+:   NetworkInterfaceController(interrupt_manager, device->interrupt_number + interrupt_manager->get_hardware_interrupt_offset()),
     mac_address_0_port(device->port),
     mac_address_2_port(device->port + 0x02),
     mac_address_4_port(device->port + 0x04),
@@ -10,10 +35,35 @@ Am79C973::Am79C973(PeripheralComponentInterconnectDeviceDescriptor *device, Inte
     reset_port(device->port + 0x14),
     bus_control_register_data_port(device->port + 0x16)
 {
-    this->raw_data_handler = nullptr;
+    if (device->controller != nullptr) {
+        device->controller->enable_bus_mastering(device); // The rings are DMA'd, firmware doesn't always turn this on.
+    }
+
     current_send_buffer = 0;
     current_receive_buffer = 0;
 
+    last_missed_frame_count = 0;
+    missed_frames = 0;
+    miss_interrupts = 0;
+    received_frames = 0;
+    sent_frames = 0;
+    send_errors = 0;
+    queued_frames = 0;
+    send_queue_full = 0;
+    send_drops = 0;
+    max_send_queue_depth = 0;
+
+    is_receive_polling_enabled = true;
+    is_receive_interrupt_masked = false;
+    interrupts = 0;
+    receive_interrupts = 0;
+    polls = 0;
+    exhausted_polls = 0;
+
+    uint8_t receive_ring_length, send_ring_length;
+    this->receive_ring_size = round_ring_size(receive_ring_size, &receive_ring_length);
+    this->send_ring_size = round_ring_size(send_ring_size, &send_ring_length);
+
     uint64_t mac_0 { mac_address_0_port.read() % 256 };
     uint64_t mac_1 { mac_address_0_port.read() / 256 };
     uint64_t mac_2 { mac_address_2_port.read() % 256 };
@@ -45,9 +95,9 @@ Am79C973::Am79C973(PeripheralComponentInterconnectDeviceDescriptor *device, Inte
     // Set MODE (bytes 0-1)
     initialization_block.mode = 0x0000; // promiscuous mode = false
     
-    // Set RLEN and TLEN (bytes 2-3) - both 3 for 8 buffers (2^3 = 8)
-    initialization_block.rlen_reserved = (3 << 4) | 0; // RLEN=3 in high nibble, reserved=0 in low nibble
-    initialization_block.tlen_reserved = (3 << 4) | 0; // TLEN=3 in high nibble, reserved=0 in low nibble
+    // Set RLEN and TLEN (bytes 2-3), the rings hold 2^RLEN and 2^TLEN descriptors
+    initialization_block.rlen_reserved = (receive_ring_length << 4) | 0; // RLEN in high nibble, reserved=0 in low nibble
+    initialization_block.tlen_reserved = (send_ring_length << 4) | 0;    // TLEN in high nibble, reserved=0 in low nibble
     
     // Set MAC address (bytes 4-9)
     initialization_block.physical_address[0] = (uint8_t)(mac_address & 0xFF);
@@ -62,20 +112,58 @@ Am79C973::Am79C973(PeripheralComponentInterconnectDeviceDescriptor *device, Inte
     // Set logical address (bytes 12-19) - all zeros for no multicast filtering
     // Already zeroed above
     
-    // force 16 byte alignment
-    send_buffer_descriptor = (BufferDescriptor*)((((uint32_t) &send_buffer_descriptor_memory[0]) + 15) & ~((uint32_t) 0xF));
+    send_ring_memory = allocate_ring(this->send_ring_size, this->send_ring_size, &send_buffer_descriptor, &send_buffers);
+    send_records = (SendRecord*) MemoryManager::memory_manager->malloc(this->send_ring_size * sizeof(SendRecord));
+    oldest_send_buffer = 0;
+    send_buffers_in_use = 0;
+
+    send_queue = (SendQueueEntry*) MemoryManager::memory_manager->malloc(AM79C973_SEND_QUEUE_SIZE * sizeof(SendQueueEntry));
+    send_queue_buffers = (uint8_t*) MemoryManager::memory_manager->malloc(AM79C973_SEND_QUEUE_SIZE * AM79C973_BUFFER_SIZE);
+    send_queue_head = 0;
+    send_queue_count = 0;
+
+    // Twice as many receive buffers as descriptors: the second half starts out in the pool.
+    receive_ring_memory = allocate_ring(this->receive_ring_size, 2 * this->receive_ring_size, &receive_buffer_descriptor, &receive_buffers);
+    uint8_t** pool { (uint8_t**) MemoryManager::memory_manager->malloc(this->receive_ring_size * sizeof(uint8_t*)) };
+
+    // A null ring would end up as DMA address 0, so don't go any further without all of them.
+    if (send_ring_memory == nullptr || send_records == nullptr || send_queue == nullptr || send_queue_buffers == nullptr
+        || receive_ring_memory == nullptr || pool == nullptr) {
+        printf_colored("Am79C973: not enough memory for the rings\n", VGA_COLOR_RED_ON_BLACK);
+
+        if (pool != nullptr) {
+            MemoryManager::memory_manager->free(pool);
+        }
+
+        free_rings();
+        return;
+    }
+
+    set_receive_buffers(receive_buffers, AM79C973_BUFFER_SIZE, 2 * this->receive_ring_size, pool, this->receive_ring_size);
+
+    for (uint16_t i = 0; i < this->receive_ring_size; ++i) {
+        receive_buffer_pool[receive_buffer_pool_count++] = &receive_buffers[(this->receive_ring_size + i) * AM79C973_BUFFER_SIZE];
+    }
+
     initialization_block.send_buffer_descriptor_address = (uint32_t) send_buffer_descriptor;
-    receive_buffer_descriptor = (BufferDescriptor*)((((uint32_t) &receive_buffer_descriptor_memory[0]) + 15) & ~((uint32_t) 0xF));
     initialization_block.receive_buffer_descriptor_address = (uint32_t) receive_buffer_descriptor;
+
+    // BCNT holds the negated buffer size (two's complement) with the top 4 bits set to ones.
+    uint32_t buffer_size_field { (((uint32_t) -AM79C973_BUFFER_SIZE) & 0x0FFF) | 0xF000 };
     
-    for (uint8_t i = 0; i < 8; ++i) {
-        send_buffer_descriptor[i].address = (((uint32_t) &send_buffers[i]) + 15) & ~(uint32_t) 0xF;
-        send_buffer_descriptor[i].flags = 0x7FF | 0xF000;
+    for (uint16_t i = 0; i < this->send_ring_size; ++i) {
+        send_buffer_descriptor[i].address = (uint32_t) &send_buffers[i * AM79C973_BUFFER_SIZE];
+        send_buffer_descriptor[i].flags = buffer_size_field;
         send_buffer_descriptor[i].flags2 = 0;
         send_buffer_descriptor[i].available = 0;
-        
-        receive_buffer_descriptor[i].address = (((uint32_t) &receive_buffers[i]) + 15) & ~(uint32_t) 0xF;
-        receive_buffer_descriptor[i].flags = 0xF7FF | 0x80000000;
+
+        send_records[i].handler = nullptr;
+        send_records[i].context = nullptr;
+    }
+
+    for (uint16_t i = 0; i < this->receive_ring_size; ++i) {
+        receive_buffer_descriptor[i].address = (uint32_t) &receive_buffers[i * AM79C973_BUFFER_SIZE];
+        receive_buffer_descriptor[i].flags = buffer_size_field | 0x80000000;
         receive_buffer_descriptor[i].flags2 = 0;
         receive_buffer_descriptor[i].available = 0;
     }
@@ -84,11 +172,70 @@ Am79C973::Am79C973(PeripheralComponentInterconnectDeviceDescriptor *device, Inte
     register_data_port.write((uint32_t) (&initialization_block) & 0xFFFF);
     register_address_port.write(2);
     register_data_port.write(((uint32_t) (&initialization_block) >> 16) & 0xFFFF);
-    
+
+    // Prefer a dedicated MSI vector over the shared legacy line when the device offers one.
+    request_interrupt_vectors(device, 1);
 }
 
 Am79C973::~Am79C973()
 {
+    free_rings();
+
+    if (receive_buffer_pool != nullptr) {
+        MemoryManager::memory_manager->free(receive_buffer_pool);
+    }
+}
+
+void Am79C973::free_rings()
+{
+    // Whatever got allocated, malloc failures leave the rest null.
+    void* allocations[] { send_ring_memory, receive_ring_memory, send_records, send_queue, send_queue_buffers };
+
+    for (uint32_t i = 0; i < sizeof(allocations) / sizeof(allocations[0]); ++i) {
+        if (allocations[i] != nullptr) {
+            MemoryManager::memory_manager->free(allocations[i]);
+        }
+    }
+
+    send_ring_memory = nullptr;
+    receive_ring_memory = nullptr;
+    send_records = nullptr;
+    send_queue = nullptr;
+    send_queue_buffers = nullptr;
+}
+
+bool Am79C973::is_available()
+{
+    return receive_ring_memory != nullptr;
+}
+
+uint16_t Am79C973::round_ring_size(uint16_t size, uint8_t* length)
+{
+    // Round up to the next power of two the hardware supports (2^0 to 2^9 descriptors).
+    *length = 0;
+
+    while (*length < 9 && (1 << *length) < size) {
+        ++(*length);
+    }
+
+    return 1 << *length;
+}
+
+void* Am79C973::allocate_ring(uint16_t ring_size, uint16_t buffer_count, BufferDescriptor** descriptors, uint8_t** buffers)
+{
+    // The descriptors need 16 byte alignment, and the buffers follow them directly
+    // (both sizes are multiples of 16, so they stay aligned too).
+    uint32_t size { ring_size * sizeof(BufferDescriptor) + buffer_count * AM79C973_BUFFER_SIZE + 15 };
+    void* memory { MemoryManager::memory_manager->malloc(size) };
+
+    if (memory == nullptr) {
+        return nullptr;
+    }
+
+    *descriptors = (BufferDescriptor*) ((((uint32_t) memory) + 15) & ~((uint32_t) 0xF));
+    *buffers = (uint8_t*) &(*descriptors)[ring_size];
+
+    return memory;
 }
 
 void Am79C973::initialize()
@@ -128,19 +275,29 @@ string Am79C973::get_driver_name() {
 
 uint32_t Am79C973::handle_interrupt(uint32_t esp)
 {
-    printf("INTERRUPT FROM AMD am79c973\n");
-    
+    ++interrupts;
+
     register_address_port.write(0);
     uint32_t temp { register_data_port.read() };
-
-    printf_hex16((uint16_t) (temp & 0xFFFF));
     
     if ((temp & STATUS_ERR) == STATUS_ERR)   printf("AMD am79c973 ERROR\n");
     if ((temp & STATUS_CERR) == STATUS_CERR) printf("AMD am79c973 COLLISION ERROR\n");
-    if ((temp & STATUS_MISS) == STATUS_MISS) printf("AMD am79c973 MISSED FRAME\n");
+    if ((temp & STATUS_MISS) == STATUS_MISS) {
+        ++miss_interrupts;
+        update_missed_frame_count();
+    }
     if ((temp & STATUS_MERR) == STATUS_MERR) printf("AMD am79c973 MEMORY ERROR\n");
-    if ((temp & STATUS_RINT) == STATUS_RINT) receive();
-    if ((temp & STATUS_TINT) == STATUS_TINT) printf("AMD am79c973 DATA SENT\n");
+    if ((temp & STATUS_RINT) == STATUS_RINT) {
+        ++receive_interrupts;
+
+        // Under load we'd take one interrupt per frame, so mask them and let poll() drain the ring.
+        if (is_receive_polling_enabled && interrupt_manager->schedule_poll(this)) {
+            set_receive_interrupt_mask(true);
+        } else {
+            while (receive(POLL_BUDGET) == POLL_BUDGET);
+        }
+    }
+    if ((temp & STATUS_TINT) == STATUS_TINT) reclaim_send_buffers();
                                
     // acknowledge interrupt
     register_address_port.write(0);
@@ -153,89 +310,360 @@ uint32_t Am79C973::handle_interrupt(uint32_t esp)
     return esp;
 }
 
-void Am79C973::send(uint8_t* buffer, int size)
+uint16_t Am79C973::poll(uint16_t budget)
+{
+    ++polls;
+
+    uint16_t received { receive(budget) };
+
+    if (received == budget) {
+        ++exhausted_polls;
+        return budget;
+    }
+
+    // The interrupt handler uses RAP too, so keep it out while we select and write registers.
+    uint32_t flags { disable_interrupts() };
+
+    // Clear RINT before the last look at the ring: a frame that lands after this sets it again,
+    // and unmasking then raises the interrupt right away, so nothing gets stranded.
+    register_address_port.write(0);
+    register_data_port.write(STATUS_RINT | STATUS_IENA);
+
+    if (!(receive_buffer_descriptor[current_receive_buffer].flags & DESCRIPTOR_OWN)) {
+        restore_interrupts(flags);
+        return budget; // Raced with a new frame, stay on the poll list.
+    }
+
+    set_receive_interrupt_mask(false);
+    restore_interrupts(flags);
+    return received;
+}
+
+void Am79C973::set_receive_interrupt_mask(bool masked)
+{
+    if (is_receive_interrupt_masked == masked) {
+        return;
+    }
+
+    register_address_port.write(3);
+    uint32_t mask { register_data_port.read() };
+    register_address_port.write(3);
+    register_data_port.write(masked ? mask | MASK_RINTM : mask & ~MASK_RINTM);
+
+    is_receive_interrupt_masked = masked;
+}
+
+void Am79C973::set_receive_polling(bool enabled)
+{
+    is_receive_polling_enabled = enabled;
+}
+
+TransmitStatus Am79C973::send(uint8_t* buffer, int size, bool wait)
 {
-    int send_descriptor { current_send_buffer };
-    current_send_buffer = (current_send_buffer + 1) % 8;
-    
     // Cap the max size at 1518 bytes
-    if (size > 1518) {
-        size = 1518;
+    if (size > MAX_ETHERNET_FRAME_SIZE) {
+        size = MAX_ETHERNET_FRAME_SIZE;
     }
-    
-    for (uint8_t *src = buffer + size -1, *dst = (uint8_t*) (send_buffer_descriptor[send_descriptor].address + size -1); src >= buffer; --src, --dst) {
-        *dst = *src;
+
+    if (size <= 0) {
+        ++send_drops;
+        return TransmitInvalid;
     }
 
-    printf("Sending: ");
+    uint32_t flags { disable_interrupts() };
+
+    if (wait) {
+        wait_for_send_space();
+    }
+
+    // The copying path: the caller's memory is free again as soon as we return.
+    if (send_queue_count == 0 && send_buffers_in_use < send_ring_size) {
+        copy_to_send_buffer(buffer, size);
+        restore_interrupts(flags);
+        return TransmitSent;
+    }
+
+    SendQueueEntry* entry { enqueue_send() };
+
+    if (entry == nullptr) {
+        restore_interrupts(flags);
+        return TransmitQueueFull;
+    }
+
+    uint8_t* destination { &send_queue_buffers[(entry - send_queue) * AM79C973_BUFFER_SIZE] };
 
     for (int i = 0; i < size; ++i) {
-        printf_hex8(buffer[i]);
+        destination[i] = buffer[i];
     }
-    
-    send_buffer_descriptor[send_descriptor].available = 0;
-    send_buffer_descriptor[send_descriptor].flags2 = 0;
-    send_buffer_descriptor[send_descriptor].flags = 0x8300F000 | ((uint16_t)((-size) & 0xFFF));
 
-    register_address_port.write(0);
-    register_data_port.write(0x48);
+    entry->fragments[0].data = destination;
+    entry->fragments[0].size = size;
+    entry->fragment_count = 1;
+    entry->is_copy = true;
+    entry->handler = nullptr;
+    entry->context = nullptr;
+
+    restore_interrupts(flags);
+    return TransmitQueued;
 }
 
-void Am79C973::receive()
+TransmitStatus Am79C973::send_fragments(TransmitFragment* fragments, uint16_t fragment_count, TransmitCompletionHandler* handler, void* context,
+                                        bool wait, const TransmitChecksumOffload* offload)
 {
-    printf("AMD am79c973 DATA RECEVED\n");
+    // No checksum offload on this chip (get_features() says so), the caller fills them in.
+    TransmitFragment used[AM79C973_MAX_SEND_FRAGMENTS];
+    uint16_t used_fragments { 0 };
+    uint32_t total_size { 0 };
 
-    for (; (receive_buffer_descriptor[current_receive_buffer].flags & 0x80000000) == 0; current_receive_buffer = (current_receive_buffer + 1) % 8) {
-        if (!(receive_buffer_descriptor[current_receive_buffer].flags & 0x40000000)
-            && (receive_buffer_descriptor[current_receive_buffer].flags & 0x03000000) == 0x03000000) {
-            uint32_t size { receive_buffer_descriptor[current_receive_buffer].flags & 0xFFF };
+    for (uint16_t i = 0; i < fragment_count; ++i) {
+        if (fragments[i].size == 0) {
+            continue;
+        }
 
-            if (size > 64) { // remove checksum
-                size -= 4;
-            }
-            
-            uint8_t* buffer { (uint8_t*) (receive_buffer_descriptor[current_receive_buffer].address) };
-            
-            if (raw_data_handler != nullptr && raw_data_handler->on_raw_data_received(buffer, size)) {
-                send(buffer, size);
-            }
+        // BCNT is only 12 bits wide.
+        if (fragments[i].size > 0x0FFF || used_fragments == AM79C973_MAX_SEND_FRAGMENTS) {
+            ++send_drops;
+            return TransmitInvalid;
+        }
 
-            size = 64;
+        used[used_fragments++] = fragments[i];
+        total_size += fragments[i].size;
+    }
 
-            for (int i = 0; i < size; ++i) {
-                printf_hex8(buffer[i]);
-            }
+    if (used_fragments == 0 || total_size > MAX_ETHERNET_FRAME_SIZE) {
+        ++send_drops;
+        return TransmitInvalid;
+    }
+
+    uint32_t flags { disable_interrupts() };
+
+    if (wait) {
+        wait_for_send_space();
+    }
+
+    // Queued frames go first, or we would reorder the stream.
+    if (send_queue_count == 0 && send_buffers_in_use + used_fragments <= send_ring_size) {
+        post_send_fragments(used, used_fragments, handler, context);
+        restore_interrupts(flags);
+        return TransmitSent;
+    }
+
+    SendQueueEntry* entry { enqueue_send() };
+
+    if (entry == nullptr) {
+        restore_interrupts(flags);
+        return TransmitQueueFull;
+    }
+
+    for (uint16_t i = 0; i < used_fragments; ++i) {
+        entry->fragments[i] = used[i];
+    }
+
+    entry->fragment_count = used_fragments;
+    entry->is_copy = false;
+    entry->handler = handler;
+    entry->context = context;
+
+    restore_interrupts(flags);
+    return TransmitQueued;
+}
+
+void Am79C973::copy_to_send_buffer(uint8_t* buffer, uint32_t size)
+{
+    // Every descriptor has its own ring buffer for copied frames.
+    uint8_t* destination { &send_buffers[current_send_buffer * AM79C973_BUFFER_SIZE] };
+
+    for (uint32_t i = 0; i < size; ++i) {
+        destination[i] = buffer[i];
+    }
+
+    TransmitFragment fragment { destination, size };
+    post_send_fragments(&fragment, 1, nullptr, nullptr);
+}
+
+void Am79C973::post_send_fragments(TransmitFragment* fragments, uint16_t fragment_count, TransmitCompletionHandler* handler, void* context)
+{
+    // Expects interrupts off, valid non-empty fragments and enough free descriptors.
+    // One descriptor per fragment, STP on the first and ENP on the last. Ownership of the first
+    // descriptor is handed over last so the NIC never starts on a half-built chain.
+    uint16_t first_descriptor { current_send_buffer };
+    uint16_t descriptor_index { current_send_buffer };
+
+    for (uint16_t i = 0; i < fragment_count; ++i) {
+        BufferDescriptor* descriptor { &send_buffer_descriptor[descriptor_index] };
+        uint32_t flags { 0xF000 | (((uint32_t) -fragments[i].size) & 0x0FFF) };
+
+        if (i == 0) {
+            flags |= DESCRIPTOR_STP;
+        } else {
+            flags |= DESCRIPTOR_OWN;
         }
-        
-        receive_buffer_descriptor[current_receive_buffer].flags2 = 0;
-        receive_buffer_descriptor[current_receive_buffer].flags = 0x8000F7FF;
+
+        if (i == fragment_count - 1) {
+            flags |= DESCRIPTOR_ENP;
+            send_records[descriptor_index].handler = handler;
+            send_records[descriptor_index].context = context;
+        } else {
+            send_records[descriptor_index].handler = nullptr;
+            send_records[descriptor_index].context = nullptr;
+        }
+
+        descriptor->address = (uint32_t) fragments[i].data;
+        descriptor->available = 0;
+        descriptor->flags2 = 0;
+        descriptor->flags = flags;
+        descriptor_index = (descriptor_index + 1) & (send_ring_size - 1);
     }
+
+    send_buffer_descriptor[first_descriptor].flags |= DESCRIPTOR_OWN;
+
+    current_send_buffer = descriptor_index;
+    send_buffers_in_use += fragment_count;
+    ++sent_frames;
+
+    // Transmit demand, so the NIC polls the ring right away instead of at its next interval.
+    register_address_port.write(0);
+    register_data_port.write(0x48);
 }
 
-RawDataHandler::RawDataHandler(Am79C973* backend)
+Am79C973::SendQueueEntry* Am79C973::enqueue_send()
 {
-    this->backend = backend;
-    backend->set_handler(this);
+    if (send_queue_count == AM79C973_SEND_QUEUE_SIZE) {
+        ++send_queue_full;
+        ++send_drops;
+        return nullptr;
+    }
+
+    SendQueueEntry* entry { &send_queue[(send_queue_head + send_queue_count) & (AM79C973_SEND_QUEUE_SIZE - 1)] };
+
+    ++send_queue_count;
+    ++queued_frames;
+
+    if (send_queue_count > max_send_queue_depth) {
+        max_send_queue_depth = send_queue_count;
+    }
+
+    return entry;
 }
 
-RawDataHandler::~RawDataHandler()
+void Am79C973::drain_send_queue()
 {
-    backend->set_handler(nullptr);
+    while (send_queue_count > 0) {
+        SendQueueEntry* entry { &send_queue[send_queue_head] };
+
+        if (send_buffers_in_use + entry->fragment_count > send_ring_size) {
+            break;
+        }
+
+        if (entry->is_copy) {
+            // The queue buffer gets reused as soon as the entry is gone, so copy once more.
+            copy_to_send_buffer(entry->fragments[0].data, entry->fragments[0].size);
+        } else {
+            post_send_fragments(entry->fragments, entry->fragment_count, entry->handler, entry->context);
+        }
+
+        send_queue_head = (send_queue_head + 1) & (AM79C973_SEND_QUEUE_SIZE - 1);
+        --send_queue_count;
+    }
+}
+
+void Am79C973::wait_for_send_space()
+{
+    // Expects interrupts off. The transmit interrupt reclaims and wakes us, we check once more
+    // ourselves in case we can't sleep here.
+    reclaim_send_buffers();
+
+    while (send_queue_count == AM79C973_SEND_QUEUE_SIZE) {
+        wait_for_send_completion();
+        reclaim_send_buffers();
+    }
 }
 
-bool RawDataHandler::on_raw_data_received(uint8_t* buffer, uint32_t size)
+void Am79C973::reclaim_send_buffers()
 {
-    return false;
+    while (send_buffers_in_use > 0 && !(send_buffer_descriptor[oldest_send_buffer].flags & DESCRIPTOR_OWN)) {
+        BufferDescriptor* descriptor { &send_buffer_descriptor[oldest_send_buffer] };
+        SendRecord* record { &send_records[oldest_send_buffer] };
+
+        if (descriptor->flags & DESCRIPTOR_ERR) {
+            ++send_errors;
+        }
+
+        if ((descriptor->flags & DESCRIPTOR_ENP) && record->handler != nullptr) {
+            record->handler->on_transmit_complete(record->context);
+        }
+
+        record->handler = nullptr;
+        record->context = nullptr;
+        descriptor->flags = 0;
+
+        oldest_send_buffer = (oldest_send_buffer + 1) & (send_ring_size - 1);
+        --send_buffers_in_use;
+    }
+
+    // Freed descriptors go to whatever was waiting for them first.
+    drain_send_queue();
+
+    if (send_queue_count < AM79C973_SEND_QUEUE_SIZE) {
+        wake_send_waiter();
+    }
 }
 
-void RawDataHandler::send(uint8_t* buffer, uint32_t size)
+void Am79C973::on_transmit_complete(void* context)
 {
-    backend->send(buffer, size);
+    // A received frame we sent back in place: its receive buffer can go back to the pool now.
+    release_receive_buffer((uint8_t*) context);
 }
 
-void Am79C973::set_handler(RawDataHandler* raw_data_handler)
+uint16_t Am79C973::receive(uint16_t budget)
 {
-    this->raw_data_handler = raw_data_handler;
+    uint16_t frames { 0 };
+
+    for (; frames < budget && (receive_buffer_descriptor[current_receive_buffer].flags & 0x80000000) == 0; current_receive_buffer = (current_receive_buffer + 1) & (receive_ring_size - 1)) {
+        ++frames;
+
+        BufferDescriptor* descriptor { &receive_buffer_descriptor[current_receive_buffer] };
+
+        if (!(descriptor->flags & 0x40000000)
+            && (descriptor->flags & 0x03000000) == 0x03000000) {
+            uint32_t size { descriptor->flags2 & 0xFFF }; // MCNT: message byte count
+
+            if (size > 64) { // remove checksum
+                size -= 4;
+            }
+            
+            uint8_t* buffer { (uint8_t*) (descriptor->address) };
+            ++received_frames;
+
+            // The buffer is lent to the stack for the duration of the callback.
+            lend_receive_buffer(buffer);
+
+            if (raw_data_handler != nullptr && raw_data_handler->on_raw_data_received(buffer, size)) {
+                // Reply straight from the receive buffer when we can keep it, otherwise copy.
+                TransmitFragment fragment { buffer, size };
+
+                if (!hold_receive_buffer(buffer)) {
+                    send(buffer, size);
+                } else {
+                    TransmitStatus status { send_fragments(&fragment, 1, this, buffer) };
+
+                    if (status == TransmitQueueFull || status == TransmitInvalid) {
+                        release_receive_buffer(buffer); // Dropped, there won't be a completion.
+                    }
+                }
+            }
+
+            // Somebody kept it, so the descriptor gets a fresh buffer from the pool instead.
+            if (end_receive_loan()) {
+                descriptor->address = (uint32_t) take_pool_buffer();
+            }
+        }
+        
+        descriptor->flags2 = 0;
+        descriptor->flags = 0x80000000 | (((uint32_t) -AM79C973_BUFFER_SIZE) & 0x0FFF) | 0xF000;
+    }
+
+    return frames;
 }
 
 uint64_t Am79C973::get_mac_address()
@@ -268,3 +696,86 @@ uint32_t Am79C973::get_ip_address()
            ((uint32_t)initialization_block.logical_address[1] << 8) |
            ((uint32_t)initialization_block.logical_address[0]);
 }
+
+uint16_t Am79C973::get_receive_ring_size()
+{
+    return receive_ring_size;
+}
+
+uint16_t Am79C973::get_send_ring_size()
+{
+    return send_ring_size;
+}
+
+uint16_t Am79C973::get_send_queue_size()
+{
+    return AM79C973_SEND_QUEUE_SIZE;
+}
+
+uint32_t Am79C973::get_send_drop_count()
+{
+    return send_drops;
+}
+
+void Am79C973::update_missed_frame_count()
+{
+    // CSR112: Missed Frame Count, frames dropped because we owned every receive descriptor.
+    // The interrupt handler points RAP elsewhere, so it mustn't get in between the two accesses.
+    uint32_t flags { disable_interrupts() };
+
+    register_address_port.write(112);
+    uint16_t count { register_data_port.read() };
+
+    missed_frames += (uint16_t) (count - last_missed_frame_count);
+    last_missed_frame_count = count;
+
+    restore_interrupts(flags);
+}
+
+uint32_t Am79C973::get_missed_frame_count()
+{
+    update_missed_frame_count();
+    return missed_frames;
+}
+
+void Am79C973::print_statistics()
+{
+    printf("Am79C973 rings: RX ");
+    printf_int(receive_ring_size);
+    printf(", TX ");
+    printf_int(send_ring_size);
+    printf("\n  received: ");
+    printf_int(received_frames);
+    printf(", sent: ");
+    printf_int(sent_frames);
+    printf(", send errors: ");
+    printf_int(send_errors);
+    printf("\n  queued: ");
+    printf_int(queued_frames);
+    printf(" (max depth ");
+    printf_int(max_send_queue_depth);
+    printf("), queue full: ");
+    printf_int(send_queue_full);
+    printf(", send drops: ");
+    printf_int(send_drops);
+    printf("\n  interrupts: ");
+    printf_int(interrupts);
+    printf(" (");
+    printf_int(receive_interrupts);
+    printf(" RINT), polls: ");
+    printf_int(polls);
+    printf(" (");
+    printf_int(exhausted_polls);
+    printf(" used the whole budget)");
+    printf("\n  missed: ");
+    printf_int(get_missed_frame_count());
+    printf(" (");
+    printf_int(miss_interrupts);
+    printf(" MISS interrupts)\n  held buffers: ");
+    printf_int(held_buffers);
+    printf(", pool free: ");
+    printf_int(receive_buffer_pool_count);
+    printf(", pool exhausted: ");
+    printf_int(pool_exhausted);
+    printf("\n");
+}
@@ -1,60 +1,276 @@
 #include "arp.h"
+#include "cpu.h"
+#include "terminal.h"
 
 AddressResolutionProtocol::AddressResolutionProtocol(EthernetFrameProvider* backend)
     :  EthernetFrameHandler(backend, 0x806)
 {
-    num_cache_entries = 0;
+    for (uint16_t i = 0; i < ARP_HASH_BUCKETS; ++i) {
+        buckets[i] = -1;
+    }
+
+    // Every entry starts out on the free list.
+    for (int16_t i = 0; i < ARP_CACHE_SIZE; ++i) {
+        entries[i].state = NeighborFree;
+        entries[i].pending_count = 0;
+        entries[i].next = i + 1 < ARP_CACHE_SIZE ? i + 1 : -1;
+    }
+
+    free_entries = 0;
+    entry_count = 0;
+
+    requests_sent = 0;
+    replies_sent = 0;
+    resolved = 0;
+    failed = 0;
+    queued_packets = 0;
+    dropped_packets = 0;
+    evictions = 0;
+
+    subnet_mask = 0xFFFFFFFF;
+
+    if (Timer::active_timer != nullptr) {
+        Timer::active_timer->add_handler(this, ARP_TIMER_PERIOD);
+    }
 }
 
 AddressResolutionProtocol::~AddressResolutionProtocol()
 {
+    if (Timer::active_timer != nullptr) {
+        Timer::active_timer->remove_handler(this);
+    }
+
+    for (uint16_t i = 0; i < ARP_CACHE_SIZE; ++i) {
+        drop_pending(&entries[i]);
+    }
+}
+
+uint16_t AddressResolutionProtocol::hash(uint32_t ip)
+{
+    // Fibonacci hashing, the top bits are the well mixed ones.
+    return (ip * 2654435761u) >> 26;
+}
+
+uint32_t AddressResolutionProtocol::get_now()
+{
+    return Timer::active_timer != nullptr ? Timer::active_timer->get_ticks() : 0;
+}
+
+AddressResolutionProtocol::NeighborEntry* AddressResolutionProtocol::find(uint32_t ip)
+{
+    for (int16_t i = buckets[hash(ip)]; i != -1; i = entries[i].next) {
+        if (entries[i].ip == ip) {
+            return &entries[i];
+        }
+    }
 
+    return nullptr;
 }
 
-bool AddressResolutionProtocol::on_ether_frame_received(uint8_t* payload, uint32_t size)
+AddressResolutionProtocol::NeighborEntry* AddressResolutionProtocol::create(uint32_t ip)
 {
-    if (size < sizeof(AddressResolutionProtocolMessage)) {
+    // Full: make room by throwing out the stale entry that was confirmed longest ago.
+    if (free_entries == -1) {
+        NeighborEntry* oldest { nullptr };
+        uint32_t now { get_now() };
+
+        for (uint16_t i = 0; i < ARP_CACHE_SIZE; ++i) {
+            if (entries[i].state == NeighborStale && (oldest == nullptr || now - entries[i].updated > now - oldest->updated)) {
+                oldest = &entries[i];
+            }
+        }
+
+        if (oldest == nullptr) {
+            return nullptr;
+        }
+
+        remove(oldest);
+        ++evictions;
+    }
+
+    int16_t index { free_entries };
+    NeighborEntry* entry { &entries[index] };
+    uint16_t bucket { hash(ip) };
+
+    free_entries = entry->next;
+    entry->next = buckets[bucket];
+    buckets[bucket] = index;
+
+    entry->ip = ip;
+    entry->mac = 0;
+    entry->state = NeighborIncomplete;
+    entry->updated = get_now();
+    entry->last_request = entry->updated;
+    entry->retries = 0;
+    entry->pending_count = 0;
+
+    ++entry_count;
+    return entry;
+}
+
+void AddressResolutionProtocol::remove(NeighborEntry* entry)
+{
+    int16_t index { (int16_t) (entry - entries) };
+    int16_t* link { &buckets[hash(entry->ip)] };
+
+    while (*link != index) {
+        link = &entries[*link].next;
+    }
+
+    *link = entry->next;
+
+    drop_pending(entry);
+    entry->state = NeighborFree;
+    entry->next = free_entries;
+    free_entries = index;
+
+    --entry_count;
+}
+
+void AddressResolutionProtocol::update(NeighborEntry* entry, uint64_t mac, bool is_confirmed)
+{
+    bool was_incomplete { entry->state == NeighborIncomplete };
+
+    entry->mac = mac;
+
+    // A request from them proves they're there, but not that they're still reachable for us.
+    if (is_confirmed || was_incomplete) {
+        entry->state = NeighborReachable;
+        entry->updated = get_now();
+        entry->retries = 0;
+    }
+
+    if (was_incomplete) {
+        ++resolved;
+        flush_pending(entry);
+    }
+}
+
+void AddressResolutionProtocol::flush_pending(NeighborEntry* entry)
+{
+    for (uint8_t i = 0; i < entry->pending_count; ++i) {
+        backend->send(entry->mac, entry->pending[i].ether_type, entry->pending[i].packet);
+    }
+
+    entry->pending_count = 0;
+}
+
+void AddressResolutionProtocol::drop_pending(NeighborEntry* entry)
+{
+    for (uint8_t i = 0; i < entry->pending_count; ++i) {
+        entry->pending[i].packet->release();
+        ++dropped_packets;
+    }
+
+    entry->pending_count = 0;
+}
+
+bool AddressResolutionProtocol::on_packet_received(PacketBuffer* packet)
+{
+    if (packet->get_length() < sizeof(AddressResolutionProtocolMessage)) {
+        return false;
+    }
+
+    AddressResolutionProtocolMessage* arp = (AddressResolutionProtocolMessage*) packet->get_data();
+
+    if (arp->hardware_type != 0x0100 // ethernet
+        || arp->protocol != 0x0008 // ipv4
+        || arp->hardware_address_size != 6
+        || arp->protocol_address_size != 4)
+    {
         return false;
     }
-    
-    AddressResolutionProtocolMessage* arp = (AddressResolutionProtocolMessage*) payload;
-    if (arp->hardware_type == 0x0100) {
-        
-        if (arp->protocol == 0x0008
-        && arp->hardware_address_size == 6
-        && arp->protocol_address_size == 4
-        && arp->destination_ip == backend->get_ip_address())
-        {
-            
-            switch(arp->command) {
-                
-                case 0x0100: // request
-                    arp->command = 0x0200;
-                    arp->destination_ip = arp->source_ip;
-                    arp->destination_mac = arp->source_mac;
-                    arp->source_ip = backend->get_ip_address();
-                    arp->source_mac = backend->get_mac_address();
-                    return true;
+
+    bool is_for_us { arp->destination_ip == backend->get_ip_address() };
+    bool send_back { false };
+
+    uint32_t flags { disable_interrupts() };
+
+    // RFC 826: whatever the packet is, if we know the sender we take its (maybe new) address.
+    // We only start knowing it when the packet was meant for us. Address 0 is a probe.
+    if (arp->source_ip != 0) {
+        NeighborEntry* entry { find(arp->source_ip) };
+
+        if (entry == nullptr && is_for_us) {
+            entry = create(arp->source_ip);
+        }
+
+        if (entry != nullptr) {
+            update(entry, arp->source_mac, is_for_us && arp->command == 0x0200);
+        }
+    }
+
+    restore_interrupts(flags);
+
+    if (is_for_us && arp->command == 0x0100) { // request
+        arp->command = 0x0200;
+        arp->destination_ip = arp->source_ip;
+        arp->destination_mac = arp->source_mac;
+        arp->source_ip = backend->get_ip_address();
+        arp->source_mac = backend->get_mac_address();
+
+        ++replies_sent;
+        send_back = true;
+    }
+
+    return send_back;
+}
+
+void AddressResolutionProtocol::on_timer(uint32_t ticks)
+{
+    for (uint16_t i = 0; i < ARP_CACHE_SIZE; ++i) {
+        NeighborEntry* entry { &entries[i] };
+        uint32_t age { ticks - entry->updated };
+
+        switch (entry->state) {
+            case NeighborIncomplete:
+                if (ticks - entry->last_request < ARP_RETRY_INTERVAL * TIMER_FREQUENCY / 1000) {
                     break;
-                    
-                case 0x0200: // response
-                    if (num_cache_entries < 128) {
-                        ip_cache[num_cache_entries] = arp->source_ip;
-                        mac_cache[num_cache_entries] = arp->source_mac;
-                        num_cache_entries++;
-                    }
+                }
+
+                if (entry->retries >= ARP_MAX_RETRIES) {
+                    ++failed;
+                    remove(entry);
                     break;
-            }
+                }
+
+                ++entry->retries;
+                entry->last_request = ticks;
+                request_mac_address(entry->ip);
+                break;
+
+            case NeighborReachable:
+                if (age >= ARP_REACHABLE_TIME * TIMER_FREQUENCY / 1000) {
+                    entry->state = NeighborStale;
+                }
+                break;
+
+            case NeighborStale:
+                if (age >= (ARP_REACHABLE_TIME + ARP_STALE_TIME) * TIMER_FREQUENCY / 1000) {
+                    remove(entry);
+                }
+                break;
+
+            default:
+                break;
         }
-        
     }
-    
-    return false;
 }
 
 void AddressResolutionProtocol::request_mac_address(uint32_t ip)
 {
-    AddressResolutionProtocolMessage arp_message;
+    if (PacketBufferPool::active_pool == nullptr) {
+        return;
+    }
+
+    // Built straight into a packet buffer, the Ethernet header gets pushed in front of it.
+    PacketBuffer* packet { PacketBufferPool::active_pool->allocate() };
+
+    if (packet == nullptr) {
+        return;
+    }
+
+    AddressResolutionProtocolMessage& arp_message { *(AddressResolutionProtocolMessage*) packet->put(sizeof(AddressResolutionProtocolMessage)) };
     arp_message.hardware_type = 0x0100; // ethernet
     arp_message.protocol = 0x0008; // ipv4
     arp_message.hardware_address_size = 6; // mac
@@ -62,34 +278,181 @@ void AddressResolutionProtocol::request_mac_address(uint32_t ip)
     arp_message.command = 0x0100; // request
     arp_message.source_mac = backend->get_mac_address();
     arp_message.source_ip = backend->get_ip_address();
-    arp_message.destination_mac = 0xFFFFFFFFFFFF; // broadcast
+    arp_message.destination_mac = 0; // unknown, that's what we're asking
     arp_message.destination_ip = ip;
 
-    this->send(arp_message.destination_mac, (uint8_t*) &arp_message, sizeof(AddressResolutionProtocolMessage));
+    ++requests_sent;
+    EthernetFrameHandler::send(0xFFFFFFFFFFFF, packet);
 }
 
-uint64_t AddressResolutionProtocol::get_mac_from_cache(uint32_t ip)
+bool AddressResolutionProtocol::get_mac_from_cache(uint32_t ip, uint64_t* mac)
 {
-    for (int i = 0; i < num_cache_entries; ++i) {
-        if (ip_cache[i] == ip) {
-            return mac_cache[i];
-        }
+    uint32_t flags { disable_interrupts() };
+
+    NeighborEntry* entry { find(ip) };
+    bool is_resolved { entry != nullptr && entry->state != NeighborIncomplete };
+
+    if (is_resolved) {
+        *mac = entry->mac;
     }
-    return 0xFFFFFFFFFFFF; // broadcast address
+
+    restore_interrupts(flags);
+    return is_resolved;
+}
+
+void AddressResolutionProtocol::set_subnet_mask(uint32_t subnet_mask)
+{
+    this->subnet_mask = subnet_mask;
 }
 
-uint64_t AddressResolutionProtocol::resolve(uint32_t ip)
+bool AddressResolutionProtocol::is_broadcast(uint32_t ip)
 {
-    uint64_t result = get_mac_from_cache(ip);
+    if (ip == 0xFFFFFFFF) {
+        return true;
+    }
+
+    // A /32 has no broadcast address of its own, all ones would just be us.
+    uint32_t own_ip { backend->get_ip_address() };
+    return subnet_mask != 0xFFFFFFFF && ip == ((own_ip & subnet_mask) | ~subnet_mask);
+}
+
+bool AddressResolutionProtocol::resolve(uint32_t ip, uint64_t* mac)
+{
+    // Nobody answers for a broadcast, and it mustn't end up in the cache.
+    if (is_broadcast(ip)) {
+        if (mac != nullptr) {
+            *mac = 0xFFFFFFFFFFFF;
+        }
+
+        return true;
+    }
+
+    uint32_t flags { disable_interrupts() };
+
+    NeighborEntry* entry { find(ip) };
+    bool needs_request { false };
+
+    if (entry == nullptr) {
+        entry = create(ip);
+        needs_request = entry != nullptr;
+    } else if (entry->state == NeighborStale && get_now() - entry->last_request >= ARP_RETRY_INTERVAL * TIMER_FREQUENCY / 1000) {
+        // Keep using the old address, but check it's still right.
+        entry->last_request = get_now();
+        needs_request = true;
+    }
 
-    if (result == 0xFFFFFFFFFFFF) {
+    bool is_resolved { entry != nullptr && entry->state != NeighborIncomplete };
+
+    if (is_resolved && mac != nullptr) {
+        *mac = entry->mac;
+    }
+
+    restore_interrupts(flags);
+
+    if (needs_request) {
         request_mac_address(ip);
     }
 
-    while (result == 0xFFFFFFFFFFFF) {
-        // possible infinite loop
-        result = get_mac_from_cache(ip);
+    return is_resolved;
+}
+
+TransmitStatus AddressResolutionProtocol::send(uint32_t ip, uint16_t ether_type, PacketBuffer* packet, bool* is_unresolved)
+{
+    uint64_t mac { 0xFFFFFFFFFFFF };
+
+    if (is_unresolved != nullptr) {
+        *is_unresolved = false;
+    }
+
+    // Limited and directed broadcasts go straight out, without touching the cache.
+    if (is_broadcast(ip) || resolve(ip, &mac)) {
+        return backend->send(mac, ether_type, packet);
+    }
+
+    uint32_t flags { disable_interrupts() };
+
+    // The reply may have come in between, otherwise the packet waits for it in the entry.
+    NeighborEntry* entry { find(ip) };
+    TransmitStatus status { TransmitQueued };
+    bool is_resolved { false };
+
+    if (entry != nullptr && entry->state != NeighborIncomplete) {
+        mac = entry->mac;
+        is_resolved = true;
+    } else if (entry != nullptr && entry->pending_count < ARP_MAX_PENDING_PACKETS) {
+        entry->pending[entry->pending_count].packet = packet;
+        entry->pending[entry->pending_count].ether_type = ether_type;
+        ++entry->pending_count;
+        ++queued_packets;
+
+        if (is_unresolved != nullptr) {
+            *is_unresolved = true;
+        }
+    } else {
+        ++dropped_packets;
+        status = TransmitQueueFull;
+    }
+
+    restore_interrupts(flags);
+
+    if (is_resolved) {
+        return backend->send(mac, ether_type, packet);
     }
-    
-    return result;
+
+    if (status == TransmitQueueFull) {
+        packet->release();
+    }
+
+    return status;
+}
+
+void AddressResolutionProtocol::print_cache()
+{
+    static const char* state_names[] { "free", "incomplete", "reachable", "stale" };
+    char hex_digits[] { "0123456789ABCDEF" };
+
+    printf("ARP cache: ");
+    printf_int(entry_count);
+    printf(" entries\n");
+
+    for (uint16_t i = 0; i < ARP_CACHE_SIZE; ++i) {
+        NeighborEntry* entry { &entries[i] };
+
+        if (entry->state == NeighborFree) {
+            continue;
+        }
+
+        printf("  ");
+
+        for (uint8_t byte = 0; byte < 4; ++byte) {
+            printf_int((entry->ip >> (8 * byte)) & 0xFF);
+            printf(byte < 3 ? "." : " ");
+        }
+
+        for (uint8_t byte = 0; byte < 6; ++byte) {
+            uint8_t value { (uint8_t) (entry->mac >> (8 * byte)) };
+            put_char(hex_digits[value >> 4]);
+            put_char(hex_digits[value & 0xF]);
+            printf(byte < 5 ? ":" : " ");
+        }
+
+        printf(state_names[entry->state]);
+        printf("\n");
+    }
+
+    printf("  requests: ");
+    printf_int(requests_sent);
+    printf(", replies: ");
+    printf_int(replies_sent);
+    printf(", resolved: ");
+    printf_int(resolved);
+    printf(", failed: ");
+    printf_int(failed);
+    printf(", queued: ");
+    printf_int(queued_packets);
+    printf(", dropped: ");
+    printf_int(dropped_packets);
+    printf(", evicted: ");
+    printf_int(evictions);
+    printf("\n");
 }
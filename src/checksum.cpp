@@ -0,0 +1,268 @@
+#include "checksum.h"
+#include "cpu.h"
+#include "nic.h"
+#include "terminal.h"
+#include "timer.h"
+
+// Lanes of the SSE2 loop gain at most 2 * 0xFFFF per 32 byte block, this many blocks can't
+// overflow them.
+#define CHECKSUM_SSE2_MAX_BLOCKS 16384
+
+#define CHECKSUM_BENCHMARK_ITERATIONS 1000
+
+static uint32_t checksum_add_scalar(const void* data, uint32_t length, uint32_t sum);
+// Only this one gets to use SSE2 (the clobbers need it), everything else stays plain i386.
+static uint32_t checksum_add_sse2(const void* data, uint32_t length, uint32_t sum) __attribute__((target("sse2")));
+
+static uint32_t (*checksum_add_implementation)(const void* data, uint32_t length, uint32_t sum) { checksum_add_scalar };
+static bool has_sse2 { false };
+
+void checksum_initialize()
+{
+    has_sse2 = enable_sse2();
+    checksum_add_implementation = has_sse2 ? checksum_add_sse2 : checksum_add_scalar;
+}
+
+const char* checksum_get_implementation_name()
+{
+    return checksum_add_implementation == checksum_add_sse2 ? "SSE2" : "scalar";
+}
+
+uint32_t checksum_add(const void* data, uint32_t length, uint32_t sum)
+{
+    return checksum_add_implementation(data, length, sum);
+}
+
+uint32_t checksum_add_fragments(const TransmitFragment* fragments, uint16_t count, uint32_t sum)
+{
+    uint64_t accumulator { sum };
+    uint32_t offset { 0 };
+
+    for (uint16_t i = 0; i < count; ++i) {
+        uint32_t partial { checksum_add(fragments[i].data, fragments[i].size) };
+
+        // A fragment starting at an odd offset has all its bytes in the other half of their
+        // words. The ones' complement sum is byte order independent, so swapping the bytes
+        // of its (folded) sum puts them back (RFC 1071 section 2).
+        if (offset & 1) {
+            partial = (partial & 0xFFFF) + (partial >> 16);
+            partial = (partial & 0xFFFF) + (partial >> 16);
+            partial = ((partial & 0xFF) << 8) | (partial >> 8);
+        }
+
+        accumulator += partial;
+        offset += fragments[i].size;
+    }
+
+    accumulator = (accumulator & 0xFFFFFFFF) + (accumulator >> 32);
+    accumulator = (accumulator & 0xFFFFFFFF) + (accumulator >> 32);
+    return (uint32_t) accumulator;
+}
+
+static uint32_t checksum_add_scalar(const void* data, uint32_t length, uint32_t sum)
+{
+    const uint8_t* bytes { (const uint8_t*) data };
+
+    // Adding 32 bit words into a 64 bit accumulator lets the carries pile up in the top half
+    // instead of handling them on every add, they get folded back in at the end.
+    uint64_t accumulator { sum };
+
+    while (length >= 32) {
+        const uint32_t* words { (const uint32_t*) bytes };
+
+        accumulator += words[0];
+        accumulator += words[1];
+        accumulator += words[2];
+        accumulator += words[3];
+        accumulator += words[4];
+        accumulator += words[5];
+        accumulator += words[6];
+        accumulator += words[7];
+
+        bytes += 32;
+        length -= 32;
+    }
+
+    while (length >= 4) {
+        accumulator += *(const uint32_t*) bytes;
+        bytes += 4;
+        length -= 4;
+    }
+
+    if (length >= 2) {
+        accumulator += *(const uint16_t*) bytes;
+        bytes += 2;
+        length -= 2;
+    }
+
+    // An odd byte at the end is padded with a zero, which in memory order makes it the low byte.
+    if (length == 1) {
+        accumulator += *bytes;
+    }
+
+    accumulator = (accumulator & 0xFFFFFFFF) + (accumulator >> 32);
+    accumulator = (accumulator & 0xFFFFFFFF) + (accumulator >> 32);
+    return (uint32_t) accumulator;
+}
+
+static uint32_t checksum_add_sse2(const void* data, uint32_t length, uint32_t sum)
+{
+    // Below one block there's nothing to gain over the scalar loop.
+    if (length < 32) {
+        return checksum_add_scalar(data, length, sum);
+    }
+
+    const uint8_t* bytes { (const uint8_t*) data };
+    uint64_t accumulator { sum };
+    uint32_t lanes[4];
+
+    // The XMM registers aren't saved on interrupts or task switches, so nobody else may run
+    // while we use them.
+    uint32_t flags { disable_interrupts() };
+
+    while (length >= 32) {
+        uint32_t blocks { length / 32 };
+
+        if (blocks > CHECKSUM_SSE2_MAX_BLOCKS) {
+            blocks = CHECKSUM_SSE2_MAX_BLOCKS;
+        }
+
+        length -= blocks * 32;
+
+        // Zero extends the 16 bit words to 32 bit lanes and adds those, so the carries stay in
+        // the lanes. Loads are unaligned: a receive buffer puts the IP header at offset 14.
+        __asm__ volatile(
+            "pxor %%xmm0, %%xmm0\n"
+            "pxor %%xmm1, %%xmm1\n"
+            "pxor %%xmm7, %%xmm7\n"
+            "1:\n"
+            "movdqu (%0), %%xmm2\n"
+            "movdqu 16(%0), %%xmm4\n"
+            "movdqa %%xmm2, %%xmm3\n"
+            "movdqa %%xmm4, %%xmm5\n"
+            "punpcklwd %%xmm7, %%xmm2\n"
+            "punpckhwd %%xmm7, %%xmm3\n"
+            "punpcklwd %%xmm7, %%xmm4\n"
+            "punpckhwd %%xmm7, %%xmm5\n"
+            "paddd %%xmm2, %%xmm0\n"
+            "paddd %%xmm3, %%xmm1\n"
+            "paddd %%xmm4, %%xmm0\n"
+            "paddd %%xmm5, %%xmm1\n"
+            "addl $32, %0\n"
+            "decl %1\n"
+            "jnz 1b\n"
+            "paddd %%xmm1, %%xmm0\n"
+            "movdqu %%xmm0, (%2)\n"
+            : "+r" (bytes), "+r" (blocks)
+            : "r" (lanes)
+            : "xmm0", "xmm1", "xmm2", "xmm3", "xmm4", "xmm5", "xmm7", "memory", "cc");
+
+        accumulator += lanes[0];
+        accumulator += lanes[1];
+        accumulator += lanes[2];
+        accumulator += lanes[3];
+    }
+
+    accumulator = (accumulator & 0xFFFFFFFF) + (accumulator >> 32);
+    accumulator = (accumulator & 0xFFFFFFFF) + (accumulator >> 32);
+
+    // The compiler may use XMM registers for the 64 bit math above as well.
+    restore_interrupts(flags);
+
+    return checksum_add_scalar(bytes, length, (uint32_t) accumulator);
+}
+
+uint16_t checksum_finish(uint32_t sum)
+{
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    return (uint16_t) ~sum;
+}
+
+uint16_t checksum_update_16(uint16_t checksum, uint16_t old_value, uint16_t new_value)
+{
+    // HC' = ~(~HC + ~m + m')
+    uint32_t sum { (uint32_t) (uint16_t) ~checksum + (uint16_t) ~old_value + new_value };
+    return checksum_finish(sum);
+}
+
+uint16_t checksum_update_32(uint16_t checksum, uint32_t old_value, uint32_t new_value)
+{
+    checksum = checksum_update_16(checksum, old_value & 0xFFFF, new_value & 0xFFFF);
+    return checksum_update_16(checksum, old_value >> 16, new_value >> 16);
+}
+
+void checksum_benchmark()
+{
+    static const uint16_t sizes[] { 64, 128, 256, 512, 1024, 1500 };
+    static uint8_t buffer[14 + 1500];
+
+    Timer* timer { Timer::active_timer };
+
+    if (timer == nullptr || timer->get_cycles() == 0) {
+        printf("checksum: no TSC, nothing to measure\n");
+        return;
+    }
+
+    // The payload starts where an IP header would in a receive buffer, after the Ethernet header.
+    uint8_t* payload { buffer + 14 };
+
+    for (uint32_t i = 0; i < 1500; ++i) {
+        payload[i] = (uint8_t) (i * 7 + 3);
+    }
+
+    uint32_t (*implementations[])(const void*, uint32_t, uint32_t) { checksum_add_scalar, checksum_add_sse2 };
+    const char* names[] { "scalar", "SSE2" };
+    uint8_t implementation_count { (uint8_t) (has_sse2 ? 2 : 1) };
+
+    for (uint8_t size = 0; size < sizeof(sizes) / sizeof(sizes[0]); ++size) {
+        uint32_t expected { checksum_finish(checksum_add_scalar(payload, sizes[size], 0)) };
+
+        // The same bytes in pieces that start and end on odd offsets, like a header and a
+        // payload in two buffers would.
+        TransmitFragment fragments[] {
+            { payload, 1 },
+            { payload + 1, 2 },
+            { payload + 3, 11 },
+            { payload + 14, (uint32_t) sizes[size] - 14 }
+        };
+
+        printf("checksum ");
+        printf_int(sizes[size]);
+        printf(" B:");
+
+        if (checksum_finish(checksum_add_fragments(fragments, 4)) != expected) {
+            printf_colored(" FRAGMENT MISMATCH", VGA_COLOR_RED_ON_BLACK);
+        }
+
+        for (uint8_t i = 0; i < implementation_count; ++i) {
+            volatile uint32_t sum { 0 };
+            uint64_t start { timer->get_cycles() };
+
+            for (uint32_t iteration = 0; iteration < CHECKSUM_BENCHMARK_ITERATIONS; ++iteration) {
+                sum = implementations[i](payload, sizes[size], 0);
+            }
+
+            uint64_t cycles { divide_64(timer->get_cycles() - start, CHECKSUM_BENCHMARK_ITERATIONS) };
+            uint64_t nanoseconds { timer->cycles_to_nanoseconds(cycles) };
+
+            printf(" ");
+            printf(names[i]);
+            printf(" ");
+            printf_int((uint32_t) cycles);
+            printf(" cycles");
+
+            if (nanoseconds != 0) {
+                printf(" (");
+                printf_int((uint32_t) divide_64((uint64_t) sizes[size] * 1000, (uint32_t) nanoseconds));
+                printf(" MB/s)");
+            }
+
+            if (checksum_finish(sum) != expected) {
+                printf_colored(" MISMATCH", VGA_COLOR_RED_ON_BLACK);
+            }
+        }
+
+        printf("\n");
+    }
+}
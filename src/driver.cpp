@@ -1,9 +1,14 @@
 #include "driver.h"
+#include "pci.h"
 
 Driver::Driver(InterruptManager* manager, uint8_t interrupt_number)
     : InterruptHandler(manager, interrupt_number)
 {
+    interrupt_queue_count = 0;
 
+    for (int i = 0; i < MAX_DRIVER_INTERRUPT_QUEUES; ++i) {
+        queue_handlers[i] = nullptr;
+    }
 }
 
 Driver::~Driver()
@@ -11,6 +16,76 @@ Driver::~Driver()
 
 }
 
+uint16_t Driver::request_interrupt_vectors(PeripheralComponentInterconnectDeviceDescriptor* device, uint16_t queue_count)
+{
+    if (device == nullptr || device->controller == nullptr || interrupt_queue_count != 0) {
+        return 0;
+    }
+
+    if (queue_count > MAX_DRIVER_INTERRUPT_QUEUES) {
+        queue_count = MAX_DRIVER_INTERRUPT_QUEUES;
+    }
+
+    // Vectors are a scarce resource, so don't take more than the device can actually use.
+    uint16_t supported { device->controller->get_message_signaled_interrupt_count(device) };
+    if (queue_count > supported) {
+        queue_count = supported;
+    }
+
+    uint8_t vectors[MAX_DRIVER_INTERRUPT_QUEUES];
+    uint16_t vector_count { 0 };
+
+    while (vector_count < queue_count) {
+        uint8_t vector { interrupt_manager->allocate_interrupt_vector() };
+        if (vector == 0) {
+            break;
+        }
+        vectors[vector_count++] = vector;
+    }
+
+    if (vector_count == 0) {
+        return 0;
+    }
+
+    uint16_t enabled { device->controller->enable_message_signaled_interrupts(device, interrupt_manager, vectors, vector_count) };
+
+    // Whatever the device didn't take (all of them if it failed, all but one with plain MSI) goes back.
+    for (uint16_t i = enabled; i < vector_count; ++i) {
+        interrupt_manager->free_interrupt_vector(vectors[i]);
+    }
+
+    if (enabled == 0) {
+        return 0;
+    }
+
+    set_interrupt_number(vectors[0]);
+    queue_handlers[0] = this;
+
+    for (uint16_t queue = 1; queue < enabled; ++queue) {
+        queue_handlers[queue] = new DriverQueueInterruptHandler(interrupt_manager, vectors[queue], this, queue);
+    }
+
+    interrupt_queue_count = enabled;
+    return enabled;
+}
+
+DriverQueueInterruptHandler::DriverQueueInterruptHandler(InterruptManager* manager, uint8_t interrupt_number, Driver* driver, uint16_t queue)
+    : InterruptHandler(manager, interrupt_number)
+{
+    this->driver = driver;
+    this->queue = queue;
+}
+
+DriverQueueInterruptHandler::~DriverQueueInterruptHandler()
+{
+
+}
+
+uint32_t DriverQueueInterruptHandler::handle_interrupt(uint32_t esp)
+{
+    return driver->handle_queue_interrupt(queue, esp);
+}
+
 void operator delete(void* ptr, unsigned int size)
 {
 
@@ -165,6 +165,29 @@ Driver* DriverManager::get_driver(uint8_t index)
     return drivers[index];
 }
 
+Driver* DriverManager::find_driver(const char* name, Driver* after)
+{
+    for (int i = find_driver_index(after) + 1; i < driver_count; i++) {
+        const char* driver_name { drivers[i]->get_driver_name() };
+        int j { 0 };
+
+        while (name[j] != '\0' && name[j] == driver_name[j]) {
+            ++j;
+        }
+
+        if (name[j] == driver_name[j]) {
+            return drivers[i];
+        }
+    }
+
+    return nullptr;
+}
+
+bool DriverManager::is_driver_registered(const char* name)
+{
+    return find_driver(name) != nullptr;
+}
+
 bool DriverManager::is_manager_active() const
 {
     return is_active;
@@ -1,15 +1,22 @@
+#include "cpu.h"
 #include "ethernet_frame.h"
+#include "memory_manager.h"
+#include "terminal.h"
 
 EthernetFrameHandler::EthernetFrameHandler(EthernetFrameProvider* backend, uint16_t ether_type)
 {
     this->ether_type = ((ether_type & 0x00FF) << 8) | ((ether_type & 0xFF00) >> 8);
     this->backend = backend;
-    backend->handlers[ether_type] = this;
+
+    // Frames are dispatched on the wire (big endian) value.
+    if (!backend->register_handler(this->ether_type, this)) {
+        printf_colored("Ethernet: no room for another EtherType handler\n", VGA_COLOR_RED_ON_BLACK);
+    }
 }
 
 EthernetFrameHandler::~EthernetFrameHandler()
 {
-    backend->handlers[ether_type] = 0;
+    backend->unregister_handler(ether_type, this);
 }
 
 bool EthernetFrameHandler::on_ethernet_frame_received(uint8_t* payload, uint32_t size)
@@ -17,21 +24,87 @@ bool EthernetFrameHandler::on_ethernet_frame_received(uint8_t* payload, uint32_t
     return false;
 }
 
-void EthernetFrameHandler::send(uint64_t destination_mac, uint8_t* data, uint32_t size)
+bool EthernetFrameHandler::on_packet_received(PacketBuffer* packet)
+{
+    return on_ethernet_frame_received(packet->get_data(), packet->get_length());
+}
+
+TransmitStatus EthernetFrameHandler::send(uint64_t destination_mac, uint8_t* data, uint32_t size, TransmitCompletionHandler* completion, void* context)
 {
-    backend->send(destination_mac, ether_type, data, size);
+    return backend->send(destination_mac, ether_type, data, size, completion, context);
 }
-EthernetFrameProvider::EthernetFrameProvider(Am79C973* backend)
+
+TransmitStatus EthernetFrameHandler::send(uint64_t destination_mac, PacketBuffer* packet)
+{
+    return backend->send(destination_mac, ether_type, packet);
+}
+
+EthernetFrameProvider::EthernetFrameProvider(NetworkInterfaceController* backend)
     : RawDataHandler(backend)
 {
-    for (uint32_t i = 0; i < 65535; i++) { // I guess we couild prob use a 16 bit int here
-        handlers[i] = 0;
+    dispatch_table.count = 0;
+
+    header_slot_count = backend->get_send_ring_size() + backend->get_send_queue_size();
+    header_slots = nullptr;
+    next_header_slot = 0;
+
+    if (header_slot_count > 0) {
+        header_slots = (EthernetFrameHeader*) MemoryManager::memory_manager->malloc(header_slot_count * sizeof(EthernetFrameHeader));
+    }
+
+    if (header_slots == nullptr) {
+        header_slot_count = 0;
     }
 }
 
 EthernetFrameProvider::~EthernetFrameProvider()
 {
+    if (header_slots != nullptr) {
+        MemoryManager::memory_manager->free(header_slots);
+    }
+}
+
+bool EthernetFrameProvider::register_handler(uint16_t ether_type, EthernetFrameHandler* handler)
+{
+    // A second handler for the same EtherType replaces the first, like the old table did.
+    for (uint8_t i = 0; i < dispatch_table.count; ++i) {
+        if (dispatch_table.ether_types[i] == ether_type) {
+            dispatch_table.handlers[i] = handler;
+            return true;
+        }
+    }
+
+    if (dispatch_table.count == MAX_ETHERNET_FRAME_HANDLERS) {
+        return false;
+    }
+
+    dispatch_table.ether_types[dispatch_table.count] = ether_type;
+    dispatch_table.handlers[dispatch_table.count] = handler;
+    ++dispatch_table.count;
+    return true;
+}
+
+void EthernetFrameProvider::unregister_handler(uint16_t ether_type, EthernetFrameHandler* handler)
+{
+    for (uint8_t i = 0; i < dispatch_table.count; ++i) {
+        if (dispatch_table.ether_types[i] == ether_type && dispatch_table.handlers[i] == handler) {
+            --dispatch_table.count;
+            dispatch_table.ether_types[i] = dispatch_table.ether_types[dispatch_table.count];
+            dispatch_table.handlers[i] = dispatch_table.handlers[dispatch_table.count];
+            return;
+        }
+    }
+}
 
+EthernetFrameHandler* EthernetFrameProvider::find_handler(uint16_t ether_type)
+{
+    for (uint8_t i = 0; i < dispatch_table.count; ++i) {
+        if (dispatch_table.ether_types[i] == ether_type) {
+            return dispatch_table.handlers[i];
+        }
+    }
+
+    return nullptr;
 }
 
 bool EthernetFrameProvider::on_raw_data_received(uint8_t* buffer, uint32_t size)
@@ -39,9 +112,26 @@ bool EthernetFrameProvider::on_raw_data_received(uint8_t* buffer, uint32_t size)
     EthernetFrameHeader* frame { (EthernetFrameHeader*) buffer };
     bool send_back { false };
 
+    if (size < sizeof(EthernetFrameHeader)) {
+        return false;
+    }
+
     if (frame->destination_mac == 0xFFFFFFFFFFFF || frame->destination_mac == backend->get_mac_address()) {
-        if (handlers[frame->ether_type] != 0) {
-            send_back = handlers[frame->ether_type]->on_ethernet_frame_received(buffer + sizeof(EthernetFrameHeader), size - sizeof(EthernetFrameHeader));
+        EthernetFrameHandler* handler { find_handler(frame->ether_type) };
+
+        // Wrapping the NIC's buffer costs a pool entry but no copy, and lets handlers keep it.
+        PacketBuffer* packet { nullptr };
+
+        if (handler != nullptr && PacketBufferPool::active_pool != nullptr) {
+            packet = PacketBufferPool::active_pool->wrap(buffer, size, backend);
+        }
+
+        if (packet != nullptr) {
+            packet->pull(sizeof(EthernetFrameHeader));
+            send_back = handler->on_packet_received(packet);
+            packet->release();
+        } else if (handler != nullptr) {
+            send_back = handler->on_ethernet_frame_received(buffer + sizeof(EthernetFrameHeader), size - sizeof(EthernetFrameHeader));
         }
     }
 
@@ -53,23 +143,112 @@ bool EthernetFrameProvider::on_raw_data_received(uint8_t* buffer, uint32_t size)
     return send_back;
 }
 
-void EthernetFrameProvider::send(uint64_t destination_mac, uint16_t ether_type, uint8_t* buffer, uint32_t size)
+TransmitStatus EthernetFrameProvider::send(uint64_t destination_mac, uint16_t ether_type, uint8_t* buffer, uint32_t size, TransmitCompletionHandler* completion, void* context)
 {
-    uint8_t* buffer2 { (uint8_t*) MemoryManager::memory_manager->malloc(sizeof(EthernetFrameHeader) + size) };
-    EthernetFrameHeader* frame { (EthernetFrameHeader*) buffer2 };
+    if (header_slots == nullptr) {
+        return send_copy(destination_mac, ether_type, buffer, size, completion, context);
+    }
+
+    uint32_t flags { disable_interrupts() };
+
+    EthernetFrameHeader* frame { &header_slots[next_header_slot] };
 
     frame->destination_mac = destination_mac;
     frame->source_mac = backend->get_mac_address();
     frame->ether_type = ether_type;
 
-    uint8_t* source { buffer };
-    uint8_t* destination { buffer2 + sizeof(EthernetFrameHeader) };
+    // Header and payload go to the NIC as two fragments, nothing gets copied or allocated.
+    TransmitFragment fragments[2] {
+        { (uint8_t*) frame, sizeof(EthernetFrameHeader) },
+        { buffer, size }
+    };
+
+    TransmitStatus status { backend->send_fragments(fragments, 2, completion, context) };
+
+    if (status == TransmitSent || status == TransmitQueued) {
+        next_header_slot = (next_header_slot + 1) % header_slot_count;
+    }
+
+    restore_interrupts(flags);
+    return status;
+}
+
+TransmitStatus EthernetFrameProvider::send(uint64_t destination_mac, uint16_t ether_type, PacketBuffer* packet)
+{
+    EthernetFrameHeader* frame { (EthernetFrameHeader*) packet->push(sizeof(EthernetFrameHeader)) };
+
+    // Not enough headroom (a wrapped receive buffer): the header goes in its own fragment.
+    if (frame == nullptr) {
+        TransmitStatus status { send(destination_mac, ether_type, packet->get_data(), packet->get_length(), this, packet) };
+
+        if (status != TransmitSent && status != TransmitQueued) {
+            packet->release();
+        }
+
+        return status;
+    }
+
+    frame->destination_mac = destination_mac;
+    frame->source_mac = backend->get_mac_address();
+    frame->ether_type = ether_type;
+
+    TransmitFragment fragment { packet->get_data(), packet->get_length() };
+    TransmitStatus status { backend->send_fragments(&fragment, 1, this, packet) };
+
+    if (status != TransmitSent && status != TransmitQueued) {
+        packet->release();
+    }
+
+    return status;
+}
+
+TransmitStatus EthernetFrameProvider::send_copy(uint64_t destination_mac, uint16_t ether_type, uint8_t* buffer, uint32_t size, TransmitCompletionHandler* completion, void* context)
+{
+    PacketBuffer* packet { PacketBufferPool::active_pool != nullptr ? PacketBufferPool::active_pool->allocate() : nullptr };
+
+    if (packet == nullptr) {
+        return TransmitInvalid;
+    }
+
+    uint8_t* data { packet->put(size) };
+    EthernetFrameHeader* frame { data != nullptr ? (EthernetFrameHeader*) packet->push(sizeof(EthernetFrameHeader)) : nullptr };
+
+    if (frame == nullptr) {
+        packet->release();
+        return TransmitInvalid;
+    }
 
     for (uint32_t i = 0; i < size; ++i) {
-        destination[i] = source[i];
+        data[i] = buffer[i];
     }
 
-    backend->send(buffer2, size + sizeof(EthernetFrameHeader));
+    frame->destination_mac = destination_mac;
+    frame->source_mac = backend->get_mac_address();
+    frame->ether_type = ether_type;
+
+    TransmitFragment fragment { packet->get_data(), packet->get_length() };
+    TransmitStatus status { backend->send_fragments(&fragment, 1, this, packet) };
+
+    if (status != TransmitSent && status != TransmitQueued) {
+        packet->release();
+        return status;
+    }
+
+    // The caller's buffer was copied, it's free again right away.
+    if (completion != nullptr) {
+        completion->on_transmit_complete(context);
+    }
+
+    return status;
+}
+
+void EthernetFrameProvider::on_transmit_complete(void* context)
+{
+    PacketBuffer* packet { (PacketBuffer*) context };
+
+    if (packet != nullptr) {
+        packet->release();
+    }
 }
 
 uint64_t EthernetFrameProvider::get_mac_address() {
@@ -79,3 +258,11 @@ uint64_t EthernetFrameProvider::get_mac_address() {
 uint32_t EthernetFrameProvider::get_ip_address() {
     return backend->get_ip_address();
 }
+
+uint32_t EthernetFrameProvider::get_features() {
+    return backend->get_features();
+}
+
+uint8_t EthernetFrameProvider::get_receive_checksum_status() {
+    return backend->get_receive_checksum_status();
+}
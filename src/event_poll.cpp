@@ -0,0 +1,302 @@
+#include "cpu.h"
+#include "event_poll.h"
+#include "terminal.h"
+
+EventSource::EventSource()
+{
+    registrations = nullptr;
+}
+
+EventSource::~EventSource()
+{
+    detach_events();
+}
+
+uint8_t EventSource::get_events()
+{
+    return 0;
+}
+
+void EventSource::notify_events(uint8_t events)
+{
+    for (EventRegistration* registration = registrations; registration != nullptr; registration = registration->next_for_source) {
+        if (events & (registration->interest | EVENT_HANGUP | EVENT_ERROR)) {
+            registration->poll->signal(registration);
+        }
+    }
+}
+
+void EventSource::detach_events()
+{
+    uint32_t flags { disable_interrupts() };
+
+    while (registrations != nullptr) {
+        registrations->poll->unlink(registrations);
+    }
+
+    restore_interrupts(flags);
+}
+
+EventPoll::EventPoll()
+{
+    for (uint8_t i = 0; i < EVENT_POLL_MAX_REGISTRATIONS; ++i) {
+        registrations[i].is_in_use = false;
+    }
+
+    ready_head = nullptr;
+    ready_tail = nullptr;
+    ready_count = 0;
+    waiter = nullptr;
+
+    notifications = 0;
+    blocks = 0;
+    reported_events = 0;
+}
+
+EventPoll::~EventPoll()
+{
+    uint32_t flags { disable_interrupts() };
+
+    for (uint8_t i = 0; i < EVENT_POLL_MAX_REGISTRATIONS; ++i) {
+        if (registrations[i].is_in_use) {
+            unlink(&registrations[i]);
+        }
+    }
+
+    restore_interrupts(flags);
+}
+
+EventRegistration* EventPoll::find(EventSource* source)
+{
+    // The source's own list is usually one entry long, shorter than our table.
+    for (EventRegistration* registration = source->registrations; registration != nullptr; registration = registration->next_for_source) {
+        if (registration->poll == this) {
+            return registration;
+        }
+    }
+
+    return nullptr;
+}
+
+void EventPoll::make_ready(EventRegistration* registration)
+{
+    if (registration->is_ready) {
+        return;
+    }
+
+    registration->is_ready = true;
+    registration->next_ready = nullptr;
+    registration->previous_ready = ready_tail;
+
+    if (ready_tail != nullptr) {
+        ready_tail->next_ready = registration;
+    } else {
+        ready_head = registration;
+    }
+
+    ready_tail = registration;
+    ++ready_count;
+}
+
+void EventPoll::signal(EventRegistration* registration)
+{
+    ++notifications;
+    make_ready(registration);
+
+    if (waiter != nullptr && TaskScheduler::active_task_scheduler != nullptr) {
+        TaskScheduler::active_task_scheduler->wake(waiter);
+    }
+}
+
+void EventPoll::remove_ready(EventRegistration* registration)
+{
+    if (!registration->is_ready) {
+        return;
+    }
+
+    if (registration->previous_ready != nullptr) {
+        registration->previous_ready->next_ready = registration->next_ready;
+    } else {
+        ready_head = registration->next_ready;
+    }
+
+    if (registration->next_ready != nullptr) {
+        registration->next_ready->previous_ready = registration->previous_ready;
+    } else {
+        ready_tail = registration->previous_ready;
+    }
+
+    registration->is_ready = false;
+    --ready_count;
+}
+
+void EventPoll::unlink(EventRegistration* registration)
+{
+    remove_ready(registration);
+
+    EventRegistration** link { &registration->source->registrations };
+
+    while (*link != nullptr && *link != registration) {
+        link = &(*link)->next_for_source;
+    }
+
+    if (*link != nullptr) {
+        *link = registration->next_for_source;
+    }
+
+    registration->is_in_use = false;
+}
+
+bool EventPoll::add(EventSource* source, uint8_t events, void* data)
+{
+    uint32_t flags { disable_interrupts() };
+
+    if (find(source) != nullptr) {
+        restore_interrupts(flags);
+        return false;
+    }
+
+    EventRegistration* registration { nullptr };
+
+    for (uint8_t i = 0; i < EVENT_POLL_MAX_REGISTRATIONS; ++i) {
+        if (!registrations[i].is_in_use) {
+            registration = &registrations[i];
+            break;
+        }
+    }
+
+    if (registration == nullptr) {
+        restore_interrupts(flags);
+        return false;
+    }
+
+    registration->poll = this;
+    registration->source = source;
+    registration->interest = events;
+    registration->data = data;
+    registration->is_in_use = true;
+    registration->is_ready = false;
+
+    registration->next_for_source = source->registrations;
+    source->registrations = registration;
+
+    // Whatever the source is already ready for counts as the first edge.
+    if (source->get_events() & (events | EVENT_HANGUP | EVENT_ERROR)) {
+        make_ready(registration);
+    }
+
+    restore_interrupts(flags);
+    return true;
+}
+
+bool EventPoll::modify(EventSource* source, uint8_t events, void* data)
+{
+    uint32_t flags { disable_interrupts() };
+    EventRegistration* registration { find(source) };
+
+    if (registration == nullptr) {
+        restore_interrupts(flags);
+        return false;
+    }
+
+    registration->interest = events;
+    registration->data = data;
+
+    if (source->get_events() & (events | EVENT_HANGUP | EVENT_ERROR)) {
+        make_ready(registration);
+    }
+
+    restore_interrupts(flags);
+    return true;
+}
+
+void EventPoll::remove(EventSource* source)
+{
+    uint32_t flags { disable_interrupts() };
+    EventRegistration* registration { find(source) };
+
+    if (registration != nullptr) {
+        unlink(registration);
+    }
+
+    restore_interrupts(flags);
+}
+
+uint32_t EventPoll::collect(PolledEvent* events, uint32_t count)
+{
+    uint32_t collected { 0 };
+
+    // Each ready registration is looked at once. The source is asked again because the ready
+    // list only says something happened, it may have been read already. Level triggered ones go
+    // back to the end of the list, so they take turns when there are more than count of them.
+    for (uint32_t remaining = ready_count; remaining > 0 && collected < count; --remaining) {
+        EventRegistration* registration { ready_head };
+        remove_ready(registration);
+
+        uint8_t ready { (uint8_t) (registration->source->get_events() & (registration->interest | EVENT_HANGUP | EVENT_ERROR)) };
+
+        if (ready == 0) {
+            continue;
+        }
+
+        events[collected].events = ready;
+        events[collected].data = registration->data;
+        ++collected;
+
+        if (!(registration->interest & EVENT_EDGE_TRIGGERED)) {
+            make_ready(registration);
+        }
+    }
+
+    reported_events += collected;
+    return collected;
+}
+
+uint32_t EventPoll::wait(PolledEvent* events, uint32_t count)
+{
+    uint32_t flags { disable_interrupts() };
+    uint32_t collected { collect(events, count) };
+
+    while (collected == 0) {
+        TaskScheduler* scheduler { TaskScheduler::active_task_scheduler };
+        Task* task { scheduler != nullptr ? scheduler->get_current_task() : nullptr };
+
+        if (task != nullptr) {
+            waiter = task;
+            ++blocks;
+            scheduler->block_current();
+            waiter = nullptr;
+        } else {
+            // Not a task, there's nothing to block: sleep until the next interrupt instead.
+            // sti only takes effect after hlt, so an interrupt can't get in between.
+            __asm__ volatile("sti\n hlt\n cli" : : : "memory");
+        }
+
+        collected = collect(events, count);
+    }
+
+    restore_interrupts(flags);
+    return collected;
+}
+
+uint32_t EventPoll::poll(PolledEvent* events, uint32_t count)
+{
+    uint32_t flags { disable_interrupts() };
+    uint32_t collected { collect(events, count) };
+    restore_interrupts(flags);
+
+    return collected;
+}
+
+void EventPoll::print_statistics()
+{
+    printf("Event poll: notifications ");
+    printf_int(notifications);
+    printf(", blocked ");
+    printf_int(blocks);
+    printf(" times, events reported ");
+    printf_int(reported_events);
+    printf(", ready now ");
+    printf_int(ready_count);
+    printf("\n");
+}
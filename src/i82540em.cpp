@@ -0,0 +1,675 @@
+#include "cpu.h"
+#include "i82540em.h"
+
+static constexpr PeripheralComponentInterconnectDeviceMatch intel_82540em_matches[] {
+    { 0x8086, 0x100E, PCI_MATCH_ANY, PCI_MATCH_ANY }, // 82540EM (QEMU, Bochs)
+    { 0x8086, 0x100F, PCI_MATCH_ANY, PCI_MATCH_ANY }, // 82545EM (VMware, VirtualBox)
+};
+
+static Driver* probe_intel_82540em(PeripheralComponentInterconnectDeviceDescriptor* device, InterruptManager* interrupt_manager)
+{
+    // Everything goes through the register BAR, without it there's nothing we can do.
+    if (device->base_address_registers[0].type != MemoryMapping || device->base_address_registers[0].size == 0) {
+        return nullptr;
+    }
+
+    Intel82540EM* driver { (Intel82540EM*) MemoryManager::memory_manager->malloc(sizeof(Intel82540EM)) };
+
+    if (driver != nullptr) {
+        new (driver) Intel82540EM(device, interrupt_manager);
+
+        // Out of memory for the rings, leave the device alone.
+        if (!driver->is_available()) {
+            driver->~Intel82540EM();
+            MemoryManager::memory_manager->free(driver);
+            return nullptr;
+        }
+    }
+
+    return driver;
+}
+
+REGISTER_PCI_DRIVER(intel_82540em, intel_82540em_matches, probe_intel_82540em);
+
+Intel82540EM::Intel82540EM(PeripheralComponentInterconnectDeviceDescriptor* device, InterruptManager* interrupt_manager)
+:   NetworkInterfaceController(interrupt_manager, device->interrupt_number + interrupt_manager->get_hardware_interrupt_offset()),
+    registers((uint32_t) device->base_address_registers[0].address, device->base_address_registers[0].size)
+{
+    if (device->controller != nullptr) {
+        device->controller->enable_bus_mastering(device); // The rings are DMA'd, firmware doesn't always turn this on.
+    }
+
+    registers.map_uncached();
+
+    ip_address = 0;
+    current_receive_buffer = 0;
+    current_send_buffer = 0;
+    oldest_send_buffer = 0;
+    send_buffers_in_use = 0;
+    lent_checksum_status = 0;
+
+    interrupts = 0;
+    received_frames = 0;
+    sent_frames = 0;
+    send_drops = 0;
+    receive_overruns = 0;
+    missed_frames = 0;
+    checksum_errors = 0;
+    offloaded_frames = 0;
+    polls = 0;
+
+    reset();
+    mac_address = read_mac_address();
+
+    // Twice as many receive buffers as descriptors: the second half starts out in the pool.
+    receive_ring_memory = allocate_ring(
+        I82540EM_RECEIVE_RING_SIZE * sizeof(ReceiveDescriptor),
+        2 * I82540EM_RECEIVE_RING_SIZE * I82540EM_RECEIVE_BUFFER_SIZE,
+        (void**) &receive_descriptors, &receive_buffers
+    );
+    uint8_t** pool { (uint8_t**) MemoryManager::memory_manager->malloc(I82540EM_RECEIVE_RING_SIZE * sizeof(uint8_t*)) };
+
+    send_ring_memory = allocate_ring(
+        I82540EM_SEND_RING_SIZE * sizeof(SendDescriptor),
+        I82540EM_SEND_RING_SIZE * I82540EM_SEND_BUFFER_SIZE,
+        (void**) &send_descriptors, &send_buffers
+    );
+    send_records = (SendRecord*) MemoryManager::memory_manager->malloc(I82540EM_SEND_RING_SIZE * sizeof(SendRecord));
+
+    // A null ring would end up as a descriptor base just past address 0, so don't go any
+    // further without all of them.
+    if (receive_ring_memory == nullptr || pool == nullptr || send_ring_memory == nullptr || send_records == nullptr) {
+        printf_colored("Intel 82540EM: not enough memory for the rings\n", VGA_COLOR_RED_ON_BLACK);
+
+        if (pool != nullptr) {
+            MemoryManager::memory_manager->free(pool);
+        }
+
+        free_rings();
+        return;
+    }
+
+    set_receive_buffers(receive_buffers, I82540EM_RECEIVE_BUFFER_SIZE, 2 * I82540EM_RECEIVE_RING_SIZE, pool, I82540EM_RECEIVE_RING_SIZE);
+
+    for (uint16_t i = 0; i < I82540EM_RECEIVE_RING_SIZE; ++i) {
+        receive_descriptors[i].address = (uint32_t) &receive_buffers[i * I82540EM_RECEIVE_BUFFER_SIZE];
+        receive_descriptors[i].length = 0;
+        receive_descriptors[i].checksum = 0;
+        receive_descriptors[i].status = 0;
+        receive_descriptors[i].errors = 0;
+        receive_descriptors[i].special = 0;
+
+        receive_buffer_pool[receive_buffer_pool_count++] = &receive_buffers[(I82540EM_RECEIVE_RING_SIZE + i) * I82540EM_RECEIVE_BUFFER_SIZE];
+    }
+
+    for (uint16_t i = 0; i < I82540EM_SEND_RING_SIZE; ++i) {
+        send_descriptors[i].address = 0;
+        send_descriptors[i].length = 0;
+        send_descriptors[i].checksum_offset = 0;
+        send_descriptors[i].command = 0;
+        send_descriptors[i].status = 0;
+        send_descriptors[i].checksum_start = 0;
+        send_descriptors[i].special = 0;
+
+        send_records[i].handler = nullptr;
+        send_records[i].context = nullptr;
+        send_records[i].last_descriptor = i;
+    }
+
+    // The NIC owns everything from RDH up to (not including) RDT, so one slot always stays empty.
+    registers.write<uint32_t>(REGISTER_RDBAL, (uint32_t) receive_descriptors);
+    registers.write<uint32_t>(REGISTER_RDBAH, 0);
+    registers.write<uint32_t>(REGISTER_RDLEN, I82540EM_RECEIVE_RING_SIZE * sizeof(ReceiveDescriptor));
+    registers.write<uint32_t>(REGISTER_RDH, 0);
+    registers.write<uint32_t>(REGISTER_RDT, I82540EM_RECEIVE_RING_SIZE - 1);
+
+    registers.write<uint32_t>(REGISTER_TDBAL, (uint32_t) send_descriptors);
+    registers.write<uint32_t>(REGISTER_TDBAH, 0);
+    registers.write<uint32_t>(REGISTER_TDLEN, I82540EM_SEND_RING_SIZE * sizeof(SendDescriptor));
+    registers.write<uint32_t>(REGISTER_TDH, 0);
+    registers.write<uint32_t>(REGISTER_TDT, 0);
+
+    request_interrupt_vectors(device, 1);
+}
+
+Intel82540EM::~Intel82540EM()
+{
+    deactivate();
+    free_rings();
+
+    if (receive_buffer_pool != nullptr) {
+        MemoryManager::memory_manager->free(receive_buffer_pool);
+    }
+}
+
+void Intel82540EM::free_rings()
+{
+    // Whatever got allocated, malloc failures leave the rest null.
+    void* allocations[] { receive_ring_memory, send_ring_memory, send_records };
+
+    for (uint32_t i = 0; i < sizeof(allocations) / sizeof(allocations[0]); ++i) {
+        if (allocations[i] != nullptr) {
+            MemoryManager::memory_manager->free(allocations[i]);
+        }
+    }
+
+    receive_ring_memory = nullptr;
+    send_ring_memory = nullptr;
+    send_records = nullptr;
+}
+
+bool Intel82540EM::is_available()
+{
+    return receive_ring_memory != nullptr;
+}
+
+void* Intel82540EM::allocate_ring(uint32_t descriptor_bytes, uint32_t buffer_bytes, void** descriptors, uint8_t** buffers)
+{
+    // Descriptor rings need 16 byte alignment, we go for 128 so a ring never straddles a cache
+    // line it shares with something else. The buffers follow directly (sizes keep them aligned).
+    void* memory { MemoryManager::memory_manager->malloc(descriptor_bytes + buffer_bytes + 127) };
+
+    if (memory == nullptr) {
+        return nullptr;
+    }
+
+    *descriptors = (void*) ((((uint32_t) memory) + 127) & ~((uint32_t) 0x7F));
+    *buffers = (uint8_t*) *descriptors + descriptor_bytes;
+
+    return memory;
+}
+
+uint16_t Intel82540EM::read_eeprom(uint8_t address)
+{
+    // EERD on the 8254x: address in bits 15:8, start in bit 0, done in bit 4, data in 31:16.
+    registers.write<uint32_t>(REGISTER_EERD, ((uint32_t) address << 8) | 0x1);
+
+    for (uint32_t i = 0; i < 100000; ++i) {
+        uint32_t value { registers.read<uint32_t>(REGISTER_EERD) };
+
+        if (value & 0x10) {
+            return value >> 16;
+        }
+    }
+
+    return 0;
+}
+
+uint64_t Intel82540EM::read_mac_address()
+{
+    uint32_t low { registers.read<uint32_t>(REGISTER_RAL) };
+    uint32_t high { registers.read<uint32_t>(REGISTER_RAH) };
+
+    // The NIC loads receive address 0 from the EEPROM on reset, only go to the EEPROM ourselves
+    // when that didn't happen.
+    if (!(high & 0x80000000)) {
+        uint16_t word_0 { read_eeprom(0) };
+        uint16_t word_1 { read_eeprom(1) };
+        uint16_t word_2 { read_eeprom(2) };
+
+        low = word_0 | ((uint32_t) word_1 << 16);
+        high = word_2;
+
+        registers.write<uint32_t>(REGISTER_RAL, low);
+        registers.write<uint32_t>(REGISTER_RAH, high | 0x80000000); // Address valid
+    }
+
+    return ((uint64_t) (high & 0xFFFF) << 32) | low;
+}
+
+void Intel82540EM::initialize()
+{
+
+}
+
+void Intel82540EM::activate()
+{
+    // Link up with auto speed detection, and clear the reset/loss-of-signal/VLAN bits.
+    uint32_t control { registers.read<uint32_t>(REGISTER_CTRL) };
+    control |= CTRL_SLU | CTRL_ASDE;
+    control &= ~(0x00000008 | 0x00000080 | 0x40000000 | 0x80000000);
+    registers.write<uint32_t>(REGISTER_CTRL, control);
+
+    // No multicast groups joined yet.
+    for (uint32_t i = 0; i < 128; ++i) {
+        registers.write<uint32_t>(REGISTER_MTA + i * 4, 0);
+    }
+
+    registers.write<uint32_t>(REGISTER_RXCSUM, RXCSUM_IPOFLD | RXCSUM_TUOFLD);
+    registers.write<uint32_t>(REGISTER_ITR, I82540EM_INTERRUPT_THROTTLE);
+
+    // 2048 byte buffers (BSIZE = 0), no long packets, broadcast on, FCS stripped.
+    registers.write<uint32_t>(REGISTER_RCTL, RCTL_EN | RCTL_BAM | RCTL_SECRC);
+
+    // Collision threshold 0x0F and full duplex collision distance 0x40, IPG from the manual.
+    registers.write<uint32_t>(REGISTER_TIPG, 0x0060200A);
+    registers.write<uint32_t>(REGISTER_TCTL, TCTL_EN | TCTL_PSP | (0x0F << 4) | (0x40 << 12));
+
+    registers.write<uint32_t>(REGISTER_IMS, INTERRUPT_RXT0 | INTERRUPT_RXO | INTERRUPT_RXDMT0 | INTERRUPT_TXDW | INTERRUPT_LSC);
+    registers.read<uint32_t>(REGISTER_ICR);
+}
+
+void Intel82540EM::deactivate()
+{
+    registers.write<uint32_t>(REGISTER_IMC, 0xFFFFFFFF);
+    registers.write<uint32_t>(REGISTER_RCTL, 0);
+    registers.write<uint32_t>(REGISTER_TCTL, 0);
+}
+
+void Intel82540EM::reset()
+{
+    registers.write<uint32_t>(REGISTER_IMC, 0xFFFFFFFF);
+    registers.write<uint32_t>(REGISTER_CTRL, registers.read<uint32_t>(REGISTER_CTRL) | CTRL_RST);
+
+    // The bit clears itself once the reset is done (takes about a microsecond).
+    for (uint32_t i = 0; i < 100000 && (registers.read<uint32_t>(REGISTER_CTRL) & CTRL_RST); ++i);
+
+    registers.write<uint32_t>(REGISTER_IMC, 0xFFFFFFFF);
+    registers.read<uint32_t>(REGISTER_ICR);
+}
+
+string Intel82540EM::get_driver_name()
+{
+    return "Intel 82540EM";
+}
+
+uint32_t Intel82540EM::handle_interrupt(uint32_t esp)
+{
+    // Reading ICR acknowledges everything in it. ITR already limits how often we get here,
+    // so each interrupt usually finds a batch of frames waiting.
+    uint32_t cause { registers.read<uint32_t>(REGISTER_ICR) };
+
+    if (cause == 0) {
+        return esp; // Someone else on a shared line.
+    }
+
+    ++interrupts;
+
+    if (cause & INTERRUPT_LSC) {
+        printf(is_link_up() ? "Intel 82540EM link up\n" : "Intel 82540EM link down\n");
+    }
+
+    if (cause & INTERRUPT_RXO) {
+        ++receive_overruns;
+    }
+
+    // Mask the receive causes and let poll() drain the ring, so a flood can't keep us in here.
+    if (cause & INTERRUPT_RECEIVE) {
+        if (interrupt_manager->schedule_poll(this)) {
+            registers.write<uint32_t>(REGISTER_IMC, INTERRUPT_RECEIVE);
+        } else {
+            while (receive(POLL_BUDGET) == POLL_BUDGET);
+        }
+    }
+
+    if (cause & INTERRUPT_TXDW) {
+        reclaim_send_buffers();
+    }
+
+    return esp;
+}
+
+uint16_t Intel82540EM::poll(uint16_t budget)
+{
+    ++polls;
+
+    uint16_t received { receive(budget) };
+
+    if (received == budget) {
+        return budget;
+    }
+
+    // Unmasking raises the interrupt again right away if a frame came in since ICR was read,
+    // so there's no need for a last look at the ring.
+    registers.write<uint32_t>(REGISTER_IMS, INTERRUPT_RECEIVE);
+    return received;
+}
+
+TransmitStatus Intel82540EM::send(uint8_t* buffer, int size, bool wait)
+{
+    if (size <= 0 || size > MAX_ETHERNET_FRAME_SIZE) {
+        ++send_drops;
+        return TransmitInvalid;
+    }
+
+    uint32_t flags { disable_interrupts() };
+
+    if (wait) {
+        wait_for_send_descriptors(1);
+    } else if (get_free_send_descriptors() == 0) {
+        reclaim_send_buffers(); // ITR may be sitting on a TXDW, look for ourselves.
+    }
+
+    if (get_free_send_descriptors() == 0) {
+        ++send_drops;
+        restore_interrupts(flags);
+        return TransmitQueueFull;
+    }
+
+    // The copying path: the frame goes into the descriptor's own buffer.
+    uint8_t* destination { &send_buffers[current_send_buffer * I82540EM_SEND_BUFFER_SIZE] };
+
+    for (int i = 0; i < size; ++i) {
+        destination[i] = buffer[i];
+    }
+
+    TransmitFragment fragment { destination, (uint32_t) size };
+    post_send_fragments(&fragment, 1, nullptr, nullptr, nullptr);
+
+    restore_interrupts(flags);
+    return TransmitSent;
+}
+
+TransmitStatus Intel82540EM::send_fragments(TransmitFragment* fragments, uint16_t fragment_count, TransmitCompletionHandler* handler, void* context,
+                                            bool wait, const TransmitChecksumOffload* offload)
+{
+    TransmitFragment used[I82540EM_MAX_SEND_FRAGMENTS];
+    uint16_t used_fragments { 0 };
+    uint32_t total_size { 0 };
+
+    for (uint16_t i = 0; i < fragment_count; ++i) {
+        if (fragments[i].size == 0) {
+            continue;
+        }
+
+        if (used_fragments == I82540EM_MAX_SEND_FRAGMENTS) {
+            ++send_drops;
+            return TransmitInvalid;
+        }
+
+        used[used_fragments++] = fragments[i];
+        total_size += fragments[i].size;
+    }
+
+    if (used_fragments == 0 || total_size > MAX_ETHERNET_FRAME_SIZE) {
+        ++send_drops;
+        return TransmitInvalid;
+    }
+
+    // Checksum offload costs one extra (context) descriptor.
+    uint16_t needed { (uint16_t) (used_fragments + (offload != nullptr ? 1 : 0)) };
+    uint32_t flags { disable_interrupts() };
+
+    if (wait) {
+        wait_for_send_descriptors(needed);
+    } else if (get_free_send_descriptors() < needed) {
+        reclaim_send_buffers();
+    }
+
+    if (get_free_send_descriptors() < needed) {
+        ++send_drops;
+        restore_interrupts(flags);
+        return TransmitQueueFull;
+    }
+
+    post_send_fragments(used, used_fragments, handler, context, offload);
+
+    restore_interrupts(flags);
+    return TransmitSent;
+}
+
+uint16_t Intel82540EM::get_free_send_descriptors()
+{
+    // TDH == TDT means empty to the NIC, so a completely full ring can't be told apart. Keep one free.
+    return I82540EM_SEND_RING_SIZE - 1 - send_buffers_in_use;
+}
+
+void Intel82540EM::post_send_fragments(TransmitFragment* fragments, uint16_t fragment_count, TransmitCompletionHandler* handler, void* context, const TransmitChecksumOffload* offload)
+{
+    // Expects interrupts off, valid non-empty fragments and enough free descriptors.
+    uint16_t first_descriptor { current_send_buffer };
+    uint16_t last_descriptor { current_send_buffer };
+    uint8_t options { 0 };
+
+    if (offload != nullptr) {
+        SendContextDescriptor* descriptor { (SendContextDescriptor*) &send_descriptors[current_send_buffer] };
+        uint8_t command { SEND_COMMAND_DEXT };
+
+        descriptor->ip_checksum_start = 0;
+        descriptor->ip_checksum_offset = 0;
+        descriptor->ip_checksum_end = 0;
+        descriptor->transport_checksum_start = 0;
+        descriptor->transport_checksum_offset = 0;
+        descriptor->transport_checksum_end = 0; // 0 means up to the end of the frame.
+
+        if (offload->insert_ip_checksum) {
+            descriptor->ip_checksum_start = offload->ip_header_start;
+            descriptor->ip_checksum_offset = offload->ip_checksum_offset;
+            descriptor->ip_checksum_end = offload->ip_header_end;
+            command |= 0x02; // TUCMD.IP: it's IPv4
+            options |= 0x01; // POPTS.IXSM
+        }
+
+        if (offload->insert_transport_checksum) {
+            descriptor->transport_checksum_start = offload->transport_start;
+            descriptor->transport_checksum_offset = offload->transport_checksum_offset;
+            command |= offload->is_tcp ? 0x01 : 0x00; // TUCMD.TCP
+            options |= 0x02; // POPTS.TXSM
+        }
+
+        descriptor->length_type_command = (uint32_t) command << 24; // DTYP 0000: context
+        descriptor->status = 0;
+        descriptor->header_length = 0;
+        descriptor->maximum_segment_size = 0;
+
+        current_send_buffer = (current_send_buffer + 1) & (I82540EM_SEND_RING_SIZE - 1);
+        ++send_buffers_in_use;
+        ++offloaded_frames;
+    }
+
+    for (uint16_t i = 0; i < fragment_count; ++i) {
+        uint8_t command { SEND_COMMAND_IFCS };
+
+        if (i == fragment_count - 1) {
+            command |= SEND_COMMAND_EOP | SEND_COMMAND_RS;
+        }
+
+        if (offload != nullptr) {
+            SendDataDescriptor* descriptor { (SendDataDescriptor*) &send_descriptors[current_send_buffer] };
+
+            descriptor->address = (uint32_t) fragments[i].data;
+            descriptor->length_type_command = fragments[i].size | (0x1 << 20) | ((uint32_t) (command | SEND_COMMAND_DEXT) << 24); // DTYP 0001: data
+            descriptor->status = 0;
+            descriptor->options = i == 0 ? options : 0; // Only looked at in the first data descriptor.
+            descriptor->special = 0;
+        } else {
+            SendDescriptor* descriptor { &send_descriptors[current_send_buffer] };
+
+            descriptor->address = (uint32_t) fragments[i].data;
+            descriptor->length = fragments[i].size;
+            descriptor->checksum_offset = 0;
+            descriptor->command = command;
+            descriptor->status = 0;
+            descriptor->checksum_start = 0;
+            descriptor->special = 0;
+        }
+
+        last_descriptor = current_send_buffer;
+        current_send_buffer = (current_send_buffer + 1) & (I82540EM_SEND_RING_SIZE - 1);
+        ++send_buffers_in_use;
+    }
+
+    send_records[first_descriptor].handler = handler;
+    send_records[first_descriptor].context = context;
+    send_records[first_descriptor].last_descriptor = last_descriptor;
+    ++sent_frames;
+
+    // The descriptors have to be in memory before the NIC hears about them.
+    __asm__ volatile("" : : : "memory");
+    registers.write<uint32_t>(REGISTER_TDT, current_send_buffer);
+}
+
+void Intel82540EM::reclaim_send_buffers()
+{
+    // Only a frame's last descriptor has RS set, so that's where DD shows up.
+    bool has_reclaimed { false };
+
+    while (send_buffers_in_use > 0) {
+        SendRecord* record { &send_records[oldest_send_buffer] };
+        uint16_t last_descriptor { record->last_descriptor };
+
+        if (!(((volatile SendDescriptor*) &send_descriptors[last_descriptor])->status & SEND_STATUS_DD)) {
+            break;
+        }
+
+        if (record->handler != nullptr) {
+            record->handler->on_transmit_complete(record->context);
+        }
+
+        record->handler = nullptr;
+        record->context = nullptr;
+
+        send_buffers_in_use -= ((last_descriptor - oldest_send_buffer) & (I82540EM_SEND_RING_SIZE - 1)) + 1;
+        oldest_send_buffer = (last_descriptor + 1) & (I82540EM_SEND_RING_SIZE - 1);
+        has_reclaimed = true;
+    }
+
+    if (has_reclaimed) {
+        wake_send_waiter();
+    }
+}
+
+void Intel82540EM::wait_for_send_descriptors(uint16_t count)
+{
+    // Expects interrupts off. TXDW reclaims and wakes us, we check once more ourselves in case
+    // we can't sleep here (or ITR is sitting on the interrupt).
+    reclaim_send_buffers();
+
+    while (get_free_send_descriptors() < count) {
+        wait_for_send_completion();
+        reclaim_send_buffers();
+    }
+}
+
+uint16_t Intel82540EM::receive(uint16_t budget)
+{
+    uint16_t frames { 0 };
+    bool has_returned_descriptors { false };
+    uint16_t last_returned { 0 };
+
+    while (frames < budget) {
+        ReceiveDescriptor* descriptor { &receive_descriptors[current_receive_buffer] };
+
+        if (!(((volatile ReceiveDescriptor*) descriptor)->status & RECEIVE_STATUS_DD)) {
+            break;
+        }
+
+        ++frames;
+
+        // Without long packet mode every frame fits one buffer, so pieces without EOP are dropped.
+        if (descriptor->errors & (RECEIVE_ERROR_IPE | RECEIVE_ERROR_TCPE)) {
+            ++checksum_errors;
+        } else if (descriptor->status & RECEIVE_STATUS_EOP) {
+            uint8_t* buffer { (uint8_t*) (uint32_t) descriptor->address };
+            uint32_t size { descriptor->length };
+
+            lent_checksum_status = 0;
+            if (!(descriptor->status & RECEIVE_STATUS_IXSM)) {
+                if (descriptor->status & RECEIVE_STATUS_IPCS) lent_checksum_status |= RECEIVE_CHECKSUM_IP_VERIFIED;
+                if (descriptor->status & RECEIVE_STATUS_TCPCS) lent_checksum_status |= RECEIVE_CHECKSUM_TRANSPORT_VERIFIED;
+            }
+
+            ++received_frames;
+
+            // The buffer is lent to the stack for the duration of the callback.
+            lend_receive_buffer(buffer);
+
+            if (raw_data_handler != nullptr && raw_data_handler->on_raw_data_received(buffer, size)) {
+                send(buffer, size);
+            }
+
+            lent_checksum_status = 0;
+
+            // Somebody kept it, so the descriptor gets a fresh buffer from the pool instead.
+            if (end_receive_loan()) {
+                descriptor->address = (uint32_t) take_pool_buffer();
+            }
+        }
+
+        descriptor->status = 0;
+        descriptor->errors = 0;
+
+        last_returned = current_receive_buffer;
+        has_returned_descriptors = true;
+        current_receive_buffer = (current_receive_buffer + 1) & (I82540EM_RECEIVE_RING_SIZE - 1);
+    }
+
+    // One tail write per batch instead of one per frame (every register access is a VM exit).
+    if (has_returned_descriptors) {
+        __asm__ volatile("" : : : "memory");
+        registers.write<uint32_t>(REGISTER_RDT, last_returned);
+    }
+
+    return frames;
+}
+
+uint64_t Intel82540EM::get_mac_address()
+{
+    return mac_address;
+}
+
+void Intel82540EM::set_ip_address(uint32_t ip)
+{
+    ip_address = ip;
+}
+
+uint32_t Intel82540EM::get_ip_address()
+{
+    return ip_address;
+}
+
+uint16_t Intel82540EM::get_send_ring_size()
+{
+    return I82540EM_SEND_RING_SIZE;
+}
+
+uint32_t Intel82540EM::get_features()
+{
+    return NIC_FEATURE_TRANSMIT_CHECKSUM | NIC_FEATURE_RECEIVE_CHECKSUM;
+}
+
+uint8_t Intel82540EM::get_receive_checksum_status()
+{
+    return lent_checksum_status;
+}
+
+bool Intel82540EM::is_link_up()
+{
+    return (registers.read<uint32_t>(REGISTER_STATUS) & STATUS_LU) != 0;
+}
+
+void Intel82540EM::print_statistics()
+{
+    missed_frames += registers.read<uint32_t>(REGISTER_MPC); // Clears on read.
+
+    printf("Intel 82540EM rings: RX ");
+    printf_int(I82540EM_RECEIVE_RING_SIZE);
+    printf(", TX ");
+    printf_int(I82540EM_SEND_RING_SIZE);
+    printf(is_link_up() ? ", link up" : ", link down");
+    printf("\n  received: ");
+    printf_int(received_frames);
+    printf(", sent: ");
+    printf_int(sent_frames);
+    printf(" (");
+    printf_int(offloaded_frames);
+    printf(" with checksum offload), send drops: ");
+    printf_int(send_drops);
+    printf("\n  interrupts: ");
+    printf_int(interrupts);
+    printf(", polls: ");
+    printf_int(polls);
+    printf(", overruns: ");
+    printf_int(receive_overruns);
+    printf(", missed: ");
+    printf_int(missed_frames);
+    printf(", bad checksums: ");
+    printf_int(checksum_errors);
+    printf("\n  held buffers: ");
+    printf_int(held_buffers);
+    printf(", pool free: ");
+    printf_int(receive_buffer_pool_count);
+    printf(", pool exhausted: ");
+    printf_int(pool_exhausted);
+    printf("\n");
+}
@@ -0,0 +1,199 @@
+#include "checksum.h"
+#include "cpu.h"
+#include "icmp.h"
+#include "terminal.h"
+#include "timer.h"
+
+static uint64_t get_cycles()
+{
+    return Timer::active_timer != nullptr ? Timer::active_timer->get_cycles() : 0;
+}
+
+InternetControlMessageProtocol::InternetControlMessageProtocol(InternetProtocolProvider* backend)
+    : InternetProtocolHandler(backend, INTERNET_PROTOCOL_ICMP)
+{
+    identifier = 0x4C55; // "LU"
+    next_sequence = 0;
+
+    echo_requests = 0;
+    echo_replies_sent = 0;
+    min_turnaround = 0;
+    max_turnaround = 0;
+    total_turnaround = 0;
+
+    echo_requests_sent = 0;
+    echo_replies = 0;
+    min_round_trip = 0;
+    max_round_trip = 0;
+    total_round_trip = 0;
+
+    checksum_errors = 0;
+    other_messages = 0;
+}
+
+InternetControlMessageProtocol::~InternetControlMessageProtocol()
+{
+}
+
+bool InternetControlMessageProtocol::on_internet_protocol_received(uint32_t source_ip, uint32_t destination_ip, PacketBuffer* packet)
+{
+    uint64_t start { get_cycles() };
+    uint32_t size { packet->get_length() };
+
+    if (size < sizeof(InternetControlMessageProtocolMessage)) {
+        return false;
+    }
+
+    InternetControlMessageProtocolMessage* message { (InternetControlMessageProtocolMessage*) packet->get_data() };
+
+    if (internet_checksum(message, size) != 0) {
+        ++checksum_errors;
+        return false;
+    }
+
+    if (message->type == ICMP_ECHO_REPLY) {
+        on_echo_reply(message, size);
+        return false;
+    }
+
+    if (message->type != ICMP_ECHO_REQUEST || message->code != 0) {
+        ++other_messages;
+        return false;
+    }
+
+    ++echo_requests;
+
+    // Only the type changes, so only the type gets added into the checksum again. Identifier,
+    // sequence and payload go back exactly as they came.
+    uint16_t old_word { (uint16_t) (message->type | (message->code << 8)) };
+    message->type = ICMP_ECHO_REPLY;
+    uint16_t new_word { (uint16_t) (message->type | (message->code << 8)) };
+    message->checksum = checksum_update_16(message->checksum, old_word, new_word);
+
+    ++echo_replies_sent;
+
+    uint64_t turnaround { get_cycles() - start };
+
+    if (echo_replies_sent == 1 || turnaround < min_turnaround) {
+        min_turnaround = turnaround;
+    }
+
+    if (turnaround > max_turnaround) {
+        max_turnaround = turnaround;
+    }
+
+    total_turnaround += turnaround;
+    return true;
+}
+
+void InternetControlMessageProtocol::on_echo_reply(InternetControlMessageProtocolMessage* message, uint32_t size)
+{
+    // Only ours carry the timestamp.
+    if (message->identifier != swap_endian_16(identifier) || size < sizeof(InternetControlMessageProtocolMessage) + sizeof(uint64_t)) {
+        ++other_messages;
+        return;
+    }
+
+    uint64_t sent { *(uint64_t*) (message + 1) };
+    uint64_t round_trip { get_cycles() - sent };
+
+    ++echo_replies;
+
+    if (echo_replies == 1 || round_trip < min_round_trip) {
+        min_round_trip = round_trip;
+    }
+
+    if (round_trip > max_round_trip) {
+        max_round_trip = round_trip;
+    }
+
+    total_round_trip += round_trip;
+}
+
+TransmitStatus InternetControlMessageProtocol::send_echo_request(uint32_t destination_ip, uint16_t payload_size)
+{
+    if (PacketBufferPool::active_pool == nullptr || payload_size < sizeof(uint64_t)) {
+        return TransmitInvalid;
+    }
+
+    PacketBuffer* packet { PacketBufferPool::active_pool->allocate() };
+
+    if (packet == nullptr) {
+        return TransmitQueueFull;
+    }
+
+    uint32_t size { sizeof(InternetControlMessageProtocolMessage) + payload_size };
+    InternetControlMessageProtocolMessage* message { (InternetControlMessageProtocolMessage*) packet->put(size) };
+
+    if (message == nullptr) {
+        packet->release();
+        return TransmitInvalid;
+    }
+
+    message->type = ICMP_ECHO_REQUEST;
+    message->code = 0;
+    message->identifier = swap_endian_16(identifier);
+    message->sequence = swap_endian_16(next_sequence++);
+
+    uint8_t* payload { (uint8_t*) (message + 1) };
+
+    for (uint16_t i = sizeof(uint64_t); i < payload_size; ++i) {
+        payload[i] = i;
+    }
+
+    // Stamped last, so the time it takes to build the packet doesn't count.
+    *(uint64_t*) payload = get_cycles();
+
+    message->checksum = 0;
+    message->checksum = internet_checksum(message, size);
+
+    ++echo_requests_sent;
+    return send(destination_ip, packet);
+}
+
+void InternetControlMessageProtocol::print_statistics()
+{
+    Timer* timer { Timer::active_timer };
+
+    printf("ICMP: echo requests ");
+    printf_int(echo_requests);
+    printf(", replies sent ");
+    printf_int(echo_replies_sent);
+    printf(", checksum errors ");
+    printf_int(checksum_errors);
+    printf(", other ");
+    printf_int(other_messages);
+    printf("\n");
+
+    if (timer == nullptr) {
+        return;
+    }
+
+    if (echo_replies_sent > 0) {
+        printf("  turnaround (ns): min ");
+        printf_int((uint32_t) timer->cycles_to_nanoseconds(min_turnaround));
+        printf(", avg ");
+        printf_int((uint32_t) timer->cycles_to_nanoseconds(divide_64(total_turnaround, echo_replies_sent)));
+        printf(", max ");
+        printf_int((uint32_t) timer->cycles_to_nanoseconds(max_turnaround));
+        printf("\n");
+    }
+
+    if (echo_requests_sent > 0) {
+        printf("  pings sent ");
+        printf_int(echo_requests_sent);
+        printf(", answered ");
+        printf_int(echo_replies);
+        printf("\n");
+    }
+
+    if (echo_replies > 0) {
+        printf("  round trip (us): min ");
+        printf_int((uint32_t) timer->cycles_to_microseconds(min_round_trip));
+        printf(", avg ");
+        printf_int((uint32_t) timer->cycles_to_microseconds(divide_64(total_round_trip, echo_replies)));
+        printf(", max ");
+        printf_int((uint32_t) timer->cycles_to_microseconds(max_round_trip));
+        printf("\n");
+    }
+}
@@ -1,6 +1,15 @@
+#include "cpu.h"
 #include "interrupts.h"
 #include "terminal.h"
 
+static const uint32_t MSR_APIC_BASE { 0x1B };
+
+static const uint32_t LOCAL_APIC_ID { 0x020 };
+static const uint32_t LOCAL_APIC_END_OF_INTERRUPT { 0x0B0 };
+static const uint32_t LOCAL_APIC_SPURIOUS_VECTOR { 0x0F0 };
+static const uint32_t LOCAL_APIC_LVT_LINT0 { 0x350 };
+static const uint32_t LOCAL_APIC_LVT_LINT1 { 0x360 };
+
 extern "C" uint32_t handle_interrupt_wrapper(uint8_t interrupt, uint32_t esp)
 {
     return InterruptManager::handle_interrupt(interrupt, esp);
@@ -20,6 +29,16 @@ InterruptHandler::~InterruptHandler()
     }
 }
 
+void InterruptHandler::set_interrupt_number(uint8_t interrupt_number)
+{
+    if (interrupt_manager->handlers[this->interrupt_number] == this) {
+        interrupt_manager->handlers[this->interrupt_number] = 0;
+    }
+
+    this->interrupt_number = interrupt_number;
+    interrupt_manager->handlers[interrupt_number] = this;
+}
+
 uint32_t InterruptHandler::handle_interrupt(uint32_t esp)
 {
     return esp;
@@ -99,6 +118,32 @@ InterruptManager::InterruptManager(uint16_t hardware_interrupt_offset, GlobalDes
     set_interrupt_descriptor_table_entry(hardware_interrupt_offset_value + 0x0E, code_segment, &handle_interrupt_request_0x0e, 0, IDT_INTERRUPT_GATE);
     set_interrupt_descriptor_table_entry(hardware_interrupt_offset_value + 0x0F, code_segment, &handle_interrupt_request_0x0f, 0, IDT_INTERRUPT_GATE);
 
+    set_interrupt_descriptor_table_entry(hardware_interrupt_offset_value + 0x20, code_segment, &handle_interrupt_request_0x20, 0, IDT_INTERRUPT_GATE);
+    set_interrupt_descriptor_table_entry(hardware_interrupt_offset_value + 0x21, code_segment, &handle_interrupt_request_0x21, 0, IDT_INTERRUPT_GATE);
+    set_interrupt_descriptor_table_entry(hardware_interrupt_offset_value + 0x22, code_segment, &handle_interrupt_request_0x22, 0, IDT_INTERRUPT_GATE);
+    set_interrupt_descriptor_table_entry(hardware_interrupt_offset_value + 0x23, code_segment, &handle_interrupt_request_0x23, 0, IDT_INTERRUPT_GATE);
+    set_interrupt_descriptor_table_entry(hardware_interrupt_offset_value + 0x24, code_segment, &handle_interrupt_request_0x24, 0, IDT_INTERRUPT_GATE);
+    set_interrupt_descriptor_table_entry(hardware_interrupt_offset_value + 0x25, code_segment, &handle_interrupt_request_0x25, 0, IDT_INTERRUPT_GATE);
+    set_interrupt_descriptor_table_entry(hardware_interrupt_offset_value + 0x26, code_segment, &handle_interrupt_request_0x26, 0, IDT_INTERRUPT_GATE);
+    set_interrupt_descriptor_table_entry(hardware_interrupt_offset_value + 0x27, code_segment, &handle_interrupt_request_0x27, 0, IDT_INTERRUPT_GATE);
+    set_interrupt_descriptor_table_entry(hardware_interrupt_offset_value + 0x28, code_segment, &handle_interrupt_request_0x28, 0, IDT_INTERRUPT_GATE);
+    set_interrupt_descriptor_table_entry(hardware_interrupt_offset_value + 0x29, code_segment, &handle_interrupt_request_0x29, 0, IDT_INTERRUPT_GATE);
+    set_interrupt_descriptor_table_entry(hardware_interrupt_offset_value + 0x2A, code_segment, &handle_interrupt_request_0x2a, 0, IDT_INTERRUPT_GATE);
+    set_interrupt_descriptor_table_entry(hardware_interrupt_offset_value + 0x2B, code_segment, &handle_interrupt_request_0x2b, 0, IDT_INTERRUPT_GATE);
+    set_interrupt_descriptor_table_entry(hardware_interrupt_offset_value + 0x2C, code_segment, &handle_interrupt_request_0x2c, 0, IDT_INTERRUPT_GATE);
+    set_interrupt_descriptor_table_entry(hardware_interrupt_offset_value + 0x2D, code_segment, &handle_interrupt_request_0x2d, 0, IDT_INTERRUPT_GATE);
+    set_interrupt_descriptor_table_entry(hardware_interrupt_offset_value + 0x2E, code_segment, &handle_interrupt_request_0x2e, 0, IDT_INTERRUPT_GATE);
+    set_interrupt_descriptor_table_entry(hardware_interrupt_offset_value + 0x2F, code_segment, &handle_interrupt_request_0x2f, 0, IDT_INTERRUPT_GATE);
+
+    set_interrupt_descriptor_table_entry(TASK_SWITCH_VECTOR, code_segment, &handle_interrupt_request_0x30, 0, IDT_INTERRUPT_GATE);
+
+    allocated_message_signaled_interrupts = 0;
+    local_apic_id = 0;
+    poll_handler_count = 0;
+    interrupt_depth = 0;
+    is_switch_deferred = false;
+    enable_local_apic();
+
     pic_master_command_port.write(0x11);  // Initialize both master and slave PICs.
     pic_slave_command_port.write(0x11);
 
@@ -136,6 +181,112 @@ uint16_t InterruptManager::get_hardware_interrupt_offset()
     return hardware_interrupt_offset_value;
 }
 
+void InterruptManager::enable_local_apic()
+{
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+
+    if (!(edx & CPU::FEATURE_APIC)) {
+        return;
+    }
+
+    uint64_t apic_base { read_msr(MSR_APIC_BASE) };
+    write_msr(MSR_APIC_BASE, apic_base | (1 << 11)); // Global enable
+
+    local_apic = MemoryMappedRegion((uint32_t) apic_base & 0xFFFFF000, 4096);
+    local_apic.map_uncached();
+
+    local_apic_id = local_apic.read<uint32_t>(LOCAL_APIC_ID) >> 24;
+
+    // Virtual wire mode: the PIC keeps arriving through LINT0 as ExtINT, NMIs through LINT1.
+    local_apic.write<uint32_t>(LOCAL_APIC_LVT_LINT0, 0x700);
+    local_apic.write<uint32_t>(LOCAL_APIC_LVT_LINT1, 0x400);
+
+    // Software enable with spurious interrupts going to 0xFF (interrupt_ignore, which needs no EOI).
+    local_apic.write<uint32_t>(LOCAL_APIC_SPURIOUS_VECTOR, 0x100 | 0xFF);
+}
+
+uint8_t InterruptManager::allocate_interrupt_vector()
+{
+    if (local_apic.get_size() == 0) {
+        return 0;
+    }
+
+    for (uint8_t i = 0; i < MAX_MESSAGE_SIGNALED_INTERRUPTS; ++i) {
+        if (!(allocated_message_signaled_interrupts & (1 << i))) {
+            allocated_message_signaled_interrupts |= 1 << i;
+            return hardware_interrupt_offset_value + MESSAGE_SIGNALED_INTERRUPT_BASE + i;
+        }
+    }
+
+    return 0;
+}
+
+void InterruptManager::free_interrupt_vector(uint8_t vector)
+{
+    uint16_t first_message_signaled_interrupt { (uint16_t) (hardware_interrupt_offset_value + MESSAGE_SIGNALED_INTERRUPT_BASE) };
+
+    if (first_message_signaled_interrupt <= vector && vector < first_message_signaled_interrupt + MAX_MESSAGE_SIGNALED_INTERRUPTS) {
+        allocated_message_signaled_interrupts &= ~(1 << (vector - first_message_signaled_interrupt));
+    }
+}
+
+bool InterruptManager::get_message_signaled_interrupt(uint8_t vector, uint32_t* address, uint32_t* data)
+{
+    if (local_apic.get_size() == 0) {
+        return false;
+    }
+
+    // Physical destination mode, fixed delivery, edge triggered, all aimed at this CPU.
+    *address = 0xFEE00000 | ((uint32_t) local_apic_id << 12);
+    *data = vector;
+    return true;
+}
+
+bool InterruptManager::schedule_poll(PollHandler* handler)
+{
+    // Only called with interrupts off (handlers, or between polls), so the list can't change under us.
+    for (uint8_t i = 0; i < poll_handler_count; ++i) {
+        if (poll_handlers[i] == handler) {
+            return true;
+        }
+    }
+
+    if (poll_handler_count >= MAX_POLL_HANDLERS) {
+        return false;
+    }
+
+    poll_handlers[poll_handler_count++] = handler;
+    return true;
+}
+
+void InterruptManager::run_poll_handlers()
+{
+    for (uint8_t round = 0; round < MAX_POLL_ROUNDS && poll_handler_count > 0; ++round) {
+        // Take the whole list. A handler is off it while it runs, so an interrupt that comes in
+        // meanwhile puts it back on (masked again), rather than finding it there just before
+        // it's dropped with its interrupt masked. The ones that need more go back on too.
+        PollHandler* handlers[MAX_POLL_HANDLERS];
+        uint8_t count { poll_handler_count };
+
+        for (uint8_t i = 0; i < count; ++i) {
+            handlers[i] = poll_handlers[i];
+        }
+
+        poll_handler_count = 0;
+
+        for (uint8_t i = 0; i < count; ++i) {
+            __asm__ volatile("sti" : : : "memory");
+            uint16_t done { handlers[i]->poll(POLL_BUDGET) };
+            __asm__ volatile("cli" : : : "memory");
+
+            if (done >= POLL_BUDGET) {
+                schedule_poll(handlers[i]);
+            }
+        }
+    }
+}
+
 void InterruptManager::activate()
 {
     if (active_interrupt_manager != 0) {
@@ -162,11 +313,18 @@ uint32_t InterruptManager::handle_interrupt(uint8_t interrupt, uint32_t esp)
     return esp;
 }
 
+bool InterruptManager::is_handling_interrupt()
+{
+    return active_interrupt_manager != 0 && active_interrupt_manager->interrupt_depth > 0;
+}
+
 uint32_t InterruptManager::do_handle_interrupt(uint8_t interrupt, uint32_t esp)
 {
+    ++interrupt_depth;
+
     if (handlers[interrupt] != 0) {
         esp = handlers[interrupt]->handle_interrupt(esp);
-    } else if (interrupt != hardware_interrupt_offset_value) {
+    } else if (interrupt != hardware_interrupt_offset_value && interrupt != TASK_SWITCH_VECTOR) {
         char error_msg[] { "UNHANDLED INTERRUPT 0x00" };
         char hex_digits[] { "0123456789ABCDEF" };
         error_msg[22] = hex_digits[(interrupt >> 4) & 0xF];
@@ -174,8 +332,10 @@ uint32_t InterruptManager::do_handle_interrupt(uint8_t interrupt, uint32_t esp)
         printf(error_msg);
     }
 
-    if (interrupt == hardware_interrupt_offset_value) {
-        esp = (uint32_t) task_scheduler->schedule((CPUState*) esp);
+    uint16_t first_message_signaled_interrupt { (uint16_t) (hardware_interrupt_offset_value + MESSAGE_SIGNALED_INTERRUPT_BASE) };
+
+    if (first_message_signaled_interrupt <= interrupt && interrupt < first_message_signaled_interrupt + MAX_MESSAGE_SIGNALED_INTERRUPTS) {
+        local_apic.write<uint32_t>(LOCAL_APIC_END_OF_INTERRUPT, 0);
     }
 
     if (hardware_interrupt_offset_value <= interrupt && interrupt < hardware_interrupt_offset_value + 16) {
@@ -185,5 +345,26 @@ uint32_t InterruptManager::do_handle_interrupt(uint8_t interrupt, uint32_t esp)
         }
     }
 
+    // Tasks switch on every tick, when one blocks, and right away when one was woken while
+    // nothing else was running.
+    bool needs_switch { interrupt == hardware_interrupt_offset_value || interrupt == TASK_SWITCH_VECTOR };
+
+    // We came in on top of the polls, which carry on once we return. Switching now would leave
+    // them half done on the old task's stack, so the outermost interrupt does it when they're through.
+    if (interrupt_depth > 1) {
+        is_switch_deferred = is_switch_deferred || needs_switch;
+        --interrupt_depth;
+        return esp;
+    }
+
+    // Deferred work runs after the EOI, with interrupts back on.
+    run_poll_handlers();
+
+    if (needs_switch || is_switch_deferred || task_scheduler->should_switch()) {
+        is_switch_deferred = false;
+        esp = (uint32_t) task_scheduler->schedule((CPUState*) esp);
+    }
+
+    --interrupt_depth;
     return esp;
 }
@@ -60,6 +60,27 @@ HANDLE_INTERRUPT_REQUEST 0x0c  # Mouse
 HANDLE_INTERRUPT_REQUEST 0x0d  # Math coprocessor
 HANDLE_INTERRUPT_REQUEST 0x0e  # Primary ATA hard disk
 HANDLE_INTERRUPT_REQUEST 0x0f  # Secondary ATA hard disk
+
+# Message signaled interrupts (vectors 0x40-0x4F, handed out to PCI devices at runtime)
+HANDLE_INTERRUPT_REQUEST 0x20
+HANDLE_INTERRUPT_REQUEST 0x21
+HANDLE_INTERRUPT_REQUEST 0x22
+HANDLE_INTERRUPT_REQUEST 0x23
+HANDLE_INTERRUPT_REQUEST 0x24
+HANDLE_INTERRUPT_REQUEST 0x25
+HANDLE_INTERRUPT_REQUEST 0x26
+HANDLE_INTERRUPT_REQUEST 0x27
+HANDLE_INTERRUPT_REQUEST 0x28
+HANDLE_INTERRUPT_REQUEST 0x29
+HANDLE_INTERRUPT_REQUEST 0x2a
+HANDLE_INTERRUPT_REQUEST 0x2b
+HANDLE_INTERRUPT_REQUEST 0x2c
+HANDLE_INTERRUPT_REQUEST 0x2d
+HANDLE_INTERRUPT_REQUEST 0x2e
+HANDLE_INTERRUPT_REQUEST 0x2f
+
+HANDLE_INTERRUPT_REQUEST 0x30  # Task switch (software interrupt, see TASK_SWITCH_VECTOR)
+
 HANDLE_INTERRUPT_REQUEST 0x31  # System call (software interrupt)
 
 # Common interrupt handler bottom half
@@ -0,0 +1,492 @@
+#include "checksum.h"
+#include "cpu.h"
+#include "ipv4.h"
+#include "terminal.h"
+#include "timer.h"
+
+InternetProtocolHandler::InternetProtocolHandler(InternetProtocolProvider* backend, uint8_t protocol)
+{
+    this->backend = backend;
+    this->protocol = protocol;
+
+    if (!backend->register_handler(protocol, this)) {
+        printf_colored("IPv4: no room for another protocol handler\n", VGA_COLOR_RED_ON_BLACK);
+    }
+}
+
+InternetProtocolHandler::~InternetProtocolHandler()
+{
+    backend->unregister_handler(protocol, this);
+}
+
+bool InternetProtocolHandler::on_internet_protocol_received(uint32_t source_ip, uint32_t destination_ip, PacketBuffer* packet)
+{
+    return false;
+}
+
+TransmitStatus InternetProtocolHandler::send(uint32_t destination_ip, PacketBuffer* packet, uint32_t source_ip)
+{
+    return backend->send(destination_ip, protocol, packet, source_ip);
+}
+
+InternetProtocolProvider::InternetProtocolProvider(EthernetFrameProvider* backend, AddressResolutionProtocol* arp, RoutingTable* routing_table, uint32_t subnet_mask)
+    : EthernetFrameHandler(backend, INTERNET_PROTOCOL_ETHER_TYPE)
+{
+    dispatch_table.count = 0;
+
+    this->arp = arp;
+    this->routing_table = routing_table;
+    this->subnet_mask = subnet_mask;
+    next_identification = 0;
+
+    arp->set_subnet_mask(subnet_mask);
+
+    received_packets = 0;
+    delivered_packets = 0;
+    header_errors = 0;
+    checksum_errors = 0;
+    foreign_packets = 0;
+    fragments_dropped = 0;
+    unknown_protocols = 0;
+    sent_packets = 0;
+    send_drops = 0;
+    no_route = 0;
+
+    is_forwarding = false;
+    forwarded_packets = 0;
+    forwarded_unresolved = 0;
+    time_to_live_exceeded = 0;
+    forward_drops = 0;
+    last_forwarded_packets = 0;
+    last_forwarding_report = Timer::active_timer != nullptr ? Timer::active_timer->get_ticks() : 0;
+
+    if (!routing_table->add_interface(this)) {
+        printf_colored("IPv4: too many interfaces for the routing table\n", VGA_COLOR_RED_ON_BLACK);
+    }
+
+    // Our own subnet is right on the link.
+    if (!routing_table->add(backend->get_ip_address() & subnet_mask, RoutingTable::get_prefix_length(subnet_mask), 0, this)) {
+        printf_colored("IPv4: no room for the interface route\n", VGA_COLOR_RED_ON_BLACK);
+    }
+}
+
+InternetProtocolProvider::~InternetProtocolProvider()
+{
+    routing_table->remove_interface(this);
+}
+
+bool InternetProtocolProvider::register_handler(uint8_t protocol, InternetProtocolHandler* handler)
+{
+    for (uint8_t i = 0; i < dispatch_table.count; ++i) {
+        if (dispatch_table.protocols[i] == protocol) {
+            dispatch_table.handlers[i] = handler;
+            return true;
+        }
+    }
+
+    if (dispatch_table.count == MAX_INTERNET_PROTOCOL_HANDLERS) {
+        return false;
+    }
+
+    dispatch_table.protocols[dispatch_table.count] = protocol;
+    dispatch_table.handlers[dispatch_table.count] = handler;
+    ++dispatch_table.count;
+    return true;
+}
+
+void InternetProtocolProvider::unregister_handler(uint8_t protocol, InternetProtocolHandler* handler)
+{
+    for (uint8_t i = 0; i < dispatch_table.count; ++i) {
+        if (dispatch_table.protocols[i] == protocol && dispatch_table.handlers[i] == handler) {
+            --dispatch_table.count;
+            dispatch_table.protocols[i] = dispatch_table.protocols[dispatch_table.count];
+            dispatch_table.handlers[i] = dispatch_table.handlers[dispatch_table.count];
+            return;
+        }
+    }
+}
+
+InternetProtocolHandler* InternetProtocolProvider::find_handler(uint8_t protocol)
+{
+    for (uint8_t i = 0; i < dispatch_table.count; ++i) {
+        if (dispatch_table.protocols[i] == protocol) {
+            return dispatch_table.handlers[i];
+        }
+    }
+
+    return nullptr;
+}
+
+bool InternetProtocolProvider::is_local_destination(uint32_t ip)
+{
+    return ip == backend->get_ip_address() || is_broadcast(ip);
+}
+
+InternetProtocolProvider* InternetProtocolProvider::find_local_interface(uint32_t ip)
+{
+    for (uint8_t i = 0; i < routing_table->get_interface_count(); ++i) {
+        InternetProtocolProvider* interface { routing_table->get_interface(i) };
+
+        if (interface->is_local_destination(ip)) {
+            return interface;
+        }
+    }
+
+    return nullptr;
+}
+
+bool InternetProtocolProvider::is_broadcast(uint32_t ip)
+{
+    // A /32 has no broadcast address of its own, all ones would just be us.
+    return ip == 0xFFFFFFFF
+        || (subnet_mask != 0xFFFFFFFF && ip == ((backend->get_ip_address() & subnet_mask) | ~subnet_mask));
+}
+
+uint16_t InternetProtocolProvider::compute_header_checksum(InternetProtocolV4Header* header, uint32_t header_length)
+{
+    uint16_t saved { header->checksum };
+
+    header->checksum = 0;
+    uint16_t checksum { internet_checksum(header, header_length) };
+    header->checksum = saved;
+
+    return checksum;
+}
+
+uint32_t InternetProtocolProvider::pseudo_header_sum(uint32_t source_ip, uint32_t destination_ip, uint8_t protocol, uint16_t length)
+{
+    // Every field in memory order, the same as checksum_add would read them.
+    return (source_ip & 0xFFFF) + (source_ip >> 16)
+         + (destination_ip & 0xFFFF) + (destination_ip >> 16)
+         + swap_endian_16(protocol)
+         + swap_endian_16(length);
+}
+
+void InternetProtocolProvider::decrease_time_to_live(InternetProtocolV4Header* header)
+{
+    // TTL shares its 16 bit word with the protocol, in memory order that's TTL in the low byte.
+    uint16_t old_word { (uint16_t) (header->time_to_live | (header->protocol << 8)) };
+    --header->time_to_live;
+    uint16_t new_word { (uint16_t) (header->time_to_live | (header->protocol << 8)) };
+
+    header->checksum = checksum_update_16(header->checksum, old_word, new_word);
+}
+
+bool InternetProtocolProvider::on_packet_received(PacketBuffer* packet)
+{
+    ++received_packets;
+
+    if (packet->get_length() < sizeof(InternetProtocolV4Header)) {
+        ++header_errors;
+        return false;
+    }
+
+    InternetProtocolV4Header* header { (InternetProtocolV4Header*) packet->get_data() };
+    uint32_t header_length { header->header_length * 4u };
+    uint32_t total_length { swap_endian_16(header->total_length) };
+
+    if (header->version != 4
+        || header_length < sizeof(InternetProtocolV4Header)
+        || total_length < header_length
+        || total_length > packet->get_length())
+    {
+        ++header_errors;
+        return false;
+    }
+
+    // The NIC may have checked it already, then there's nothing to add up.
+    if (!(backend->get_receive_checksum_status() & RECEIVE_CHECKSUM_IP_VERIFIED)
+        && checksum_finish(checksum_add(header, header_length)) != 0)
+    {
+        ++checksum_errors;
+        return false;
+    }
+
+    if (!is_local_destination(header->destination_ip)) {
+        InternetProtocolProvider* owner { find_local_interface(header->destination_ip) };
+
+        // Another interface's address is still us, it's handed up here like our own. The
+        // broadcast of another attached subnet isn't passed on to it (RFC 2644).
+        if (owner == nullptr && is_forwarding) {
+            packet->trim(total_length);
+            forward(header, packet);
+            return false;
+        }
+
+        if (owner == nullptr || owner->is_broadcast(header->destination_ip)) {
+            ++foreign_packets;
+            return false;
+        }
+    }
+
+    // No reassembly: anything but a whole datagram is dropped.
+    if (swap_endian_16(header->flags_and_offset) & (INTERNET_PROTOCOL_FLAG_MORE_FRAGMENTS | INTERNET_PROTOCOL_FRAGMENT_OFFSET)) {
+        ++fragments_dropped;
+        return false;
+    }
+
+    InternetProtocolHandler* handler { find_handler(header->protocol) };
+
+    if (handler == nullptr) {
+        ++unknown_protocols;
+        return false;
+    }
+
+    // Ethernet pads short frames, the payload ends where the IP header says it does.
+    packet->trim(total_length);
+    packet->pull(header_length);
+
+    ++delivered_packets;
+    uint32_t source_ip { header->source_ip };
+    uint32_t destination_ip { header->destination_ip };
+
+    if (!handler->on_internet_protocol_received(source_ip, destination_ip, packet)) {
+        return false;
+    }
+
+    // The reply goes back in the same buffer: turn the header around. It comes from the address
+    // the request went to (maybe another interface's), ours if that was a broadcast.
+    packet->push(header_length);
+
+    header->destination_ip = source_ip;
+    header->source_ip = is_broadcast(destination_ip) ? backend->get_ip_address() : destination_ip;
+    header->time_to_live = INTERNET_PROTOCOL_DEFAULT_TIME_TO_LIVE;
+    header->checksum = compute_header_checksum(header, header_length);
+
+    ++sent_packets;
+    return true;
+}
+
+void InternetProtocolProvider::forward(InternetProtocolV4Header* header, PacketBuffer* packet)
+{
+    // Multicast (224.0.0.0/4) stays on the link it was sent on.
+    if ((header->destination_ip & 0xF0) == 0xE0) {
+        ++foreign_packets;
+        return;
+    }
+
+    // Dropped without an ICMP time exceeded.
+    if (header->time_to_live <= 1) {
+        ++time_to_live_exceeded;
+        return;
+    }
+
+    Route* route { routing_table->lookup(header->destination_ip) };
+
+    if (route == nullptr) {
+        ++no_route;
+        return;
+    }
+
+    // Two bytes of the header change, so does the checksum, by just that much.
+    decrease_time_to_live(header);
+
+    // The packet is only lent to us. Keeping it asks the receiving NIC for a spare buffer to put
+    // in its ring instead, so the other NIC sends the frame from the same memory it arrived in.
+    // Only when there's none to spare does it get copied.
+    PacketBuffer* kept { packet->retain() };
+
+    if (kept == nullptr) {
+        ++forward_drops;
+        return;
+    }
+
+    // With the neighbour known (the usual case) ARP hands it straight to the card, the Ethernet
+    // header going in the headroom the received one left. The completion gives the buffer back
+    // to the receiving NIC.
+    InternetProtocolProvider* output { route->interface };
+    bool is_unresolved { false };
+    TransmitStatus status { output->transmit(RoutingTable::get_next_hop(route, header->destination_ip), kept, &is_unresolved) };
+
+    if (status == TransmitSent || status == TransmitQueued) {
+        ++forwarded_packets;
+
+        if (is_unresolved) {
+            ++forwarded_unresolved;
+        }
+    } else {
+        ++forward_drops;
+    }
+}
+
+InternetProtocolProvider* InternetProtocolProvider::get_output_interface(uint32_t destination_ip, Route** route)
+{
+    // A broadcast stays on our link, everything else goes where the table says.
+    if (destination_ip == 0xFFFFFFFF) {
+        *route = nullptr;
+        return this;
+    }
+
+    *route = routing_table->lookup(destination_ip);
+    return *route != nullptr ? (*route)->interface : nullptr;
+}
+
+TransmitStatus InternetProtocolProvider::send(uint32_t destination_ip, uint8_t protocol, PacketBuffer* packet, uint32_t source_ip)
+{
+    uint32_t total_length { packet->get_length() + sizeof(InternetProtocolV4Header) };
+
+    if (total_length > INTERNET_PROTOCOL_MTU) {
+        ++send_drops;
+        packet->release();
+        return TransmitInvalid;
+    }
+
+    Route* route { nullptr };
+    InternetProtocolProvider* output { get_output_interface(destination_ip, &route) };
+
+    if (output == nullptr) {
+        ++no_route;
+        packet->release();
+        return TransmitInvalid;
+    }
+
+    InternetProtocolV4Header* header { (InternetProtocolV4Header*) packet->push(sizeof(InternetProtocolV4Header)) };
+
+    if (header == nullptr) {
+        ++send_drops;
+        packet->release();
+        return TransmitInvalid;
+    }
+
+    uint32_t flags { disable_interrupts() };
+    uint16_t identification { next_identification++ };
+    restore_interrupts(flags);
+
+    header->version = 4;
+    header->header_length = sizeof(InternetProtocolV4Header) / 4;
+    header->type_of_service = 0;
+    header->total_length = swap_endian_16(total_length);
+    header->identification = swap_endian_16(identification);
+    header->flags_and_offset = swap_endian_16(INTERNET_PROTOCOL_FLAG_DONT_FRAGMENT);
+    header->time_to_live = INTERNET_PROTOCOL_DEFAULT_TIME_TO_LIVE;
+    header->protocol = protocol;
+    header->source_ip = source_ip != 0 ? source_ip : output->get_ip_address();
+    header->destination_ip = destination_ip;
+    header->checksum = 0;
+    header->checksum = internet_checksum(header, sizeof(InternetProtocolV4Header));
+
+    ++sent_packets;
+
+    if (route == nullptr) {
+        return EthernetFrameHandler::send(0xFFFFFFFFFFFF, packet);
+    }
+
+    return output->transmit(RoutingTable::get_next_hop(route, destination_ip), packet);
+}
+
+TransmitStatus InternetProtocolProvider::transmit(uint32_t next_hop, PacketBuffer* packet, bool* is_unresolved)
+{
+    return arp->send(next_hop, ether_type, packet, is_unresolved);
+}
+
+void InternetProtocolProvider::set_forwarding(bool is_forwarding)
+{
+    this->is_forwarding = is_forwarding;
+}
+
+uint32_t InternetProtocolProvider::get_forwarded_packets()
+{
+    return forwarded_packets;
+}
+
+uint32_t InternetProtocolProvider::get_ip_address()
+{
+    return backend->get_ip_address();
+}
+
+uint32_t InternetProtocolProvider::get_subnet_mask()
+{
+    return subnet_mask;
+}
+
+RoutingTable* InternetProtocolProvider::get_routing_table()
+{
+    return routing_table;
+}
+
+uint32_t InternetProtocolProvider::get_next_hop(uint32_t destination_ip)
+{
+    Route* route { routing_table->lookup(destination_ip) };
+    return route != nullptr ? RoutingTable::get_next_hop(route, destination_ip) : 0;
+}
+
+uint32_t InternetProtocolProvider::get_source_for(uint32_t destination_ip)
+{
+    Route* route { nullptr };
+    InternetProtocolProvider* output { get_output_interface(destination_ip, &route) };
+
+    // Without a route send() drops the packet anyway.
+    return output != nullptr ? output->get_ip_address() : get_ip_address();
+}
+
+uint8_t InternetProtocolProvider::get_receive_checksum_status()
+{
+    return backend->get_receive_checksum_status();
+}
+
+void InternetProtocolProvider::print_statistics()
+{
+    printf("IPv4: received ");
+    printf_int(received_packets);
+    printf(", delivered ");
+    printf_int(delivered_packets);
+    printf(", header errors ");
+    printf_int(header_errors);
+    printf(", checksum errors ");
+    printf_int(checksum_errors);
+    printf(", not ours ");
+    printf_int(foreign_packets);
+    printf(", fragments ");
+    printf_int(fragments_dropped);
+    printf(", unknown protocol ");
+    printf_int(unknown_protocols);
+    printf("\n  sent ");
+    printf_int(sent_packets);
+    printf(", send drops ");
+    printf_int(send_drops);
+    printf(", no route ");
+    printf_int(no_route);
+    printf("\n");
+}
+
+void InternetProtocolProvider::print_forwarding_statistics()
+{
+    Timer* timer { Timer::active_timer };
+
+    if (timer == nullptr) {
+        return;
+    }
+
+    uint32_t flags { disable_interrupts() };
+    uint32_t now { timer->get_ticks() };
+    uint32_t packets { forwarded_packets - last_forwarded_packets };
+    uint32_t elapsed { now - last_forwarding_report };
+
+    last_forwarded_packets = forwarded_packets;
+    last_forwarding_report = now;
+    restore_interrupts(flags);
+
+    if (elapsed == 0) {
+        elapsed = 1;
+    }
+
+    printf("IPv4 forwarding from ");
+    printf_int(get_ip_address() & 0xFF);
+    printf(".");
+    printf_int((get_ip_address() >> 8) & 0xFF);
+    printf(".");
+    printf_int((get_ip_address() >> 16) & 0xFF);
+    printf(".");
+    printf_int(get_ip_address() >> 24);
+    printf(": ");
+    printf_int((uint32_t) divide_64((uint64_t) packets * TIMER_FREQUENCY, elapsed));
+    printf(" pps, forwarded ");
+    printf_int(forwarded_packets);
+    printf(" (");
+    printf_int(forwarded_unresolved);
+    printf(" waited for ARP), TTL exceeded ");
+    printf_int(time_to_live_exceeded);
+    printf(", drops ");
+    printf_int(forward_drops);
+    printf("\n");
+}
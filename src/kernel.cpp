@@ -1,17 +1,30 @@
 #include "am79c973.h"
 #include "arp.h"
+#include "checksum.h"
+#include "cpu.h"
 #include "ethernet_frame.h"
+#include "event_poll.h"
 #include "driver_manager.h"
 #include "gdt.h"
 #include "globals.h"
+#include "i82540em.h"
+#include "icmp.h"
 #include "interrupts.h"
+#include "ipv4.h"
 #include "keyboard.h"
+#include "loopback.h"
 #include "memory_manager.h"
 #include "mouse.h"
+#include "packet_buffer.h"
+#include "packet_generator.h"
 #include "pci.h"
 #include "task_scheduler.h"
+#include "tcp.h"
 #include "terminal.h"
+#include "timer.h"
 #include "types.h"
+#include "udp.h"
+#include "virtio_network.h"
 
 volatile bool tasks_should_stop = false;
 
@@ -48,6 +61,132 @@ void task_donko()
     printf("Donko task stopped.\n");
 }
 
+// Set up by kernel_main when there's something to benchmark, tasks can't take arguments.
+PacketGenerator* packet_generator { nullptr };
+PacketSink* packet_sink { nullptr };
+
+void task_packet_generator()
+{
+    packet_generator->run();
+    packet_generator->print_results();
+    packet_sink->print_results();
+
+    // Tasks can't exit, so block for good. Nothing ever wakes us.
+    disable_interrupts();
+
+    while (true) {
+        TaskScheduler::active_task_scheduler->block_current();
+    }
+}
+
+// UDP echo (RFC 862) on port 7. Datagrams go back out in the buffers they came in.
+#define UDP_ECHO_PORT 7
+#define UDP_ECHO_BATCH 16
+
+UserDatagramProtocolSocket* udp_echo_socket { nullptr };
+EventPoll* udp_echo_events { nullptr };
+
+void task_udp_echo()
+{
+    UserDatagram datagrams[UDP_ECHO_BATCH];
+    PolledEvent event;
+
+    // Edge triggered: we only hear about new datagrams, so the ring is drained every time.
+    udp_echo_events->add(udp_echo_socket, EVENT_READABLE | EVENT_EDGE_TRIGGERED, nullptr);
+
+    while (true) {
+        uint32_t count { udp_echo_socket->receive_batch(datagrams, UDP_ECHO_BATCH) };
+
+        if (count == 0) {
+            udp_echo_events->wait(&event, 1);
+            continue;
+        }
+
+        // Source address and port become the destination as they are.
+        udp_echo_socket->send_batch(datagrams, count);
+    }
+}
+
+// TCP echo on the same port, a few connections at a time.
+#define TCP_ECHO_PORT 7
+#define TCP_ECHO_CONNECTIONS 4
+#define TCP_ECHO_CHUNK 512
+
+TransmissionControlProtocolSocket* tcp_echo_listener { nullptr };
+EventPoll* tcp_echo_events { nullptr };
+
+void task_tcp_echo()
+{
+    uint8_t connection_count { 0 };
+    PolledEvent events[TCP_ECHO_CONNECTIONS + 1];
+    uint8_t buffer[TCP_ECHO_CHUNK];
+
+    // Level triggered, the listener's data is nullptr and a connection's is the connection.
+    tcp_echo_events->add(tcp_echo_listener, EVENT_READABLE, nullptr);
+
+    while (true) {
+        uint32_t count { tcp_echo_events->wait(events, TCP_ECHO_CONNECTIONS + 1) };
+
+        for (uint32_t i = 0; i < count; ++i) {
+            TransmissionControlProtocolSocket* connection { (TransmissionControlProtocolSocket*) events[i].data };
+
+            if (connection == nullptr) {
+                TransmissionControlProtocolSocket* accepted;
+
+                while ((accepted = tcp_echo_listener->accept()) != nullptr) {
+                    // No room for it.
+                    if (connection_count == TCP_ECHO_CONNECTIONS || !tcp_echo_events->add(accepted, EVENT_READABLE, accepted)) {
+                        accepted->close();
+                        continue;
+                    }
+
+                    ++connection_count;
+                }
+
+                continue;
+            }
+
+            // Only take what can be sent back right away, the rest waits in the socket.
+            uint32_t space { connection->get_send_space() };
+            uint32_t received { connection->receive(buffer, space < TCP_ECHO_CHUNK ? space : TCP_ECHO_CHUNK) };
+
+            if (received > 0) {
+                connection->send(buffer, received);
+            }
+
+            if (connection->is_end_of_stream() || connection->get_state() == TcpClosed) {
+                connection->close();
+                --connection_count;
+                continue;
+            }
+
+            // With data left over the send buffer is full, wait for room rather than being told
+            // it's readable over and over.
+            tcp_echo_events->modify(connection, connection->get_receive_available() > 0 ? EVENT_WRITABLE : EVENT_READABLE, connection);
+        }
+    }
+}
+
+// Forwarded pps once a second on each interface, while anything is being forwarded.
+InternetProtocolProvider* forwarding_interfaces[2] { nullptr, nullptr };
+
+void task_forwarding_monitor()
+{
+    uint32_t last_forwarded { 0 };
+
+    while (true) {
+        TaskScheduler::active_task_scheduler->sleep(1000);
+
+        uint32_t forwarded { forwarding_interfaces[0]->get_forwarded_packets() + forwarding_interfaces[1]->get_forwarded_packets() };
+
+        if (forwarded != last_forwarded) {
+            forwarding_interfaces[0]->print_forwarding_statistics();
+            forwarding_interfaces[1]->print_forwarding_statistics();
+            last_forwarded = forwarded;
+        }
+    }
+}
+
 typedef void (*constructor)();
 extern "C" constructor start_ctors;
 extern "C" constructor end_ctors;
@@ -124,6 +263,10 @@ extern "C" void kernel_main(const void* multiboot_structure, uint32_t multiboot_
     printf_hex16(((size_t)allocated      ) & 0xFFFF);
     printf("\n");
 
+    printf("• Setting up packet buffers... ");
+    PacketBufferPool packet_buffer_pool;
+    printf_colored("OK\n", VGA_COLOR_GREEN_ON_BLACK);
+
     printf("• Setting up Task Scheduler... ");
     TaskScheduler task_scheduler;
     // Task task1(&gdt, task_doggo);
@@ -148,6 +291,16 @@ extern "C" void kernel_main(const void* multiboot_structure, uint32_t multiboot_
     driver_manager.register_driver(&keyboard);
     printf_colored("OK\n", VGA_COLOR_GREEN_ON_BLACK);
 
+    printf("• Registering timer... ");
+    Timer timer(&interrupt_manager);
+    driver_manager.register_driver(&timer);
+    printf_colored("OK\n", VGA_COLOR_GREEN_ON_BLACK);
+
+    printf("• Registering loopback device... ");
+    Loopback loopback(&interrupt_manager);
+    driver_manager.register_driver(&loopback);
+    printf_colored("OK\n", VGA_COLOR_GREEN_ON_BLACK);
+
     // Uncomment when you want to enable mouse support
     // printf("• Registering mouse driver... ");
     // MouseDriver mouse(&interrupt_manager);
@@ -167,12 +320,31 @@ extern "C" void kernel_main(const void* multiboot_structure, uint32_t multiboot_
     interrupt_manager.activate();
     printf_colored("OK\n", VGA_COLOR_GREEN_ON_BLACK);
 
+    printf("• Selecting checksum routine... ");
+    checksum_initialize();
+    printf_colored(checksum_get_implementation_name(), VGA_COLOR_GREEN_ON_BLACK);
+    printf("\n");
+    checksum_benchmark();
+
     for (int i = 0; i < 10000000; i++) {
         i++;
     }
 
-    uint8_t num_drivers = driver_manager.get_driver_count();
-    Am79C973* am79c973 = (Am79C973*) driver_manager.get_driver(num_drivers - 1);
+    // Paravirtual beats emulated: virtio-net first, then the e1000, which is a lot faster than the PCnet.
+    NetworkInterfaceController* nic = (VirtioNetwork*) driver_manager.find_driver("virtio-net");
+
+    if (nic == nullptr) {
+        nic = (Intel82540EM*) driver_manager.find_driver("Intel 82540EM");
+    }
+
+    if (nic == nullptr) {
+        nic = (Am79C973*) driver_manager.find_driver("Am79C973");
+    }
+
+    // No card at all: run the stack over the loopback, everything we send comes back to us.
+    if (nic == nullptr) {
+        nic = &loopback;
+    }
 
     auto make_ip = [](uint8_t a, uint8_t b, uint8_t c, uint8_t d) -> uint32_t {
         return ((uint32_t)d << 24) | ((uint32_t)c << 16) | ((uint32_t)b << 8) | (uint32_t)a;
@@ -181,16 +353,114 @@ extern "C" void kernel_main(const void* multiboot_structure, uint32_t multiboot_
     uint32_t device_ip = make_ip(10, 0, 2, 15);   // 10.0.2.15
     uint32_t gateway_ip = make_ip(10, 0, 2, 2);   // 10.0.2.2
 
-    am79c973->set_ip_address(device_ip);
+    nic->set_ip_address(device_ip);
 
-    EthernetFrameProvider ethernet_frame(am79c973);
+    EthernetFrameProvider ethernet_frame(nic);
 
     AddressResolutionProtocol arp(&ethernet_frame);
     arp.resolve(gateway_ip);
 
-    // am79c973->send((uint8_t*) "Hello World", 11);
+    RoutingTable routing_table;
+    InternetProtocolProvider ipv4(&ethernet_frame, &arp, &routing_table, make_ip(255, 255, 255, 0));
+    routing_table.add(0, 0, gateway_ip, &ipv4);
+    InternetControlMessageProtocol icmp(&ipv4);
+
+    UserDatagramProtocolProvider udp(&ipv4);
+    UserDatagramProtocolSocket udp_echo(&udp, UDP_ECHO_PORT);
+    EventPoll udp_events;
+    Task udp_echo_task(&gdt, task_udp_echo);
+
+    udp_echo_socket = &udp_echo;
+    udp_echo_events = &udp_events;
+    task_scheduler.add_task(&udp_echo_task);
+
+    TransmissionControlProtocolProvider tcp(&ipv4);
+    EventPoll tcp_events;
+    Task tcp_echo_task(&gdt, task_tcp_echo);
+
+    tcp_echo_listener = tcp.listen(TCP_ECHO_PORT);
+    tcp_echo_events = &tcp_events;
+
+    if (tcp_echo_listener != nullptr) {
+        task_scheduler.add_task(&tcp_echo_task);
+    }
+
+    // A second card makes us a router between the two links, same kinds of card in the same order.
+    NetworkInterfaceController* second_nic { nullptr };
+    const char* card_names[] { "virtio-net", "Intel 82540EM", "Am79C973" };
+
+    for (uint8_t i = 0; i < 3 && second_nic == nullptr && nic != &loopback; ++i) {
+        Driver* driver { driver_manager.find_driver(card_names[i]) };
+
+        if (driver == nic) {
+            driver = driver_manager.find_driver(card_names[i], driver);
+        }
+
+        second_nic = (NetworkInterfaceController*) driver;
+    }
+
+    Task forwarding_monitor_task(&gdt, task_forwarding_monitor);
+
+    // Lives as long as the card does, like the drivers themselves. All of it or nothing, so a
+    // half set up interface never gets hooked up to the card.
+    MemoryManager* memory { MemoryManager::memory_manager };
+    void* second_ethernet_frame_memory { second_nic != nullptr ? memory->malloc(sizeof(EthernetFrameProvider)) : nullptr };
+    void* second_arp_memory { second_nic != nullptr ? memory->malloc(sizeof(AddressResolutionProtocol)) : nullptr };
+    void* second_ipv4_memory { second_nic != nullptr ? memory->malloc(sizeof(InternetProtocolProvider)) : nullptr };
+
+    if (second_nic != nullptr && (second_ethernet_frame_memory == nullptr || second_arp_memory == nullptr || second_ipv4_memory == nullptr)) {
+        printf_colored("Not enough memory for the second interface, no forwarding\n", VGA_COLOR_RED_ON_BLACK);
+
+        void* allocations[] { second_ethernet_frame_memory, second_arp_memory, second_ipv4_memory };
+
+        for (uint8_t i = 0; i < 3; ++i) {
+            if (allocations[i] != nullptr) {
+                memory->free(allocations[i]);
+            }
+        }
+
+        second_nic = nullptr;
+    }
+
+    if (second_nic != nullptr) {
+        second_nic->set_ip_address(make_ip(10, 0, 3, 1));
+
+        EthernetFrameProvider* second_ethernet_frame { new (second_ethernet_frame_memory) EthernetFrameProvider(second_nic) };
+        AddressResolutionProtocol* second_arp { new (second_arp_memory) AddressResolutionProtocol(second_ethernet_frame) };
+        InternetProtocolProvider* second_ipv4 { new (second_ipv4_memory) InternetProtocolProvider(second_ethernet_frame, second_arp, &routing_table, make_ip(255, 255, 255, 0)) };
+
+        ipv4.set_forwarding(true);
+        second_ipv4->set_forwarding(true);
+
+        forwarding_interfaces[0] = &ipv4;
+        forwarding_interfaces[1] = second_ipv4;
+        task_scheduler.add_task(&forwarding_monitor_task);
+
+        printf("Forwarding between ");
+        printf(nic->get_driver_name());
+        printf(" and ");
+        printf(second_nic->get_driver_name());
+        printf("\n");
+    }
+
+    // Without a card, measure the stack itself: pktgen over the loopback into the sink. It only
+    // starts once everything else is set up, the first tick after add_task switches to it.
+    PacketSink sink(&ethernet_frame);
+    PacketGenerator generator(&ethernet_frame, nic);
+    Task packet_generator_task(&gdt, task_packet_generator);
+
+    if (nic == &loopback) {
+        PacketGeneratorConfiguration configuration { loopback.get_mac_address(), PACKET_GENERATOR_MIN_FRAME_SIZE, 100000, 0, false };
+        generator.configure(&configuration);
+
+        packet_generator = &generator;
+        packet_sink = &sink;
+        task_scheduler.add_task(&packet_generator_task);
+    }
+
+    // nic->send((uint8_t*) "Hello World", 11);
     
-    printf(am79c973->get_driver_name());
+    printf(nic->get_driver_name());
     
     // printf("\n");
     // printf_colored("System initialized successfully!\n", VGA_COLOR_GREEN_ON_BLACK);
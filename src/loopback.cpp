@@ -0,0 +1,267 @@
+#include "cpu.h"
+#include "loopback.h"
+#include "memory_manager.h"
+
+Loopback::Loopback(InterruptManager* interrupt_manager, uint64_t mac_address)
+:   NetworkInterfaceController(interrupt_manager, interrupt_manager->get_hardware_interrupt_offset() + LOOPBACK_INTERRUPT_NUMBER)
+{
+    this->mac_address = mac_address;
+    ip_address = 0;
+
+    queue_head = 0;
+    queue_count = 0;
+    is_delivering = false;
+
+    sent_frames = 0;
+    sent_bytes = 0;
+    received_frames = 0;
+    send_drops = 0;
+    deferred_polls = 0;
+    max_queue_depth = 0;
+
+    // Half the buffers back the queue, the other half replaces the ones the stack holds.
+    memory = MemoryManager::memory_manager->malloc(2 * LOOPBACK_QUEUE_SIZE * LOOPBACK_BUFFER_SIZE + 15);
+    buffers = (uint8_t*) ((((uint32_t) memory) + 15) & ~((uint32_t) 0xF));
+    queue = (QueueEntry*) MemoryManager::memory_manager->malloc(LOOPBACK_QUEUE_SIZE * sizeof(QueueEntry));
+    // All buffers live in the pool, queued frames take theirs from it too. Holding stops short
+    // of the buffers it takes to fill the whole queue.
+    set_receive_buffers(buffers, LOOPBACK_BUFFER_SIZE, 2 * LOOPBACK_QUEUE_SIZE,
+                        (uint8_t**) MemoryManager::memory_manager->malloc(2 * LOOPBACK_QUEUE_SIZE * sizeof(uint8_t*)), 2 * LOOPBACK_QUEUE_SIZE, LOOPBACK_QUEUE_SIZE);
+
+    for (uint16_t i = 0; i < 2 * LOOPBACK_QUEUE_SIZE; ++i) {
+        receive_buffer_pool[receive_buffer_pool_count++] = &buffers[i * LOOPBACK_BUFFER_SIZE];
+    }
+}
+
+Loopback::~Loopback()
+{
+    MemoryManager::memory_manager->free(memory);
+    MemoryManager::memory_manager->free(queue);
+    MemoryManager::memory_manager->free(receive_buffer_pool);
+}
+
+void Loopback::initialize()
+{
+
+}
+
+void Loopback::activate()
+{
+
+}
+
+void Loopback::deactivate()
+{
+
+}
+
+void Loopback::reset()
+{
+
+}
+
+string Loopback::get_driver_name()
+{
+    return "Loopback";
+}
+
+uint32_t Loopback::handle_interrupt(uint32_t esp)
+{
+    // There's no IDT gate for our vector, so this never runs.
+    return esp;
+}
+
+uint16_t Loopback::poll(uint16_t budget)
+{
+    // Polls run with interrupts on, the queue wants them off.
+    uint32_t flags { disable_interrupts() };
+    uint16_t delivered { receive(budget) };
+
+    // Something may have been queued after we came off the list for the last time.
+    if (delivered < budget && queue_count > 0) {
+        delivered = budget;
+    }
+
+    restore_interrupts(flags);
+    return delivered;
+}
+
+TransmitStatus Loopback::enqueue(TransmitFragment* fragments, uint16_t fragment_count, TransmitCompletionHandler* handler, void* context)
+{
+    // Expects interrupts off.
+    uint32_t size { 0 };
+
+    for (uint16_t i = 0; i < fragment_count; ++i) {
+        size += fragments[i].size;
+    }
+
+    if (size == 0 || size > MAX_ETHERNET_FRAME_SIZE) {
+        ++send_drops;
+        return TransmitInvalid;
+    }
+
+    if (queue_count == LOOPBACK_QUEUE_SIZE || receive_buffer_pool_count == 0) {
+        ++send_drops;
+        return TransmitQueueFull;
+    }
+
+    // This copy is the one thing the loopback costs, same as a NIC's DMA would.
+    uint8_t* buffer { take_pool_buffer() };
+    uint32_t offset { 0 };
+
+    for (uint16_t i = 0; i < fragment_count; ++i) {
+        for (uint32_t j = 0; j < fragments[i].size; ++j) {
+            buffer[offset++] = fragments[i].data[j];
+        }
+    }
+
+    QueueEntry* entry { &queue[(queue_head + queue_count) & (LOOPBACK_QUEUE_SIZE - 1)] };
+    entry->buffer = buffer;
+    entry->size = size;
+    entry->handler = handler;
+    entry->context = context;
+
+    ++queue_count;
+    ++sent_frames;
+    sent_bytes += size;
+
+    if (queue_count > max_queue_depth) {
+        max_queue_depth = queue_count;
+    }
+
+    return TransmitSent;
+}
+
+void Loopback::deliver()
+{
+    // Expects interrupts off. Sends from inside a handler land here again, they only queue.
+    if (is_delivering) {
+        return;
+    }
+
+    // Anything over budget goes to the poll list so a reply storm can't keep us here forever.
+    if (receive(POLL_BUDGET) == POLL_BUDGET && queue_count > 0) {
+        ++deferred_polls;
+        interrupt_manager->schedule_poll(this);
+    }
+}
+
+TransmitStatus Loopback::send(uint8_t* buffer, int size, bool wait)
+{
+    if (size <= 0) {
+        ++send_drops;
+        return TransmitInvalid;
+    }
+
+    TransmitFragment fragment { buffer, (uint32_t) size };
+    return send_fragments(&fragment, 1, nullptr, nullptr, wait);
+}
+
+TransmitStatus Loopback::send_fragments(TransmitFragment* fragments, uint16_t fragment_count, TransmitCompletionHandler* handler, void* context,
+                                        bool wait, const TransmitChecksumOffload* offload)
+{
+    // The checksums are never looked at (see get_receive_checksum_status), so offload is free.
+    uint32_t flags { disable_interrupts() };
+
+    TransmitStatus status { enqueue(fragments, fragment_count, handler, context) };
+
+    // A full queue only drains through delivery, so waiting means delivering now.
+    if (status == TransmitQueueFull && wait && !is_delivering) {
+        --send_drops;
+        receive(queue_count);
+        status = enqueue(fragments, fragment_count, handler, context);
+    }
+
+    if (status == TransmitSent) {
+        deliver();
+    }
+
+    restore_interrupts(flags);
+    return status;
+}
+
+uint16_t Loopback::receive(uint16_t budget)
+{
+    // Expects interrupts off, and must not nest: handlers that send only queue.
+    uint16_t frames { 0 };
+    is_delivering = true;
+
+    while (frames < budget && queue_count > 0) {
+        QueueEntry entry { queue[queue_head] };
+
+        queue_head = (queue_head + 1) & (LOOPBACK_QUEUE_SIZE - 1);
+        --queue_count;
+        ++frames;
+        ++received_frames;
+
+        // The sender's memory was done with when we copied it.
+        if (entry.handler != nullptr) {
+            entry.handler->on_transmit_complete(entry.context);
+        }
+
+        lend_receive_buffer(entry.buffer);
+
+        if (raw_data_handler != nullptr && raw_data_handler->on_raw_data_received(entry.buffer, entry.size)) {
+            TransmitFragment fragment { entry.buffer, entry.size };
+            enqueue(&fragment, 1, nullptr, nullptr);
+        }
+
+        if (!end_receive_loan()) {
+            receive_buffer_pool[receive_buffer_pool_count++] = entry.buffer;
+        }
+    }
+
+    is_delivering = false;
+    return frames;
+}
+
+uint64_t Loopback::get_mac_address()
+{
+    return mac_address;
+}
+
+void Loopback::set_ip_address(uint32_t ip)
+{
+    ip_address = ip;
+}
+
+uint32_t Loopback::get_ip_address()
+{
+    return ip_address;
+}
+
+uint16_t Loopback::get_send_ring_size()
+{
+    return LOOPBACK_QUEUE_SIZE;
+}
+
+uint32_t Loopback::get_features()
+{
+    return NIC_FEATURE_TRANSMIT_CHECKSUM | NIC_FEATURE_RECEIVE_CHECKSUM;
+}
+
+uint8_t Loopback::get_receive_checksum_status()
+{
+    return RECEIVE_CHECKSUM_IP_VERIFIED | RECEIVE_CHECKSUM_TRANSPORT_VERIFIED;
+}
+
+void Loopback::print_statistics()
+{
+    printf("Loopback sent: ");
+    printf_int(sent_frames);
+    printf(" (");
+    printf_int(sent_bytes);
+    printf(" bytes), received: ");
+    printf_int(received_frames);
+    printf(", drops: ");
+    printf_int(send_drops);
+    printf("\n  max queue depth: ");
+    printf_int(max_queue_depth);
+    printf(", deferred polls: ");
+    printf_int(deferred_polls);
+    printf(", held buffers: ");
+    printf_int(held_buffers);
+    printf(", pool exhausted: ");
+    printf_int(pool_exhausted);
+    printf("\n");
+}
@@ -0,0 +1,140 @@
+#include "cpu.h"
+#include "mmio.h"
+
+static const uint32_t MSR_MTRR_CAPABILITIES { 0x0FE };
+static const uint32_t MSR_MTRR_PHYSICAL_BASE_0 { 0x200 };
+static const uint32_t MSR_MTRR_DEFAULT_TYPE { 0x2FF };
+
+static const uint64_t MTRR_ENABLE { 1 << 11 };    // Same bit in the default type and mask registers.
+static const uint64_t MTRR_TYPE_UNCACHEABLE { 0x00 };
+static const uint32_t MTRR_MINIMUM_SIZE { 4096 };
+
+// The MTRR mask has to cover every physical address bit the CPU implements.
+static uint64_t get_physical_address_mask()
+{
+    uint32_t eax, ebx, ecx, edx;
+    uint32_t address_bits { 36 };
+
+    cpuid(0x80000000, &eax, &ebx, &ecx, &edx);
+    if (eax >= 0x80000008) {
+        cpuid(0x80000008, &eax, &ebx, &ecx, &edx);
+        address_bits = eax & 0xFF;
+    }
+
+    return ((1ULL << address_bits) - 1) & ~((uint64_t) MTRR_MINIMUM_SIZE - 1);
+}
+
+MemoryMappedRegion::MemoryMappedRegion()
+{
+    this->base = 0;
+    this->size = 0;
+}
+
+MemoryMappedRegion::MemoryMappedRegion(uint32_t base, uint32_t size)
+{
+    this->base = base;
+    this->size = size;
+}
+
+MemoryMappedRegion::~MemoryMappedRegion()
+{
+
+}
+
+bool MemoryMappedRegion::map_uncached()
+{
+    return map_memory_uncached(base, size);
+}
+
+uint32_t MemoryMappedRegion::get_base()
+{
+    return base;
+}
+
+uint32_t MemoryMappedRegion::get_size()
+{
+    return size;
+}
+
+bool map_memory_uncached(uint32_t physical_address, uint32_t size)
+{
+    if (size == 0) {
+        return false;
+    }
+
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+
+    if (!(edx & CPU::FEATURE_MTRR)) {
+        // No MTRRs means the firmware can't have marked the region cacheable either.
+        return true;
+    }
+
+    // MTRR ranges are at least a page and must be naturally aligned powers of two.
+    uint32_t range_size { MTRR_MINIMUM_SIZE };
+    while (range_size < size && range_size != 0) {
+        range_size <<= 1;
+    }
+
+    if (range_size == 0) {
+        return false;
+    }
+
+    uint64_t range_base { physical_address & ~(range_size - 1) };
+    uint64_t physical_address_mask { get_physical_address_mask() };
+    uint64_t range_mask { ~((uint64_t) range_size - 1) & physical_address_mask };
+
+    uint64_t default_type { read_msr(MSR_MTRR_DEFAULT_TYPE) };
+    uint32_t variable_count { (uint32_t) read_msr(MSR_MTRR_CAPABILITIES) & 0xFF };
+    int free_slot { -1 };
+    bool covered_by_any { false };
+
+    for (uint32_t i = 0; i < variable_count; ++i) {
+        uint64_t base { read_msr(MSR_MTRR_PHYSICAL_BASE_0 + 2 * i) };
+        uint64_t mask { read_msr(MSR_MTRR_PHYSICAL_BASE_0 + 2 * i + 1) };
+
+        if (!(mask & MTRR_ENABLE)) {
+            if (free_slot == -1) {
+                free_slot = i;
+            }
+            continue;
+        }
+
+        mask &= physical_address_mask;
+        bool covers_start { (range_base & mask) == (base & mask) };
+        bool covers_end { ((range_base + range_size - 1) & mask) == (base & mask) };
+
+        if (covers_start || covers_end) {
+            covered_by_any = true;
+        }
+
+        // UC always wins when ranges overlap, so an existing UC range covering us is enough.
+        if (covers_start && covers_end && (base & 0xFF) == MTRR_TYPE_UNCACHEABLE) {
+            return true;
+        }
+    }
+
+    if (!covered_by_any && (default_type & 0xFF) == MTRR_TYPE_UNCACHEABLE) {
+        return true;
+    }
+
+    if (free_slot == -1) {
+        return false;
+    }
+
+    // Follow the update sequence from the Intel SDM: caches off and flushed while MTRRs change.
+    uint32_t flags { disable_interrupts() };
+    uint32_t cr0;
+    __asm__ volatile("movl %%cr0, %0" : "=r" (cr0));
+    __asm__ volatile("movl %0, %%cr0\n wbinvd" : : "r" ((cr0 | 0x40000000) & ~0x20000000) : "memory");
+
+    write_msr(MSR_MTRR_DEFAULT_TYPE, default_type & ~MTRR_ENABLE);
+    write_msr(MSR_MTRR_PHYSICAL_BASE_0 + 2 * free_slot, range_base | MTRR_TYPE_UNCACHEABLE);
+    write_msr(MSR_MTRR_PHYSICAL_BASE_0 + 2 * free_slot + 1, range_mask | MTRR_ENABLE);
+    write_msr(MSR_MTRR_DEFAULT_TYPE, default_type);
+
+    __asm__ volatile("wbinvd\n movl %0, %%cr0" : : "r" (cr0) : "memory");
+    restore_interrupts(flags);
+
+    return true;
+}
@@ -0,0 +1,179 @@
+#include "cpu.h"
+#include "nic.h"
+
+NetworkInterfaceController::NetworkInterfaceController(InterruptManager* interrupt_manager, uint8_t interrupt_number)
+    : Driver(interrupt_manager, interrupt_number)
+{
+    raw_data_handler = nullptr;
+    send_waiter = nullptr;
+
+    receive_buffer_region = nullptr;
+    receive_buffer_size = 0;
+    receive_buffer_region_size = 0;
+    receive_buffer_pool = nullptr;
+    receive_buffer_pool_count = 0;
+    receive_buffer_pool_size = 0;
+    receive_buffer_pool_reserve = 0;
+    lent_receive_buffer = nullptr;
+    is_lent_buffer_held = false;
+    held_buffers = 0;
+    pool_exhausted = 0;
+}
+
+NetworkInterfaceController::~NetworkInterfaceController()
+{
+
+}
+
+void NetworkInterfaceController::set_handler(RawDataHandler* raw_data_handler)
+{
+    this->raw_data_handler = raw_data_handler;
+}
+
+void NetworkInterfaceController::set_receive_buffers(uint8_t* buffers, uint32_t buffer_size, uint32_t buffer_count, uint8_t** pool, uint16_t pool_size, uint16_t pool_reserve)
+{
+    receive_buffer_region = buffers;
+    receive_buffer_size = buffer_size;
+    receive_buffer_region_size = buffer_size * buffer_count;
+    receive_buffer_pool = pool;
+    receive_buffer_pool_count = 0;
+    receive_buffer_pool_size = pool_size;
+    receive_buffer_pool_reserve = pool_reserve;
+}
+
+uint8_t* NetworkInterfaceController::get_receive_buffer_start(uint8_t* pointer)
+{
+    uint32_t offset { (uint32_t) (pointer - receive_buffer_region) };
+
+    if (receive_buffer_region == nullptr || pointer < receive_buffer_region || offset >= receive_buffer_region_size) {
+        return nullptr;
+    }
+
+    return receive_buffer_region + (offset / receive_buffer_size) * receive_buffer_size;
+}
+
+void NetworkInterfaceController::lend_receive_buffer(uint8_t* buffer)
+{
+    lent_receive_buffer = buffer;
+    is_lent_buffer_held = false;
+}
+
+bool NetworkInterfaceController::end_receive_loan()
+{
+    lent_receive_buffer = nullptr;
+    return is_lent_buffer_held;
+}
+
+uint8_t* NetworkInterfaceController::take_pool_buffer()
+{
+    // Polls run with interrupts on, and transmit completions refill the pool from the handler.
+    uint32_t flags { disable_interrupts() };
+    uint8_t* buffer { receive_buffer_pool_count > 0 ? receive_buffer_pool[--receive_buffer_pool_count] : nullptr };
+    restore_interrupts(flags);
+
+    return buffer;
+}
+
+bool NetworkInterfaceController::hold_receive_buffer(uint8_t* buffer)
+{
+    if (lent_receive_buffer == nullptr || get_receive_buffer_start(buffer) != lent_receive_buffer) {
+        return false;
+    }
+
+    if (is_lent_buffer_held) {
+        return true;
+    }
+
+    if (receive_buffer_pool_count <= receive_buffer_pool_reserve) {
+        ++pool_exhausted;
+        return false;
+    }
+
+    is_lent_buffer_held = true;
+    ++held_buffers;
+    return true;
+}
+
+void NetworkInterfaceController::release_receive_buffer(uint8_t* buffer)
+{
+    uint8_t* start { get_receive_buffer_start(buffer) };
+
+    if (start == nullptr) {
+        return;
+    }
+
+    // Releases can come from task context, so keep the interrupt handler off the pool meanwhile.
+    uint32_t flags { disable_interrupts() };
+
+    if (start == lent_receive_buffer) {
+        is_lent_buffer_held = false; // Released before the callback even returned.
+    } else if (receive_buffer_pool_count < receive_buffer_pool_size) {
+        receive_buffer_pool[receive_buffer_pool_count++] = start;
+    }
+
+    restore_interrupts(flags);
+}
+
+void NetworkInterfaceController::wait_for_send_completion()
+{
+    if (InterruptManager::is_handling_interrupt()) {
+        return;
+    }
+
+    TaskScheduler* scheduler { TaskScheduler::active_task_scheduler };
+    Task* task { scheduler != nullptr ? scheduler->get_current_task() : nullptr };
+
+    // One sleeper per NIC. Anyone else (boot code, the idle loop, a second sender) just halts
+    // until the next interrupt, which is when space could have come free anyway.
+    if (task != nullptr && send_waiter == nullptr) {
+        send_waiter = task;
+        scheduler->block_current();
+    } else {
+        __asm__ volatile("sti\n hlt\n cli" : : : "memory");
+    }
+}
+
+void NetworkInterfaceController::wake_send_waiter()
+{
+    if (send_waiter != nullptr) {
+        Task* task { send_waiter };
+        send_waiter = nullptr;
+        TaskScheduler::active_task_scheduler->wake(task);
+    }
+}
+
+void TransmitCompletionHandler::on_transmit_complete(void* context)
+{
+
+}
+
+RawDataHandler::RawDataHandler(NetworkInterfaceController* backend)
+{
+    this->backend = backend;
+    backend->set_handler(this);
+}
+
+RawDataHandler::~RawDataHandler()
+{
+    backend->set_handler(nullptr);
+}
+
+bool RawDataHandler::on_raw_data_received(uint8_t* buffer, uint32_t size)
+{
+    return false;
+}
+
+TransmitStatus RawDataHandler::send(uint8_t* buffer, uint32_t size, bool wait)
+{
+    return backend->send(buffer, size, wait);
+}
+
+bool RawDataHandler::hold_buffer(uint8_t* buffer)
+{
+    return backend->hold_receive_buffer(buffer);
+}
+
+void RawDataHandler::release_buffer(uint8_t* buffer)
+{
+    backend->release_receive_buffer(buffer);
+}
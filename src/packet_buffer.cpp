@@ -0,0 +1,247 @@
+#include "cpu.h"
+#include "memory_manager.h"
+#include "packet_buffer.h"
+#include "terminal.h"
+
+PacketBufferPool* PacketBufferPool::active_pool { nullptr };
+
+uint8_t* PacketBuffer::push(uint32_t size)
+{
+    if (get_headroom() < size) {
+        return nullptr;
+    }
+
+    data -= size;
+    length += size;
+    return data;
+}
+
+uint8_t* PacketBuffer::put(uint32_t size)
+{
+    if (get_tailroom() < size) {
+        return nullptr;
+    }
+
+    uint8_t* tail { data + length };
+    length += size;
+    return tail;
+}
+
+uint8_t* PacketBuffer::pull(uint32_t size)
+{
+    if (length < size) {
+        return nullptr;
+    }
+
+    data += size;
+    length -= size;
+    return data;
+}
+
+void PacketBuffer::trim(uint32_t length)
+{
+    if (length < this->length) {
+        this->length = length;
+    }
+}
+
+PacketBuffer* PacketBuffer::retain()
+{
+    uint32_t flags { disable_interrupts() };
+
+    // Our own memory, or a lent buffer the NIC already let us keep.
+    if (lender == nullptr || is_held) {
+        ++reference_count;
+        restore_interrupts(flags);
+        return this;
+    }
+
+    if (lender->hold_receive_buffer(data)) {
+        is_held = true;
+        ++reference_count;
+        restore_interrupts(flags);
+        return this;
+    }
+
+    restore_interrupts(flags);
+
+    // The NIC is out of spare buffers, so this is the one place a packet gets copied.
+    PacketBuffer* copy { pool->allocate(get_headroom() > PACKET_BUFFER_HEADROOM ? get_headroom() : PACKET_BUFFER_HEADROOM) };
+
+    if (copy == nullptr || copy->put(length) == nullptr) {
+        if (copy != nullptr) {
+            copy->release();
+        }
+        return nullptr;
+    }
+
+    for (uint32_t i = 0; i < length; ++i) {
+        copy->data[i] = data[i];
+    }
+
+    pool->count_retain_copy();
+    return copy;
+}
+
+void PacketBuffer::release()
+{
+    uint32_t flags { disable_interrupts() };
+
+    if (--reference_count == 0) {
+        if (lender != nullptr && is_held) {
+            lender->release_receive_buffer(data);
+        }
+
+        pool->free(this);
+    }
+
+    restore_interrupts(flags);
+}
+
+PacketBufferPool::PacketBufferPool(uint16_t buffer_count)
+{
+    this->buffer_count = buffer_count;
+
+    memory = MemoryManager::memory_manager->malloc(buffer_count * PACKET_BUFFER_SIZE + 15);
+    buffer_memory = (uint8_t*) ((((uint32_t) memory) + 15) & ~((uint32_t) 0xF));
+    buffers = (PacketBuffer*) MemoryManager::memory_manager->malloc(buffer_count * sizeof(PacketBuffer));
+
+    free_list = nullptr;
+    free_count = 0;
+    allocations = 0;
+    allocation_failures = 0;
+    retain_copies = 0;
+
+    // Without the memory the pool stays empty, and nobody gets to see it as the active one.
+    if (memory == nullptr || buffers == nullptr) {
+        printf_colored("Packet buffers: not enough memory for the pool\n", VGA_COLOR_RED_ON_BLACK);
+
+        if (memory != nullptr) {
+            MemoryManager::memory_manager->free(memory);
+        }
+
+        if (buffers != nullptr) {
+            MemoryManager::memory_manager->free(buffers);
+        }
+
+        memory = nullptr;
+        buffers = nullptr;
+        this->buffer_count = 0;
+        min_free_count = 0;
+        return;
+    }
+
+    for (uint16_t i = 0; i < buffer_count; ++i) {
+        buffers[i].pool = this;
+        buffers[i].next = free_list;
+        free_list = &buffers[i];
+        ++free_count;
+    }
+
+    min_free_count = free_count;
+    active_pool = this;
+}
+
+PacketBufferPool::~PacketBufferPool()
+{
+    if (active_pool == this) {
+        active_pool = nullptr;
+    }
+
+    if (buffers != nullptr) {
+        MemoryManager::memory_manager->free(buffers);
+        MemoryManager::memory_manager->free(memory);
+    }
+}
+
+PacketBuffer* PacketBufferPool::take()
+{
+    uint32_t flags { disable_interrupts() };
+    PacketBuffer* buffer { free_list };
+
+    if (buffer == nullptr) {
+        ++allocation_failures;
+    } else {
+        free_list = buffer->next;
+        --free_count;
+        ++allocations;
+
+        if (free_count < min_free_count) {
+            min_free_count = free_count;
+        }
+    }
+
+    restore_interrupts(flags);
+    return buffer;
+}
+
+PacketBuffer* PacketBufferPool::allocate(uint32_t headroom)
+{
+    if (headroom > PACKET_BUFFER_SIZE) {
+        return nullptr;
+    }
+
+    PacketBuffer* buffer { take() };
+
+    if (buffer == nullptr) {
+        return nullptr;
+    }
+
+    buffer->start = &buffer_memory[(buffer - buffers) * PACKET_BUFFER_SIZE];
+    buffer->end = buffer->start + PACKET_BUFFER_SIZE;
+    buffer->data = buffer->start + headroom;
+    buffer->length = 0;
+    buffer->reference_count = 1;
+    buffer->lender = nullptr;
+    buffer->is_held = false;
+    buffer->next = nullptr;
+    return buffer;
+}
+
+PacketBuffer* PacketBufferPool::wrap(uint8_t* data, uint32_t length, NetworkInterfaceController* lender)
+{
+    PacketBuffer* buffer { take() };
+
+    if (buffer == nullptr) {
+        return nullptr;
+    }
+
+    // No headroom or tailroom: the memory isn't ours to grow into.
+    buffer->start = data;
+    buffer->end = data + length;
+    buffer->data = data;
+    buffer->length = length;
+    buffer->reference_count = 1;
+    buffer->lender = lender;
+    buffer->is_held = false;
+    buffer->next = nullptr;
+    return buffer;
+}
+
+void PacketBufferPool::free(PacketBuffer* buffer)
+{
+    uint32_t flags { disable_interrupts() };
+
+    buffer->next = free_list;
+    free_list = buffer;
+    ++free_count;
+
+    restore_interrupts(flags);
+}
+
+void PacketBufferPool::print_statistics()
+{
+    printf("Packet buffers free: ");
+    printf_int(free_count);
+    printf("/");
+    printf_int(buffer_count);
+    printf(" (low ");
+    printf_int(min_free_count);
+    printf("), allocations: ");
+    printf_int(allocations);
+    printf(", failures: ");
+    printf_int(allocation_failures);
+    printf(", retain copies: ");
+    printf_int(retain_copies);
+    printf("\n");
+}
@@ -0,0 +1,345 @@
+#include "cpu.h"
+#include "memory_manager.h"
+#include "packet_generator.h"
+#include "terminal.h"
+
+// EthernetFrameProvider takes the EtherType as it goes on the wire.
+static const uint16_t PACKET_GENERATOR_ETHER_TYPE_BIG_ENDIAN { ((PACKET_GENERATOR_ETHER_TYPE & 0xFF) << 8) | (PACKET_GENERATOR_ETHER_TYPE >> 8) };
+
+PacketGenerator::PacketGenerator(EthernetFrameProvider* backend, NetworkInterfaceController* nic)
+{
+    this->backend = backend;
+    this->nic = nic;
+
+    // Frames complete in order, so a slot is free again once the ones sent after it could be too.
+    slot_count = nic->get_send_ring_size() + nic->get_send_queue_size();
+    slots = slot_count > 0 ? (uint8_t*) MemoryManager::memory_manager->malloc(slot_count * MAX_ETHERNET_FRAME_SIZE) : nullptr;
+    next_slot = 0;
+
+    // No slots, nothing to send from: configure() has nothing to fill and run() won't start.
+    if (slots == nullptr) {
+        slot_count = 0;
+    }
+    waiter = nullptr;
+
+    PacketGeneratorConfiguration defaults { 0xFFFFFFFFFFFF, PACKET_GENERATOR_MIN_FRAME_SIZE, 1000, 0, false };
+    configure(&defaults);
+}
+
+PacketGenerator::~PacketGenerator()
+{
+    if (slots != nullptr) {
+        MemoryManager::memory_manager->free(slots);
+    }
+}
+
+void PacketGenerator::configure(const PacketGeneratorConfiguration* configuration)
+{
+    this->configuration = *configuration;
+
+    if (this->configuration.frame_size < PACKET_GENERATOR_MIN_FRAME_SIZE) {
+        this->configuration.frame_size = PACKET_GENERATOR_MIN_FRAME_SIZE;
+    }
+
+    if (this->configuration.frame_size > MAX_ETHERNET_FRAME_SIZE) {
+        this->configuration.frame_size = MAX_ETHERNET_FRAME_SIZE;
+    }
+
+    // Everything but the generator header stays the same from frame to frame, so fill it in once.
+    for (uint16_t i = 0; i < slot_count; ++i) {
+        uint8_t* slot { &slots[i * MAX_ETHERNET_FRAME_SIZE] };
+        EthernetFrameHeader* header { (EthernetFrameHeader*) slot };
+
+        header->destination_mac = this->configuration.destination_mac;
+        header->source_mac = nic->get_mac_address();
+        header->ether_type = PACKET_GENERATOR_ETHER_TYPE_BIG_ENDIAN;
+
+        for (uint16_t j = sizeof(EthernetFrameHeader) + sizeof(PacketGeneratorHeader); j < MAX_ETHERNET_FRAME_SIZE; ++j) {
+            slot[j] = (uint8_t) j;
+        }
+    }
+}
+
+TransmitStatus PacketGenerator::send_frame(uint8_t* slot, uint16_t payload_size)
+{
+    if (configuration.use_driver) {
+        TransmitFragment fragment { slot, (uint32_t) (sizeof(EthernetFrameHeader) + payload_size) };
+        return nic->send_fragments(&fragment, 1, this, nullptr);
+    }
+
+    return backend->send(configuration.destination_mac, PACKET_GENERATOR_ETHER_TYPE_BIG_ENDIAN, slot + sizeof(EthernetFrameHeader), payload_size, this, nullptr);
+}
+
+void PacketGenerator::run()
+{
+    Timer* timer { Timer::active_timer };
+
+    if (timer == nullptr || timer->get_cycles_per_microsecond() == 0) {
+        printf_colored("pktgen: needs a timer with a working TSC\n", VGA_COLOR_RED_ON_BLACK);
+        return;
+    }
+
+    if (slots == nullptr) {
+        printf_colored("pktgen: no memory for the frame slots\n", VGA_COLOR_RED_ON_BLACK);
+        return;
+    }
+
+    sent_frames = 0;
+    completed_frames = 0;
+    sent_bytes = 0;
+    queue_full_retries = 0;
+    invalid_frames = 0;
+
+    uint16_t payload_size { (uint16_t) (configuration.frame_size - sizeof(EthernetFrameHeader)) };
+    uint64_t interval { 0 };
+
+    if (configuration.rate != 0) {
+        interval = divide_64((uint64_t) timer->get_cycles_per_microsecond() * 1000000, configuration.rate);
+    }
+
+    start_cycles = timer->get_cycles();
+    uint64_t deadline { start_cycles };
+
+    for (uint32_t sequence = 0; sequence < configuration.frame_count; ++sequence) {
+        // Pacing against an absolute deadline, so a late frame doesn't push all the others back.
+        if (interval != 0) {
+            while (timer->get_cycles() < deadline);
+            deadline += interval;
+        }
+
+        // All slots in flight: wait for the NIC to finish the oldest one.
+        uint32_t flags { disable_interrupts() };
+
+        while (sent_frames - completed_frames >= slot_count) {
+            wait_for_completion();
+        }
+
+        restore_interrupts(flags);
+
+        uint8_t* slot { &slots[next_slot * MAX_ETHERNET_FRAME_SIZE] };
+        PacketGeneratorHeader* header { (PacketGeneratorHeader*) (slot + sizeof(EthernetFrameHeader)) };
+
+        header->magic = PACKET_GENERATOR_MAGIC;
+        header->sequence = sequence;
+        header->timestamp = timer->get_cycles();
+
+        TransmitStatus status { send_frame(slot, payload_size) };
+
+        // Flat out means keeping the NIC busy, so a full queue is backpressure, not a drop.
+        // With frames of ours in flight their completion is what makes room, otherwise just retry.
+        while (status == TransmitQueueFull) {
+            ++queue_full_retries;
+            flags = disable_interrupts();
+
+            if (sent_frames != completed_frames) {
+                wait_for_completion();
+            }
+
+            restore_interrupts(flags);
+            status = send_frame(slot, payload_size);
+        }
+
+        if (status == TransmitInvalid) {
+            ++invalid_frames;
+            continue;
+        }
+
+        ++sent_frames;
+        sent_bytes += configuration.frame_size;
+        next_slot = (next_slot + 1) % slot_count;
+    }
+
+    end_cycles = timer->get_cycles();
+}
+
+void PacketGenerator::wait_for_completion()
+{
+    // Expects interrupts off, so the completion can't come in between the caller's check and
+    // going to sleep. Returns once at least one more frame completed.
+    TaskScheduler* scheduler { TaskScheduler::active_task_scheduler };
+    Task* task { scheduler != nullptr ? scheduler->get_current_task() : nullptr };
+    uint32_t completed { completed_frames };
+
+    while (completed_frames == completed) {
+        if (task != nullptr) {
+            waiter = task;
+            scheduler->block_current();
+        } else {
+            __asm__ volatile("sti\n hlt\n cli" : : : "memory");
+        }
+    }
+}
+
+void PacketGenerator::on_transmit_complete(void* context)
+{
+    ++completed_frames;
+
+    if (waiter != nullptr) {
+        Task* task { waiter };
+        waiter = nullptr;
+        TaskScheduler::active_task_scheduler->wake(task);
+    }
+}
+
+void PacketGenerator::print_results()
+{
+    Timer* timer { Timer::active_timer };
+
+    if (timer == nullptr) {
+        return;
+    }
+
+    uint32_t elapsed { (uint32_t) timer->cycles_to_microseconds(end_cycles - start_cycles) };
+
+    if (elapsed == 0) {
+        elapsed = 1;
+    }
+
+    printf("pktgen: ");
+    printf_int(sent_frames);
+    printf(" frames of ");
+    printf_int(configuration.frame_size);
+    printf(" bytes in ");
+    printf_int(elapsed);
+    printf(" us through ");
+    printf(configuration.use_driver ? "the driver\n" : "EthernetFrameProvider\n");
+    printf("  ");
+    printf_int((uint32_t) divide_64((uint64_t) sent_frames * 1000000, elapsed));
+    printf(" pps, ");
+    printf_int((uint32_t) divide_64(sent_bytes * 8000, elapsed));
+    printf(" kbit/s, queue full retries: ");
+    printf_int(queue_full_retries);
+    printf(", dropped: ");
+    printf_int(invalid_frames);
+    printf("\n");
+}
+
+PacketSink::PacketSink(EthernetFrameProvider* backend)
+    : EthernetFrameHandler(backend, PACKET_GENERATOR_ETHER_TYPE)
+{
+    reset();
+}
+
+PacketSink::~PacketSink()
+{
+
+}
+
+void PacketSink::reset()
+{
+    received_frames = 0;
+    received_bytes = 0;
+    lost_frames = 0;
+    reordered_frames = 0;
+    foreign_frames = 0;
+    expected_sequence = 0;
+    first_arrival = 0;
+    last_arrival = 0;
+    previous_transit = 0;
+    jitter = 0;
+    total_latency = 0;
+    min_latency = 0;
+    max_latency = 0;
+}
+
+bool PacketSink::on_ethernet_frame_received(uint8_t* payload, uint32_t size)
+{
+    PacketGeneratorHeader* header { (PacketGeneratorHeader*) payload };
+
+    if (size < sizeof(PacketGeneratorHeader) || header->magic != PACKET_GENERATOR_MAGIC || Timer::active_timer == nullptr) {
+        ++foreign_frames;
+        return false;
+    }
+
+    uint64_t arrival { Timer::active_timer->get_cycles() };
+
+    if (received_frames == 0) {
+        first_arrival = arrival;
+    }
+
+    last_arrival = arrival;
+    ++received_frames;
+    received_bytes += size + sizeof(EthernetFrameHeader);
+
+    // Gaps count as lost until (unless) the frame turns up late.
+    if (header->sequence >= expected_sequence) {
+        lost_frames += header->sequence - expected_sequence;
+        expected_sequence = header->sequence + 1;
+    } else {
+        ++reordered_frames;
+
+        if (lost_frames > 0) {
+            --lost_frames;
+        }
+    }
+
+    // Transit includes the offset between the two clocks, but that cancels out in the jitter
+    // (J += (|D| - J) / 16 from RFC 3550, kept multiplied by 16).
+    int64_t transit { (int64_t) (arrival - header->timestamp) };
+
+    if (received_frames > 1) {
+        int64_t difference { transit - previous_transit };
+
+        if (difference < 0) {
+            difference = -difference;
+        }
+
+        jitter += difference - (jitter >> 4);
+    }
+
+    previous_transit = transit;
+
+    uint64_t latency { arrival - header->timestamp };
+    total_latency += latency;
+
+    if (received_frames == 1 || latency < min_latency) {
+        min_latency = latency;
+    }
+
+    if (latency > max_latency) {
+        max_latency = latency;
+    }
+
+    return false;
+}
+
+void PacketSink::print_results()
+{
+    Timer* timer { Timer::active_timer };
+
+    if (timer == nullptr) {
+        return;
+    }
+
+    uint32_t elapsed { (uint32_t) timer->cycles_to_microseconds(last_arrival - first_arrival) };
+
+    if (elapsed == 0) {
+        elapsed = 1;
+    }
+
+    printf("sink: ");
+    printf_int(received_frames);
+    printf(" frames, lost: ");
+    printf_int(lost_frames);
+    printf(", reordered: ");
+    printf_int(reordered_frames);
+    printf(", other: ");
+    printf_int(foreign_frames);
+    printf("\n  ");
+    printf_int((uint32_t) divide_64((uint64_t) received_frames * 1000000, elapsed));
+    printf(" pps, ");
+    printf_int((uint32_t) divide_64(received_bytes * 8000, elapsed));
+    printf(" kbit/s, jitter: ");
+    printf_int((uint32_t) timer->cycles_to_nanoseconds((uint64_t) (jitter >> 4)));
+    printf(" ns\n");
+
+    if (received_frames > 0) {
+        printf("  latency (same clock only) min/avg/max: ");
+        printf_int((uint32_t) timer->cycles_to_nanoseconds(min_latency));
+        printf("/");
+        printf_int((uint32_t) timer->cycles_to_nanoseconds(divide_64(total_latency, received_frames)));
+        printf("/");
+        printf_int((uint32_t) timer->cycles_to_nanoseconds(max_latency));
+        printf(" ns\n");
+    }
+}
@@ -1,8 +1,20 @@
-#include "am79c973.h"
 #include "pci.h"
 
+extern "C" const PeripheralComponentInterconnectDriverEntry start_pci_drivers;
+extern "C" const PeripheralComponentInterconnectDriverEntry end_pci_drivers;
+
+BaseAddressRegister::BaseAddressRegister()
+{
+    prefetchable_bit = false;
+    is_64_bit = false;
+    address = nullptr;
+    size = 0;
+    type = MemoryMapping;
+}
+
 PeripheralComponentInterconnectDeviceDescriptor::PeripheralComponentInterconnectDeviceDescriptor()
 {
+    controller = nullptr;
 
 }
 
@@ -15,7 +27,16 @@ PeripheralComponentInterconnectController::PeripheralComponentInterconnectContro
 : command_port(0xCF8),
   data_port(0xCFC)
 {
-
+    device_count = 0;
+    bus_count = 0;
+    is_enumerated = false;
+    config_access_count = 0;
+    configuration_space_start_bus = 0;
+    configuration_space_end_bus = 0;
+
+    for (int i = 0; i < 256 / 32; ++i) {
+        visited_buses[i] = 0;
+    }
 }
 
 PeripheralComponentInterconnectController::~PeripheralComponentInterconnectController()
@@ -23,8 +44,36 @@ PeripheralComponentInterconnectController::~PeripheralComponentInterconnectContr
 
 }
 
+bool PeripheralComponentInterconnectController::is_memory_mapped(uint16_t bus_number)
+{
+    return configuration_space.get_size() != 0
+        && bus_number >= configuration_space_start_bus
+        && bus_number <= configuration_space_end_bus;
+}
+
+uint32_t PeripheralComponentInterconnectController::get_configuration_offset(uint16_t bus_number, uint16_t device_number, uint16_t function_number, uint32_t register_offset)
+{
+    // Every function gets its own 4 KiB page inside the ECAM window.
+    return ((uint32_t) (bus_number - configuration_space_start_bus) << 20)
+        | ((device_number & 0x1F) << 15)
+        | ((function_number & 0x07) << 12)
+        | (register_offset & 0xFFC);
+}
+
 uint32_t PeripheralComponentInterconnectController::read(uint16_t bus_number, uint16_t device_number, uint16_t function_number, uint32_t register_offset)
 {
+    ++config_access_count;
+
+    if (is_memory_mapped(bus_number)) {
+        uint32_t result { configuration_space.read<uint32_t>(get_configuration_offset(bus_number, device_number, function_number, register_offset)) };
+        return result >> (8 * (register_offset % 4));
+    }
+
+    // The legacy mechanism can only reach the first 256 bytes.
+    if (register_offset >= 0x100) {
+        return 0xFFFFFFFF;
+    }
+
     uint32_t identifier {
         0x1 << 31
         | ((bus_number & 0xFF) << 16)
@@ -39,6 +88,17 @@ uint32_t PeripheralComponentInterconnectController::read(uint16_t bus_number, ui
 
 void PeripheralComponentInterconnectController::write(uint16_t bus_number, uint16_t device_number, uint16_t function_number, uint32_t register_offset, uint32_t value)
 {
+    ++config_access_count;
+
+    if (is_memory_mapped(bus_number)) {
+        configuration_space.write<uint32_t>(get_configuration_offset(bus_number, device_number, function_number, register_offset), value);
+        return;
+    }
+
+    if (register_offset >= 0x100) {
+        return;
+    }
+
     uint32_t identifier {
         0x1 << 31
         | ((bus_number & 0xFF) << 16)
@@ -55,156 +115,554 @@ bool PeripheralComponentInterconnectController::device_has_functions(uint16_t bu
     return read(bus_number, device_number, 0, 0x0E) & (1<<7); // This bit will tells us whether the device has functions.
 }
 
-void PeripheralComponentInterconnectController::select_drivers(DriverManager* driver_manager, InterruptManager* interrupt_manager)
+bool PeripheralComponentInterconnectController::enable_memory_mapped_configuration()
 {
-    for (int bus_number = 0; bus_number < 8; ++bus_number) {
+    AdvancedConfigurationPowerInterface acpi;
+    SystemDescriptionTableHeader* mcfg { acpi.find_table("MCFG") };
 
-        for (int device_number = 0; device_number < 32; ++device_number) {
+    if (mcfg == nullptr) {
+        return false;
+    }
 
-            int num_functions = device_has_functions(bus_number, device_number) ? 8 : 1;
+    // The allocations start after the standard header and 8 reserved bytes.
+    uint32_t entries_offset { sizeof(SystemDescriptionTableHeader) + 8 };
+    uint32_t entry_count { (mcfg->length - entries_offset) / sizeof(MemoryMappedConfigurationAllocation) };
+    MemoryMappedConfigurationAllocation* entries { (MemoryMappedConfigurationAllocation*) ((uint8_t*) mcfg + entries_offset) };
 
-            for (int function_number = 0; function_number < num_functions; ++function_number) {
+    for (uint32_t i = 0; i < entry_count; ++i) {
+        // We only know about segment group 0, and can't reach a window above 4 GiB.
+        if (entries[i].segment_group != 0 || (entries[i].base_address >> 32) != 0) {
+            continue;
+        }
 
-                PeripheralComponentInterconnectDeviceDescriptor device_descriptor = get_device_descriptor(bus_number, device_number, function_number);
-                
-                if (device_descriptor.vendor_id == 0x0000 || device_descriptor.vendor_id == 0xFFFF) {
-                    continue;
-                }
+        // The base address is for bus 0 even when start_bus isn't 0.
+        uint32_t bus_count { (uint32_t) entries[i].end_bus - entries[i].start_bus + 1 };
+        uint32_t base { (uint32_t) entries[i].base_address + ((uint32_t) entries[i].start_bus << 20) };
 
-                for (int bar_number = 0; bar_number < 6; ++bar_number) {
-                    BaseAddressRegister base_address_register = get_base_address_register(bus_number, device_number, function_number, bar_number);
+        if (!map_memory_uncached(base, bus_count << 20)) {
+            continue;
+        }
 
-                    if (base_address_register.address && (base_address_register.type == InputOutput)) {
-                        device_descriptor.port = (uint32_t) base_address_register.address;
-                    }
-                }
+        configuration_space = MemoryMappedRegion(base, bus_count << 20);
+        configuration_space_start_bus = entries[i].start_bus;
+        configuration_space_end_bus = entries[i].end_bus;
+        return true;
+    }
+
+    return false;
+}
+
+bool PeripheralComponentInterconnectController::has_extended_configuration_space()
+{
+    return configuration_space.get_size() != 0;
+}
+
+uint16_t PeripheralComponentInterconnectController::find_extended_capability(uint16_t bus_number, uint16_t device_number, uint16_t function_number, uint16_t capability_id)
+{
+    if (!is_memory_mapped(bus_number)) {
+        return 0;
+    }
+
+    // Extended capabilities form a list starting at 0x100: id in bits 0-15, next offset in bits 20-31.
+    uint16_t offset { 0x100 };
+
+    for (int visited = 0; offset >= 0x100 && visited < 64; ++visited) {
+        uint32_t header { read(bus_number, device_number, function_number, offset) };
+
+        if (header == 0 || header == 0xFFFFFFFF) {
+            return 0;
+        }
+
+        if ((header & 0xFFFF) == capability_id) {
+            return offset;
+        }
+
+        offset = (header >> 20) & 0xFFC;
+    }
+
+    return 0;
+}
+
+uint8_t PeripheralComponentInterconnectController::find_capability(uint16_t bus_number, uint16_t device_number, uint16_t function_number, uint8_t capability_id)
+{
+    // Bit 4 of the status register says whether there is a capability list at all.
+    if (!(read(bus_number, device_number, function_number, 0x06) & (1 << 4))) {
+        return 0;
+    }
+
+    uint8_t offset { (uint8_t) (read(bus_number, device_number, function_number, 0x34) & 0xFC) };
+
+    for (int visited = 0; offset != 0 && visited < 48; ++visited) {
+        uint32_t header { read(bus_number, device_number, function_number, offset) };
+
+        if ((header & 0xFF) == capability_id) {
+            return offset;
+        }
+
+        offset = (header >> 8) & 0xFC;
+    }
+
+    return 0;
+}
+
+uint16_t PeripheralComponentInterconnectController::get_message_signaled_interrupt_count(PeripheralComponentInterconnectDeviceDescriptor* device)
+{
+    uint8_t msix { find_capability(device->bus_number, device->device_number, device->function_number, 0x11) };
+
+    if (msix != 0) {
+        return ((read(device->bus_number, device->device_number, device->function_number, msix) >> 16) & 0x7FF) + 1;
+    }
+
+    return find_capability(device->bus_number, device->device_number, device->function_number, 0x05) != 0 ? 1 : 0;
+}
+
+void PeripheralComponentInterconnectController::enable_bus_mastering(PeripheralComponentInterconnectDeviceDescriptor* device)
+{
+    // Command register: bit 0 is I/O space, bit 1 is memory space, bit 2 is bus master.
+    uint32_t command { read(device->bus_number, device->device_number, device->function_number, 0x04) & 0xFFFF };
+    write(device->bus_number, device->device_number, device->function_number, 0x04, command | 0x7);
+}
 
-                Driver* driver { get_driver(device_descriptor, interrupt_manager) };
+uint16_t PeripheralComponentInterconnectController::enable_message_signaled_interrupts(PeripheralComponentInterconnectDeviceDescriptor* device, InterruptManager* interrupt_manager, uint8_t* vectors, uint16_t vector_count)
+{
+    uint16_t bus_number { device->bus_number };
+    uint16_t device_number { device->device_number };
+    uint16_t function_number { device->function_number };
+    uint32_t address, data;
+    uint16_t enabled { 0 };
+
+    if (vector_count == 0) {
+        return 0;
+    }
 
-                if (driver != 0) {
-                    driver_manager->register_driver(driver);
+    uint8_t msix { find_capability(bus_number, device_number, function_number, 0x11) };
+
+    if (msix != 0) {
+        uint32_t header { read(bus_number, device_number, function_number, msix) };
+        uint16_t table_size { (uint16_t) (((header >> 16) & 0x7FF) + 1) };
+        uint32_t table_location { read(bus_number, device_number, function_number, msix + 4) };
+        BaseAddressRegister* table_bar { &device->base_address_registers[table_location & 0x7] };
+
+        if (table_bar->address != nullptr && table_bar->type == MemoryMapping) {
+            MemoryMappedRegion table((uint32_t) table_bar->address + (table_location & ~0x7), 16 * table_size);
+
+            // Mask the whole function while the table is being written.
+            write(bus_number, device_number, function_number, msix, header | (1 << 30) | (1 << 31));
+
+            for (uint16_t i = 0; i < table_size; ++i) {
+                // Each entry: address low, address high, data, vector control (bit 0 = masked).
+                if (i < vector_count && interrupt_manager->get_message_signaled_interrupt(vectors[i], &address, &data)) {
+                    table.write<uint32_t>(16 * i + 0, address);
+                    table.write<uint32_t>(16 * i + 4, 0);
+                    table.write<uint32_t>(16 * i + 8, data);
+                    table.write<uint32_t>(16 * i + 12, 0);
+                    ++enabled;
+                } else {
+                    table.write<uint32_t>(16 * i + 12, 1);
                 }
-                
-                printf_colored("PCI BUS: ", VGA_COLOR_GREEN_ON_BLACK);
-                printf_hex16(bus_number & 0xFF);
-                
-                printf_colored(", DEVICE: ", VGA_COLOR_GREEN_ON_BLACK);
-                printf_hex16(device_number & 0xFF);
-
-                printf_colored(", FUNCTION: ", VGA_COLOR_GREEN_ON_BLACK);
-                printf_hex16(function_number & 0xFF);
-                
-                printf_colored(" = VENDOR: ", VGA_COLOR_GREEN_ON_BLACK);
-                printf_hex16((device_descriptor.vendor_id & 0xFF00) >> 8);
-                printf_hex16(device_descriptor.vendor_id & 0xFF);
-                
-                printf_colored(", DEVICE: ", VGA_COLOR_GREEN_ON_BLACK);
-                printf_hex16((device_descriptor.device_id & 0xFF00) >> 8);
-                printf_hex16(device_descriptor.device_id & 0xFF);
-
-                printf("\n");
+            }
+
+            write(bus_number, device_number, function_number, msix, (header | (1 << 31)) & ~(1 << 30));
+        }
+    }
+
+    if (enabled == 0) {
+        uint8_t msi { find_capability(bus_number, device_number, function_number, 0x05) };
+
+        if (msi == 0 || !interrupt_manager->get_message_signaled_interrupt(vectors[0], &address, &data)) {
+            return 0;
+        }
+
+        // Message control lives in the upper half of the capability header. We always ask for a
+        // single message (multiple message enable = 0), which also keeps vector allocation simple.
+        uint32_t header { read(bus_number, device_number, function_number, msi) };
+        bool is_64_bit { (header & (1 << 23)) != 0 };
+
+        write(bus_number, device_number, function_number, msi + 4, address);
+
+        if (is_64_bit) {
+            write(bus_number, device_number, function_number, msi + 8, 0);
+            write(bus_number, device_number, function_number, msi + 12, data);
+        } else {
+            write(bus_number, device_number, function_number, msi + 8, data);
+        }
+
+        write(bus_number, device_number, function_number, msi, (header & ~(0x7 << 20)) | (1 << 16));
+        enabled = 1;
+    }
+
+    // Interrupt disable (bit 10) so the device stops asserting its legacy line too.
+    uint32_t command { read(bus_number, device_number, function_number, 0x04) & 0xFFFF };
+    write(bus_number, device_number, function_number, 0x04, command | (1 << 10));
+
+    return enabled;
+}
+
+void PeripheralComponentInterconnectController::enumerate()
+{
+    if (is_enumerated) {
+        return;
+    }
+
+    is_enumerated = true;
+
+    if (enable_memory_mapped_configuration()) {
+        printf("PCI: using ECAM at 0x");
+        printf_hex16((configuration_space.get_base() >> 16) & 0xFFFF);
+        printf_hex16(configuration_space.get_base() & 0xFFFF);
+        printf("\n");
+    }
+
+    // A multi-function host bridge means there are several host controllers, function N owning bus N.
+    uint32_t host_header { read(0, 0, 0, 0x0C) };
+
+    if ((host_header & 0x00800000) == 0) {
+        enumerate_bus(0);
+    } else {
+        for (uint16_t function_number = 0; function_number < 8; ++function_number) {
+            if ((read(0, 0, function_number, 0x00) & 0xFFFF) != 0xFFFF) {
+                enumerate_bus(function_number);
             }
         }
     }
 }
 
+void PeripheralComponentInterconnectController::enumerate_bus(uint16_t bus_number)
+{
+    bus_number &= 0xFF;
+
+    if (visited_buses[bus_number / 32] & (1 << (bus_number % 32))) {
+        return;
+    }
+
+    visited_buses[bus_number / 32] |= 1 << (bus_number % 32);
+    ++bus_count;
+
+    for (uint16_t device_number = 0; device_number < 32; ++device_number) {
+        // Vendor and device ID come back in one dword, an empty slot reads as all ones.
+        uint32_t id { read(bus_number, device_number, 0, 0x00) };
+
+        if ((id & 0xFFFF) == 0xFFFF || (id & 0xFFFF) == 0x0000) {
+            continue;
+        }
+
+        enumerate_function(bus_number, device_number, 0, id);
+
+        PeripheralComponentInterconnectDeviceDescriptor* function_0 { find_device_by_location(bus_number, device_number, 0) };
+
+        if (function_0 == nullptr || (function_0->header_type & 0x80) == 0) {
+            continue;
+        }
+
+        for (uint16_t function_number = 1; function_number < 8; ++function_number) {
+            id = read(bus_number, device_number, function_number, 0x00);
+
+            if ((id & 0xFFFF) != 0xFFFF && (id & 0xFFFF) != 0x0000) {
+                enumerate_function(bus_number, device_number, function_number, id);
+            }
+        }
+    }
+}
+
+void PeripheralComponentInterconnectController::enumerate_function(uint16_t bus_number, uint16_t device_number, uint16_t function_number, uint32_t id)
+{
+    if (device_count >= MAX_PCI_DEVICES) {
+        return;
+    }
+
+    PeripheralComponentInterconnectDeviceDescriptor* device_descriptor { &devices[device_count++] };
+
+    uint32_t class_register { read(bus_number, device_number, function_number, 0x08) };
+    uint32_t header_register { read(bus_number, device_number, function_number, 0x0C) };
+    uint32_t interrupt_register { read(bus_number, device_number, function_number, 0x3C) };
+
+    device_descriptor->controller = this;
+    device_descriptor->bus_number = bus_number;
+    device_descriptor->device_number = device_number;
+    device_descriptor->function_number = function_number;
+
+    device_descriptor->vendor_id = id & 0xFFFF;
+    device_descriptor->device_id = id >> 16;
+
+    device_descriptor->revision_id = class_register & 0xFF;
+    device_descriptor->programming_interface = (class_register >> 8) & 0xFF;
+    device_descriptor->subclass = (class_register >> 16) & 0xFF;
+    device_descriptor->class_code = (class_register >> 24) & 0xFF;
+
+    device_descriptor->header_type = (header_register >> 16) & 0xFF;
+    device_descriptor->interrupt_number = interrupt_register & 0xFF;
+    device_descriptor->port = 0;
+
+    int max_bars = 6 - (4 * (device_descriptor->header_type & 0x7F));
+
+    // Turn decoding off once for the whole function instead of once per BAR.
+    uint32_t command { read(bus_number, device_number, function_number, 0x04) & 0xFFFF };
+    write(bus_number, device_number, function_number, 0x04, command & ~0x3);
+
+    for (int bar_number = 0; bar_number < max_bars; ++bar_number) {
+        BaseAddressRegister base_address_register { probe_base_address_register(bus_number, device_number, function_number, bar_number, max_bars) };
+        device_descriptor->base_address_registers[bar_number] = base_address_register;
+
+        if (base_address_register.address && (base_address_register.type == InputOutput)) {
+            device_descriptor->port = (uint32_t) base_address_register.address;
+        }
+
+        if (base_address_register.address && base_address_register.type == MemoryMapping && !base_address_register.prefetchable_bit) {
+            // Device registers must never sit in the cache (reads have side effects).
+            map_memory_uncached((uint32_t) base_address_register.address, base_address_register.size);
+        }
+
+        if (base_address_register.is_64_bit) {
+            ++bar_number; // The next slot holds the upper half of this address.
+        }
+    }
+
+    write(bus_number, device_number, function_number, 0x04, command);
+
+    // PCI-to-PCI bridge: everything behind it lives on its secondary bus.
+    if ((device_descriptor->header_type & 0x7F) == 0x01 && device_descriptor->class_code == 0x06 && device_descriptor->subclass == 0x04) {
+        uint32_t bus_register { read(bus_number, device_number, function_number, 0x18) };
+        uint16_t secondary_bus { (uint16_t) ((bus_register >> 8) & 0xFF) };
+
+        if (secondary_bus != 0) {
+            enumerate_bus(secondary_bus);
+        }
+    }
+}
+
+void PeripheralComponentInterconnectController::select_drivers(DriverManager* driver_manager, InterruptManager* interrupt_manager)
+{
+    enumerate();
+
+    for (uint16_t i = 0; i < device_count; ++i) {
+        Driver* driver { get_driver(&devices[i], interrupt_manager) };
+
+        if (driver != 0) {
+            driver_manager->register_driver(driver);
+        }
+    }
+
+    printf_colored("PCI: ", VGA_COLOR_GREEN_ON_BLACK);
+    printf_int(device_count);
+    printf(" functions on ");
+    printf_int(bus_count);
+    printf(" buses, ");
+    printf_int(config_access_count);
+    printf(" config accesses\n");
+}
+
 BaseAddressRegister PeripheralComponentInterconnectController::get_base_address_register(uint16_t bus_number, uint16_t device_number, uint16_t function_number, uint16_t bar_number)
 {
-    BaseAddressRegister result;
-    
     uint32_t bar_type { read(bus_number, device_number, function_number, 0x0E) & 0x7F };
-    int max_bars { 6 - (4 * bar_type) };
+    int max_bars = 6 - (4 * bar_type);
+
+    // Decoding has to be off while we probe, otherwise the device briefly claims whatever
+    // address the all-ones pattern points to.
+    uint32_t command { read(bus_number, device_number, function_number, 0x04) & 0xFFFF };
+    write(bus_number, device_number, function_number, 0x04, command & ~0x3);
+
+    BaseAddressRegister result { probe_base_address_register(bus_number, device_number, function_number, bar_number, max_bars) };
+
+    write(bus_number, device_number, function_number, 0x04, command);
+    
+    return result;
+}
+
+// Expects the caller to have turned off I/O and memory decoding in the command register.
+BaseAddressRegister PeripheralComponentInterconnectController::probe_base_address_register(uint16_t bus_number, uint16_t device_number, uint16_t function_number, uint16_t bar_number, int max_bars)
+{
+    BaseAddressRegister result;
 
     if (bar_number >= max_bars) {
         return result;
     }
     
-    uint32_t bar_value { read(bus_number, device_number, function_number, 0x10 + 4 * bar_number) };
+    uint32_t bar_offset { 0x10 + 4 * (uint32_t) bar_number };
+    uint32_t bar_value { read(bus_number, device_number, function_number, bar_offset) };
 
     result.type = (bar_value & 0x1) ? InputOutput : MemoryMapping;
+
+    // An unassigned BAR isn't worth the three extra config cycles of a size probe.
+    if (bar_value == 0) {
+        return result;
+    }
+
+    // Writing all ones makes the device hand back a mask of the address bits it actually decodes.
+    write(bus_number, device_number, function_number, bar_offset, 0xFFFFFFFF);
+    uint32_t size_mask { read(bus_number, device_number, function_number, bar_offset) };
+    write(bus_number, device_number, function_number, bar_offset, bar_value);
     
     if (result.type == MemoryMapping) {
 
-        // To be implemented in the future.
+        result.prefetchable_bit = (bar_value & 0x8) != 0;
+        uint32_t address_high { 0 };
         
         switch ((bar_value >> 1) & 0x3)
         {
-            
             case 0: // 32 Bit Mode
                 break;
-            case 1: // 20 Bit Mode
+            case 1: // 20 Bit Mode (legacy, below 1 MiB)
+                size_mask |= 0xFFF00000;
                 break;
             case 2: // 64 Bit Mode
+                if (bar_number + 1 < max_bars) {
+                    result.is_64_bit = true;
+                    address_high = read(bus_number, device_number, function_number, bar_offset + 4);
+
+                    write(bus_number, device_number, function_number, bar_offset + 4, 0xFFFFFFFF);
+                    uint32_t size_mask_high { read(bus_number, device_number, function_number, bar_offset + 4) };
+                    write(bus_number, device_number, function_number, bar_offset + 4, address_high);
+
+                    if (size_mask_high != 0xFFFFFFFF) {
+                        size_mask = 0; // Larger than 4 GiB, which we can't represent (or reach).
+                    }
+                }
                 break;
         }
+
+        size_mask &= ~0xF;
+        result.size = ~size_mask + 1;
+
+        // Without PAE anything above 4 GiB is unreachable, so leave the address empty.
+        if (address_high == 0 && size_mask != 0) {
+            result.address = (uint8_t*) (bar_value & ~0xF);
+        } else {
+            result.size = 0;
+        }
         
     } else {
         result.address = (uint8_t*) (bar_value & ~0x3);
         result.prefetchable_bit = false;
+        result.size = (~(size_mask & ~0x3) + 1) & 0xFFFF;
+    }
+
+    if (size_mask == 0) {
+        result.address = nullptr;
+        result.size = 0;
     }
     
     return result;
 }
 
-Driver* PeripheralComponentInterconnectController::get_driver(PeripheralComponentInterconnectDeviceDescriptor device_descriptor, InterruptManager* interrupt_manager)
+Driver* PeripheralComponentInterconnectController::get_driver(PeripheralComponentInterconnectDeviceDescriptor* device_descriptor, InterruptManager* interrupt_manager)
 {
-    Driver* driver = nullptr;
-
-    switch (device_descriptor.vendor_id) {
-        case 0x1022: // AMD
-            switch(device_descriptor.device_id) {
-                case 0x2000: // AM79C973 (AMD PCnet-PCI II)
-                    driver = (Am79C973*) MemoryManager::memory_manager->malloc(sizeof(Am79C973));
-                    if (driver != nullptr) {
-                        new (driver) Am79C973(&device_descriptor, interrupt_manager);
-                    }
-                    printf("AMD am79c973 ");
-                    return driver;
-                    break;
+    for (const PeripheralComponentInterconnectDriverEntry* entry = &start_pci_drivers; entry != &end_pci_drivers; ++entry) {
+        for (uint32_t i = 0; i < entry->match_count; ++i) {
+            if (!entry->matches[i].matches(device_descriptor)) {
+                continue;
             }
-            break;
 
-        case 0x8086: // Intel
-            switch(device_descriptor.device_id) {
-                case 0x100E: // 82540EM Gigabit Ethernet Controller
-                    printf("Intel 82540EM ");
-                    break;
-            }
-            break;
-    }
-    
-    
-    switch (device_descriptor.class_code) {
-        case 0x03: // graphics
-            switch(device_descriptor.subclass) {
-                case 0x00: // VGA
-                    printf("VGA ");
-                    break;
+            Driver* driver { entry->probe(device_descriptor, interrupt_manager) };
+
+            if (driver != nullptr) {
+                return driver;
             }
-            break;
+
+            break; // This driver declined the device, give the next one a chance.
+        }
     }
     
-    return 0;
+    return nullptr;
 }
 
 PeripheralComponentInterconnectDeviceDescriptor PeripheralComponentInterconnectController::get_device_descriptor(uint16_t bus_number, uint16_t device_number, uint16_t function_number)
 {
     PeripheralComponentInterconnectDeviceDescriptor device_descriptor;
 
-    device_descriptor.interrupt_number = read(bus_number, device_number, function_number, 0x3c);
+    device_descriptor.controller = this;
+    device_descriptor.interrupt_number = read(bus_number, device_number, function_number, 0x3c) & 0xFF;
     
     device_descriptor.bus_number = bus_number;
     device_descriptor.device_number = device_number;
     device_descriptor.function_number = function_number;
     
-    device_descriptor.vendor_id = read(bus_number, device_number, function_number, 0x00);
-    device_descriptor.device_id = read(bus_number, device_number, function_number, 0x02);
+    uint32_t id { read(bus_number, device_number, function_number, 0x00) };
+    device_descriptor.vendor_id = id & 0xFFFF;
+    device_descriptor.device_id = id >> 16;
 
-    device_descriptor.class_code = read(bus_number, device_number, function_number, 0x0b);
-    device_descriptor.subclass = read(bus_number, device_number, function_number, 0x0a);
-    device_descriptor.programming_interface = read(bus_number, device_number, function_number, 0x09);
+    uint32_t class_register { read(bus_number, device_number, function_number, 0x08) };
+    device_descriptor.class_code = (class_register >> 24) & 0xFF;
+    device_descriptor.subclass = (class_register >> 16) & 0xFF;
+    device_descriptor.programming_interface = (class_register >> 8) & 0xFF;
+    device_descriptor.revision_id = class_register & 0xFF;
 
-    device_descriptor.revision_id = read(bus_number, device_number, function_number, 0x08);
+    device_descriptor.header_type = read(bus_number, device_number, function_number, 0x0E) & 0xFF;
     
     return device_descriptor;
 }
+
+uint16_t PeripheralComponentInterconnectController::get_device_count()
+{
+    return device_count;
+}
+
+PeripheralComponentInterconnectDeviceDescriptor* PeripheralComponentInterconnectController::get_device(uint16_t index)
+{
+    if (index >= device_count) {
+        return nullptr;
+    }
+    return &devices[index];
+}
+
+PeripheralComponentInterconnectDeviceDescriptor* PeripheralComponentInterconnectController::find_device(uint16_t vendor_id, uint16_t device_id, PeripheralComponentInterconnectDeviceDescriptor* after)
+{
+    uint16_t start { (uint16_t) (after == nullptr ? 0 : (after - devices) + 1) };
+
+    for (uint16_t i = start; i < device_count; ++i) {
+        if (devices[i].vendor_id == vendor_id && devices[i].device_id == device_id) {
+            return &devices[i];
+        }
+    }
+    return nullptr;
+}
+
+PeripheralComponentInterconnectDeviceDescriptor* PeripheralComponentInterconnectController::find_device_by_class(uint8_t class_code, uint8_t subclass, PeripheralComponentInterconnectDeviceDescriptor* after)
+{
+    uint16_t start { (uint16_t) (after == nullptr ? 0 : (after - devices) + 1) };
+
+    for (uint16_t i = start; i < device_count; ++i) {
+        if (devices[i].class_code == class_code && devices[i].subclass == subclass) {
+            return &devices[i];
+        }
+    }
+    return nullptr;
+}
+
+PeripheralComponentInterconnectDeviceDescriptor* PeripheralComponentInterconnectController::find_device_by_location(uint16_t bus_number, uint16_t device_number, uint16_t function_number)
+{
+    for (uint16_t i = 0; i < device_count; ++i) {
+        if (devices[i].bus_number == bus_number
+            && devices[i].device_number == device_number
+            && devices[i].function_number == function_number) {
+            return &devices[i];
+        }
+    }
+    return nullptr;
+}
+
+uint32_t PeripheralComponentInterconnectController::get_config_access_count()
+{
+    return config_access_count;
+}
+
+void PeripheralComponentInterconnectController::print_devices()
+{
+    for (uint16_t i = 0; i < device_count; ++i) {
+        printf_colored("PCI BUS: ", VGA_COLOR_GREEN_ON_BLACK);
+        printf_hex16(devices[i].bus_number & 0xFF);
+        
+        printf_colored(", DEVICE: ", VGA_COLOR_GREEN_ON_BLACK);
+        printf_hex16(devices[i].device_number & 0xFF);
+
+        printf_colored(", FUNCTION: ", VGA_COLOR_GREEN_ON_BLACK);
+        printf_hex16(devices[i].function_number & 0xFF);
+        
+        printf_colored(" = VENDOR: ", VGA_COLOR_GREEN_ON_BLACK);
+        printf_hex16(devices[i].vendor_id);
+        
+        printf_colored(", DEVICE: ", VGA_COLOR_GREEN_ON_BLACK);
+        printf_hex16(devices[i].device_id);
+
+        printf("\n");
+    }
+}
@@ -0,0 +1,369 @@
+#include "cpu.h"
+#include "ipv4.h"
+#include "memory_manager.h"
+#include "routing.h"
+#include "terminal.h"
+
+// The trie works on host order keys, so bit 0 is the first bit on the wire.
+static inline uint32_t prefix_mask(uint8_t length)
+{
+    return length == 0 ? 0 : 0xFFFFFFFF << (32 - length);
+}
+
+static inline uint8_t get_bit(uint32_t key, uint8_t index)
+{
+    return (key >> (31 - index)) & 1;
+}
+
+static uint8_t common_prefix_length(uint32_t a, uint32_t b, uint8_t limit)
+{
+    uint32_t difference { a ^ b };
+    uint8_t length { 0 };
+
+    while (length < limit && get_bit(difference, length) == 0) {
+        ++length;
+    }
+
+    return length;
+}
+
+static void print_ip(uint32_t ip)
+{
+    for (uint8_t i = 0; i < 4; ++i) {
+        printf_int((ip >> (i * 8)) & 0xFF);
+
+        if (i < 3) {
+            printf(".");
+        }
+    }
+}
+
+RoutingTable::RoutingTable()
+{
+    uint32_t capacity { 2 * ROUTING_TABLE_MAX_ROUTES };
+    nodes = (Node*) MemoryManager::memory_manager->malloc(capacity * sizeof(Node));
+    free_nodes = nullptr;
+
+    if (nodes == nullptr) {
+        printf_colored("Routing: no memory for the table\n", VGA_COLOR_RED_ON_BLACK);
+    } else {
+        for (uint32_t i = 0; i < capacity; ++i) {
+            free_node(&nodes[i]);
+        }
+    }
+
+    root = nullptr;
+    generation = 1;
+    route_count = 0;
+    node_count = 0;
+
+    for (uint16_t i = 0; i < ROUTE_CACHE_SIZE; ++i) {
+        cache[i].generation = 0;
+    }
+
+    interface_count = 0;
+
+    lookups = 0;
+    cache_hits = 0;
+    no_route = 0;
+}
+
+RoutingTable::~RoutingTable()
+{
+    if (nodes != nullptr) {
+        MemoryManager::memory_manager->free(nodes);
+    }
+}
+
+RoutingTable::Node* RoutingTable::allocate_node(uint32_t key, uint8_t length)
+{
+    Node* node { free_nodes };
+
+    if (node == nullptr) {
+        return nullptr;
+    }
+
+    free_nodes = node->children[0];
+    ++node_count;
+
+    node->key = key & prefix_mask(length);
+    node->length = length;
+    node->has_route = false;
+    node->children[0] = nullptr;
+    node->children[1] = nullptr;
+    return node;
+}
+
+void RoutingTable::free_node(Node* node)
+{
+    // The free list goes through the first child.
+    node->has_route = false;
+    node->children[0] = free_nodes;
+    free_nodes = node;
+}
+
+bool RoutingTable::add(uint32_t destination, uint8_t prefix_length, uint32_t gateway, InternetProtocolProvider* interface)
+{
+    if (nodes == nullptr || prefix_length > 32) {
+        return false;
+    }
+
+    uint32_t flags { disable_interrupts() };
+
+    uint32_t key { swap_endian_32(destination) & prefix_mask(prefix_length) };
+    Node** link { &root };
+    Node* target { nullptr };
+
+    // Every split takes at most two nodes, check for both before touching the trie.
+    if (route_count == ROUTING_TABLE_MAX_ROUTES || 2 * ROUTING_TABLE_MAX_ROUTES - node_count < 2) {
+        restore_interrupts(flags);
+        return false;
+    }
+
+    while (target == nullptr) {
+        Node* node { *link };
+
+        if (node == nullptr) {
+            target = allocate_node(key, prefix_length);
+            *link = target;
+            break;
+        }
+
+        uint8_t limit { node->length < prefix_length ? node->length : prefix_length };
+        uint8_t common { common_prefix_length(node->key, key, limit) };
+
+        if (common == node->length && common == prefix_length) {
+            target = node;
+        } else if (common == node->length) {
+            // The node's prefix covers ours, keep going down.
+            link = &node->children[get_bit(key, node->length)];
+        } else if (common == prefix_length) {
+            // Ours covers the node's: it goes right above it.
+            target = allocate_node(key, prefix_length);
+            target->children[get_bit(node->key, prefix_length)] = node;
+            *link = target;
+        } else {
+            // They part ways somewhere in the middle, a fork takes over where they do.
+            Node* fork { allocate_node(key, common) };
+            target = allocate_node(key, prefix_length);
+
+            fork->children[get_bit(node->key, common)] = node;
+            fork->children[get_bit(key, common)] = target;
+            *link = fork;
+        }
+    }
+
+    if (!target->has_route) {
+        ++route_count;
+    }
+
+    target->has_route = true;
+    target->route.destination = swap_endian_32(key);
+    target->route.prefix_length = prefix_length;
+    target->route.gateway = gateway;
+    target->route.interface = interface;
+    target->route.hits = 0;
+
+    ++generation;
+
+    restore_interrupts(flags);
+    return true;
+}
+
+bool RoutingTable::remove(uint32_t destination, uint8_t prefix_length)
+{
+    if (prefix_length > 32) {
+        return false;
+    }
+
+    uint32_t flags { disable_interrupts() };
+
+    uint32_t key { swap_endian_32(destination) & prefix_mask(prefix_length) };
+    Node** parent_link { nullptr };
+    Node** link { &root };
+
+    while (*link != nullptr) {
+        Node* node { *link };
+
+        if (node->length >= prefix_length || ((node->key ^ key) & prefix_mask(node->length)) != 0) {
+            break;
+        }
+
+        parent_link = link;
+        link = &node->children[get_bit(key, node->length)];
+    }
+
+    Node* node { *link };
+
+    if (node == nullptr || node->length != prefix_length || node->key != key || !node->has_route) {
+        restore_interrupts(flags);
+        return false;
+    }
+
+    node->has_route = false;
+    --route_count;
+    ++generation;
+
+    // Nodes without a route only stay as forks, with both children.
+    if (node->children[0] == nullptr || node->children[1] == nullptr) {
+        *link = node->children[0] != nullptr ? node->children[0] : node->children[1];
+        free_node(node);
+        --node_count;
+
+        Node* parent { parent_link != nullptr ? *parent_link : nullptr };
+
+        if (parent != nullptr && !parent->has_route && (parent->children[0] == nullptr || parent->children[1] == nullptr)) {
+            *parent_link = parent->children[0] != nullptr ? parent->children[0] : parent->children[1];
+            free_node(parent);
+            --node_count;
+        }
+    }
+
+    restore_interrupts(flags);
+    return true;
+}
+
+bool RoutingTable::add_interface(InternetProtocolProvider* interface)
+{
+    if (interface_count == ROUTING_TABLE_MAX_INTERFACES) {
+        return false;
+    }
+
+    interfaces[interface_count++] = interface;
+    return true;
+}
+
+void RoutingTable::remove_interface(InternetProtocolProvider* interface)
+{
+    for (uint8_t i = 0; i < interface_count; ++i) {
+        if (interfaces[i] == interface) {
+            interfaces[i] = interfaces[--interface_count];
+            break;
+        }
+    }
+
+    if (nodes == nullptr) {
+        return;
+    }
+
+    // Nodes on the free list never have a route, so just go over all of them.
+    for (uint32_t i = 0; i < 2 * ROUTING_TABLE_MAX_ROUTES; ++i) {
+        if (nodes[i].has_route && nodes[i].route.interface == interface) {
+            remove(nodes[i].route.destination, nodes[i].route.prefix_length);
+        }
+    }
+}
+
+Route* RoutingTable::find_longest_match(uint32_t key)
+{
+    Route* best { nullptr };
+    Node* node { root };
+
+    while (node != nullptr && ((node->key ^ key) & prefix_mask(node->length)) == 0) {
+        if (node->has_route) {
+            best = &node->route;
+        }
+
+        if (node->length == 32) {
+            break;
+        }
+
+        node = node->children[get_bit(key, node->length)];
+    }
+
+    return best;
+}
+
+Route* RoutingTable::lookup(uint32_t destination)
+{
+    uint32_t flags { disable_interrupts() };
+
+    ++lookups;
+
+    // Fibonacci hashing like the ARP cache.
+    CacheEntry* entry { &cache[(destination * 2654435761u) >> (32 - ROUTE_CACHE_BITS)] };
+    Route* route;
+
+    if (entry->generation == generation && entry->destination == destination) {
+        ++cache_hits;
+        route = entry->route;
+    } else {
+        route = find_longest_match(swap_endian_32(destination));
+
+        entry->destination = destination;
+        entry->generation = generation;
+        entry->route = route;
+    }
+
+    if (route != nullptr) {
+        ++route->hits;
+    } else {
+        ++no_route;
+    }
+
+    restore_interrupts(flags);
+    return route;
+}
+
+uint8_t RoutingTable::get_prefix_length(uint32_t subnet_mask)
+{
+    uint32_t mask { swap_endian_32(subnet_mask) };
+    uint8_t length { 0 };
+
+    while (length < 32 && get_bit(mask, length) == 1) {
+        ++length;
+    }
+
+    return length;
+}
+
+void RoutingTable::print_node(Node* node)
+{
+    if (node == nullptr) {
+        return;
+    }
+
+    // In order of the prefixes, shorter ones first.
+    if (node->has_route) {
+        printf("  ");
+        print_ip(node->route.destination);
+        printf("/");
+        printf_int(node->route.prefix_length);
+
+        if (node->route.gateway != 0) {
+            printf(" via ");
+            print_ip(node->route.gateway);
+        }
+
+        printf(" dev ");
+        print_ip(node->route.interface->get_ip_address());
+        printf(", ");
+        printf_int(node->route.hits);
+        printf(" hits\n");
+    }
+
+    print_node(node->children[0]);
+    print_node(node->children[1]);
+}
+
+void RoutingTable::print_routes()
+{
+    uint32_t flags { disable_interrupts() };
+    print_node(root);
+    restore_interrupts(flags);
+}
+
+void RoutingTable::print_statistics()
+{
+    printf("Routing: ");
+    printf_int(route_count);
+    printf(" routes in ");
+    printf_int(node_count);
+    printf(" nodes, ");
+    printf_int(lookups);
+    printf(" lookups, ");
+    printf_int(cache_hits);
+    printf(" cache hits, ");
+    printf_int(no_route);
+    printf(" without a route\n");
+}
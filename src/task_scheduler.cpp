@@ -1,8 +1,15 @@
 #include "task_scheduler.h"
+#include "cpu.h"
+#include "timer.h"
+
+TaskScheduler* TaskScheduler::active_task_scheduler { nullptr };
 
 Task::Task(GlobalDescriptorTable *gdt, void entry_point())
 {
     cpu_state = (CPUState*) (stack + 4096 - sizeof(CPUState));
+    state = TaskRunnable;
+    is_sleeping = false;
+    wake_tick = 0;
     
     cpu_state -> eax = 0;
     cpu_state -> ebx = 0;
@@ -30,10 +37,17 @@ TaskScheduler::TaskScheduler()
 {
     num_tasks = 0;
     current_task = -1;
+    idle_state = nullptr;
+    is_switch_pending = false;
+
+    active_task_scheduler = this;
 }
 
 TaskScheduler::~TaskScheduler()
 {
+    if (active_task_scheduler == this) {
+        active_task_scheduler = nullptr;
+    }
 }
 
 bool TaskScheduler::add_task(Task* task)
@@ -50,13 +64,100 @@ CPUState* TaskScheduler::schedule(CPUState* cpu_state)
     if (num_tasks <= 0) {
         return cpu_state;
     }
-    
+
+    is_switch_pending = false;
+    wake_sleepers();
+
     if (current_task >= 0) {
          tasks[current_task]->cpu_state = cpu_state;
+    } else {
+        idle_state = cpu_state;
     }
-    
-    if (++current_task >= num_tasks) {
-        current_task %= num_tasks;
+
+    // Round robin over the runnable ones, the current task last.
+    for (int i = 1; i <= num_tasks; ++i) {
+        int candidate { (current_task + i) % num_tasks };
+
+        if (tasks[candidate]->state == TaskRunnable) {
+            current_task = candidate;
+            return tasks[current_task]->cpu_state;
+        }
+    }
+
+    // All blocked, so sit in hlt until an interrupt wakes one of them.
+    current_task = -1;
+    return idle_state;
+}
+
+Task* TaskScheduler::get_current_task()
+{
+    return current_task >= 0 ? tasks[current_task] : nullptr;
+}
+
+void TaskScheduler::block_current()
+{
+    if (current_task < 0) {
+        return;
+    }
+
+    // Interrupts are off, so a wakeup can't slip in between the caller's check and this.
+    tasks[current_task]->state = TaskBlocked;
+    __asm__ volatile("int %0" : : "i" (TASK_SWITCH_VECTOR) : "memory");
+}
+
+void TaskScheduler::wake_sleepers()
+{
+    if (Timer::active_timer == nullptr) {
+        return;
+    }
+
+    uint32_t now { Timer::active_timer->get_ticks() };
+
+    // Signed so it keeps working when the tick counter wraps.
+    for (int i = 0; i < num_tasks; ++i) {
+        if (tasks[i]->is_sleeping && (int32_t) (now - tasks[i]->wake_tick) >= 0) {
+            tasks[i]->is_sleeping = false;
+            tasks[i]->state = TaskRunnable;
+        }
+    }
+}
+
+void TaskScheduler::sleep(uint32_t milliseconds)
+{
+    Timer* timer { Timer::active_timer };
+
+    if (timer == nullptr) {
+        return;
+    }
+
+    if (current_task < 0) {
+        timer->sleep(milliseconds);
+        return;
+    }
+
+    uint32_t flags { disable_interrupts() };
+    Task* task { tasks[current_task] };
+
+    task->wake_tick = timer->get_ticks() + milliseconds * TIMER_FREQUENCY / 1000;
+    task->is_sleeping = true;
+
+    // Someone else's wake() may get us going early, then it's back to sleep.
+    while (task->is_sleeping) {
+        block_current();
+    }
+
+    restore_interrupts(flags);
+}
+
+void TaskScheduler::wake(Task* task)
+{
+    if (task->state != TaskBlocked) {
+        return;
+    }
+
+    task->state = TaskRunnable;
+
+    if (current_task < 0) {
+        is_switch_pending = true;
     }
-    return tasks[current_task]->cpu_state;
 }
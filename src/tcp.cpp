@@ -0,0 +1,1548 @@
+#include "checksum.h"
+#include "cpu.h"
+#include "memory_manager.h"
+#include "tcp.h"
+#include "terminal.h"
+
+// Sequence numbers wrap, so they're compared by their distance.
+static inline bool sequence_before(uint32_t a, uint32_t b)
+{
+    return (int32_t) (a - b) < 0;
+}
+
+static inline bool sequence_after(uint32_t a, uint32_t b)
+{
+    return (int32_t) (a - b) > 0;
+}
+
+static inline uint32_t minimum(uint32_t a, uint32_t b)
+{
+    return a < b ? a : b;
+}
+
+static inline uint32_t maximum(uint32_t a, uint32_t b)
+{
+    return a > b ? a : b;
+}
+
+static uint32_t get_deadline(uint32_t milliseconds)
+{
+    uint32_t now { Timer::active_timer != nullptr ? Timer::active_timer->get_ticks() : 0 };
+    uint32_t deadline { now + milliseconds * TIMER_FREQUENCY / 1000 };
+
+    // 0 means the timer isn't running.
+    return deadline != 0 ? deadline : 1;
+}
+
+static inline bool has_expired(uint32_t deadline, uint32_t ticks)
+{
+    return deadline != 0 && (int32_t) (ticks - deadline) >= 0;
+}
+
+TransmissionControlProtocolSocket::TransmissionControlProtocolSocket()
+{
+    backend = nullptr;
+    state = TcpClosed;
+    is_in_use = false;
+    send_buffer = nullptr;
+    receive_queue_head = 0;
+    receive_queue_tail = 0;
+    out_of_order_count = 0;
+}
+
+void TransmissionControlProtocolSocket::initialize(TransmissionControlProtocolProvider* backend, uint32_t local_ip, uint16_t local_port, uint32_t remote_ip, uint16_t remote_port)
+{
+    this->backend = backend;
+    state = TcpClosed;
+    is_in_use = true;
+    is_closed_by_user = false;
+    is_reset = false;
+
+    this->local_ip = local_ip;
+    this->local_port = local_port;
+    this->remote_ip = remote_ip;
+    this->remote_port = remote_port;
+
+    parent = nullptr;
+    accept_count = 0;
+    pending_count = 0;
+    backlog = 0;
+
+    initial_send_sequence = 0;
+    send_unacknowledged = 0;
+    send_next = 0;
+    send_maximum = 0;
+    send_window = 0;
+    send_window_sequence = 0;
+    send_window_acknowledged = 0;
+    send_maximum_segment_size = TCP_DEFAULT_SEGMENT_SIZE;
+    send_window_scale = 0;
+    receive_window_scale = TCP_WINDOW_SCALE;
+    send_buffer = nullptr;
+    send_buffer_start = 0;
+    send_buffer_count = 0;
+    is_fin_sent = false;
+    is_sending = false;
+
+    receive_next = 0;
+    receive_advertised = 0;
+    receive_queue_head = 0;
+    receive_queue_tail = 0;
+    receive_queued_bytes = 0;
+    out_of_order_count = 0;
+    is_fin_received = false;
+
+    congestion_window = 0;
+    slow_start_threshold = 0xFFFFFFFF;
+    duplicate_acks = 0;
+    is_in_fast_recovery = false;
+    recovery_point = 0;
+
+    smoothed_rtt = 0;
+    rtt_variance = 0;
+    retransmission_timeout = TCP_INITIAL_RTO;
+    is_timing_rtt = false;
+    rtt_sequence = 0;
+    rtt_start = 0;
+
+    retransmit_deadline = 0;
+    delayed_ack_deadline = 0;
+    time_wait_deadline = 0;
+    retries = 0;
+    unacknowledged_segments = 0;
+
+    segments_sent = 0;
+    segments_received = 0;
+    retransmissions = 0;
+    fast_retransmissions = 0;
+    timeouts = 0;
+}
+
+void TransmissionControlProtocolSocket::release_buffers()
+{
+    while (receive_queue_tail != receive_queue_head) {
+        receive_queue[receive_queue_tail % TCP_RECEIVE_QUEUE_SIZE]->release();
+        ++receive_queue_tail;
+    }
+
+    for (uint8_t i = 0; i < out_of_order_count; ++i) {
+        out_of_order[i].packet->release();
+    }
+
+    out_of_order_count = 0;
+    receive_queued_bytes = 0;
+
+    if (send_buffer != nullptr) {
+        MemoryManager::memory_manager->free(send_buffer);
+        send_buffer = nullptr;
+    }
+
+    send_buffer_count = 0;
+}
+
+uint32_t TransmissionControlProtocolSocket::get_receive_window()
+{
+    return receive_queued_bytes < TCP_RECEIVE_BUFFER_SIZE ? TCP_RECEIVE_BUFFER_SIZE - receive_queued_bytes : 0;
+}
+
+uint32_t TransmissionControlProtocolSocket::get_flight_size()
+{
+    return send_next - send_unacknowledged;
+}
+
+void TransmissionControlProtocolSocket::start_retransmit_timer()
+{
+    retransmit_deadline = get_deadline(retransmission_timeout);
+}
+
+uint8_t TransmissionControlProtocolSocket::get_events()
+{
+    if (state == TcpListen) {
+        return accept_count > 0 ? EVENT_READABLE : 0;
+    }
+
+    uint8_t events { 0 };
+
+    // The FIN is readable too, receive() returning nothing is how the reader sees it.
+    if (receive_queued_bytes > 0 || is_fin_received) {
+        events |= EVENT_READABLE;
+    }
+
+    if ((state == TcpEstablished || state == TcpCloseWait) && send_buffer_count < TCP_SEND_BUFFER_SIZE) {
+        events |= EVENT_WRITABLE;
+    }
+
+    if (state == TcpClosed) {
+        events |= is_reset ? EVENT_HANGUP | EVENT_ERROR : EVENT_HANGUP;
+    }
+
+    return events;
+}
+
+TransmissionControlProtocolSocket* TransmissionControlProtocolSocket::accept()
+{
+    uint32_t flags { disable_interrupts() };
+    TransmissionControlProtocolSocket* connection { nullptr };
+
+    if (state == TcpListen && accept_count > 0) {
+        connection = accept_queue[0];
+        --accept_count;
+
+        for (uint8_t i = 0; i < accept_count; ++i) {
+            accept_queue[i] = accept_queue[i + 1];
+        }
+
+        connection->parent = nullptr;
+    }
+
+    restore_interrupts(flags);
+    return connection;
+}
+
+uint32_t TransmissionControlProtocolSocket::send(const uint8_t* data, uint32_t size)
+{
+    uint32_t flags { disable_interrupts() };
+
+    // Data can be queued during the handshake too, it goes out once we're established.
+    if (state != TcpEstablished && state != TcpCloseWait && state != TcpSynSent && state != TcpSynReceived) {
+        restore_interrupts(flags);
+        return 0;
+    }
+
+    uint32_t accepted { minimum(size, TCP_SEND_BUFFER_SIZE - send_buffer_count) };
+    uint32_t position { (send_buffer_start + send_buffer_count) % TCP_SEND_BUFFER_SIZE };
+
+    for (uint32_t i = 0; i < accepted; ++i) {
+        send_buffer[position] = data[i];
+        position = (position + 1) % TCP_SEND_BUFFER_SIZE;
+    }
+
+    send_buffer_count += accepted;
+    backend->output(this);
+
+    restore_interrupts(flags);
+    return accepted;
+}
+
+uint32_t TransmissionControlProtocolSocket::receive(uint8_t* buffer, uint32_t size)
+{
+    uint32_t flags { disable_interrupts() };
+    uint32_t received { 0 };
+
+    while (received < size && receive_queue_tail != receive_queue_head) {
+        PacketBuffer* packet { receive_queue[receive_queue_tail % TCP_RECEIVE_QUEUE_SIZE] };
+        uint32_t length { minimum(packet->get_length(), size - received) };
+        uint8_t* data { packet->get_data() };
+
+        for (uint32_t i = 0; i < length; ++i) {
+            buffer[received + i] = data[i];
+        }
+
+        received += length;
+
+        // Whatever is left of the segment stays at the front of the queue.
+        if (length == packet->get_length()) {
+            packet->release();
+            ++receive_queue_tail;
+        } else {
+            packet->pull(length);
+        }
+    }
+
+    receive_queued_bytes -= received;
+
+    if (received > 0) {
+        backend->update_receive_window(this);
+    }
+
+    restore_interrupts(flags);
+    return received;
+}
+
+PacketBuffer* TransmissionControlProtocolSocket::receive_packet()
+{
+    uint32_t flags { disable_interrupts() };
+    PacketBuffer* packet { nullptr };
+
+    if (receive_queue_tail != receive_queue_head) {
+        packet = receive_queue[receive_queue_tail % TCP_RECEIVE_QUEUE_SIZE];
+        ++receive_queue_tail;
+
+        receive_queued_bytes -= packet->get_length();
+        backend->update_receive_window(this);
+    }
+
+    restore_interrupts(flags);
+    return packet;
+}
+
+void TransmissionControlProtocolSocket::close()
+{
+    uint32_t flags { disable_interrupts() };
+
+    is_closed_by_user = true;
+    detach_events();
+
+    switch (state) {
+        case TcpListen:
+            // Connections nobody accepted yet go down with it.
+            for (uint16_t i = 0; i < TCP_MAX_SOCKETS; ++i) {
+                TransmissionControlProtocolSocket* child { &backend->sockets[i] };
+
+                if (child->is_in_use && child->parent == this) {
+                    backend->abort(child, true);
+                }
+            }
+
+            backend->free(this);
+            break;
+
+        case TcpClosed:
+        case TcpSynSent:
+            backend->free(this);
+            break;
+
+        case TcpSynReceived:
+        case TcpEstablished:
+            state = TcpFinWait1;
+            backend->output(this);
+            break;
+
+        case TcpCloseWait:
+            state = TcpLastAck;
+            backend->output(this);
+            break;
+
+        default:
+            break;
+    }
+
+    restore_interrupts(flags);
+}
+
+void TransmissionControlProtocolSocket::print_statistics()
+{
+    static const char* state_names[] {
+        "CLOSED", "LISTEN", "SYN-SENT", "SYN-RECEIVED", "ESTABLISHED", "FIN-WAIT-1",
+        "FIN-WAIT-2", "CLOSE-WAIT", "CLOSING", "LAST-ACK", "TIME-WAIT"
+    };
+
+    printf("TCP ");
+    printf_int(local_port);
+    printf(" -> ");
+
+    for (uint8_t byte = 0; byte < 4; ++byte) {
+        printf_int((remote_ip >> (8 * byte)) & 0xFF);
+        printf(byte < 3 ? "." : ":");
+    }
+
+    printf_int(remote_port);
+    printf(" ");
+    printf(state_names[state]);
+    printf("\n  srtt ");
+    printf_int(smoothed_rtt);
+    printf(" ms, rto ");
+    printf_int(retransmission_timeout);
+    printf(" ms, cwnd ");
+    printf_int(congestion_window);
+    printf(", ssthresh ");
+    printf_int(slow_start_threshold == 0xFFFFFFFF ? -1 : (int) slow_start_threshold);
+    printf(", window ");
+    printf_int(send_window);
+    printf("\n  segments sent ");
+    printf_int(segments_sent);
+    printf(", received ");
+    printf_int(segments_received);
+    printf(", retransmitted ");
+    printf_int(retransmissions);
+    printf(" (fast ");
+    printf_int(fast_retransmissions);
+    printf(", timeouts ");
+    printf_int(timeouts);
+    printf(")\n");
+}
+
+TransmissionControlProtocolProvider::TransmissionControlProtocolProvider(InternetProtocolProvider* backend)
+    : InternetProtocolHandler(backend, INTERNET_PROTOCOL_TCP)
+{
+    next_ephemeral_port = TCP_EPHEMERAL_PORT_START;
+    sequence_seed = Timer::active_timer != nullptr ? (uint32_t) Timer::active_timer->get_cycles() : 0;
+
+    received_segments = 0;
+    header_errors = 0;
+    checksum_errors = 0;
+    resets_sent = 0;
+    dropped_segments = 0;
+
+    if (Timer::active_timer != nullptr) {
+        Timer::active_timer->add_handler(this, TCP_TIMER_PERIOD);
+    }
+}
+
+TransmissionControlProtocolProvider::~TransmissionControlProtocolProvider()
+{
+    if (Timer::active_timer != nullptr) {
+        Timer::active_timer->remove_handler(this);
+    }
+
+    for (uint16_t i = 0; i < TCP_MAX_SOCKETS; ++i) {
+        if (sockets[i].is_in_use) {
+            sockets[i].release_buffers();
+        }
+    }
+}
+
+uint32_t TransmissionControlProtocolProvider::get_now()
+{
+    return Timer::active_timer != nullptr ? Timer::active_timer->get_ticks() : 0;
+}
+
+TransmissionControlProtocolSocket* TransmissionControlProtocolProvider::allocate(uint32_t local_ip, uint16_t local_port, uint32_t remote_ip, uint16_t remote_port)
+{
+    for (uint16_t i = 0; i < TCP_MAX_SOCKETS; ++i) {
+        if (!sockets[i].is_in_use) {
+            sockets[i].initialize(this, local_ip, local_port, remote_ip, remote_port);
+            return &sockets[i];
+        }
+    }
+
+    return nullptr;
+}
+
+void TransmissionControlProtocolProvider::free(TransmissionControlProtocolSocket* socket)
+{
+    TransmissionControlProtocolSocket* listener { socket->parent };
+
+    // Still waiting in a listener, either for accept() or for the end of the handshake.
+    if (listener != nullptr) {
+        bool was_queued { false };
+
+        for (uint8_t i = 0; i < listener->accept_count; ++i) {
+            if (listener->accept_queue[i] == socket) {
+                --listener->accept_count;
+                listener->accept_queue[i] = listener->accept_queue[listener->accept_count];
+                was_queued = true;
+                break;
+            }
+        }
+
+        if (!was_queued) {
+            --listener->pending_count;
+        }
+
+        socket->parent = nullptr;
+    }
+
+    socket->release_buffers();
+    socket->state = TcpClosed;
+    socket->is_in_use = false;
+}
+
+TransmissionControlProtocolSocket* TransmissionControlProtocolProvider::find(uint32_t remote_ip, uint16_t remote_port, uint32_t local_ip, uint16_t local_port)
+{
+    // A few dozen sockets at most, a scan is as quick as a hash here.
+    for (uint16_t i = 0; i < TCP_MAX_SOCKETS; ++i) {
+        TransmissionControlProtocolSocket* socket { &sockets[i] };
+
+        if (socket->is_in_use
+            && socket->state != TcpListen
+            && socket->state != TcpClosed
+            && socket->local_port == local_port
+            && socket->local_ip == local_ip
+            && socket->remote_port == remote_port
+            && socket->remote_ip == remote_ip)
+        {
+            return socket;
+        }
+    }
+
+    return nullptr;
+}
+
+TransmissionControlProtocolSocket* TransmissionControlProtocolProvider::find_listener(uint16_t local_port)
+{
+    for (uint16_t i = 0; i < TCP_MAX_SOCKETS; ++i) {
+        if (sockets[i].is_in_use && sockets[i].state == TcpListen && sockets[i].local_port == local_port) {
+            return &sockets[i];
+        }
+    }
+
+    return nullptr;
+}
+
+bool TransmissionControlProtocolProvider::is_port_in_use(uint16_t port)
+{
+    for (uint16_t i = 0; i < TCP_MAX_SOCKETS; ++i) {
+        if (sockets[i].is_in_use && sockets[i].local_port == port) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+uint32_t TransmissionControlProtocolProvider::generate_initial_sequence()
+{
+    // RFC 6528 wants a clock plus something an attacker can't guess. Our clock is the tick
+    // count at the usual 4 us rate, the rest is a generator seeded from the TSC at boot.
+    sequence_seed = sequence_seed * 1103515245 + 12345;
+    return get_now() * 250 + sequence_seed;
+}
+
+void TransmissionControlProtocolProvider::parse_options(TransmissionControlProtocolSocket* socket, TransmissionControlProtocolHeader* header)
+{
+    uint8_t* options { (uint8_t*) (header + 1) };
+    uint32_t length { header->data_offset * 4u - sizeof(TransmissionControlProtocolHeader) };
+    bool has_window_scale { false };
+
+    for (uint32_t i = 0; i < length;) {
+        uint8_t kind { options[i] };
+
+        if (kind == TCP_OPTION_END) {
+            break;
+        }
+
+        if (kind == TCP_OPTION_NOP) {
+            ++i;
+            continue;
+        }
+
+        if (i + 1 >= length || options[i + 1] < 2 || i + options[i + 1] > length) {
+            break;
+        }
+
+        if (kind == TCP_OPTION_MAXIMUM_SEGMENT_SIZE && options[i + 1] == 4) {
+            uint16_t segment_size { (uint16_t) ((options[i + 2] << 8) | options[i + 3]) };
+            socket->send_maximum_segment_size = minimum(segment_size, TCP_MAXIMUM_SEGMENT_SIZE);
+        } else if (kind == TCP_OPTION_WINDOW_SCALE && options[i + 1] == 3) {
+            socket->send_window_scale = minimum(options[i + 2], 14);
+            has_window_scale = true;
+        }
+
+        i += options[i + 1];
+    }
+
+    // Scaling only happens when both sides ask for it.
+    if (!has_window_scale) {
+        socket->send_window_scale = 0;
+        socket->receive_window_scale = 0;
+    }
+}
+
+void TransmissionControlProtocolProvider::send_segment(TransmissionControlProtocolSocket* socket, uint32_t sequence, uint32_t length, uint8_t flags)
+{
+    if (PacketBufferPool::active_pool == nullptr) {
+        return;
+    }
+
+    PacketBuffer* packet { PacketBufferPool::active_pool->allocate() };
+
+    if (packet == nullptr) {
+        return;
+    }
+
+    // The payload is copied straight from the send buffer into the packet, the one copy on the
+    // way out. The headers then go in front of it.
+    if (length > 0) {
+        uint8_t* payload { packet->put(length) };
+        uint32_t position { (socket->send_buffer_start + (sequence - socket->send_unacknowledged)) % TCP_SEND_BUFFER_SIZE };
+
+        for (uint32_t i = 0; i < length; ++i) {
+            payload[i] = socket->send_buffer[position];
+            position = (position + 1) % TCP_SEND_BUFFER_SIZE;
+        }
+    }
+
+    bool is_syn { (flags & TCP_FLAG_SYN) != 0 };
+    uint32_t options_length { is_syn ? (socket->receive_window_scale != 0 ? 8u : 4u) : 0u };
+    uint32_t header_length { sizeof(TransmissionControlProtocolHeader) + options_length };
+    TransmissionControlProtocolHeader* header { (TransmissionControlProtocolHeader*) packet->push(header_length) };
+
+    header->source_port = swap_endian_16(socket->local_port);
+    header->destination_port = swap_endian_16(socket->remote_port);
+    header->sequence_number = swap_endian_32(sequence);
+    header->acknowledgement_number = (flags & TCP_FLAG_ACK) ? swap_endian_32(socket->receive_next) : 0;
+    header->reserved = 0;
+    header->data_offset = header_length / 4;
+    header->flags = flags;
+    header->urgent_pointer = 0;
+
+    // The window in a SYN is never scaled.
+    uint32_t window { socket->get_receive_window() };
+    uint32_t advertised { minimum(is_syn ? window : window >> socket->receive_window_scale, 0xFFFF) };
+
+    header->window_size = swap_endian_16(advertised);
+    socket->receive_advertised = socket->receive_next + (is_syn ? advertised : advertised << socket->receive_window_scale);
+
+    if (is_syn) {
+        uint8_t* options { (uint8_t*) (header + 1) };
+
+        options[0] = TCP_OPTION_MAXIMUM_SEGMENT_SIZE;
+        options[1] = 4;
+        options[2] = TCP_MAXIMUM_SEGMENT_SIZE >> 8;
+        options[3] = TCP_MAXIMUM_SEGMENT_SIZE & 0xFF;
+
+        if (options_length == 8) {
+            options[4] = TCP_OPTION_NOP;
+            options[5] = TCP_OPTION_WINDOW_SCALE;
+            options[6] = 3;
+            options[7] = socket->receive_window_scale;
+        }
+    }
+
+    uint32_t segment_length { header_length + length };
+    uint32_t sum { InternetProtocolProvider::pseudo_header_sum(socket->local_ip, socket->remote_ip, INTERNET_PROTOCOL_TCP, segment_length) };
+
+    header->checksum = 0;
+    header->checksum = checksum_finish(checksum_add(header, segment_length, sum));
+
+    // Every segment carries the latest ACK, so a delayed one isn't needed anymore.
+    if (flags & TCP_FLAG_ACK) {
+        socket->delayed_ack_deadline = 0;
+        socket->unacknowledged_segments = 0;
+    }
+
+    ++socket->segments_sent;
+    InternetProtocolHandler::send(socket->remote_ip, packet, socket->local_ip);
+}
+
+void TransmissionControlProtocolProvider::send_acknowledgement(TransmissionControlProtocolSocket* socket)
+{
+    send_segment(socket, socket->send_next, 0, TCP_FLAG_ACK);
+}
+
+void TransmissionControlProtocolProvider::send_reset(uint32_t source_ip, uint32_t destination_ip, TransmissionControlProtocolHeader* received, uint32_t segment_length)
+{
+    if (PacketBufferPool::active_pool == nullptr) {
+        return;
+    }
+
+    PacketBuffer* packet { PacketBufferPool::active_pool->allocate() };
+
+    if (packet == nullptr) {
+        return;
+    }
+
+    TransmissionControlProtocolHeader* header { (TransmissionControlProtocolHeader*) packet->push(sizeof(TransmissionControlProtocolHeader)) };
+
+    // RFC 793: with an ACK the reset takes its sequence number from it, without one it
+    // acknowledges the segment instead.
+    if (received->flags & TCP_FLAG_ACK) {
+        header->sequence_number = received->acknowledgement_number;
+        header->acknowledgement_number = 0;
+        header->flags = TCP_FLAG_RST;
+    } else {
+        header->sequence_number = 0;
+        header->acknowledgement_number = swap_endian_32(swap_endian_32(received->sequence_number) + segment_length);
+        header->flags = TCP_FLAG_RST | TCP_FLAG_ACK;
+    }
+
+    header->source_port = received->destination_port;
+    header->destination_port = received->source_port;
+    header->reserved = 0;
+    header->data_offset = sizeof(TransmissionControlProtocolHeader) / 4;
+    header->window_size = 0;
+    header->urgent_pointer = 0;
+
+    uint32_t sum { InternetProtocolProvider::pseudo_header_sum(source_ip, destination_ip, INTERNET_PROTOCOL_TCP, sizeof(TransmissionControlProtocolHeader)) };
+
+    header->checksum = 0;
+    header->checksum = checksum_finish(checksum_add(header, sizeof(TransmissionControlProtocolHeader), sum));
+
+    ++resets_sent;
+    InternetProtocolHandler::send(destination_ip, packet, source_ip);
+}
+
+void TransmissionControlProtocolProvider::output(TransmissionControlProtocolSocket* socket)
+{
+    // Over the loopback a segment can come back (and get answered) while we're still sending,
+    // the outer call picks up whatever that changed.
+    if (socket->is_sending) {
+        return;
+    }
+
+    socket->is_sending = true;
+
+    while (socket->is_in_use && !socket->is_fin_sent) {
+        TransmissionControlProtocolState state { socket->state };
+
+        if (state != TcpEstablished && state != TcpCloseWait && state != TcpFinWait1 && state != TcpLastAck) {
+            break;
+        }
+
+        uint32_t flight { socket->get_flight_size() };
+        uint32_t unsent { socket->send_buffer_count - flight };
+
+        if (unsent > 0) {
+            uint32_t window { minimum(socket->congestion_window, socket->send_window) };
+            uint32_t usable { window > flight ? window - flight : 0 };
+
+            if (usable == 0) {
+                // Zero window with nothing in flight: nothing will ever open it for us, so
+                // the retransmit timer doubles as the persist timer and sends a probe.
+                if (socket->send_window == 0 && flight == 0 && socket->retransmit_deadline == 0) {
+                    socket->start_retransmit_timer();
+                }
+
+                break;
+            }
+
+            uint32_t length { minimum(minimum(unsent, socket->send_maximum_segment_size), usable) };
+
+            // Sender side silly window avoidance: a runt only goes out when it's all we have
+            // or when nothing else is in flight.
+            if (length < socket->send_maximum_segment_size && length < unsent && flight > 0) {
+                break;
+            }
+
+            uint32_t sequence { socket->send_next };
+            socket->send_next += length;
+
+            // Only new data gets timed, a resent segment's ACK could be for either copy.
+            if (!socket->is_timing_rtt && sequence == socket->send_maximum) {
+                socket->is_timing_rtt = true;
+                socket->rtt_sequence = sequence;
+                socket->rtt_start = get_now();
+            }
+
+            if (sequence_after(socket->send_next, socket->send_maximum)) {
+                socket->send_maximum = socket->send_next;
+            }
+
+            if (socket->retransmit_deadline == 0) {
+                socket->start_retransmit_timer();
+            }
+
+            send_segment(socket, sequence, length, TCP_FLAG_ACK | (length == unsent ? TCP_FLAG_PSH : 0));
+            continue;
+        }
+
+        // Everything is out, the FIN follows if close() asked for one.
+        if (state == TcpFinWait1 || state == TcpLastAck) {
+            uint32_t sequence { socket->send_next };
+
+            socket->send_next += 1;
+            socket->is_fin_sent = true;
+
+            if (sequence_after(socket->send_next, socket->send_maximum)) {
+                socket->send_maximum = socket->send_next;
+            }
+
+            if (socket->retransmit_deadline == 0) {
+                socket->start_retransmit_timer();
+            }
+
+            send_segment(socket, sequence, 0, TCP_FLAG_FIN | TCP_FLAG_ACK);
+        }
+
+        break;
+    }
+
+    socket->is_sending = false;
+}
+
+void TransmissionControlProtocolProvider::retransmit_first(TransmissionControlProtocolSocket* socket)
+{
+    ++socket->retransmissions;
+    socket->is_timing_rtt = false;
+
+    if (socket->state == TcpSynSent) {
+        send_segment(socket, socket->initial_send_sequence, 0, TCP_FLAG_SYN);
+        return;
+    }
+
+    if (socket->state == TcpSynReceived) {
+        send_segment(socket, socket->initial_send_sequence, 0, TCP_FLAG_SYN | TCP_FLAG_ACK);
+        return;
+    }
+
+    uint32_t length { minimum(socket->send_buffer_count, socket->send_maximum_segment_size) };
+    uint8_t flags { TCP_FLAG_ACK };
+
+    // The FIN rides along when it comes right after this data.
+    if (socket->is_fin_sent && length == socket->send_buffer_count) {
+        flags |= TCP_FLAG_FIN;
+    }
+
+    send_segment(socket, socket->send_unacknowledged, length, flags);
+}
+
+void TransmissionControlProtocolProvider::update_receive_window(TransmissionControlProtocolSocket* socket)
+{
+    if (socket->state != TcpEstablished && socket->state != TcpFinWait1 && socket->state != TcpFinWait2) {
+        return;
+    }
+
+    // Receiver side silly window avoidance: only tell the peer once the window grew by a couple
+    // of segments (or half the buffer), otherwise the next ACK will do.
+    uint32_t right_edge { socket->receive_next + socket->get_receive_window() };
+    uint32_t growth { right_edge - socket->receive_advertised };
+
+    if (sequence_after(right_edge, socket->receive_advertised)
+        && (growth >= 2 * TCP_MAXIMUM_SEGMENT_SIZE || growth >= TCP_RECEIVE_BUFFER_SIZE / 2))
+    {
+        send_acknowledgement(socket);
+    }
+}
+
+void TransmissionControlProtocolProvider::update_rtt(TransmissionControlProtocolSocket* socket, uint32_t sample)
+{
+    // RFC 6298, alpha 1/8 and beta 1/4.
+    if (socket->smoothed_rtt == 0 && socket->rtt_variance == 0) {
+        socket->smoothed_rtt = sample;
+        socket->rtt_variance = sample / 2;
+    } else {
+        uint32_t difference { socket->smoothed_rtt > sample ? socket->smoothed_rtt - sample : sample - socket->smoothed_rtt };
+
+        socket->rtt_variance = (3 * socket->rtt_variance + difference) / 4;
+        socket->smoothed_rtt = (7 * socket->smoothed_rtt + sample) / 8;
+    }
+
+    uint32_t timeout { socket->smoothed_rtt + maximum(TCP_TIMER_PERIOD, 4 * socket->rtt_variance) };
+    socket->retransmission_timeout = minimum(maximum(timeout, TCP_MIN_RTO), TCP_MAX_RTO);
+}
+
+void TransmissionControlProtocolProvider::enter_time_wait(TransmissionControlProtocolSocket* socket)
+{
+    socket->state = TcpTimeWait;
+    socket->retransmit_deadline = 0;
+    socket->time_wait_deadline = get_deadline(TCP_TIME_WAIT_TIME);
+}
+
+void TransmissionControlProtocolProvider::on_connection_closed(TransmissionControlProtocolSocket* socket)
+{
+    socket->state = TcpClosed;
+    socket->retransmit_deadline = 0;
+    socket->delayed_ack_deadline = 0;
+    socket->time_wait_deadline = 0;
+
+    socket->notify_events(socket->is_reset ? EVENT_HANGUP | EVENT_ERROR : EVENT_HANGUP);
+
+    // Nobody will look at it anymore: closed by its user, or never accepted.
+    if (socket->is_closed_by_user || socket->parent != nullptr) {
+        free(socket);
+    }
+}
+
+void TransmissionControlProtocolProvider::abort(TransmissionControlProtocolSocket* socket, bool send_reset)
+{
+    if (send_reset && socket->state != TcpSynSent && socket->state != TcpTimeWait) {
+        send_segment(socket, socket->send_next, 0, TCP_FLAG_RST | TCP_FLAG_ACK);
+    }
+
+    socket->is_reset = true;
+    on_connection_closed(socket);
+}
+
+TransmissionControlProtocolSocket* TransmissionControlProtocolProvider::listen(uint16_t port, uint8_t backlog)
+{
+    uint32_t flags { disable_interrupts() };
+    TransmissionControlProtocolSocket* listener { nullptr };
+
+    if (port != 0 && find_listener(port) == nullptr) {
+        listener = allocate(0, port, 0, 0);
+    }
+
+    if (listener != nullptr) {
+        listener->state = TcpListen;
+        listener->backlog = minimum(backlog, TCP_MAX_BACKLOG);
+    }
+
+    restore_interrupts(flags);
+    return listener;
+}
+
+TransmissionControlProtocolSocket* TransmissionControlProtocolProvider::connect(uint32_t ip, uint16_t port)
+{
+    uint32_t flags { disable_interrupts() };
+    uint16_t local_port { 0 };
+
+    for (uint32_t tries = 0; tries < 65536 - TCP_EPHEMERAL_PORT_START; ++tries) {
+        uint16_t candidate { next_ephemeral_port };
+        next_ephemeral_port = candidate == 65535 ? TCP_EPHEMERAL_PORT_START : candidate + 1;
+
+        if (!is_port_in_use(candidate)) {
+            local_port = candidate;
+            break;
+        }
+    }
+
+    // The address we go out of now is the one the connection keeps, even if routes change.
+    TransmissionControlProtocolSocket* socket { local_port != 0 ? allocate(backend->get_source_for(ip), local_port, ip, port) : nullptr };
+
+    if (socket != nullptr) {
+        socket->send_buffer = (uint8_t*) MemoryManager::memory_manager->malloc(TCP_SEND_BUFFER_SIZE);
+
+        if (socket->send_buffer == nullptr) {
+            free(socket);
+            socket = nullptr;
+        }
+    }
+
+    if (socket != nullptr) {
+        socket->initial_send_sequence = generate_initial_sequence();
+        socket->send_unacknowledged = socket->initial_send_sequence;
+        socket->send_next = socket->initial_send_sequence + 1;
+        socket->send_maximum = socket->send_next;
+        socket->state = TcpSynSent;
+
+        socket->is_timing_rtt = true;
+        socket->rtt_sequence = socket->initial_send_sequence;
+        socket->rtt_start = get_now();
+
+        send_segment(socket, socket->initial_send_sequence, 0, TCP_FLAG_SYN);
+        socket->start_retransmit_timer();
+    }
+
+    restore_interrupts(flags);
+    return socket;
+}
+
+void TransmissionControlProtocolProvider::process_listen(TransmissionControlProtocolSocket* listener, uint32_t source_ip, uint32_t destination_ip, TransmissionControlProtocolHeader* header, uint32_t segment_length)
+{
+    // A full backlog drops the SYN quietly, the peer tries again later.
+    if (listener->accept_count + listener->pending_count >= listener->backlog) {
+        ++dropped_segments;
+        return;
+    }
+
+    // Answer from the address they reached us on, whichever interface that was.
+    TransmissionControlProtocolSocket* socket { allocate(destination_ip, listener->local_port, source_ip, swap_endian_16(header->source_port)) };
+
+    if (socket == nullptr) {
+        ++dropped_segments;
+        return;
+    }
+
+    socket->send_buffer = (uint8_t*) MemoryManager::memory_manager->malloc(TCP_SEND_BUFFER_SIZE);
+
+    if (socket->send_buffer == nullptr) {
+        free(socket);
+        ++dropped_segments;
+        return;
+    }
+
+    socket->parent = listener;
+    ++listener->pending_count;
+
+    uint32_t sequence { swap_endian_32(header->sequence_number) };
+
+    socket->receive_next = sequence + 1;
+    parse_options(socket, header);
+
+    socket->send_window = swap_endian_16(header->window_size);
+    socket->send_window_sequence = sequence;
+    socket->send_window_acknowledged = 0;
+
+    socket->initial_send_sequence = generate_initial_sequence();
+    socket->send_unacknowledged = socket->initial_send_sequence;
+    socket->send_next = socket->initial_send_sequence + 1;
+    socket->send_maximum = socket->send_next;
+    socket->state = TcpSynReceived;
+
+    socket->is_timing_rtt = true;
+    socket->rtt_sequence = socket->initial_send_sequence;
+    socket->rtt_start = get_now();
+
+    send_segment(socket, socket->initial_send_sequence, 0, TCP_FLAG_SYN | TCP_FLAG_ACK);
+    socket->start_retransmit_timer();
+}
+
+void TransmissionControlProtocolProvider::process_syn_sent(TransmissionControlProtocolSocket* socket, TransmissionControlProtocolHeader* header)
+{
+    uint8_t flags { header->flags };
+    uint32_t sequence { swap_endian_32(header->sequence_number) };
+    uint32_t acknowledgement { swap_endian_32(header->acknowledgement_number) };
+
+    if ((flags & TCP_FLAG_ACK) && acknowledgement != socket->initial_send_sequence + 1) {
+        if (!(flags & TCP_FLAG_RST)) {
+            send_reset(socket->local_ip, socket->remote_ip, header, 0);
+        }
+
+        return;
+    }
+
+    // Refused.
+    if (flags & TCP_FLAG_RST) {
+        if (flags & TCP_FLAG_ACK) {
+            abort(socket, false);
+        }
+
+        return;
+    }
+
+    if (!(flags & TCP_FLAG_SYN)) {
+        return;
+    }
+
+    socket->receive_next = sequence + 1;
+    parse_options(socket, header);
+
+    // Both sent a SYN at the same time: answer theirs and wait for the ACK of ours.
+    if (!(flags & TCP_FLAG_ACK)) {
+        socket->state = TcpSynReceived;
+        send_segment(socket, socket->initial_send_sequence, 0, TCP_FLAG_SYN | TCP_FLAG_ACK);
+        return;
+    }
+
+    socket->send_unacknowledged = acknowledgement;
+    socket->send_window = swap_endian_16(header->window_size);
+    socket->send_window_sequence = sequence;
+    socket->send_window_acknowledged = acknowledgement;
+    socket->congestion_window = TCP_INITIAL_WINDOW_SEGMENTS * socket->send_maximum_segment_size;
+    socket->state = TcpEstablished;
+    socket->retransmit_deadline = 0;
+    socket->retries = 0;
+
+    if (socket->is_timing_rtt) {
+        update_rtt(socket, get_now() - socket->rtt_start);
+        socket->is_timing_rtt = false;
+    }
+
+    send_acknowledgement(socket);
+    socket->notify_events(EVENT_WRITABLE);
+    output(socket);
+}
+
+bool TransmissionControlProtocolProvider::process_acknowledgement(TransmissionControlProtocolSocket* socket, TransmissionControlProtocolHeader* header, uint32_t payload_length)
+{
+    uint32_t sequence { swap_endian_32(header->sequence_number) };
+    uint32_t acknowledgement { swap_endian_32(header->acknowledgement_number) };
+    uint32_t window { (uint32_t) swap_endian_16(header->window_size) << socket->send_window_scale };
+
+    if (socket->state == TcpSynReceived) {
+        if (acknowledgement != socket->initial_send_sequence + 1) {
+            send_reset(socket->local_ip, socket->remote_ip, header, 0);
+            return false;
+        }
+
+        socket->state = TcpEstablished;
+        socket->congestion_window = TCP_INITIAL_WINDOW_SEGMENTS * socket->send_maximum_segment_size;
+        socket->notify_events(EVENT_WRITABLE);
+
+        // Handshake done, on to the accept queue (the rest of this ACK is handled below).
+        TransmissionControlProtocolSocket* listener { socket->parent };
+
+        if (listener != nullptr) {
+            --listener->pending_count;
+
+            if (listener->accept_count == TCP_MAX_BACKLOG) {
+                ++listener->pending_count;
+                abort(socket, true);
+                return false;
+            }
+
+            listener->accept_queue[listener->accept_count++] = socket;
+            listener->notify_events(EVENT_READABLE);
+        }
+    }
+
+    if (sequence_after(acknowledgement, socket->send_maximum)) {
+        send_acknowledgement(socket);
+        return false;
+    }
+
+    // Older than what we already have: nothing to learn from the ACK, the data may be new.
+    if (sequence_before(acknowledgement, socket->send_unacknowledged)) {
+        return true;
+    }
+
+    socket->retries = 0;
+
+    if (acknowledgement == socket->send_unacknowledged) {
+        uint32_t flight { socket->get_flight_size() };
+
+        // RFC 5681 duplicate: nothing new, no data, no window change, something outstanding.
+        bool is_duplicate { payload_length == 0
+                            && !(header->flags & (TCP_FLAG_SYN | TCP_FLAG_FIN))
+                            && window == socket->send_window
+                            && flight > 0 };
+
+        if (is_duplicate) {
+            ++socket->duplicate_acks;
+
+            if (socket->is_in_fast_recovery) {
+                // Every duplicate means a segment left the network, so one more may go in.
+                socket->congestion_window += socket->send_maximum_segment_size;
+            } else if (socket->duplicate_acks == TCP_DUPLICATE_ACK_THRESHOLD) {
+                socket->slow_start_threshold = maximum(flight / 2, 2 * socket->send_maximum_segment_size);
+                socket->recovery_point = socket->send_maximum;
+                socket->is_in_fast_recovery = true;
+
+                retransmit_first(socket);
+                ++socket->fast_retransmissions;
+
+                socket->congestion_window = socket->slow_start_threshold + TCP_DUPLICATE_ACK_THRESHOLD * socket->send_maximum_segment_size;
+            }
+        }
+    } else {
+        uint32_t acknowledged { acknowledgement - socket->send_unacknowledged };
+        bool was_handshake { acknowledgement == socket->initial_send_sequence + 1 && socket->send_unacknowledged == socket->initial_send_sequence };
+
+        // The SYN and the FIN count in the sequence space but aren't in the send buffer. Once
+        // we're closing, the only thing past the buffer can be our FIN.
+        uint32_t data_acknowledged { acknowledged - (was_handshake ? 1 : 0) };
+        bool is_closing { socket->state == TcpFinWait1 || socket->state == TcpClosing || socket->state == TcpLastAck };
+        bool is_fin_acknowledged { is_closing && data_acknowledged > socket->send_buffer_count };
+
+        data_acknowledged = minimum(data_acknowledged, socket->send_buffer_count);
+
+        socket->send_buffer_start = (socket->send_buffer_start + data_acknowledged) % TCP_SEND_BUFFER_SIZE;
+        socket->send_buffer_count -= data_acknowledged;
+        socket->send_unacknowledged = acknowledgement;
+
+        if (data_acknowledged > 0) {
+            socket->notify_events(EVENT_WRITABLE);
+        }
+
+        // After a timeout send_next went back, the peer may have had more than that already.
+        if (sequence_before(socket->send_next, acknowledgement)) {
+            socket->send_next = acknowledgement;
+        }
+
+        if (socket->is_timing_rtt && sequence_after(acknowledgement, socket->rtt_sequence)) {
+            update_rtt(socket, get_now() - socket->rtt_start);
+            socket->is_timing_rtt = false;
+        }
+
+        uint32_t segment_size { socket->send_maximum_segment_size };
+
+        if (socket->is_in_fast_recovery) {
+            if (sequence_before(acknowledgement, socket->recovery_point)) {
+                // NewReno partial ACK: the next hole is lost too, resend it right away and
+                // take back what the acknowledged data inflated the window by.
+                retransmit_first(socket);
+                socket->congestion_window -= minimum(data_acknowledged, socket->congestion_window);
+                socket->congestion_window += segment_size;
+            } else {
+                socket->congestion_window = minimum(socket->slow_start_threshold, socket->get_flight_size() + segment_size);
+                socket->is_in_fast_recovery = false;
+                socket->duplicate_acks = 0;
+            }
+        } else {
+            socket->duplicate_acks = 0;
+
+            if (socket->congestion_window < socket->slow_start_threshold) {
+                socket->congestion_window += minimum(data_acknowledged, segment_size);
+            } else {
+                socket->congestion_window += maximum(1, segment_size * segment_size / socket->congestion_window);
+            }
+        }
+
+        if (socket->send_next == socket->send_unacknowledged) {
+            socket->retransmit_deadline = 0;
+        } else {
+            socket->start_retransmit_timer();
+        }
+
+        if (is_fin_acknowledged) {
+            socket->is_fin_sent = true;
+
+            if (socket->state == TcpFinWait1) {
+                socket->state = TcpFinWait2;
+            } else if (socket->state == TcpClosing) {
+                enter_time_wait(socket);
+            } else if (socket->state == TcpLastAck) {
+                on_connection_closed(socket);
+                return false;
+            }
+        }
+    }
+
+    // Only newer segments get to change the window (SND.WL1 / SND.WL2).
+    if (sequence_before(socket->send_window_sequence, sequence)
+        || (socket->send_window_sequence == sequence && !sequence_before(acknowledgement, socket->send_window_acknowledged)))
+    {
+        socket->send_window = window;
+        socket->send_window_sequence = sequence;
+        socket->send_window_acknowledged = acknowledgement;
+    }
+
+    return true;
+}
+
+bool TransmissionControlProtocolProvider::enqueue_data(TransmissionControlProtocolSocket* socket, PacketBuffer* packet)
+{
+    uint32_t length { packet->get_length() };
+
+    // Closed by the user: nobody will read it, but it's acknowledged all the same.
+    if (socket->is_closed_by_user) {
+        socket->receive_next += length;
+        return true;
+    }
+
+    if (socket->receive_queue_head - socket->receive_queue_tail == TCP_RECEIVE_QUEUE_SIZE) {
+        ++dropped_segments;
+        return false;
+    }
+
+    // Keeps the NIC's buffer without copying it (unless the NIC can't spare one).
+    PacketBuffer* kept { packet->retain() };
+
+    if (kept == nullptr) {
+        ++dropped_segments;
+        return false;
+    }
+
+    socket->receive_queue[socket->receive_queue_head % TCP_RECEIVE_QUEUE_SIZE] = kept;
+    ++socket->receive_queue_head;
+    socket->receive_queued_bytes += length;
+    socket->receive_next += length;
+
+    socket->notify_events(EVENT_READABLE);
+    return true;
+}
+
+bool TransmissionControlProtocolProvider::process_data(TransmissionControlProtocolSocket* socket, uint32_t sequence, PacketBuffer* packet)
+{
+    uint32_t length { packet->get_length() };
+
+    // Entirely old (a retransmission of something we have): the peer needs a fresh ACK.
+    if (!sequence_after(sequence + length, socket->receive_next)) {
+        return true;
+    }
+
+    // Whatever doesn't fit into the window is dropped, the peer sends it again later.
+    uint32_t window { socket->get_receive_window() };
+    uint32_t offset { sequence_before(sequence, socket->receive_next) ? socket->receive_next - sequence : 0 };
+
+    if (length - offset > window && !socket->is_closed_by_user) {
+        packet->trim(offset + window);
+        length = offset + window;
+
+        if (length == offset) {
+            return true;
+        }
+    }
+
+    // Ahead of what we expect: keep it until the gap is filled, and tell the peer right away
+    // (the duplicate ACKs drive its fast retransmit).
+    if (sequence_after(sequence, socket->receive_next)) {
+        if (socket->out_of_order_count == TCP_MAX_OUT_OF_ORDER || socket->is_closed_by_user) {
+            ++dropped_segments;
+            return true;
+        }
+
+        for (uint8_t i = 0; i < socket->out_of_order_count; ++i) {
+            if (socket->out_of_order[i].sequence == sequence) {
+                return true;
+            }
+        }
+
+        PacketBuffer* kept { packet->retain() };
+
+        if (kept != nullptr) {
+            socket->out_of_order[socket->out_of_order_count].sequence = sequence;
+            socket->out_of_order[socket->out_of_order_count].packet = kept;
+            ++socket->out_of_order_count;
+        }
+
+        return true;
+    }
+
+    packet->pull(offset);
+
+    if (!enqueue_data(socket, packet)) {
+        return true;
+    }
+
+    ++socket->unacknowledged_segments;
+
+    // Filling a gap gets an immediate ACK too (RFC 5681), once the waiting segments are in.
+    bool had_gap { socket->out_of_order_count > 0 };
+    bool is_progressing { true };
+
+    while (is_progressing) {
+        is_progressing = false;
+
+        for (uint8_t i = 0; i < socket->out_of_order_count; ++i) {
+            TransmissionControlProtocolSocket::OutOfOrderSegment segment { socket->out_of_order[i] };
+            uint32_t end { segment.sequence + segment.packet->get_length() };
+
+            if (sequence_after(segment.sequence, socket->receive_next)) {
+                continue;
+            }
+
+            --socket->out_of_order_count;
+            socket->out_of_order[i] = socket->out_of_order[socket->out_of_order_count];
+
+            if (sequence_after(end, socket->receive_next)) {
+                segment.packet->pull(socket->receive_next - segment.sequence);
+
+                // enqueue_data took its own reference.
+                enqueue_data(socket, segment.packet);
+            }
+
+            segment.packet->release();
+            is_progressing = true;
+            break;
+        }
+    }
+
+    return had_gap;
+}
+
+void TransmissionControlProtocolProvider::process_fin(TransmissionControlProtocolSocket* socket)
+{
+    socket->receive_next += 1;
+    socket->is_fin_received = true;
+    socket->notify_events(EVENT_READABLE);
+
+    switch (socket->state) {
+        case TcpEstablished:
+            socket->state = TcpCloseWait;
+            break;
+
+        case TcpFinWait1:
+            // Our FIN isn't acknowledged yet (that would have made it FIN-WAIT-2 by now).
+            socket->state = TcpClosing;
+            break;
+
+        case TcpFinWait2:
+            enter_time_wait(socket);
+            break;
+
+        default:
+            break;
+    }
+}
+
+bool TransmissionControlProtocolProvider::on_internet_protocol_received(uint32_t source_ip, uint32_t destination_ip, PacketBuffer* packet)
+{
+    uint32_t length { packet->get_length() };
+
+    if (length < sizeof(TransmissionControlProtocolHeader)) {
+        ++header_errors;
+        return false;
+    }
+
+    TransmissionControlProtocolHeader* header { (TransmissionControlProtocolHeader*) packet->get_data() };
+    uint32_t header_length { header->data_offset * 4u };
+
+    if (header_length < sizeof(TransmissionControlProtocolHeader) || header_length > length) {
+        ++header_errors;
+        return false;
+    }
+
+    if (!(backend->get_receive_checksum_status() & RECEIVE_CHECKSUM_TRANSPORT_VERIFIED)) {
+        uint32_t sum { InternetProtocolProvider::pseudo_header_sum(source_ip, destination_ip, INTERNET_PROTOCOL_TCP, length) };
+
+        if (checksum_finish(checksum_add(header, length, sum)) != 0) {
+            ++checksum_errors;
+            return false;
+        }
+    }
+
+    // Connections only ever go to one host, a broadcast gets neither an answer nor a reset
+    // (RFC 1122 4.2.3.10). It would also leave the socket without a usable local address.
+    if (backend->is_broadcast(destination_ip)) {
+        ++dropped_segments;
+        return false;
+    }
+
+    ++received_segments;
+
+    uint8_t flags { header->flags };
+    uint32_t sequence { swap_endian_32(header->sequence_number) };
+    uint32_t payload_length { length - header_length };
+    uint32_t segment_length { payload_length + ((flags & TCP_FLAG_SYN) ? 1 : 0) + ((flags & TCP_FLAG_FIN) ? 1 : 0) };
+    uint16_t local_port { swap_endian_16(header->destination_port) };
+
+    TransmissionControlProtocolSocket* socket { find(source_ip, swap_endian_16(header->source_port), destination_ip, local_port) };
+
+    if (socket == nullptr) {
+        TransmissionControlProtocolSocket* listener { find_listener(local_port) };
+
+        if (listener != nullptr && (flags & (TCP_FLAG_SYN | TCP_FLAG_ACK | TCP_FLAG_RST)) == TCP_FLAG_SYN) {
+            process_listen(listener, source_ip, destination_ip, header, segment_length);
+        } else if (!(flags & TCP_FLAG_RST)) {
+            send_reset(destination_ip, source_ip, header, segment_length);
+        }
+
+        return false;
+    }
+
+    ++socket->segments_received;
+
+    if (socket->state == TcpSynSent) {
+        process_syn_sent(socket, header);
+        return false;
+    }
+
+    // Our SYN-ACK got lost and they sent their SYN again.
+    if (socket->state == TcpSynReceived && (flags & TCP_FLAG_SYN) && !(flags & TCP_FLAG_ACK) && sequence + 1 == socket->receive_next) {
+        retransmit_first(socket);
+        return false;
+    }
+
+    // Does any of it fall into the receive window? (RFC 793, the four cases.)
+    uint32_t window { socket->get_receive_window() };
+    uint32_t receive_next { socket->receive_next };
+    bool is_acceptable;
+
+    if (segment_length == 0) {
+        is_acceptable = window == 0
+            ? sequence == receive_next
+            : !sequence_before(sequence, receive_next) && sequence_before(sequence, receive_next + window);
+    } else {
+        uint32_t last { sequence + segment_length - 1 };
+
+        is_acceptable = window != 0
+            && ((!sequence_before(sequence, receive_next) && sequence_before(sequence, receive_next + window))
+                || (!sequence_before(last, receive_next) && sequence_before(last, receive_next + window)));
+    }
+
+    if (!is_acceptable) {
+        if (!(flags & TCP_FLAG_RST)) {
+            send_acknowledgement(socket);
+        }
+
+        return false;
+    }
+
+    // RFC 5961: only a reset right at RCV.NXT counts, anything else in the window could be
+    // blind and gets a challenge ACK. Same for a SYN in the middle of a connection.
+    if (flags & (TCP_FLAG_RST | TCP_FLAG_SYN)) {
+        if ((flags & TCP_FLAG_RST) && sequence == receive_next) {
+            abort(socket, false);
+        } else {
+            send_acknowledgement(socket);
+        }
+
+        return false;
+    }
+
+    if (!(flags & TCP_FLAG_ACK)) {
+        return false;
+    }
+
+    if (!process_acknowledgement(socket, header, payload_length) || !socket->is_in_use) {
+        return false;
+    }
+
+    bool is_ack_urgent { false };
+    TransmissionControlProtocolState state { socket->state };
+
+    if (payload_length > 0 && (state == TcpEstablished || state == TcpFinWait1 || state == TcpFinWait2)) {
+        packet->pull(header_length);
+        is_ack_urgent = process_data(socket, sequence, packet);
+    }
+
+    // A FIN only counts once everything before it is in.
+    if ((flags & TCP_FLAG_FIN) && sequence + payload_length == socket->receive_next && !socket->is_fin_received) {
+        process_fin(socket);
+        is_ack_urgent = true;
+    }
+
+    // New data may go out with the ACK on it, otherwise ACK every second segment right away
+    // and delay the rest a little (RFC 1122).
+    output(socket);
+
+    if (is_ack_urgent || socket->unacknowledged_segments >= 2) {
+        send_acknowledgement(socket);
+    } else if (socket->unacknowledged_segments > 0 && socket->delayed_ack_deadline == 0) {
+        socket->delayed_ack_deadline = get_deadline(TCP_DELAYED_ACK_TIME);
+    }
+
+    return false;
+}
+
+void TransmissionControlProtocolProvider::on_socket_timer(TransmissionControlProtocolSocket* socket, uint32_t ticks)
+{
+    if (has_expired(socket->time_wait_deadline, ticks)) {
+        on_connection_closed(socket);
+        return;
+    }
+
+    if (has_expired(socket->delayed_ack_deadline, ticks)) {
+        send_acknowledgement(socket);
+    }
+
+    if (!has_expired(socket->retransmit_deadline, ticks)) {
+        return;
+    }
+
+    bool is_handshake { socket->state == TcpSynSent || socket->state == TcpSynReceived };
+
+    if (socket->retries >= (is_handshake ? TCP_MAX_SYN_RETRIES : TCP_MAX_RETRIES)) {
+        abort(socket, true);
+        return;
+    }
+
+    ++socket->retries;
+    ++socket->timeouts;
+    socket->retransmission_timeout = minimum(socket->retransmission_timeout * 2, TCP_MAX_RTO);
+
+    if (is_handshake) {
+        retransmit_first(socket);
+        socket->start_retransmit_timer();
+        return;
+    }
+
+    uint32_t flight { socket->get_flight_size() };
+    uint32_t segment_size { socket->send_maximum_segment_size };
+
+    // Persist timer: the peer's window is closed, push one byte past it to hear about it.
+    if (flight == 0 && socket->send_window == 0 && socket->send_buffer_count > 0) {
+        uint32_t sequence { socket->send_next };
+        socket->send_next += 1;
+
+        if (sequence_after(socket->send_next, socket->send_maximum)) {
+            socket->send_maximum = socket->send_next;
+        }
+
+        send_segment(socket, sequence, 1, TCP_FLAG_ACK);
+        socket->start_retransmit_timer();
+        return;
+    }
+
+    // A real timeout: back to one segment and go back to the first unacknowledged byte.
+    socket->slow_start_threshold = maximum(flight / 2, 2 * segment_size);
+    socket->congestion_window = segment_size;
+    socket->duplicate_acks = 0;
+    socket->is_in_fast_recovery = false;
+    socket->is_timing_rtt = false;
+    ++socket->retransmissions;
+
+    socket->send_next = socket->send_unacknowledged;
+    socket->is_fin_sent = false;
+    socket->retransmit_deadline = 0;
+
+    output(socket);
+
+    if (socket->retransmit_deadline == 0 && socket->send_next != socket->send_unacknowledged) {
+        socket->start_retransmit_timer();
+    }
+}
+
+void TransmissionControlProtocolProvider::on_timer(uint32_t ticks)
+{
+    for (uint16_t i = 0; i < TCP_MAX_SOCKETS; ++i) {
+        TransmissionControlProtocolSocket* socket { &sockets[i] };
+
+        if (socket->is_in_use && socket->state != TcpClosed && socket->state != TcpListen) {
+            on_socket_timer(socket, ticks);
+        }
+    }
+}
+
+void TransmissionControlProtocolProvider::print_statistics()
+{
+    printf("TCP: received ");
+    printf_int(received_segments);
+    printf(", header errors ");
+    printf_int(header_errors);
+    printf(", checksum errors ");
+    printf_int(checksum_errors);
+    printf(", resets sent ");
+    printf_int(resets_sent);
+    printf(", dropped ");
+    printf_int(dropped_segments);
+    printf("\n");
+
+    for (uint16_t i = 0; i < TCP_MAX_SOCKETS; ++i) {
+        if (sockets[i].is_in_use && sockets[i].state != TcpListen) {
+            sockets[i].print_statistics();
+        }
+    }
+}
@@ -0,0 +1,239 @@
+#include "cpu.h"
+#include "timer.h"
+
+Timer* Timer::active_timer { nullptr };
+
+Timer::Timer(InterruptManager* manager)
+    : Driver(manager, manager->get_hardware_interrupt_offset()), // IRQ 0
+      channel_0_data_port(0x40),
+      channel_2_data_port(0x42),
+      command_port(0x43),
+      channel_2_gate_port(0x61)
+{
+    ticks = 0;
+    cycles_per_microsecond = 0;
+    registration_count = 0;
+    handled_ticks = 0;
+
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    has_timestamp_counter = (edx & CPU::FEATURE_TSC) != 0;
+
+    if (has_timestamp_counter) {
+        calibrate_timestamp_counter();
+    }
+
+    boot_timestamp = get_cycles();
+    active_timer = this;
+}
+
+Timer::~Timer()
+{
+    deactivate();
+
+    if (active_timer == this) {
+        active_timer = nullptr;
+    }
+}
+
+void Timer::calibrate_timestamp_counter()
+{
+    // Channel 2 can be polled without interrupts: its output shows up in bit 5 of port 0x61.
+    // Gate it on (bit 0) with the speaker off (bit 1), and count down 10ms in mode 0.
+    const uint16_t count { PIT_BASE_FREQUENCY / 100 };
+    uint8_t gate { channel_2_gate_port.read() };
+
+    channel_2_gate_port.write((gate & ~0x02) | 0x01);
+    command_port.write(0xB0); // Channel 2, low then high byte, mode 0 (interrupt on terminal count)
+    channel_2_data_port.write(count & 0xFF);
+    channel_2_data_port.write(count >> 8);
+
+    uint64_t start { read_timestamp_counter() };
+
+    while (!(channel_2_gate_port.read() & 0x20));
+
+    uint64_t end { read_timestamp_counter() };
+
+    channel_2_gate_port.write(gate);
+
+    cycles_per_microsecond = (uint32_t) divide_64(end - start, 10000);
+
+    if (cycles_per_microsecond == 0) {
+        has_timestamp_counter = false; // Hardly counting, not worth trusting.
+    }
+}
+
+void Timer::initialize()
+{
+
+}
+
+void Timer::activate()
+{
+    // Channel 0, low then high byte, mode 2 (rate generator).
+    uint16_t divisor { PIT_BASE_FREQUENCY / TIMER_FREQUENCY };
+
+    command_port.write(0x34);
+    channel_0_data_port.write(divisor & 0xFF);
+    channel_0_data_port.write(divisor >> 8);
+}
+
+void Timer::deactivate()
+{
+    // Back to the BIOS default of 18.2Hz (a divisor of 0 means 65536).
+    command_port.write(0x34);
+    channel_0_data_port.write(0);
+    channel_0_data_port.write(0);
+}
+
+void Timer::reset()
+{
+    ticks = 0;
+    handled_ticks = 0;
+}
+
+const char* Timer::get_driver_name()
+{
+    return "PIT";
+}
+
+uint32_t Timer::handle_interrupt(uint32_t esp)
+{
+    ++ticks;
+
+    // The handlers run from poll(), if the list is full they have to run right here.
+    if (registration_count > 0 && !interrupt_manager->schedule_poll(this)) {
+        poll(POLL_BUDGET);
+    }
+
+    return esp;
+}
+
+uint16_t Timer::poll(uint16_t budget)
+{
+    // Catches up on every tick since the last run. Ticks that come in meanwhile put us back on
+    // the poll list, and anything over budget waits for the next pass.
+    //
+    // Polls run with interrupts on, but the handlers (ARP, TCP) walk state the receive path
+    // also changes, and a fallback receive in a nested interrupt could land in the middle. So
+    // each tick's handlers run with interrupts off, like they did from the interrupt itself.
+    uint16_t done { 0 };
+    uint32_t flags { disable_interrupts() };
+
+    while (done < budget && handled_ticks != ticks) {
+        uint32_t now { ++handled_ticks };
+        ++done;
+
+        for (uint8_t i = 0; i < registration_count; ++i) {
+            TimerRegistration* registration { &registrations[i] };
+
+            // Signed, so it keeps working when the tick counter wraps.
+            if ((int32_t) (now - registration->next_tick) >= 0) {
+                registration->next_tick += registration->period;
+                registration->handler->on_timer(now);
+            }
+        }
+
+        // Lets waiting interrupts in between ticks.
+        restore_interrupts(flags);
+        flags = disable_interrupts();
+    }
+
+    restore_interrupts(flags);
+    return done;
+}
+
+bool Timer::add_handler(TimerHandler* handler, uint32_t period)
+{
+    uint32_t period_ticks { period * TIMER_FREQUENCY / 1000 };
+
+    if (period_ticks == 0) {
+        period_ticks = 1;
+    }
+
+    uint32_t flags { disable_interrupts() };
+
+    if (registration_count == MAX_TIMER_HANDLERS) {
+        restore_interrupts(flags);
+        return false;
+    }
+
+    registrations[registration_count].handler = handler;
+    registrations[registration_count].period = period_ticks;
+    registrations[registration_count].next_tick = ticks + period_ticks;
+    ++registration_count;
+
+    restore_interrupts(flags);
+    return true;
+}
+
+void Timer::remove_handler(TimerHandler* handler)
+{
+    uint32_t flags { disable_interrupts() };
+
+    for (uint8_t i = 0; i < registration_count; ++i) {
+        if (registrations[i].handler == handler) {
+            registrations[i] = registrations[--registration_count];
+            break;
+        }
+    }
+
+    restore_interrupts(flags);
+}
+
+void TimerHandler::on_timer(uint32_t ticks)
+{
+
+}
+
+uint32_t Timer::get_ticks()
+{
+    return ticks;
+}
+
+uint64_t Timer::get_microseconds()
+{
+    if (!has_timestamp_counter) {
+        return (uint64_t) ticks * (1000000 / TIMER_FREQUENCY);
+    }
+
+    return cycles_to_microseconds(get_cycles() - boot_timestamp);
+}
+
+uint64_t Timer::get_cycles()
+{
+    return has_timestamp_counter ? read_timestamp_counter() : 0;
+}
+
+uint32_t Timer::get_cycles_per_microsecond()
+{
+    return cycles_per_microsecond;
+}
+
+uint64_t Timer::cycles_to_microseconds(uint64_t cycles)
+{
+    if (cycles_per_microsecond == 0) {
+        return 0;
+    }
+
+    return divide_64(cycles, cycles_per_microsecond);
+}
+
+uint64_t Timer::cycles_to_nanoseconds(uint64_t cycles)
+{
+    if (cycles_per_microsecond == 0) {
+        return 0;
+    }
+
+    return divide_64(cycles * 1000, cycles_per_microsecond);
+}
+
+void Timer::sleep(uint32_t milliseconds)
+{
+    uint32_t start { ticks };
+    uint32_t wait_ticks { milliseconds * TIMER_FREQUENCY / 1000 };
+
+    while (ticks - start < wait_ticks) {
+        __asm__ volatile("hlt");
+    }
+}
@@ -0,0 +1,309 @@
+#include "checksum.h"
+#include "cpu.h"
+#include "terminal.h"
+#include "udp.h"
+
+UserDatagramProtocolSocket::UserDatagramProtocolSocket(UserDatagramProtocolProvider* backend, uint16_t port)
+{
+    this->backend = backend;
+    this->port = 0;
+    next = nullptr;
+
+    head = 0;
+    tail = 0;
+
+    received_datagrams = 0;
+    dropped_datagrams = 0;
+    sent_datagrams = 0;
+    send_failures = 0;
+
+    if (!backend->bind(this, port)) {
+        printf_colored("UDP: port already in use\n", VGA_COLOR_RED_ON_BLACK);
+    }
+}
+
+UserDatagramProtocolSocket::~UserDatagramProtocolSocket()
+{
+    if (port != 0) {
+        backend->unbind(this);
+    }
+
+    while (tail != head) {
+        ring[tail % UDP_RECEIVE_RING_SIZE].packet->release();
+        ++tail;
+    }
+}
+
+bool UserDatagramProtocolSocket::enqueue(uint32_t source_ip, uint16_t source_port, PacketBuffer* packet)
+{
+    if (head - tail == UDP_RECEIVE_RING_SIZE) {
+        ++dropped_datagrams;
+        return false;
+    }
+
+    // Keeps the buffer without copying it, unless the NIC has no spare to give us.
+    PacketBuffer* kept { packet->retain() };
+
+    if (kept == nullptr) {
+        ++dropped_datagrams;
+        return false;
+    }
+
+    UserDatagram& datagram { ring[head % UDP_RECEIVE_RING_SIZE] };
+    datagram.packet = kept;
+    datagram.ip = source_ip;
+    datagram.port = source_port;
+
+    ++head;
+    ++received_datagrams;
+
+    notify_events(EVENT_READABLE);
+    return true;
+}
+
+uint8_t UserDatagramProtocolSocket::get_events()
+{
+    // Sending never waits, the datagram goes out or is dropped.
+    return (head != tail ? EVENT_READABLE : 0) | EVENT_WRITABLE;
+}
+
+uint32_t UserDatagramProtocolSocket::receive_batch(UserDatagram* datagrams, uint32_t count)
+{
+    uint32_t flags { disable_interrupts() };
+    uint32_t received { 0 };
+
+    while (received < count && tail != head) {
+        datagrams[received] = ring[tail % UDP_RECEIVE_RING_SIZE];
+        ++tail;
+        ++received;
+    }
+
+    restore_interrupts(flags);
+    return received;
+}
+
+uint32_t UserDatagramProtocolSocket::send_batch(UserDatagram* datagrams, uint32_t count)
+{
+    uint32_t accepted { 0 };
+
+    for (uint32_t i = 0; i < count; ++i) {
+        TransmitStatus status { backend->send(port, datagrams[i].ip, datagrams[i].port, datagrams[i].packet) };
+
+        if (status == TransmitSent || status == TransmitQueued) {
+            ++accepted;
+        }
+    }
+
+    sent_datagrams += accepted;
+    send_failures += count - accepted;
+    return accepted;
+}
+
+TransmitStatus UserDatagramProtocolSocket::send_to(uint32_t ip, uint16_t port, const uint8_t* data, uint32_t size)
+{
+    if (PacketBufferPool::active_pool == nullptr) {
+        return TransmitInvalid;
+    }
+
+    PacketBuffer* packet { PacketBufferPool::active_pool->allocate() };
+
+    if (packet == nullptr) {
+        ++send_failures;
+        return TransmitQueueFull;
+    }
+
+    uint8_t* payload { packet->put(size) };
+
+    if (payload == nullptr) {
+        ++send_failures;
+        packet->release();
+        return TransmitInvalid;
+    }
+
+    for (uint32_t i = 0; i < size; ++i) {
+        payload[i] = data[i];
+    }
+
+    UserDatagram datagram { packet, ip, port };
+    return send_batch(&datagram, 1) == 1 ? TransmitSent : TransmitQueueFull;
+}
+
+void UserDatagramProtocolSocket::print_statistics()
+{
+    printf("UDP port ");
+    printf_int(port);
+    printf(": received ");
+    printf_int(received_datagrams);
+    printf(", dropped ");
+    printf_int(dropped_datagrams);
+    printf(", sent ");
+    printf_int(sent_datagrams);
+    printf(", send failures ");
+    printf_int(send_failures);
+    printf("\n");
+}
+
+UserDatagramProtocolProvider::UserDatagramProtocolProvider(InternetProtocolProvider* backend)
+    : InternetProtocolHandler(backend, INTERNET_PROTOCOL_UDP)
+{
+    for (uint16_t i = 0; i < UDP_SOCKET_BUCKETS; ++i) {
+        buckets[i] = nullptr;
+    }
+
+    next_ephemeral_port = UDP_EPHEMERAL_PORT_START;
+
+    received_datagrams = 0;
+    header_errors = 0;
+    checksum_errors = 0;
+    no_port = 0;
+}
+
+UserDatagramProtocolProvider::~UserDatagramProtocolProvider()
+{
+}
+
+uint16_t UserDatagramProtocolProvider::hash(uint16_t port)
+{
+    // Fibonacci hashing like the ARP cache, ports handed out in sequence still spread out.
+    return (uint16_t) ((port * 2654435761u) >> 26);
+}
+
+UserDatagramProtocolSocket* UserDatagramProtocolProvider::find(uint16_t port)
+{
+    for (UserDatagramProtocolSocket* socket = buckets[hash(port)]; socket != nullptr; socket = socket->next) {
+        if (socket->port == port) {
+            return socket;
+        }
+    }
+
+    return nullptr;
+}
+
+bool UserDatagramProtocolProvider::bind(UserDatagramProtocolSocket* socket, uint16_t port)
+{
+    uint32_t flags { disable_interrupts() };
+
+    if (port == 0) {
+        // Try every ephemeral port once at most, starting after the last one handed out.
+        for (uint32_t tries = 0; tries < 65536 - UDP_EPHEMERAL_PORT_START; ++tries) {
+            uint16_t candidate { next_ephemeral_port };
+            next_ephemeral_port = candidate == 65535 ? UDP_EPHEMERAL_PORT_START : candidate + 1;
+
+            if (find(candidate) == nullptr) {
+                port = candidate;
+                break;
+            }
+        }
+    } else if (find(port) != nullptr) {
+        port = 0;
+    }
+
+    if (port == 0) {
+        restore_interrupts(flags);
+        return false;
+    }
+
+    uint16_t bucket { hash(port) };
+    socket->port = port;
+    socket->next = buckets[bucket];
+    buckets[bucket] = socket;
+
+    restore_interrupts(flags);
+    return true;
+}
+
+void UserDatagramProtocolProvider::unbind(UserDatagramProtocolSocket* socket)
+{
+    uint32_t flags { disable_interrupts() };
+
+    UserDatagramProtocolSocket** link { &buckets[hash(socket->port)] };
+
+    while (*link != nullptr && *link != socket) {
+        link = &(*link)->next;
+    }
+
+    if (*link != nullptr) {
+        *link = socket->next;
+    }
+
+    restore_interrupts(flags);
+}
+
+bool UserDatagramProtocolProvider::on_internet_protocol_received(uint32_t source_ip, uint32_t destination_ip, PacketBuffer* packet)
+{
+    if (packet->get_length() < sizeof(UserDatagramProtocolHeader)) {
+        ++header_errors;
+        return false;
+    }
+
+    UserDatagramProtocolHeader* header { (UserDatagramProtocolHeader*) packet->get_data() };
+    uint16_t length { swap_endian_16(header->length) };
+
+    if (length < sizeof(UserDatagramProtocolHeader) || length > packet->get_length()) {
+        ++header_errors;
+        return false;
+    }
+
+    // A zero checksum means the sender didn't compute one.
+    if (header->checksum != 0 && !(backend->get_receive_checksum_status() & RECEIVE_CHECKSUM_TRANSPORT_VERIFIED)) {
+        uint32_t sum { InternetProtocolProvider::pseudo_header_sum(source_ip, destination_ip, INTERNET_PROTOCOL_UDP, length) };
+
+        if (checksum_finish(checksum_add(header, length, sum)) != 0) {
+            ++checksum_errors;
+            return false;
+        }
+    }
+
+    UserDatagramProtocolSocket* socket { find(swap_endian_16(header->destination_port)) };
+
+    if (socket == nullptr) {
+        ++no_port;
+        return false;
+    }
+
+    ++received_datagrams;
+    uint16_t source_port { swap_endian_16(header->source_port) };
+
+    packet->trim(length);
+    packet->pull(sizeof(UserDatagramProtocolHeader));
+
+    socket->enqueue(source_ip, source_port, packet);
+    return false;
+}
+
+TransmitStatus UserDatagramProtocolProvider::send(uint16_t source_port, uint32_t destination_ip, uint16_t destination_port, PacketBuffer* packet)
+{
+    uint32_t length { packet->get_length() + sizeof(UserDatagramProtocolHeader) };
+    UserDatagramProtocolHeader* header { (UserDatagramProtocolHeader*) packet->push(sizeof(UserDatagramProtocolHeader)) };
+
+    if (header == nullptr || length > 0xFFFF) {
+        packet->release();
+        return TransmitInvalid;
+    }
+
+    header->source_port = swap_endian_16(source_port);
+    header->destination_port = swap_endian_16(destination_port);
+    header->length = swap_endian_16(length);
+    header->checksum = 0;
+
+    uint32_t sum { InternetProtocolProvider::pseudo_header_sum(backend->get_source_for(destination_ip), destination_ip, INTERNET_PROTOCOL_UDP, length) };
+    uint16_t checksum { checksum_finish(checksum_add(header, length, sum)) };
+
+    // Zero is "no checksum", a real zero goes out as all ones (RFC 768).
+    header->checksum = checksum != 0 ? checksum : 0xFFFF;
+
+    return InternetProtocolHandler::send(destination_ip, packet);
+}
+
+void UserDatagramProtocolProvider::print_statistics()
+{
+    printf("UDP: received ");
+    printf_int(received_datagrams);
+    printf(", header errors ");
+    printf_int(header_errors);
+    printf(", checksum errors ");
+    printf_int(checksum_errors);
+    printf(", no port ");
+    printf_int(no_port);
+    printf("\n");
+}
@@ -0,0 +1,249 @@
+#include "memory_manager.h"
+#include "port.h"
+#include "virtio.h"
+
+// x86 keeps stores in order, but a store followed by a load can still pass each other. That's
+// exactly what the event index check does (publish our index, then read the device's), so it
+// needs a full barrier. A locked add works on every CPU, mfence would need SSE2.
+static inline void full_memory_barrier()
+{
+    __asm__ volatile("lock; addl $0, (%%esp)" : : : "memory");
+}
+
+static inline void compiler_barrier()
+{
+    __asm__ volatile("" : : : "memory");
+}
+
+// Straight from the virtio spec: did new_index just step past event (coming from old_index)?
+static inline bool need_event(uint16_t event, uint16_t new_index, uint16_t old_index)
+{
+    return (uint16_t) (new_index - event - 1) < (uint16_t) (new_index - old_index);
+}
+
+VirtioQueue::VirtioQueue()
+{
+    io_base = 0;
+    queue_index = 0;
+    size = 0;
+    has_event_index = false;
+    memory = nullptr;
+    descriptors = nullptr;
+    available = nullptr;
+    used = nullptr;
+    free_head = 0;
+    free_count = 0;
+    last_used_index = 0;
+    last_kicked_index = 0;
+    notifications = 0;
+    suppressed_notifications = 0;
+}
+
+VirtioQueue::~VirtioQueue()
+{
+    if (memory != nullptr) {
+        MemoryManager::memory_manager->free(memory);
+    }
+}
+
+bool VirtioQueue::initialize(uint16_t io_base, uint16_t queue_index, bool has_event_index)
+{
+    this->io_base = io_base;
+    this->queue_index = queue_index;
+    this->has_event_index = has_event_index;
+
+    Port16Bit queue_select_port(io_base + VIRTIO_REGISTER_QUEUE_SELECT);
+    Port16Bit queue_size_port(io_base + VIRTIO_REGISTER_QUEUE_SIZE);
+    Port32Bit queue_address_port(io_base + VIRTIO_REGISTER_QUEUE_ADDRESS);
+
+    queue_select_port.write(queue_index);
+    size = queue_size_port.read();
+
+    if (size == 0) {
+        return false; // The queue doesn't exist.
+    }
+
+    // Descriptors and the available ring share the first aligned block, the used ring gets its own.
+    uint32_t available_end { size * sizeof(VirtioQueueDescriptor) + sizeof(VirtioQueueAvailable) + (size + 1) * sizeof(uint16_t) };
+    uint32_t used_offset { (available_end + VIRTIO_QUEUE_ALIGNMENT - 1) & ~(VIRTIO_QUEUE_ALIGNMENT - 1) };
+    uint32_t used_size { sizeof(VirtioQueueUsed) + size * sizeof(VirtioQueueUsedElement) + sizeof(uint16_t) };
+    uint32_t total_size { used_offset + ((used_size + VIRTIO_QUEUE_ALIGNMENT - 1) & ~(VIRTIO_QUEUE_ALIGNMENT - 1)) };
+
+    memory = MemoryManager::memory_manager->malloc(total_size + VIRTIO_QUEUE_ALIGNMENT - 1);
+
+    if (memory == nullptr) {
+        return false;
+    }
+
+    uint8_t* base { (uint8_t*) ((((uint32_t) memory) + VIRTIO_QUEUE_ALIGNMENT - 1) & ~(VIRTIO_QUEUE_ALIGNMENT - 1)) };
+
+    for (uint32_t i = 0; i < total_size; ++i) {
+        base[i] = 0;
+    }
+
+    descriptors = (VirtioQueueDescriptor*) base;
+    available = (VirtioQueueAvailable*) (base + size * sizeof(VirtioQueueDescriptor));
+    used = (VirtioQueueUsed*) (base + used_offset);
+
+    // All descriptors start out on the free list.
+    for (uint16_t i = 0; i < size; ++i) {
+        descriptors[i].next = i + 1;
+    }
+
+    free_head = 0;
+    free_count = size;
+    last_used_index = 0;
+    last_kicked_index = 0;
+
+    queue_address_port.write((uint32_t) base / VIRTIO_QUEUE_ALIGNMENT);
+    return true;
+}
+
+volatile uint16_t* VirtioQueue::get_used_event()
+{
+    return (volatile uint16_t*) ((uint8_t*) available + sizeof(VirtioQueueAvailable) + size * sizeof(uint16_t));
+}
+
+volatile uint16_t* VirtioQueue::get_available_event()
+{
+    return (volatile uint16_t*) ((uint8_t*) used + sizeof(VirtioQueueUsed) + size * sizeof(VirtioQueueUsedElement));
+}
+
+uint16_t VirtioQueue::get_size()
+{
+    return size;
+}
+
+uint16_t VirtioQueue::get_free_count()
+{
+    return free_count;
+}
+
+int32_t VirtioQueue::add(VirtioBuffer* buffers, uint16_t buffer_count, bool is_device_writable)
+{
+    if (buffer_count == 0 || buffer_count > free_count) {
+        return -1;
+    }
+
+    uint16_t head { free_head };
+    uint16_t index { head };
+
+    for (uint16_t i = 0; i < buffer_count; ++i) {
+        VirtioQueueDescriptor* descriptor { &descriptors[index] };
+
+        descriptor->address = (uint32_t) buffers[i].data;
+        descriptor->length = buffers[i].size;
+        descriptor->flags = is_device_writable ? VIRTIO_DESCRIPTOR_F_WRITE : 0;
+
+        if (i + 1 < buffer_count) {
+            descriptor->flags |= VIRTIO_DESCRIPTOR_F_NEXT;
+            index = descriptor->next;
+        }
+    }
+
+    free_head = descriptors[index].next;
+    free_count -= buffer_count;
+
+    // The descriptors have to be visible before the ring entry that points at them, and the
+    // ring entry before the index that publishes it.
+    available->ring[available->index & (size - 1)] = head;
+    compiler_barrier();
+    ((volatile VirtioQueueAvailable*) available)->index = available->index + 1;
+
+    return head;
+}
+
+void VirtioQueue::kick()
+{
+    uint16_t new_index { available->index };
+    uint16_t old_index { last_kicked_index };
+
+    if (new_index == old_index) {
+        return;
+    }
+
+    last_kicked_index = new_index;
+    full_memory_barrier();
+
+    bool should_notify {
+        has_event_index
+            ? need_event(*get_available_event(), new_index, old_index)
+            : !(((volatile VirtioQueueUsed*) used)->flags & VIRTIO_USED_F_NO_NOTIFY)
+    };
+
+    if (!should_notify) {
+        ++suppressed_notifications;
+        return;
+    }
+
+    // Every notify is a trip out to the hypervisor, which is the whole point of batching.
+    ++notifications;
+    Port16Bit queue_notify_port(io_base + VIRTIO_REGISTER_QUEUE_NOTIFY);
+    queue_notify_port.write(queue_index);
+}
+
+bool VirtioQueue::has_used()
+{
+    return ((volatile VirtioQueueUsed*) used)->index != last_used_index;
+}
+
+bool VirtioQueue::get_used(uint16_t* head, uint32_t* length)
+{
+    if (!has_used()) {
+        return false;
+    }
+
+    compiler_barrier();
+
+    VirtioQueueUsedElement* element { &used->ring[last_used_index & (size - 1)] };
+    *head = element->id;
+    *length = element->length;
+    ++last_used_index;
+
+    // Put the whole chain back on the free list.
+    uint16_t index { *head };
+    uint16_t count { 1 };
+
+    while (descriptors[index].flags & VIRTIO_DESCRIPTOR_F_NEXT) {
+        index = descriptors[index].next;
+        ++count;
+    }
+
+    descriptors[index].next = free_head;
+    free_head = *head;
+    free_count += count;
+
+    return true;
+}
+
+bool VirtioQueue::enable_used_interrupts()
+{
+    if (has_event_index) {
+        *get_used_event() = last_used_index;
+    } else {
+        ((volatile VirtioQueueAvailable*) available)->flags = available->flags & ~VIRTIO_AVAILABLE_F_NO_INTERRUPT;
+    }
+
+    // A buffer that got used before the device saw the above won't raise anything.
+    full_memory_barrier();
+    return !has_used();
+}
+
+void VirtioQueue::disable_used_interrupts()
+{
+    // With event indexes the device only interrupts when used_event gets passed, so leaving it
+    // behind is enough. Without, there's the flag.
+    if (!has_event_index) {
+        ((volatile VirtioQueueAvailable*) available)->flags = available->flags | VIRTIO_AVAILABLE_F_NO_INTERRUPT;
+    }
+}
+
+uint32_t VirtioQueue::get_notification_count()
+{
+    return notifications;
+}
+
+uint32_t VirtioQueue::get_suppressed_notification_count()
+{
+    return suppressed_notifications;
+}
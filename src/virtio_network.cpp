@@ -0,0 +1,564 @@
+#include "cpu.h"
+#include "virtio_network.h"
+
+static constexpr PeripheralComponentInterconnectDeviceMatch virtio_network_matches[] {
+    { 0x1AF4, 0x1000, PCI_MATCH_ANY, PCI_MATCH_ANY }, // Transitional virtio-net (has the legacy interface)
+};
+
+static Driver* probe_virtio_network(PeripheralComponentInterconnectDeviceDescriptor* device, InterruptManager* interrupt_manager)
+{
+    // The legacy interface lives in the I/O BAR.
+    if (device->port == 0) {
+        return nullptr;
+    }
+
+    VirtioNetwork* driver { (VirtioNetwork*) MemoryManager::memory_manager->malloc(sizeof(VirtioNetwork)) };
+
+    if (driver != nullptr) {
+        new (driver) VirtioNetwork(device, interrupt_manager);
+
+        // No queues or no memory for the buffers, leave the device alone.
+        if (!driver->is_available()) {
+            driver->~VirtioNetwork();
+            MemoryManager::memory_manager->free(driver);
+            return nullptr;
+        }
+    }
+
+    return driver;
+}
+
+REGISTER_PCI_DRIVER(virtio_network, virtio_network_matches, probe_virtio_network);
+
+VirtioNetwork::VirtioNetwork(PeripheralComponentInterconnectDeviceDescriptor* device, InterruptManager* interrupt_manager)
+:   NetworkInterfaceController(interrupt_manager, device->interrupt_number + interrupt_manager->get_hardware_interrupt_offset())
+{
+    io_base = device->port;
+    ip_address = 0;
+    receive_slots = nullptr;
+    receive_memory = nullptr;
+    send_records = nullptr;
+    send_memory = nullptr;
+    send_copy_buffers = nullptr;
+    send_copy_buffer_count = 0;
+
+    interrupts = 0;
+    polls = 0;
+    received_frames = 0;
+    sent_frames = 0;
+    send_drops = 0;
+    merged_frame_drops = 0;
+
+    uint8_t* header { (uint8_t*) &send_header };
+    for (uint32_t i = 0; i < sizeof(VirtioNetworkHeader); ++i) {
+        header[i] = 0;
+    }
+
+    device->controller->enable_bus_mastering(device);
+
+    Port8Bit status_port(io_base + VIRTIO_REGISTER_DEVICE_STATUS);
+    Port32Bit device_features_port(io_base + VIRTIO_REGISTER_DEVICE_FEATURES);
+    Port32Bit guest_features_port(io_base + VIRTIO_REGISTER_GUEST_FEATURES);
+
+    // Reset, then say hello and that we know how to drive it.
+    status_port.write(0);
+    status_port.write(VIRTIO_STATUS_ACKNOWLEDGE);
+    status_port.write(VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER);
+
+    features = device_features_port.read() & (VIRTIO_NETWORK_F_MAC | VIRTIO_NETWORK_F_MRG_RXBUF | VIRTIO_NETWORK_F_STATUS | VIRTIO_RING_F_EVENT_IDX);
+    guest_features_port.write(features);
+
+    // The header only has buffer_count when mergeable buffers are on.
+    header_size = (features & VIRTIO_NETWORK_F_MRG_RXBUF) ? sizeof(VirtioNetworkHeader) : sizeof(VirtioNetworkHeader) - sizeof(uint16_t);
+
+    is_message_signaled = request_interrupt_vectors(device, 1) > 0
+        && device->controller->find_capability(device->bus_number, device->device_number, device->function_number, 0x11) != 0;
+    config_offset = is_message_signaled ? 0x18 : 0x14;
+
+    bool has_event_index { (features & VIRTIO_RING_F_EVENT_IDX) != 0 };
+
+    if (!receive_queue.initialize(io_base, VIRTIO_NETWORK_RECEIVE_QUEUE, has_event_index)
+        || !send_queue.initialize(io_base, VIRTIO_NETWORK_SEND_QUEUE, has_event_index)) {
+        printf_colored("virtio-net: could not set up the queues\n", VGA_COLOR_RED_ON_BLACK);
+        status_port.write(VIRTIO_STATUS_FAILED);
+        return;
+    }
+
+    if (is_message_signaled) {
+        // Config changes and both queues all go to our one vector (MSI-X table entry 0).
+        Port16Bit config_vector_port(io_base + VIRTIO_REGISTER_CONFIG_VECTOR);
+        Port16Bit queue_select_port(io_base + VIRTIO_REGISTER_QUEUE_SELECT);
+        Port16Bit queue_vector_port(io_base + VIRTIO_REGISTER_QUEUE_VECTOR);
+
+        config_vector_port.write(0);
+        queue_select_port.write(VIRTIO_NETWORK_RECEIVE_QUEUE);
+        queue_vector_port.write(0);
+        queue_select_port.write(VIRTIO_NETWORK_SEND_QUEUE);
+        queue_vector_port.write(0);
+    }
+
+    if (features & VIRTIO_NETWORK_F_MAC) {
+        mac_address = 0;
+
+        for (uint16_t i = 0; i < 6; ++i) {
+            Port8Bit config_port(io_base + config_offset + i);
+            mac_address |= (uint64_t) config_port.read() << (8 * i);
+        }
+    } else {
+        mac_address = 0x563412005202ULL; // 02:52:00:12:34:56, locally administered
+    }
+
+    // With mergeable buffers a receive buffer is one descriptor, without it's header + data.
+    uint16_t receive_queue_size { receive_queue.get_size() };
+    uint16_t posted_buffers { (features & VIRTIO_NETWORK_F_MRG_RXBUF) ? receive_queue_size : (uint16_t) (receive_queue_size / 2) };
+
+    // Twice the buffers we post: the second half starts out in the pool for held buffers.
+    receive_buffer_count = 2 * posted_buffers;
+    receive_memory = MemoryManager::memory_manager->malloc(receive_buffer_count * VIRTIO_NETWORK_BUFFER_SIZE + 15);
+    receive_buffers = (uint8_t*) ((((uint32_t) receive_memory) + 15) & ~((uint32_t) 0xF));
+    receive_slots = (uint8_t**) MemoryManager::memory_manager->malloc(receive_queue_size * sizeof(uint8_t*));
+    uint8_t** pool { (uint8_t**) MemoryManager::memory_manager->malloc(posted_buffers * sizeof(uint8_t*)) };
+
+    // Copied sends take at least two descriptors (header and frame), so that's as many as can be in flight.
+    uint16_t send_queue_size { send_queue.get_size() };
+    uint16_t copy_buffers { (uint16_t) (send_queue_size / 2) };
+
+    send_records = (SendRecord*) MemoryManager::memory_manager->malloc(send_queue_size * sizeof(SendRecord));
+    send_memory = MemoryManager::memory_manager->malloc(copy_buffers * VIRTIO_NETWORK_BUFFER_SIZE);
+    send_copy_buffers = (uint8_t**) MemoryManager::memory_manager->malloc(copy_buffers * sizeof(uint8_t*));
+
+    // Nothing gets posted to the device unless all of it is there, a null buffer would be DMA'd to.
+    if (receive_memory == nullptr || receive_slots == nullptr || pool == nullptr
+        || send_records == nullptr || send_memory == nullptr || send_copy_buffers == nullptr) {
+        printf_colored("virtio-net: not enough memory for the buffers\n", VGA_COLOR_RED_ON_BLACK);
+        status_port.write(VIRTIO_STATUS_FAILED);
+
+        if (pool != nullptr) {
+            MemoryManager::memory_manager->free(pool);
+        }
+
+        free_buffers();
+        return;
+    }
+
+    set_receive_buffers(receive_buffers, VIRTIO_NETWORK_BUFFER_SIZE, receive_buffer_count, pool, posted_buffers);
+
+    for (uint16_t i = 0; i < receive_queue_size; ++i) {
+        receive_slots[i] = nullptr;
+    }
+
+    for (uint16_t i = 0; i < posted_buffers; ++i) {
+        post_receive_buffer(&receive_buffers[i * VIRTIO_NETWORK_BUFFER_SIZE]);
+        receive_buffer_pool[receive_buffer_pool_count++] = &receive_buffers[(posted_buffers + i) * VIRTIO_NETWORK_BUFFER_SIZE];
+    }
+
+    for (uint16_t i = 0; i < send_queue_size; ++i) {
+        send_records[i].handler = nullptr;
+        send_records[i].context = nullptr;
+        send_records[i].copy_buffer = nullptr;
+    }
+
+    for (uint16_t i = 0; i < copy_buffers; ++i) {
+        send_copy_buffers[send_copy_buffer_count++] = (uint8_t*) send_memory + i * VIRTIO_NETWORK_BUFFER_SIZE;
+    }
+}
+
+VirtioNetwork::~VirtioNetwork()
+{
+    reset();
+    free_buffers();
+
+    if (receive_buffer_pool != nullptr) {
+        MemoryManager::memory_manager->free(receive_buffer_pool);
+    }
+}
+
+void VirtioNetwork::free_buffers()
+{
+    // Whatever got allocated, malloc failures (or a setup that stopped early) leave the rest null.
+    void* allocations[] { receive_memory, receive_slots, send_records, send_memory, send_copy_buffers };
+
+    for (uint32_t i = 0; i < sizeof(allocations) / sizeof(allocations[0]); ++i) {
+        if (allocations[i] != nullptr) {
+            MemoryManager::memory_manager->free(allocations[i]);
+        }
+    }
+
+    receive_memory = nullptr;
+    receive_slots = nullptr;
+    send_records = nullptr;
+    send_memory = nullptr;
+    send_copy_buffers = nullptr;
+}
+
+bool VirtioNetwork::is_available()
+{
+    return receive_slots != nullptr;
+}
+
+void VirtioNetwork::initialize()
+{
+
+}
+
+void VirtioNetwork::activate()
+{
+    if (receive_slots == nullptr) {
+        return; // Setup failed.
+    }
+
+    Port8Bit status_port(io_base + VIRTIO_REGISTER_DEVICE_STATUS);
+    status_port.write(VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_DRIVER_OK);
+
+    // The receive buffers were queued during setup, this tells the device about all of them at once.
+    receive_queue.enable_used_interrupts();
+    send_queue.enable_used_interrupts();
+    receive_queue.kick();
+}
+
+void VirtioNetwork::deactivate()
+{
+    reset();
+}
+
+void VirtioNetwork::reset()
+{
+    Port8Bit status_port(io_base + VIRTIO_REGISTER_DEVICE_STATUS);
+    status_port.write(0);
+}
+
+string VirtioNetwork::get_driver_name()
+{
+    return "virtio-net";
+}
+
+uint32_t VirtioNetwork::handle_interrupt(uint32_t esp)
+{
+    // Without MSI-X we may share the line, and reading the ISR is also what acknowledges it.
+    if (!is_message_signaled) {
+        Port8Bit isr_status_port(io_base + VIRTIO_REGISTER_ISR_STATUS);
+
+        if (isr_status_port.read() == 0) {
+            return esp;
+        }
+    }
+
+    ++interrupts;
+
+    // Same as the PCnet: stop receive interrupts and drain the queue from the poll list.
+    if (interrupt_manager->schedule_poll(this)) {
+        receive_queue.disable_used_interrupts();
+    } else {
+        while (poll(POLL_BUDGET) == POLL_BUDGET);
+    }
+
+    reclaim_send_buffers();
+    return esp;
+}
+
+uint16_t VirtioNetwork::poll(uint16_t budget)
+{
+    ++polls;
+
+    uint16_t received { receive(budget) };
+
+    if (received == budget) {
+        return budget;
+    }
+
+    // Re-arm, and if something slipped in before the device saw that, keep polling instead.
+    // The interrupt handler masks the same queue, so it waits until we're done.
+    uint32_t flags { disable_interrupts() };
+
+    if (!receive_queue.enable_used_interrupts()) {
+        receive_queue.disable_used_interrupts();
+        restore_interrupts(flags);
+        return budget;
+    }
+
+    restore_interrupts(flags);
+    return received;
+}
+
+void VirtioNetwork::post_receive_buffer(uint8_t* buffer)
+{
+    VirtioBuffer chain[2];
+    uint16_t chain_length { 1 };
+
+    if (features & VIRTIO_NETWORK_F_MRG_RXBUF) {
+        chain[0] = { buffer, VIRTIO_NETWORK_BUFFER_SIZE };
+    } else {
+        // Legacy devices want the header in its own descriptor, it's still the same memory.
+        chain[0] = { buffer, header_size };
+        chain[1] = { buffer + header_size, (uint32_t) (VIRTIO_NETWORK_BUFFER_SIZE - header_size) };
+        chain_length = 2;
+    }
+
+    int32_t head { receive_queue.add(chain, chain_length, true) };
+
+    if (head >= 0) {
+        receive_slots[head] = buffer;
+    }
+}
+
+uint16_t VirtioNetwork::receive(uint16_t budget)
+{
+    uint16_t frames { 0 };
+    uint16_t head;
+    uint32_t length;
+
+    while (frames < budget && receive_queue.get_used(&head, &length)) {
+        uint8_t* buffer { receive_slots[head] };
+        VirtioNetworkHeader* header { (VirtioNetworkHeader*) buffer };
+
+        receive_slots[head] = nullptr;
+        ++frames;
+
+        // Our buffers fit any frame we can get, so this shouldn't happen. If it does, drop the
+        // frame and give all of its buffers back.
+        if ((features & VIRTIO_NETWORK_F_MRG_RXBUF) && header->buffer_count > 1) {
+            uint16_t extra_head;
+            uint32_t extra_length;
+
+            for (uint16_t i = 1; i < header->buffer_count && receive_queue.get_used(&extra_head, &extra_length); ++i) {
+                // Clear the slot first: posting takes the same descriptor off the free list again.
+                uint8_t* extra_buffer { receive_slots[extra_head] };
+                receive_slots[extra_head] = nullptr;
+                post_receive_buffer(extra_buffer);
+            }
+
+            ++merged_frame_drops;
+            post_receive_buffer(buffer);
+            continue;
+        }
+
+        if (length > header_size) {
+            uint8_t* frame { buffer + header_size };
+            uint32_t size { length - header_size };
+
+            ++received_frames;
+
+            // The buffer is lent to the stack for the duration of the callback.
+            lend_receive_buffer(buffer);
+
+            if (raw_data_handler != nullptr && raw_data_handler->on_raw_data_received(frame, size)) {
+                send(frame, size);
+            }
+
+            // Somebody kept it, so a fresh buffer from the pool goes back to the device instead.
+            if (end_receive_loan()) {
+                buffer = take_pool_buffer();
+            }
+        }
+
+        post_receive_buffer(buffer);
+    }
+
+    // One notify for the whole batch of refilled buffers (and usually none, thanks to the event index).
+    receive_queue.kick();
+    return frames;
+}
+
+void VirtioNetwork::reclaim_send_buffers()
+{
+    uint16_t head;
+    uint32_t length;
+    bool has_reclaimed { false };
+
+    while (send_queue.get_used(&head, &length)) {
+        SendRecord* record { &send_records[head] };
+        has_reclaimed = true;
+
+        if (record->handler != nullptr) {
+            record->handler->on_transmit_complete(record->context);
+        }
+
+        if (record->copy_buffer != nullptr) {
+            send_copy_buffers[send_copy_buffer_count++] = record->copy_buffer;
+        }
+
+        record->handler = nullptr;
+        record->context = nullptr;
+        record->copy_buffer = nullptr;
+    }
+
+    // With event indexes the device only interrupts again once it passes the index we publish here.
+    send_queue.enable_used_interrupts();
+
+    if (has_reclaimed) {
+        wake_send_waiter();
+    }
+}
+
+bool VirtioNetwork::reserve_send_space(uint16_t descriptor_count, bool needs_copy_buffer, bool wait)
+{
+    // Expects interrupts off.
+    if (send_queue.get_free_count() < descriptor_count || (needs_copy_buffer && send_copy_buffer_count == 0)) {
+        reclaim_send_buffers();
+    }
+
+    // The send interrupt reclaims and wakes us, we check once more ourselves in case we can't sleep here.
+    while (wait && (send_queue.get_free_count() < descriptor_count || (needs_copy_buffer && send_copy_buffer_count == 0))) {
+        wait_for_send_completion();
+        reclaim_send_buffers();
+    }
+
+    return send_queue.get_free_count() >= descriptor_count && (!needs_copy_buffer || send_copy_buffer_count > 0);
+}
+
+void VirtioNetwork::post_send(VirtioBuffer* chain, uint16_t chain_length, TransmitCompletionHandler* handler, void* context, uint8_t* copy_buffer)
+{
+    int32_t head { send_queue.add(chain, chain_length, false) };
+
+    send_records[head].handler = handler;
+    send_records[head].context = context;
+    send_records[head].copy_buffer = copy_buffer;
+    ++sent_frames;
+
+    // Only traps out to the hypervisor when the device asked to hear about this index.
+    send_queue.kick();
+}
+
+TransmitStatus VirtioNetwork::send(uint8_t* buffer, int size, bool wait)
+{
+    if (size <= 0 || size > MAX_ETHERNET_FRAME_SIZE) {
+        ++send_drops;
+        return TransmitInvalid;
+    }
+
+    uint32_t flags { disable_interrupts() };
+
+    if (!reserve_send_space(2, true, wait)) {
+        ++send_drops;
+        restore_interrupts(flags);
+        return TransmitQueueFull;
+    }
+
+    // The copying path: the caller's memory is free again as soon as we return.
+    uint8_t* copy_buffer { send_copy_buffers[--send_copy_buffer_count] };
+
+    for (int i = 0; i < size; ++i) {
+        copy_buffer[i] = buffer[i];
+    }
+
+    VirtioBuffer chain[2] {
+        { &send_header, header_size },
+        { copy_buffer, (uint32_t) size }
+    };
+
+    post_send(chain, 2, nullptr, nullptr, copy_buffer);
+
+    restore_interrupts(flags);
+    return TransmitSent;
+}
+
+TransmitStatus VirtioNetwork::send_fragments(TransmitFragment* fragments, uint16_t fragment_count, TransmitCompletionHandler* handler, void* context,
+                                             bool wait, const TransmitChecksumOffload* offload)
+{
+    // We don't negotiate VIRTIO_NET_F_CSUM (get_features() says so), the caller fills in checksums.
+    VirtioBuffer chain[VIRTIO_NETWORK_MAX_SEND_FRAGMENTS + 1];
+    uint16_t chain_length { 1 };
+    uint32_t total_size { 0 };
+
+    chain[0] = { &send_header, header_size };
+
+    for (uint16_t i = 0; i < fragment_count; ++i) {
+        if (fragments[i].size == 0) {
+            continue;
+        }
+
+        if (chain_length == VIRTIO_NETWORK_MAX_SEND_FRAGMENTS + 1) {
+            ++send_drops;
+            return TransmitInvalid;
+        }
+
+        chain[chain_length++] = { fragments[i].data, fragments[i].size };
+        total_size += fragments[i].size;
+    }
+
+    if (chain_length == 1 || total_size > MAX_ETHERNET_FRAME_SIZE) {
+        ++send_drops;
+        return TransmitInvalid;
+    }
+
+    uint32_t flags { disable_interrupts() };
+
+    if (!reserve_send_space(chain_length, false, wait)) {
+        ++send_drops;
+        restore_interrupts(flags);
+        return TransmitQueueFull;
+    }
+
+    post_send(chain, chain_length, handler, context, nullptr);
+
+    restore_interrupts(flags);
+    return TransmitSent;
+}
+
+uint64_t VirtioNetwork::get_mac_address()
+{
+    return mac_address;
+}
+
+void VirtioNetwork::set_ip_address(uint32_t ip)
+{
+    ip_address = ip;
+}
+
+uint32_t VirtioNetwork::get_ip_address()
+{
+    return ip_address;
+}
+
+uint16_t VirtioNetwork::get_send_ring_size()
+{
+    return send_queue.get_size();
+}
+
+bool VirtioNetwork::is_link_up()
+{
+    if (!(features & VIRTIO_NETWORK_F_STATUS)) {
+        return true;
+    }
+
+    Port16Bit status_port(io_base + config_offset + 6);
+    return (status_port.read() & 0x1) != 0;
+}
+
+void VirtioNetwork::print_statistics()
+{
+    printf("virtio-net queues: RX ");
+    printf_int(receive_queue.get_size());
+    printf(", TX ");
+    printf_int(send_queue.get_size());
+    printf((features & VIRTIO_RING_F_EVENT_IDX) ? ", event index" : "");
+    printf((features & VIRTIO_NETWORK_F_MRG_RXBUF) ? ", mergeable buffers" : "");
+    printf(is_link_up() ? ", link up" : ", link down");
+    printf("\n  received: ");
+    printf_int(received_frames);
+    printf(", sent: ");
+    printf_int(sent_frames);
+    printf(", send drops: ");
+    printf_int(send_drops);
+    printf(", merged drops: ");
+    printf_int(merged_frame_drops);
+    printf("\n  interrupts: ");
+    printf_int(interrupts);
+    printf(", polls: ");
+    printf_int(polls);
+    printf("\n  notifies RX: ");
+    printf_int(receive_queue.get_notification_count());
+    printf(" (");
+    printf_int(receive_queue.get_suppressed_notification_count());
+    printf(" suppressed), TX: ");
+    printf_int(send_queue.get_notification_count());
+    printf(" (");
+    printf_int(send_queue.get_suppressed_notification_count());
+    printf(" suppressed)\n  held buffers: ");
+    printf_int(held_buffers);
+    printf(", pool free: ");
+    printf_int(receive_buffer_pool_count);
+    printf(", pool exhausted: ");
+    printf_int(pool_exhausted);
+    printf("\n");
+}